@@ -21,6 +21,87 @@
 #include "c2s.h"
 #include <stringprep.h>
 
+static void _c2s_sess_check_schedule(sess_t sess);
+
+/** idle and keepalive checks for a single session */
+static int _c2s_sess_check(void *data1, void *data2) {
+    sess_t sess = (sess_t) data1;
+    c2s_t c2s = sess->c2s;
+    time_t now;
+
+    sess->check_timer = NULL;
+
+    now = time(NULL);
+
+    if(c2s->io_check_idle > 0 && now > sess->last_activity + c2s->io_check_idle) {
+        log_write(c2s->log, LOG_NOTICE, "[%d] [%s, port=%d] timed out", sess->fd->fd, sess->ip, sess->port);
+
+        sx_error(sess->s, stream_err_HOST_GONE, "connection timed out");
+        sx_close(sess->s);
+
+        return 0;
+    }
+
+    if(c2s->io_check_keepalive > 0 && now > sess->last_activity + c2s->io_check_keepalive && sess->s->state >= state_STREAM) {
+        log_debug(ZONE, "sending keepalive for %d", sess->fd->fd);
+
+        sx_raw_write(sess->s, " ", 1);
+    }
+
+    _c2s_sess_check_schedule(sess);
+
+    return 0;
+}
+
+/** arm the check timer for the next idle or keepalive deadline */
+static void _c2s_sess_check_schedule(sess_t sess) {
+    c2s_t c2s = sess->c2s;
+    time_t now, when = 0;
+
+    if(c2s->io_check_interval <= 0)
+        return;
+
+    now = time(NULL);
+
+    if(c2s->io_check_idle > 0)
+        when = sess->last_activity + c2s->io_check_idle + 1;
+
+    /* keepalives repeat every keepalive seconds until they do something */
+    if(c2s->io_check_keepalive > 0) {
+        time_t ka = sess->last_activity + c2s->io_check_keepalive + 1;
+        if(ka <= now)
+            ka = now + c2s->io_check_keepalive;
+        if(when == 0 || ka < when)
+            when = ka;
+    }
+
+    if(when == 0)
+        return;
+
+    if(when <= now)
+        when = now + 1;
+
+    sess->check_timer = mio_add_timeout(c2s->mio, _c2s_sess_check, (void *) sess, NULL, (unsigned long long) (when - now) * 1000);
+}
+
+/** read the pending bytes when the byte rate limit is no longer in effect */
+static int _c2s_sess_unthrottle(void *data1, void *data2) {
+    sess_t sess = (sess_t) data1;
+
+    sess->rate_timer = NULL;
+
+    if(rate_check(sess->rate) == 0) {
+        sess->rate_timer = mio_add_timeout(sess->c2s->mio, _c2s_sess_unthrottle, (void *) sess, NULL, 1000);
+        return 0;
+    }
+
+    log_debug(ZONE, "reading throttled %d", sess->fd->fd);
+    sess->s->want_read = 1;
+    sx_can_read(sess->s);
+
+    return 0;
+}
+
 static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
     sess_t sess = (sess_t) arg;
     sx_buf_t buf = (sx_buf_t) data;
@@ -58,6 +139,12 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
                         sess->rate_log = 1;
                     }
 
+                    /* come back when the throttle runs out */
+                    if(sess->rate_timer == NULL) {
+                        time_t wait = sess->rate->bad + sess->rate->wait - time(NULL);
+                        sess->rate_timer = mio_add_timeout(sess->c2s->mio, _c2s_sess_unthrottle, (void *) sess, NULL, (unsigned long long) (wait > 0 ? wait : 1) * 1000);
+                    }
+
                     return -1;
                 }
 
@@ -139,9 +226,13 @@ static int _c2s_client_sx_callback(sx_t s, sx_event_t e, void *data, void *arg)
             return len;
 
         case event_WRITE:
+        case event_WRITEV:
             log_debug(ZONE, "writing to %d", sess->fd->fd);
 
-            len = send(sess->fd->fd, buf->data, buf->len, 0);
+            if(e == event_WRITEV)
+                len = writev(sess->fd->fd, ((sx_wvec_t *) data)->iov, ((sx_wvec_t *) data)->niov);
+            else
+                len = send(sess->fd->fd, buf->data, buf->len, 0);
             if(len >= 0) {
                 log_debug(ZONE, "%d bytes written", len);
                 return len;
@@ -548,6 +639,12 @@ static int _c2s_client_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *
                 for(bres = sess->resources; bres != NULL; bres = bres->next)
                     sm_end(sess, bres);
 
+            if(sess->check_timer != NULL)
+                mio_cancel_timeout(sess->c2s->mio, sess->check_timer);
+            if(sess->rate_timer != NULL)
+                mio_cancel_timeout(sess->c2s->mio, sess->rate_timer);
+            sess->check_timer = sess->rate_timer = NULL;
+
             jqueue_push(sess->c2s->dead, (void *) sess->s, 0);
 
             xhash_zap(sess->c2s->sessions, sess->skey);
@@ -615,7 +712,10 @@ static int _c2s_accept_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data
             sprintf(sess->skey, "%d", fd->fd);
             xhash_put(c2s->sessions, sess->skey, (void *) sess);
 
-            flags = SX_SASL_OFFER;
+            /* idle and keepalive checks */
+            _c2s_sess_check_schedule(sess);
+
+            flags = SX_SASL_OFFER | SX_WRITEV;
 #ifdef HAVE_SSL
             /* go ssl wrappermode if they're on the ssl port */
             if(port == c2s->local_ssl_port)
@@ -742,9 +842,13 @@ int c2s_router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             return len;
 
         case event_WRITE:
+        case event_WRITEV:
             log_debug(ZONE, "writing to %d", c2s->fd->fd);
 
-            len = send(c2s->fd->fd, buf->data, buf->len, 0);
+            if(e == event_WRITEV)
+                len = writev(c2s->fd->fd, ((sx_wvec_t *) data)->iov, ((sx_wvec_t *) data)->niov);
+            else
+                len = send(c2s->fd->fd, buf->data, buf->len, 0);
             if(len >= 0) {
                 log_debug(ZONE, "%d bytes written", len);
                 return len;
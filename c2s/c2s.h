@@ -97,6 +97,10 @@ struct sess_st {
     time_t              last_activity;
     unsigned int        packet_count;
 
+    /** idle/keepalive check and byte rate release timers */
+    void                *check_timer;
+    void                *rate_timer;
+
     /* count of bound resources */
     int                 bound;
     /* list of bound jids */
@@ -228,8 +232,6 @@ struct c2s_st {
     int                 io_check_idle;
     int                 io_check_keepalive;
 
-    time_t              next_check;
-
     /** auth/reg module */
     char                *ar_module_name;
     authreg_t           ar;
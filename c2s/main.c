@@ -133,6 +133,13 @@ static void _c2s_config_expand(c2s_t c2s)
 
     c2s->io_max_fds = j_atoi(config_get_one(c2s->config, "io.max_fds", 0), 1024);
 
+    nad_cache_config(j_atoi(config_get_one(c2s->config, "io.nad_cache.max", 0), NAD_CACHE_MAX),
+                     j_atoi(config_get_one(c2s->config, "io.nad_cache.size", 0), NAD_CACHE_SIZE));
+
+    jid_cache_config(j_atoi(config_get_one(c2s->config, "io.jid_cache", 0), JID_CACHE_SIZE));
+
+    pool_cache_config(j_atoi(config_get_one(c2s->config, "io.pool_cache", 0), POOL_CACHE_SIZE));
+
     c2s->compression = (config_get(c2s->config, "io.compression") != NULL);
 
     c2s->io_check_interval = j_atoi(config_get_one(c2s->config, "io.check.interval", 0), 0);
@@ -184,15 +191,6 @@ static void _c2s_config_expand(c2s_t c2s)
 
     c2s->stanza_size_limit = j_atoi(config_get_one(c2s->config, "io.limits.stanzasize", 0), 0);
 
-    /* tweak timed checks with rate times */
-    if(c2s->io_check_interval == 0) {
-        if(c2s->byte_rate_total != 0)
-            c2s->io_check_interval = c2s->byte_rate_wait;
-
-        if(c2s->stanza_rate_total != 0 && c2s->io_check_interval > c2s->stanza_rate_wait)
-            c2s->io_check_interval = c2s->stanza_rate_wait;
-    }
-
     str = config_get_one(c2s->config, "io.access.order", 0);
     if(str == NULL || strcmp(str, "deny,allow") != 0)
         c2s->access = access_new(0);
@@ -338,7 +336,7 @@ static int _c2s_router_connect(c2s_t c2s) {
     }
 
     c2s->router = sx_new(c2s->sx_env, c2s->fd->fd, c2s_router_sx_callback, (void *) c2s);
-    sx_client_init(c2s->router, 0, NULL, NULL, NULL, "1.0");
+    sx_client_init(c2s->router, SX_WRITEV, NULL, NULL, NULL, "1.0");
 
     return 0;
 }
@@ -514,53 +512,18 @@ static int _c2s_sx_sasl_callback(int cb, void *arg, void **res, sx_t s, void *cb
 
     return sx_sasl_ret_FAIL;
 }
-static void _c2s_time_checks(c2s_t c2s) {
-    sess_t sess;
-    time_t now;
-    union xhashv xhv;
-
-    now = time(NULL);
-
-    if(xhash_iter_first(c2s->sessions))
-        do {
-            xhv.sess_val = &sess;
-            xhash_iter_get(c2s->sessions, NULL, NULL, xhv.val);
-
-            if(c2s->io_check_idle > 0 && sess->s && now > sess->last_activity + c2s->io_check_idle) {
-                log_write(c2s->log, LOG_NOTICE, "[%d] [%s, port=%d] timed out", sess->fd->fd, sess->ip, sess->port);
-
-                sx_error(sess->s, stream_err_HOST_GONE, "connection timed out");
-                sx_close(sess->s);
-
-                continue;
-            }
-
-            if(c2s->io_check_keepalive > 0 && now > sess->last_activity + c2s->io_check_keepalive && sess->s->state >= state_STREAM) {
-                log_debug(ZONE, "sending keepalive for %d", sess->fd->fd);
-
-                sx_raw_write(sess->s, " ", 1);
-            }
-
-            if(sess->rate != NULL && sess->rate->bad != 0 && rate_check(sess->rate) != 0) {
-                /* read the pending bytes when rate limit is no longer in effect */
-                log_debug(ZONE, "reading throttled %d", sess->fd->fd);
-                sess->s->want_read = 1;
-                sx_can_read(sess->s);
-            }
-
-        } while(xhash_iter_next(c2s->sessions));
-}
-
 JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to Server", "jabberd2router\0")
 {
     c2s_t c2s;
     char *config_file;
     int optchar;
-    int mio_timeout;
     sess_t sess;
     bres_t res;
     union xhashv xhv;
     time_t check_time = 0;
+    nad_cache_stats_t nad_stats;
+    jid_cache_stats_t jid_stats;
+    pool_cache_stats_t pool_stats;
 
 #ifdef HAVE_UMASK
     umask((mode_t) 0027);
@@ -727,11 +690,8 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
     c2s->retry_left = c2s->retry_init;
     _c2s_router_connect(c2s);
 
-    mio_timeout = ((c2s->io_check_interval != 0 && c2s->io_check_interval < 5) ?
-        c2s->io_check_interval : 5) * 1000;
-
     while(!c2s_shutdown) {
-        mio_run(c2s->mio, mio_timeout);
+        mio_run(c2s->mio, 5000);
 
         if(c2s_logrotate) {
             log_write(c2s->log, LOG_NOTICE, "reopening log ...");
@@ -790,16 +750,6 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
         while(jqueue_size(c2s->dead) > 0)
             sx_free((sx_t) jqueue_pull(c2s->dead));
 
-        /* time checks */
-        if(c2s->io_check_interval > 0 && time(NULL) >= c2s->next_check) {
-            log_debug(ZONE, "running time checks");
-
-            _c2s_time_checks(c2s);
-
-            c2s->next_check = time(NULL) + c2s->io_check_interval;
-            log_debug(ZONE, "next time check at %d", c2s->next_check);
-        }
-
         if(time(NULL) > check_time + 60) {
 #ifdef POOL_DEBUG
             pool_stat(1);
@@ -826,6 +776,15 @@ JABBER_MAIN("jabberd2c2s", "Jabber 2 C2S", "Jabber Open Source Server: Client to
 
     log_write(c2s->log, LOG_NOTICE, "shutting down");
 
+    nad_cache_stats(&nad_stats);
+    log_write(c2s->log, LOG_INFO, "nad cache: %lu of %lu nads reused, %lu dropped, %lu buffer reallocs", nad_stats.hits, nad_stats.news, nad_stats.drops, nad_stats.reallocs);
+
+    jid_cache_stats(&jid_stats);
+    log_write(c2s->log, LOG_INFO, "jid cache: %lu of %lu jid parts prepped from the cache (%lu invalid), %lu too long to cache", jid_stats.hits, jid_stats.lookups, jid_stats.invalid, jid_stats.skipped);
+
+    pool_cache_stats(&pool_stats);
+    log_write(c2s->log, LOG_INFO, "pool cache: %lu of %lu blocks reused, %lu dropped, %lu bytes held, %lu of %lu bytes lost to rounding and unused heap space", pool_stats.hits, pool_stats.allocs, pool_stats.drops, pool_stats.held, pool_stats.slack + pool_stats.unused, pool_stats.requested);
+
     if(c2s->server_fd) mio_close(c2s->mio, c2s->server_fd);
 
     if(xhash_iter_first(c2s->sessions))
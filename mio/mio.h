@@ -50,6 +50,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <limits.h>
 
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
@@ -184,6 +185,8 @@ JABBERD2_API mio_t mio_new(int maxfd); /* returns NULL if failed */
 
 #define mio_cancel_immed_timeout(m, t) (*m)->mio_cancel_immed_timeout((m), (t))
 
+/** timed timeouts are kept in a timer wheel with 1 ms resolution, arming and cancelling are O(1) */
+/** the returned handle is freed once fn has run, so don't cancel it after that (cancelling from inside fn is fine) */
 #define mio_add_timeout(m, fn, data1, data2, msec) ((*m)->mio_add_timeout((m), (fn), (data1), (data2), (msec)))
 
 #define mio_cancel_timeout(m, t) (*m)->mio_cancel_timeout((m), (t))
@@ -58,26 +58,57 @@ typedef struct mio_priv_fd_st
     MIO_FD_VARS
 } *mio_priv_fd_t;
 
+/** a pending timeout, linked into the immed list or a timer wheel slot */
+typedef struct mio_timeout_st
+{
+    struct mio_timeout_st *next;
+    struct mio_timeout_st *prev;
+
+    mio_timeout_fn fn;
+    void *data1;
+    void *data2;
+
+    unsigned long long expires;     /* absolute, in ms */
+    int running;                    /* fn is being called right now */
+} *mio_timeout_t;
+
+/**
+ * Timed timeouts live in a hierarchical timing wheel with 1 ms ticks.
+ * Level 0 has a slot per ms for the next 256 ms, each level above it
+ * has 64 slots each covering a whole turn of the level below. Timers
+ * are arm/cancel in O(1) and cascade down a level when their slot
+ * comes up; anything further out than 2^32 ms just cascades around
+ * the top level until it's close enough.
+ */
+#define MIO_WHEEL_BITS0     8
+#define MIO_WHEEL_BITS      6
+#define MIO_WHEEL_LEVELS    4
+#define MIO_WHEEL_SIZE0     (1 << MIO_WHEEL_BITS0)
+#define MIO_WHEEL_SIZE      (1 << MIO_WHEEL_BITS)
+#define MIO_WHEEL_MASK0     (MIO_WHEEL_SIZE0 - 1)
+#define MIO_WHEEL_MASK      (MIO_WHEEL_SIZE - 1)
+#define MIO_WHEEL_SHIFT(l)  (MIO_WHEEL_BITS0 + (l) * MIO_WHEEL_BITS)
+#define MIO_WHEEL_MAX       0xffffffffULL
+
 /** now define our master data type */
 typedef struct mio_priv_st
 {
     struct mio_st *mio;
 
     int maxfd;
-    jqueue_t immed_timeout, timed_timeout;
+
+    /* immed timeouts, fifo */
+    struct mio_timeout_st immed_timeout;
+
+    /* timer wheel, base is the next tick to be processed */
+    unsigned long long wheel_base;
+    int wheel_count;
+    struct mio_timeout_st wheel0[MIO_WHEEL_SIZE0];
+    struct mio_timeout_st wheel[MIO_WHEEL_LEVELS][MIO_WHEEL_SIZE];
 
     MIO_VARS
 } *mio_priv_t;
 
-typedef struct mio_timeout_st
-{
-    mio_timeout_fn fn;
-    void *data1;
-    void *data2;
-    unsigned long long msec;
-    struct timeval t_0;
-} *mio_timeout_t;
-
 /* lazy factor */
 #define MIO(m) ((mio_priv_t) m)
 #define FD(m,f) ((mio_priv_fd_t) f)
@@ -216,20 +247,175 @@ static void _mio_app(mio_t m, mio_fd_t fd, mio_handler_t app, void *arg)
     FD(m,fd)->arg = arg;
 }
 
+/** current time in ms, monotonic where we can get it */
+static unsigned long long _mio_now(void)
+{
+    struct timeval tv;
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+
+    gettimeofday(&tv, NULL);
+    return (unsigned long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* timeout lists are circular, the list heads are never used as timeouts */
+#define MIO_TLIST_INIT(h)   ((h)->next = (h)->prev = (h))
+#define MIO_TLIST_EMPTY(h)  ((h)->next == (h))
+
+static void _mio_tlist_add(mio_timeout_t head, mio_timeout_t t)
+{
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void _mio_tlist_del(mio_timeout_t t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    MIO_TLIST_INIT(t);
+}
+
+/** put a timeout in the wheel slot its expiry falls in */
+static void _mio_wheel_add(mio_t m, mio_timeout_t t)
+{
+    unsigned long long base = MIO(m)->wheel_base, expires = t->expires, idx;
+    int l;
+
+    /* overdue, fire on the next tick */
+    if(expires < base)
+    {
+        _mio_tlist_add(&MIO(m)->wheel0[base & MIO_WHEEL_MASK0], t);
+        return;
+    }
+
+    idx = expires - base;
+    if(idx < MIO_WHEEL_SIZE0)
+    {
+        _mio_tlist_add(&MIO(m)->wheel0[expires & MIO_WHEEL_MASK0], t);
+        return;
+    }
+
+    /* too far out, park it as far as we can reach */
+    if(idx > MIO_WHEEL_MAX)
+        expires = base + MIO_WHEEL_MAX;
+
+    for(l = 0; l < MIO_WHEEL_LEVELS - 1; l++)
+        if(idx < (1ULL << MIO_WHEEL_SHIFT(l + 1)))
+            break;
+
+    _mio_tlist_add(&MIO(m)->wheel[l][(expires >> MIO_WHEEL_SHIFT(l)) & MIO_WHEEL_MASK], t);
+}
+
+/** move everything in a slot down to where it belongs now */
+static void _mio_wheel_cascade(mio_t m, int level, int index)
+{
+    mio_timeout_t head = &MIO(m)->wheel[level][index], t;
+
+    while(!MIO_TLIST_EMPTY(head))
+    {
+        t = head->next;
+        _mio_tlist_del(t);
+        _mio_wheel_add(m, t);
+    }
+}
+
+/** earliest tick we have to do something on (fire or cascade), never after the first expiry */
+static unsigned long long _mio_wheel_next(mio_t m)
+{
+    unsigned long long base = MIO(m)->wheel_base, next = (unsigned long long) -1, tick, step;
+    int i, l;
+
+    /* level 0 slots hold exactly the next 256 ms */
+    for(i = 0; i < MIO_WHEEL_SIZE0; i++)
+        if(!MIO_TLIST_EMPTY(&MIO(m)->wheel0[(base + i) & MIO_WHEEL_MASK0]))
+        {
+            next = base + i;
+            break;
+        }
+
+    /* a slot higher up might cascade something in before that */
+    for(l = 0; l < MIO_WHEEL_LEVELS; l++)
+    {
+        step = 1ULL << MIO_WHEEL_SHIFT(l);
+        tick = (base + step - 1) & ~(step - 1);
+        if(tick >= next)
+            break;
+
+        for(i = 0; i < MIO_WHEEL_SIZE && tick < next; i++, tick += step)
+            if(!MIO_TLIST_EMPTY(&MIO(m)->wheel[l][(tick >> MIO_WHEEL_SHIFT(l)) & MIO_WHEEL_MASK]))
+            {
+                next = tick;
+                break;
+            }
+    }
+
+    return next;
+}
+
+/** run a timeout that's already been taken off its list */
+static int _mio_timeout_fire(mio_timeout_t t)
+{
+    int ret = 0;
+
+    t->running = 1;
+    if(t->fn)
+        ret = t->fn(t->data1, t->data2);
+    free(t);
+
+    return ret;
+}
+
 static void _mio_check_timed_timeouts(mio_t m)
 {
-    while (1) {
-        if (!jqueue_size(MIO(m)->timed_timeout)) return;
-
-        mio_timeout_t f = (mio_timeout_t) MIO(m)->timed_timeout->front->data;
-        struct timeval now;
-        gettimeofday(&now, NULL);
-        long long msec = (f->msec - (now.tv_sec - f->t_0.tv_sec) * 1000 - (now.tv_usec - f->t_0.tv_usec) / 1000);
-        if (msec > 0) return;
-
-        f = jqueue_pull(MIO(m)->timed_timeout);
-        if (f->fn) f->fn(f->data1, f->data2);
-        free(f);
+    struct mio_timeout_st expired;
+    unsigned long long now = _mio_now(), base;
+    mio_timeout_t t;
+    int l, index;
+
+    while(MIO(m)->wheel_base <= now)
+    {
+        /* skip straight to the next tick that has work */
+        if(MIO(m)->wheel_count == 0 || (base = _mio_wheel_next(m)) > now)
+        {
+            MIO(m)->wheel_base = now + 1;
+            return;
+        }
+        MIO(m)->wheel_base = base;
+
+        /* top of a level 0 turn, pull the next slots down */
+        if((base & MIO_WHEEL_MASK0) == 0)
+            for(l = 0; l < MIO_WHEEL_LEVELS; l++)
+            {
+                index = (base >> MIO_WHEEL_SHIFT(l)) & MIO_WHEEL_MASK;
+                _mio_wheel_cascade(m, l, index);
+                if(index != 0)
+                    break;
+            }
+
+        /* take this tick's timeouts off the wheel before running them,
+         * anything they add will go in from the next tick on */
+        MIO_TLIST_INIT(&expired);
+        while(!MIO_TLIST_EMPTY(&MIO(m)->wheel0[base & MIO_WHEEL_MASK0]))
+        {
+            t = MIO(m)->wheel0[base & MIO_WHEEL_MASK0].next;
+            _mio_tlist_del(t);
+            _mio_tlist_add(&expired, t);
+        }
+        MIO(m)->wheel_base = base + 1;
+
+        while(!MIO_TLIST_EMPTY(&expired))
+        {
+            t = expired.next;
+            _mio_tlist_del(t);
+            MIO(m)->wheel_count--;
+            _mio_timeout_fire(t);
+        }
     }
 }
 
@@ -240,36 +426,25 @@ static void _mio_run(mio_t m, int timeout)
     MIO_INIT_ITERATOR(iter);
 
     /* handle timeouts (this is not the 'timeout' parameter) */
-    while (jqueue_size(MIO(m)->immed_timeout))
+    while (!MIO_TLIST_EMPTY(&MIO(m)->immed_timeout))
     {
-        mio_timeout_t t = (mio_timeout_t) jqueue_pull(MIO(m)->immed_timeout);
-        if (t->fn && t->fn(t->data1, t->data2))
-        {
-            free(t);
+        mio_timeout_t t = MIO(m)->immed_timeout.next;
+        _mio_tlist_del(t);
+        if (_mio_timeout_fire(t))
             return;
-        }
-        free(t);
     }
-    if (jqueue_size(MIO(m)->timed_timeout))
+    if (MIO(m)->wheel_count)
     {
-        /* whenever the queue is not empty, update MIO(m)->timed_timeout->init_time about every hour and update */
-        /* all priority entries. keeps 'int priority' within the bounds of a 32-bit int, but minimizes CPU use */
-        struct timeval now;
-        gettimeofday(&now, NULL);
-        if (now.tv_sec - MIO(m)->timed_timeout->init_time > 3600 /*1 hr in sec*/)
-        {
-            time_t negative_delta = MIO(m)->timed_timeout->init_time - now.tv_sec;
-            _jqueue_node_t qn;
-            for (qn = MIO(m)->timed_timeout->front; qn != NULL; qn = qn->prev) qn->priority += negative_delta;
-            MIO(m)->timed_timeout->init_time = now.tv_sec;
-        }
-
-        mio_timeout_t f = (mio_timeout_t) MIO(m)->timed_timeout->front->data;
-        long long msec = (f->msec - (now.tv_sec - f->t_0.tv_sec) * 1000 - (now.tv_usec - f->t_0.tv_usec) / 1000);
+        /* sleep no longer than the next thing the wheel has to do */
+        unsigned long long now = _mio_now(), next = _mio_wheel_next(m);
+        long long msec = next > now ? (long long) (next - now) : 0;
+        /* a timer weeks away would overflow the int, and a negative wait is forever */
+        if (msec > INT_MAX - 1)
+            msec = INT_MAX - 1;
         if (timeout < 0 || msec < (long long) timeout)
         {
             mio_debug(ZONE, "mio run until next timeout (%lld ms) not requested delay of %d ms", msec, timeout);
-            timeout = ((int) msec) + 5 /* add 5 ms to rate-limit timeout handling at 200 Hz */;
+            timeout = ((int) msec) + 1 /* round up, so the tick is due when we wake */;
         }
     }
 
@@ -537,25 +712,19 @@ static void * _mio_add_immed_timeout(mio_t m, mio_timeout_fn fn, void * data1, v
     t->fn = fn;
     t->data1 = data1;
     t->data2 = data2;
-    jqueue_push(MIO(m)->immed_timeout, t, 0);
+    _mio_tlist_add(&MIO(m)->immed_timeout, t);
     return t;
 }
 
 static void _mio_cancel_immed_timeout(mio_t m, void * t)
 {
-    _jqueue_node_t qn;
-    for (qn = MIO(m)->immed_timeout->front; qn != NULL; qn = qn->prev) if (qn->data == t) {
-        /* remove qn from list */
-        if (qn == MIO(m)->immed_timeout->front) MIO(m)->immed_timeout->front = qn->prev;
-        if (qn == MIO(m)->immed_timeout->back) MIO(m)->immed_timeout->back = qn->next;
-        if (qn->prev) qn->prev->next = qn->next;
-        if (qn->next) qn->next->prev = qn->prev;
-        qn->next = MIO(m)->immed_timeout->cache;
-        MIO(m)->immed_timeout->cache = qn;
-        MIO(m)->immed_timeout->size--;
-        free(qn->data); /* (mio_timeout_t) qn->data */
-        return;
-    }
+    mio_timeout_t f = (mio_timeout_t) t;
+
+    /* cancelling ourselves from inside fn, it gets freed when fn returns */
+    if (f == NULL || f->running) return;
+
+    _mio_tlist_del(f);
+    free(f);
 }
 
 static void * _mio_add_timeout(mio_t m, mio_timeout_fn fn, void * data1, void * data2, unsigned long long msec)
@@ -564,69 +733,59 @@ static void * _mio_add_timeout(mio_t m, mio_timeout_fn fn, void * data1, void *
     t->fn = fn;
     t->data1 = data1;
     t->data2 = data2;
-    t->msec = msec;
-    gettimeofday(&t->t_0, NULL);
-    jqueue_push(MIO(m)->timed_timeout, t, (int) (
-        t->t_0.tv_usec / 1000 + (t->t_0.tv_sec - MIO(m)->timed_timeout->init_time) * 1000 + msec ) );
+    t->expires = _mio_now() + msec;
+    _mio_wheel_add(m, t);
+    MIO(m)->wheel_count++;
     return t;
 }
 
 static void _mio_cancel_timeout(mio_t m, void * t)
 {
-    _jqueue_node_t qn;
-    for (qn = MIO(m)->timed_timeout->front; qn != NULL; qn = qn->prev) if (qn->data == t) {
-        /* remove qn from list */
-        if (qn == MIO(m)->timed_timeout->front) MIO(m)->timed_timeout->front = qn->prev;
-        if (qn == MIO(m)->timed_timeout->back) MIO(m)->timed_timeout->back = qn->next;
-        if (qn->prev) qn->prev->next = qn->next;
-        if (qn->next) qn->next->prev = qn->prev;
-        qn->next = MIO(m)->timed_timeout->cache;
-        MIO(m)->timed_timeout->cache = qn;
-        MIO(m)->timed_timeout->size--;
-        free(qn->data); /* (mio_timeout_t) qn->data */
-        return;
-    }
+    mio_timeout_t f = (mio_timeout_t) t;
+
+    if (f == NULL || f->running) return;
+
+    _mio_tlist_del(f);
+    MIO(m)->wheel_count--;
+    free(f);
 }
 
 static void _mio_run_timeout_early(mio_t m, void * t)
 {
-    _jqueue_node_t qn;
-    for (qn = MIO(m)->timed_timeout->front; qn != NULL; qn = qn->prev) if (qn->data == t) {
-        /* remove qn from list */
-        if (qn == MIO(m)->timed_timeout->front) MIO(m)->timed_timeout->front = qn->prev;
-        if (qn == MIO(m)->timed_timeout->back) MIO(m)->timed_timeout->back = qn->next;
-        if (qn->prev) qn->prev->next = qn->next;
-        if (qn->next) qn->next->prev = qn->prev;
-        qn->next = MIO(m)->timed_timeout->cache;
-        MIO(m)->timed_timeout->cache = qn;
-        MIO(m)->timed_timeout->size--;
-        if (((mio_timeout_t) qn->data)->fn) {
-            mio_timeout_t f = (mio_timeout_t) qn->data;
-            f->fn(f->data1, f->data2);
-        }
-        free(qn->data); /* (mio_timeout_t) qn->data */
-        return;
-    }
+    mio_timeout_t f = (mio_timeout_t) t;
+
+    if (f == NULL || f->running) return;
+
+    _mio_tlist_del(f);
+    MIO(m)->wheel_count--;
+    _mio_timeout_fire(f);
 }
 
 
 /** adam */
 static void _mio_free(mio_t m)
 {
+    int l, i;
+
     MIO_FREE_VARS(m);
 
-    if (MIO(m)->immed_timeout)
-    {
-        while (jqueue_size(MIO(m)->immed_timeout))
-            free(jqueue_pull(MIO(m)->immed_timeout));
-        jqueue_free(MIO(m)->immed_timeout);
-    }
-    if (MIO(m)->timed_timeout)
+    while (!MIO_TLIST_EMPTY(&MIO(m)->immed_timeout))
     {
-        while (jqueue_size(MIO(m)->timed_timeout))
-            free(jqueue_pull(MIO(m)->timed_timeout));
-        jqueue_free(MIO(m)->timed_timeout);
+        mio_timeout_t t = MIO(m)->immed_timeout.next;
+        _mio_tlist_del(t);
+        free(t);
     }
+    for (l = 0; l <= MIO_WHEEL_LEVELS; l++)
+        for (i = 0; i < (l == 0 ? MIO_WHEEL_SIZE0 : MIO_WHEEL_SIZE); i++)
+        {
+            mio_timeout_t head = l == 0 ? &MIO(m)->wheel0[i] : &MIO(m)->wheel[l - 1][i];
+            while (!MIO_TLIST_EMPTY(head))
+            {
+                mio_timeout_t t = head->next;
+                _mio_tlist_del(t);
+                free(t);
+            }
+        }
     free(m);
 }
 
@@ -647,6 +806,7 @@ static mio_t _mio_new(int maxfd)
         _mio_run_timeout_early,
     };
     mio_t m;
+    int l, i;
 
     /* init winsock if we are in Windows */
 #ifdef _WIN32
@@ -663,8 +823,13 @@ static mio_t _mio_new(int maxfd)
 
     /* set up our internal vars */
     *m = &mio_impl;
-    MIO(m)->immed_timeout = jqueue_new();
-    MIO(m)->timed_timeout = jqueue_new();
+    MIO_TLIST_INIT(&MIO(m)->immed_timeout);
+    for (i = 0; i < MIO_WHEEL_SIZE0; i++)
+        MIO_TLIST_INIT(&MIO(m)->wheel0[i]);
+    for (l = 0; l < MIO_WHEEL_LEVELS; l++)
+        for (i = 0; i < MIO_WHEEL_SIZE; i++)
+            MIO_TLIST_INIT(&MIO(m)->wheel[l][i]);
+    MIO(m)->wheel_base = _mio_now();
     MIO(m)->maxfd = maxfd;
 
     MIO_INIT_VARS(m);
@@ -103,6 +103,13 @@ static void _router_config_expand(router_t r)
 
     r->io_max_fds = j_atoi(config_get_one(r->config, "io.max_fds", 0), 1024);
 
+    nad_cache_config(j_atoi(config_get_one(r->config, "io.nad_cache.max", 0), NAD_CACHE_MAX),
+                     j_atoi(config_get_one(r->config, "io.nad_cache.size", 0), NAD_CACHE_SIZE));
+
+    jid_cache_config(j_atoi(config_get_one(r->config, "io.jid_cache", 0), JID_CACHE_SIZE));
+
+    pool_cache_config(j_atoi(config_get_one(r->config, "io.pool_cache", 0), POOL_CACHE_SIZE));
+
     elem = config_get(r->config, "io.limits.bytes");
     if(elem != NULL)
     {
@@ -125,6 +132,15 @@ static void _router_config_expand(router_t r)
         }
     }
 
+    r->tq_max_packets = 10000;
+    r->tq_max_bytes = 33554432;
+    elem = config_get(r->config, "io.limits.queue");
+    if(elem != NULL)
+    {
+        r->tq_max_packets = j_atoi(elem->values[0], 10000);
+        r->tq_max_bytes = j_atoi(j_attr((const char **) elem->attrs[0], "bytes"), 33554432);
+    }
+
     str = config_get_one(r->config, "io.access.order", 0);
     if(str == NULL || strcmp(str, "deny,allow") != 0)
         r->access = access_new(0);
@@ -269,6 +285,11 @@ static void _router_time_checks(router_t r) {
                log_debug(ZONE, "sending keepalive for %d", target->fd->fd);
                sx_raw_write(target->s, " ", 1);
           }
+
+         if(target->tq != NULL)
+               log_write(r->log, LOG_NOTICE, "[%s, port=%d] throttled, %d packets (%d bytes) queued, peak %d; dropped %d probes, %d presence, %d other",
+                   target->ip, target->port, target->tq_packets, target->tq_bytes, target->tq_peak,
+                   target->tq_drops[tq_PROBE], target->tq_drops[tq_PRESENCE], target->tq_drops[tq_STANZA]);
        } while(xhash_iter_next(r->components));
    return;
 }
@@ -282,6 +303,9 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
     rate_t rt;
     component_t comp;
     union xhashv xhv;
+    nad_cache_stats_t nad_stats;
+    jid_cache_stats_t jid_stats;
+    pool_cache_stats_t pool_stats;
 
 #ifdef POOL_DEBUG
     time_t pool_time = 0;
@@ -469,6 +493,15 @@ JABBER_MAIN("jabberd2router", "Jabber 2 Router", "Jabber Open Source Server: Rou
 
     log_write(r->log, LOG_NOTICE, "shutting down");
 
+    nad_cache_stats(&nad_stats);
+    log_write(r->log, LOG_INFO, "nad cache: %lu of %lu nads reused, %lu dropped, %lu buffer reallocs", nad_stats.hits, nad_stats.news, nad_stats.drops, nad_stats.reallocs);
+
+    jid_cache_stats(&jid_stats);
+    log_write(r->log, LOG_INFO, "jid cache: %lu of %lu jid parts prepped from the cache (%lu invalid), %lu too long to cache", jid_stats.hits, jid_stats.lookups, jid_stats.invalid, jid_stats.skipped);
+
+    pool_cache_stats(&pool_stats);
+    log_write(r->log, LOG_INFO, "pool cache: %lu of %lu blocks reused, %lu dropped, %lu bytes held, %lu of %lu bytes lost to rounding and unused heap space", pool_stats.hits, pool_stats.allocs, pool_stats.drops, pool_stats.held, pool_stats.slack + pool_stats.unused, pool_stats.requested);
+
     /* stop accepting new connections */
     if (r->fd) mio_close(r->mio, r->fd);
 
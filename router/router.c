@@ -146,12 +146,107 @@ static void _router_process_handshake(component_t comp, nad_t nad) {
 }
 
 void routes_free(routes_t routes) {
+    int i;
+
     if(routes->name) free(routes->name);
     if(routes->comp) free(routes->comp);
+    if(routes->weight) free(routes->weight);
+    if(routes->instance) {
+        for(i = 0; i < routes->ncomp; i++)
+            free(routes->instance[i]);
+        free(routes->instance);
+    }
+    if(routes->ring) free(routes->ring);
     free(routes);
 }
 
-static int _route_add(xht hroutes, const char *name, component_t comp, route_type_t rtype) {
+static int _route_point_cmp(const void *a, const void *b) {
+    unsigned int ha = ((const struct route_point_st *) a)->hash, hb = ((const struct route_point_st *) b)->hash;
+
+    return (ha > hb) - (ha < hb);
+}
+
+/** find the ring point that owns this hash - the first one at or after it, wrapping around */
+static struct route_point_st *_route_ring_find(struct route_point_st *ring, int nring, unsigned int hash) {
+    int lo = 0, hi = nring, mid;
+
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return &ring[lo == nring ? 0 : lo];
+}
+
+/** rebuild the hash ring for a route after its components change, and report how much of it moved */
+static void _route_ring_build(router_t r, routes_t routes) {
+    struct route_point_st *ring, *bounds;
+    int nring, nbounds, i, j, len;
+    size_t size;
+    unsigned int prev;
+    double moved = 0;
+    char *key;
+
+    /* each component gets points in proportion to its weight, placed by its
+     * instance name, so it gets the same ones back when it reconnects */
+    for(size = 0, i = 0; i < routes->ncomp; i++)
+        size += (size_t) routes->weight[i] * ROUTE_RING_POINTS;
+
+    ring = (struct route_point_st *) malloc(sizeof(struct route_point_st) * (size > 0 ? size : 1));
+    if(ring == NULL) {
+        /* users get spread at random until the next rebuild */
+        log_write(r->log, LOG_ERR, "[%s] couldn't allocate a hash ring of %lu points, spreading users at random", routes->name, (unsigned long) size);
+        if(routes->ring != NULL) free(routes->ring);
+        routes->ring = NULL;
+        routes->nring = 0;
+        return;
+    }
+
+    for(nring = 0, i = 0; i < routes->ncomp; i++) {
+        len = strlen(routes->name) + strlen(routes->instance[i]) + 14;
+        key = (char *) malloc(len);
+        for(j = 0; j < routes->weight[i] * ROUTE_RING_POINTS; j++) {
+            snprintf(key, len, "%s/%s#%d", routes->name, routes->instance[i], j);
+            ring[nring].hash = xhash_hash(key, strlen(key));
+            ring[nring].comp = routes->comp[i];
+            nring++;
+        }
+        free(key);
+    }
+
+    qsort(ring, nring, sizeof(struct route_point_st), _route_point_cmp);
+
+    /* work out how much of the hash space changed hands - between any two adjacent
+     * points of either ring, everything belongs to one component in each */
+    if(routes->nring > 0 && nring > 0) {
+        nbounds = routes->nring + nring;
+        bounds = (struct route_point_st *) malloc(sizeof(struct route_point_st) * nbounds);
+        memcpy(bounds, routes->ring, sizeof(struct route_point_st) * routes->nring);
+        memcpy(bounds + routes->nring, ring, sizeof(struct route_point_st) * nring);
+        qsort(bounds, nbounds, sizeof(struct route_point_st), _route_point_cmp);
+
+        prev = bounds[nbounds - 1].hash;
+        for(i = 0; i < nbounds; i++) {
+            if(_route_ring_find(routes->ring, routes->nring, bounds[i].hash)->comp != _route_ring_find(ring, nring, bounds[i].hash)->comp)
+                moved += (unsigned int) (bounds[i].hash - prev);
+            prev = bounds[i].hash;
+        }
+
+        free(bounds);
+
+        log_write(r->log, LOG_NOTICE, "[%s] now spread over %d components, %.1f%% of its users moved", routes->name, routes->ncomp, moved * 100.0 / 4294967296.0);
+    }
+
+    if(routes->ring != NULL) free(routes->ring);
+    routes->ring = ring;
+    routes->nring = nring;
+}
+
+/** add a component to a route. instance is a name for it that stays the same across connections (NULL for its ip:port) */
+static int _route_add(xht hroutes, const char *name, component_t comp, route_type_t rtype, int weight, const char *instance) {
     routes_t routes;
 
     routes = xhash_get(hroutes, name);
@@ -161,13 +256,20 @@ static int _route_add(xht hroutes, const char *name, component_t comp, route_typ
         routes->rtype = rtype;
     }
     routes->comp = (component_t *) realloc(routes->comp, sizeof(component_t *) * (routes->ncomp + 1));
+    routes->weight = (int *) realloc(routes->weight, sizeof(int) * (routes->ncomp + 1));
+    routes->instance = (char **) realloc(routes->instance, sizeof(char *) * (routes->ncomp + 1));
     routes->comp[routes->ncomp] = comp;
+    routes->weight[routes->ncomp] = weight < 1 ? 1 : weight > ROUTE_WEIGHT_MAX ? ROUTE_WEIGHT_MAX : weight;
+    routes->instance[routes->ncomp] = strdup(instance != NULL ? instance : comp->ipport);
     routes->ncomp++;
     xhash_put(hroutes, routes->name, (void *) routes);
 
     if(routes->rtype != rtype)
         log_write(comp->r->log, LOG_ERR, "Mixed route types for '%s' bind request", name);
 
+    /* spread users over the components */
+    _route_ring_build(comp->r, routes);
+
     return routes->ncomp;
 }
 
@@ -181,12 +283,17 @@ static void _route_remove(xht hroutes, const char *name, component_t comp) {
     if(routes->ncomp > 1) {
         for(i = 0; i < routes->ncomp; i++) {
             if(routes->comp[i] == comp) {
+                free(routes->instance[i]);
                 if(i != routes->ncomp - 1) {
                     routes->comp[i] = routes->comp[routes->ncomp - 1];
+                    routes->weight[i] = routes->weight[routes->ncomp - 1];
+                    routes->instance[i] = routes->instance[routes->ncomp - 1];
                 }
                 routes->ncomp--;
             }
         }
+
+        _route_ring_build(comp->r, routes);
     }
     else {
         jqueue_push(comp->r->deadroutes, (void *) routes, 0);
@@ -195,10 +302,10 @@ static void _route_remove(xht hroutes, const char *name, component_t comp) {
 }
 
 static void _router_process_bind(component_t comp, nad_t nad) {
-    int attr, multi, n;
+    int attr, multi, n, weight = 1;
     jid_t name;
     alias_t alias;
-    char *user, *c;
+    char *user, *c, *instance = NULL;
 
     attr = nad_find_attr(nad, 0, -1, "name", NULL);
     if(attr < 0 || (name = jid_new(NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr))) == NULL) {
@@ -223,6 +330,16 @@ static void _router_process_bind(component_t comp, nad_t nad) {
     }
 
     multi = nad_find_attr(nad, 0, -1, "multi", NULL);
+    if((attr = nad_find_attr(nad, 0, -1, "weight", NULL)) >= 0 && NAD_AVAL_L(nad, attr) < 8) {
+        char wbuf[8];
+        snprintf(wbuf, sizeof(wbuf), "%.*s", NAD_AVAL_L(nad, attr), NAD_AVAL(nad, attr));
+        weight = j_atoi(wbuf, 1);
+    }
+    if(weight < 1 || weight > ROUTE_WEIGHT_MAX) {
+        log_write(comp->r->log, LOG_NOTICE, "[%s, port=%d] asked for weight %d binding '%s', using %d", comp->ip, comp->port, weight, name->domain, weight < 1 ? 1 : ROUTE_WEIGHT_MAX);
+        weight = weight < 1 ? 1 : ROUTE_WEIGHT_MAX;
+    }
+
     if(xhash_get(comp->r->routes, name->domain) != NULL && multi < 0) {
         log_write(comp->r->log, LOG_NOTICE, "[%s, port=%d] tried to bind '%s', but it's already bound", comp->ip, comp->port, name->domain);
         nad_set_attr(nad, 0, -1, "name", NULL, 0);
@@ -289,7 +406,21 @@ static void _router_process_bind(component_t comp, nad_t nad) {
 
     free(user);
 
-    n = _route_add(comp->r->routes, name->domain, comp, multi<0?route_SINGLE:route_MULTI_TO);
+    /* multicast routes, we tell them we understood so they know they can send them too */
+    if(nad_find_elem(nad, 0, NAD_ENS(nad, 0), "multicast", 1) >= 0) {
+        log_debug(ZONE, "%s (%s, port %d) takes multicast routes", name->domain, comp->ip, comp->port);
+        comp->multicast = 1;
+        nad_set_attr(nad, 0, -1, "multicast", "true", 4);
+    }
+
+    /* a name for the component that outlives this connection, to keep its users where they were */
+    if((attr = nad_find_attr(nad, 0, -1, "instance", NULL)) >= 0 && NAD_AVAL_L(nad, attr) > 0 && NAD_AVAL_L(nad, attr) < 1024) {
+        instance = (char *) malloc(NAD_AVAL_L(nad, attr) + 1);
+        memcpy(instance, NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
+        instance[NAD_AVAL_L(nad, attr)] = '\0';
+    }
+
+    n = _route_add(comp->r->routes, name->domain, comp, multi<0?route_SINGLE:route_MULTI_TO, weight, instance);
     xhash_put(comp->routes, pstrdup(xhash_pool(comp->routes), name->domain), (void *) comp);
 
     if(n>1)
@@ -309,7 +440,7 @@ static void _router_process_bind(component_t comp, nad_t nad) {
     /* bind aliases */
     for(alias = comp->r->aliases; alias != NULL; alias = alias->next) {
         if(strcmp(alias->target, name->domain) == 0) {
-            _route_add(comp->r->routes, name->domain, comp, route_MULTI_TO);
+            _route_add(comp->r->routes, name->domain, comp, route_MULTI_TO, weight, instance);
             xhash_put(comp->routes, pstrdup(xhash_pool(comp->routes), alias->name), (void *) comp);
             
             log_write(comp->r->log, LOG_NOTICE, "[%s] online (alias of '%s', bound to %s, port %d)", alias->name, name->domain, comp->ip, comp->port);
@@ -321,6 +452,7 @@ static void _router_process_bind(component_t comp, nad_t nad) {
 
     /* done with this */
     jid_free(name);
+    if(instance != NULL) free(instance);
 }
 
 static void _router_process_unbind(component_t comp, nad_t nad) {
@@ -366,12 +498,126 @@ static void _router_process_unbind(component_t comp, nad_t nad) {
     jid_free(name);
 }
 
+/** which throttle queue class a packet falls in */
+static tq_class_t _router_tq_class(nad_t nad) {
+    int attr;
+
+    if(NAD_ENAME_L(nad, 0) != 5 || strncmp("route", NAD_ENAME(nad, 0), 5) != 0 || nad->ecur < 2)
+        return tq_CONTROL;
+
+    if(NAD_ENAME_L(nad, 1) != 8 || strncmp("presence", NAD_ENAME(nad, 1), 8) != 0)
+        return tq_STANZA;
+
+    attr = nad_find_attr(nad, 1, -1, "type", NULL);
+    if(attr >= 0 && NAD_AVAL_L(nad, attr) == 5 && strncmp("probe", NAD_AVAL(nad, attr), 5) == 0)
+        return tq_PROBE;
+
+    return tq_PRESENCE;
+}
+
+/** memory a queued packet holds on to */
+static int _router_tq_size(nad_t nad) {
+    return nad->elen + nad->alen + nad->nlen + nad->clen + nad->dlen;
+}
+
+/** true if a queue holding this much is over the limits */
+static int _router_tq_over(router_t r, int packets, int bytes) {
+    return (r->tq_max_packets > 0 && packets > r->tq_max_packets) || (r->tq_max_bytes > 0 && bytes > r->tq_max_bytes);
+}
+
+/** drop the oldest queued packet of a class */
+static void _router_tq_evict(component_t comp, tq_class_t cls) {
+    _jqueue_node_t n;
+    nad_t nad;
+
+    for(n = comp->tq->front; n != NULL; n = n->prev) {
+        nad = (nad_t) n->data;
+        if(nad == NULL || _router_tq_class(nad) != cls)
+            continue;
+
+        /* leave a hole, it gets swept out later */
+        n->data = NULL;
+
+        comp->tq_packets--;
+        comp->tq_bytes -= _router_tq_size(nad);
+        comp->tq_count[cls]--;
+        comp->tq_drops[cls]++;
+
+        nad_free(nad);
+        return;
+    }
+}
+
+/** hold a packet for a throttled component, dropping lesser packets to make room if we have to.
+ *  presence that doesn't fit is dropped; returns 1 (packet untouched) if anything else doesn't fit */
+static int _router_tq_push(component_t comp, nad_t nad) {
+    tq_class_t cls = _router_tq_class(nad), low;
+    int size = _router_tq_size(nad);
+    jqueue_t tq;
+    nad_t pkt;
+
+    while(cls != tq_CONTROL && _router_tq_over(comp->r, comp->tq_packets + 1, comp->tq_bytes + size)) {
+        for(low = tq_PROBE; low < cls && low < tq_STANZA && comp->tq_count[low] == 0; low++);
+        if(low == cls || low == tq_STANZA)
+            break;
+
+        _router_tq_evict(comp, low);
+    }
+
+    if(cls != tq_CONTROL && _router_tq_over(comp->r, comp->tq_packets + 1, comp->tq_bytes + size)) {
+        log_debug(ZONE, "throttle queue for %s port %d is full, no room for class %d packet", comp->ip, comp->port, cls);
+        comp->tq_drops[cls]++;
+
+        if(cls == tq_STANZA)
+            return 1;
+
+        nad_free(nad);
+        return 0;
+    }
+
+    log_debug(ZONE, "%s port %d is throttled, jqueueing packet", comp->ip, comp->port);
+    jqueue_push(comp->tq, nad, 0);
+
+    comp->tq_packets++;
+    comp->tq_bytes += size;
+    comp->tq_count[cls]++;
+
+    if(comp->tq_packets > comp->tq_peak)
+        comp->tq_peak = comp->tq_packets;
+
+    /* sweep out the holes once they outnumber the packets */
+    if(jqueue_size(comp->tq) > comp->tq_packets * 2 + 64) {
+        tq = jqueue_new();
+        while(jqueue_size(comp->tq) > 0)
+            if((pkt = (nad_t) jqueue_pull(comp->tq)) != NULL)
+                jqueue_push(tq, pkt, 0);
+
+        jqueue_free(comp->tq);
+        comp->tq = tq;
+    }
+
+    return 0;
+}
+
+/** stop reading from a component while the queue it's feeding has no room */
+static void _router_tq_wait(component_t comp, component_t target) {
+    if(comp == target || comp->tq != NULL || comp->tq_wait[0] != '\0')
+        return;
+
+    if(!_router_tq_over(comp->r, target->tq_packets + 1, target->tq_bytes))
+        return;
+
+    log_write(comp->r->log, LOG_NOTICE, "[%s, port=%d] is sending to the full queue of %s, port %d, delaying reads", comp->ip, comp->port, target->ip, target->port);
+
+    strcpy(comp->tq_wait, target->ipport);
+}
+
 static void _router_comp_write(component_t comp, nad_t nad) {
     int attr;
 
     if(comp->tq != NULL) {
-        log_debug(ZONE, "%s port %d is throttled, jqueueing packet", comp->ip, comp->port);
-        jqueue_push(comp->tq, nad, 0);
+        if(_router_tq_push(comp, nad))
+            nad_free(nad);
         return;
     }
 
@@ -394,6 +640,50 @@ static void _router_comp_write(component_t comp, nad_t nad) {
     sx_nad_write_elem(comp->s, nad, 1);
 }
 
+/** check that a packet's wire bytes stand on their own - the route must declare its own namespace,
+ *  and nothing inside it can lean on the stream prefix */
+static int _router_raw_ok(nad_t nad, char *raw, int len) {
+    int ns, i;
+
+    for(ns = nad->elems[0].ns; ns >= 0 && ns != NAD_ENS(nad, 0); ns = nad->nss[ns].next);
+    if(ns < 0 || nad->nss[ns].iprefix >= 0)
+        return 0;
+
+    if(nad_find_scoped_namespace(nad, uri_STREAMS, NULL) >= 0)
+        return 0;
+
+    /* and it's really on the start tag, not just in scope from the stream header */
+    for(i = 0; i < len - 7 && raw[i] != '>'; i++)
+        if((raw[i] == ' ' || raw[i] == '\t' || raw[i] == '\r' || raw[i] == '\n') && strncmp(raw + i + 1, "xmlns=", 6) == 0)
+            return 1;
+
+    return 0;
+}
+
+/** send a routed packet on, as it arrived if we can */
+static void _router_comp_write_raw(component_t comp, component_t target, nad_t nad, char *raw, int len) {
+    /* throttled components queue the nad, and we hold off the sender once the queue fills */
+    if(target->tq != NULL) {
+        if(_router_tq_push(target, nad)) {
+            log_debug(ZONE, "no room for route to %s, port %d, bouncing", target->ip, target->port);
+            nad_set_attr(nad, 0, -1, "error", "503", 3);
+            _router_comp_write(comp, nad);
+        }
+
+        _router_tq_wait(comp, target);
+        return;
+    }
+
+    /* legacy components get the nad, as usual */
+    if(raw == NULL || target->legacy) {
+        _router_comp_write(target, nad);
+        return;
+    }
+
+    sx_raw_write(target->s, raw, len);
+    nad_free(nad);
+}
+
 static void _router_route_log_sink(const char *key, int keylen, void *val, void *arg) {
     component_t comp = (component_t) val;
     nad_t nad = (nad_t) arg;
@@ -405,7 +695,15 @@ static void _router_route_log_sink(const char *key, int keylen, void *val, void
     _router_comp_write(comp, nad);
 }
 
-static void _router_process_route(component_t comp, nad_t nad) {
+static void _router_route(component_t comp, nad_t nad, int wire);
+
+/** route one address of a multicast on, as if it had come in on its own */
+static void _router_multicast_route(nad_t nad, void *arg) {
+    _router_route((component_t) arg, nad, 0);
+}
+
+/** a route the component sent us, or one we built (wire = 0) - its bytes aren't on the stream, so it can't go out raw */
+static void _router_route(component_t comp, nad_t nad, int wire) {
     int atype, ato, afrom;
     unsigned int dest;
     struct jid_st sto, sfrom;
@@ -414,6 +712,8 @@ static void _router_process_route(component_t comp, nad_t nad) {
     routes_t targets;
     component_t target;
     union xhashv xhv;
+    char *raw = NULL;
+    int rawlen = 0, ret = 0;
 
     /* init static jid */
     jid_static(&sto,&sto_buf);
@@ -453,7 +753,7 @@ static void _router_process_route(component_t comp, nad_t nad) {
 
         /* filter it */
         if(comp->r->filter != NULL) {
-            int ret = filter_packet(comp->r, nad);
+            ret = filter_packet(comp->r, nad);
             if(ret == stanza_err_REDIRECT) {
                 ato = nad_find_attr(nad, 0, -1, "to", NULL);
                 if(ato >= 0) to = jid_reset(&sto, NAD_AVAL(nad, ato), NAD_AVAL_L(nad, ato));
@@ -466,6 +766,10 @@ static void _router_process_route(component_t comp, nad_t nad) {
             }
         }
 
+        /* if we haven't touched it (legacy packets have been rewrapped), it can go out as it came in */
+        if(ret == 0 && wire && !comp->legacy && sx_raw_packet(comp->s, &raw, &rawlen) && !_router_raw_ok(nad, raw, rawlen))
+            raw = NULL;
+
         /* find a target */
         targets = xhash_get(comp->r->routes, to->domain);
         if(targets == NULL) {
@@ -491,7 +795,7 @@ static void _router_process_route(component_t comp, nad_t nad) {
 
         /* get route candidate */
         if(targets->ncomp == 1) {
-            dest = 0;
+            target = targets->comp[0];
         }
         else {
             switch(targets->rtype) {
@@ -521,27 +825,18 @@ static void _router_process_route(component_t comp, nad_t nad) {
                     log_write(comp->r->log, LOG_ERR, "Multiple components bound to single component route '%s'", targets->name);
                     /* simulate no 'to' info in this case */
             }
-            if(to->node == NULL || strlen(to->node) == 0) {
+            if(to->node == NULL || strlen(to->node) == 0 || targets->nring == 0) {
                 /* no node in destination JID - going random */
-                dest = rand();
-                log_debug(ZONE, "randomized to %u %% %d = %d", dest, targets->ncomp, dest % targets->ncomp);
+                dest = rand() % targets->ncomp;
+                target = targets->comp[dest];
+                log_debug(ZONE, "randomized to %d", dest);
             }
             else {
-                /* use JID hash */
-                unsigned char hashval[20];
-                unsigned int *val;
-                int i;
-                
-                shahash_raw(jid_user(to), hashval);
-                
-                val = (unsigned int *) hashval;
-                dest = *val;
-                for(i=1; i < 20 / (sizeof(unsigned int)/sizeof(unsigned char)); i++, val++) {
-                    dest ^= *val;
-                }
-                dest >>= 2;
+                /* the user's place on the ring, so they stay put as components come and go */
+                dest = xhash_hash(jid_user(to), strlen(jid_user(to)));
+                target = _route_ring_find(targets->ring, targets->nring, dest)->comp;
 
-                log_debug(ZONE, "JID %s hashed to %u %% %d = %d", jid_user(to), dest, targets->ncomp, dest % targets->ncomp);
+                log_debug(ZONE, "JID %s hashed to %u, %s port %d", jid_user(to), dest, target->ip, target->port);
 
                 /* jid_user() calls jid_expand() which may allocate some memory in _user and _full */
                 if (to->_user != NULL )
@@ -549,15 +844,12 @@ static void _router_process_route(component_t comp, nad_t nad) {
                 if (to->_full != NULL )
                     free(to->_full);
             }
-            dest = dest % targets->ncomp;
         }
 
-        target = targets->comp[dest];
-
         /* push it out */
-        log_debug(ZONE, "writing route for '%s'*%u to %s, port %d", to->domain, dest+1, target->ip, target->port);
+        log_debug(ZONE, "writing route for '%s' to %s, port %d", to->domain, target->ip, target->port);
 
-        _router_comp_write(target, nad);
+        _router_comp_write_raw(comp, target, nad, raw, rawlen);
 
         return;
     }
@@ -599,11 +891,60 @@ static void _router_process_route(component_t comp, nad_t nad) {
         return;
     }
 
+    /* multicast - one stanza, many addresses in a single domain */
+    if(NAD_AVAL_L(nad, atype) == 9 && strncmp("multicast", NAD_AVAL(nad, atype), 9) == 0) {
+        if(to == NULL || from == NULL) {
+            log_debug(ZONE, "multicast route with missing or invalid to or from, bouncing");
+            nad_set_attr(nad, 0, -1, "error", "400", 3);
+            _router_comp_write(comp, nad);
+            return;
+        }
+
+        log_debug(ZONE, "multicast route from %s to %s", from->domain, to->domain);
+
+        /* check the from */
+        if(xhash_get(comp->routes, from->domain) == NULL) {
+            log_write(comp->r->log, LOG_NOTICE, "[%s, port=%d] tried to send a packet from '%s', but that name is not bound to this component", comp->ip, comp->port, from->domain);
+            nad_set_attr(nad, 0, -1, "error", "401", 3);
+            _router_comp_write(comp, nad);
+            return;
+        }
+
+        targets = xhash_get(comp->r->routes, to->domain);
+        if(targets == NULL && comp->r->default_route != NULL && strcmp(from->domain, comp->r->default_route) != 0)
+            targets = xhash_get(comp->r->routes, comp->r->default_route);
+
+        /* one component that can take it whole, and nobody needing to see each address - straight through */
+        if(targets != NULL && targets->ncomp == 1 && targets->comp[0]->multicast && comp->r->filter == NULL && xhash_count(comp->r->log_sinks) == 0) {
+            target = targets->comp[0];
+
+            if(!comp->legacy && sx_raw_packet(comp->s, &raw, &rawlen) && !_router_raw_ok(nad, raw, rawlen))
+                raw = NULL;
+
+            log_debug(ZONE, "writing multicast route for '%s' to %s, port %d", to->domain, target->ip, target->port);
+
+            _router_comp_write_raw(comp, target, nad, raw, rawlen);
+
+            return;
+        }
+
+        /* otherwise each address goes through the normal unicast path, filters, bounces and all */
+        ret = nad_multicast_expand(nad, _router_multicast_route, (void *) comp);
+
+        log_debug(ZONE, "expanded multicast route for '%s' into %d routes", to->domain, ret);
+
+        return;
+    }
+
     log_debug(ZONE, "unknown route type '%.*s', dropping", NAD_AVAL_L(nad, atype), NAD_AVAL(nad, atype));
 
     nad_free(nad);
 }
 
+static void _router_process_route(component_t comp, nad_t nad) {
+    _router_route(comp, nad, 1);
+}
+
 static void _router_process_throttle(component_t comp, nad_t nad) {
     jqueue_t tq;
     nad_t pkt;
@@ -613,17 +954,22 @@ static void _router_process_throttle(component_t comp, nad_t nad) {
 
         log_write(comp->r->log, LOG_NOTICE, "[%s, port=%d] throttling packets on request", comp->ip, comp->port);
         comp->tq = jqueue_new();
+
+        comp->tq_packets = comp->tq_bytes = 0;
+        memset(comp->tq_count, 0, sizeof(comp->tq_count));
     }
 
     else {
-        log_write(comp->r->log, LOG_NOTICE, "[%s, port=%d] unthrottling packets on request", comp->ip, comp->port);
+        log_write(comp->r->log, LOG_NOTICE, "[%s, port=%d] unthrottling packets on request, delivering %d queued (%d bytes)", comp->ip, comp->port, comp->tq_packets, comp->tq_bytes);
         tq = comp->tq;
         comp->tq = NULL;
 
         _router_comp_write(comp, nad);
 
-        while((pkt = jqueue_pull(tq)) != NULL)
-            _router_comp_write(comp, pkt);
+        /* holes left by dropped packets pull as NULL */
+        while(jqueue_size(tq) > 0)
+            if((pkt = (nad_t) jqueue_pull(tq)) != NULL)
+                _router_comp_write(comp, pkt);
 
         jqueue_free(tq);
     }
@@ -639,6 +985,7 @@ static int _router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
     jid_static_buf sto_buf, sfrom_buf;
     jid_t to, from;
     alias_t alias;
+    component_t target;
 
     /* init static jid */
     jid_static(&sto,&sto_buf);
@@ -658,6 +1005,20 @@ static int _router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
         case event_READ:
             log_debug(ZONE, "reading from %d", comp->fd->fd);
 
+            /* hold off while they're feeding a full throttle queue, until it's half drained */
+            if(comp->tq_wait[0] != '\0') {
+                target = (component_t) xhash_get(comp->r->components, comp->tq_wait);
+                if(target != NULL && target->tq != NULL && _router_tq_over(comp->r, target->tq_packets * 2, target->tq_bytes * 2)) {
+                    log_debug(ZONE, "%d is sending to a full queue, delaying read", comp->fd->fd);
+
+                    buf->len = 0;
+                    return 0;
+                }
+
+                log_write(comp->r->log, LOG_NOTICE, "[%s, port=%d] queue it was sending to has drained, resuming reads", comp->ip, comp->port);
+                comp->tq_wait[0] = '\0';
+            }
+
             /* check rate limits */
             if(comp->rate != NULL) {
                 if(rate_check(comp->rate) == 0) {
@@ -721,9 +1082,13 @@ static int _router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             return len;
 
         case event_WRITE:
+        case event_WRITEV:
             log_debug(ZONE, "writing to %d", comp->fd->fd);
 
-            len = send(comp->fd->fd, buf->data, buf->len, 0);
+            if(e == event_WRITEV)
+                len = writev(comp->fd->fd, ((sx_wvec_t *) data)->iov, ((sx_wvec_t *) data)->niov);
+            else
+                len = send(comp->fd->fd, buf->data, buf->len, 0);
             if(len >= 0) {
                 log_debug(ZONE, "%d bytes written", len);
                 return len;
@@ -783,7 +1148,7 @@ static int _router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                     }
 
 
-                n = _route_add(comp->r->routes, s->req_to, comp, route_MULTI_FROM);
+                n = _route_add(comp->r->routes, s->req_to, comp, route_MULTI_FROM, 1, NULL);
                 xhash_put(comp->routes, pstrdup(xhash_pool(comp->routes), s->req_to), (void *) comp);
 
                 if(n>1)
@@ -799,7 +1164,7 @@ static int _router_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                 /* bind aliases */
                 for(alias = comp->r->aliases; alias != NULL; alias = alias->next) {
                     if(strcmp(alias->target, s->req_to) == 0) {
-                        _route_add(comp->r->routes, alias->name, comp, route_MULTI_FROM);
+                        _route_add(comp->r->routes, alias->name, comp, route_MULTI_FROM, 1, NULL);
                         xhash_put(comp->routes, pstrdup(xhash_pool(comp->routes), alias->name), (void *) comp);
             
                         log_write(comp->r->log, LOG_NOTICE, "[%s] online (alias of '%s', bound to %s, port %d)", alias->name, s->req_to, comp->ip, comp->port);
@@ -989,6 +1354,7 @@ int router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *
     component_t comp = (component_t) arg;
     router_t r;
     int nbytes;
+    nad_t nad;
 
     switch(a) {
         case action_READ:
@@ -1028,9 +1394,13 @@ int router_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *
 
             xhash_free(comp->routes);
 
-            if(comp->tq != NULL)
+            if(comp->tq != NULL) {
                 /* !!! bounce packets */
+                while(jqueue_size(comp->tq) > 0)
+                    if((nad = (nad_t) jqueue_pull(comp->tq)) != NULL)
+                        nad_free(nad);
                 jqueue_free(comp->tq);
+            }
 
             rate_free(comp->rate);
 
@@ -1092,9 +1462,9 @@ int router_mio_accept_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data,
     xhash_put(r->components, comp->ipport, (void *) comp);
 
 #ifdef HAVE_SSL
-    sx_server_init(comp->s, SX_SSL_STARTTLS_OFFER | SX_SASL_OFFER);
+    sx_server_init(comp->s, SX_SSL_STARTTLS_OFFER | SX_SASL_OFFER | SX_WRITEV | SX_RAW_READ);
 #else
-    sx_server_init(comp->s, SX_SASL_OFFER);
+    sx_server_init(comp->s, SX_SASL_OFFER | SX_WRITEV | SX_RAW_READ);
 #endif
 
     return 0;
@@ -112,6 +112,10 @@ struct router_st {
     int                 byte_rate_seconds;
     int                 byte_rate_wait;
 
+    /** limits on what we'll hold for a throttled component (0 means no limit) */
+    int                 tq_max_packets;
+    int                 tq_max_bytes;
+
     /** sx environment */
     sx_env_t            sx_env;
     sx_plugin_t         sx_ssl;
@@ -157,6 +161,15 @@ struct router_st {
     jqueue_t            deadroutes;
 };
 
+/** throttle queue classes - when a queue is full, packets of the lowest class go first */
+typedef enum {
+    tq_PROBE = 0,               /**< presence probes */
+    tq_PRESENCE = 1,            /**< other presence */
+    tq_STANZA = 2,              /**< messages, iqs and anything else routed */
+    tq_CONTROL = 3,             /**< our own packets to the component, never dropped */
+    tq_CLASSES = 4
+} tq_class_t;
+
 /** a single component */
 struct component_st {
     router_t            r;
@@ -184,8 +197,22 @@ struct component_st {
     /** true if this is an old component:accept stream */
     int                 legacy;
 
-    /** throttle queue */
+    /** true if the component asked for multicast routes whole, rather than one route per address */
+    int                 multicast;
+
+    /** throttle queue - packets waiting for the component to unthrottle,
+     *  oldest first; dropped packets leave a NULL behind */
     jqueue_t            tq;
+    int                 tq_packets;
+    int                 tq_bytes;
+    int                 tq_count[tq_CLASSES];
+
+    /** throttle queue counters, for the life of the component */
+    int                 tq_peak;
+    int                 tq_drops[tq_CLASSES];
+
+    /** ip:port of the full queue we're feeding, we stop reading until it drains */
+    char                tq_wait[INET6_ADDRSTRLEN + 6];
 
     /** timestamps for idle timeouts */
     time_t              last_activity;
@@ -198,12 +225,31 @@ typedef enum {
     route_MULTI_FROM = 0x11,     /**< multi component route - route by 'from' */
 } route_type_t;
 
+/** points on the hash ring for each unit of component weight */
+#define ROUTE_RING_POINTS   (100)
+
+/** most weight a component can ask for */
+#define ROUTE_WEIGHT_MAX    (100)
+
+/** a point on a multi component route's hash ring */
+struct route_point_st
+{
+    unsigned int        hash;
+    component_t         comp;
+};
+
 struct routes_st
 {
     char                *name;
     route_type_t        rtype;
     component_t         *comp;
+    int                 *weight;
+    char                **instance;     /**< what each component's ring points are placed by */
     int                 ncomp;
+
+    /** consistent hash ring over the components, sorted by hash */
+    struct route_point_st *ring;
+    int                 nring;
 };
 
 struct alias_st {
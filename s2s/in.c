@@ -86,6 +86,8 @@ int in_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg)
             /* !!! logging */
             log_write(in->s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] disconnect, packets: %i", fd->fd, in->ip, in->port, in->packet_count);
 
+            s2s_conn_check_cancel(in);
+
             jqueue_push(in->s2s->dead, (void *) in->s, 0);
 
             /* remove from open streams hash if online, or open connections if not */
@@ -148,10 +150,13 @@ int mio_accept_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *
     snprintf(ipport, INET6_ADDRSTRLEN + 16, "%s/%d", in->ip, in->port);
     xhash_put(s2s->in_accept, pstrdup(xhash_pool(s2s->in_accept),ipport), (void *) in);
 
+    /* stream initiation timeout */
+    s2s_conn_check_schedule(in, 0);
+
 #ifdef HAVE_SSL
-    sx_server_init(in->s, S2S_DB_HEADER | ((s2s->sx_ssl != NULL) ? SX_SSL_STARTTLS_OFFER : 0) );
+    sx_server_init(in->s, S2S_DB_HEADER | SX_WRITEV | ((s2s->sx_ssl != NULL) ? SX_SSL_STARTTLS_OFFER : 0) );
 #else
-    sx_server_init(in->s, S2S_DB_HEADER);
+    sx_server_init(in->s, S2S_DB_HEADER | SX_WRITEV);
 #endif
     return 0;
 }
@@ -208,9 +213,13 @@ static int _in_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             return len;
 
         case event_WRITE:
+        case event_WRITEV:
             log_debug(ZONE, "writing to %d", in->fd->fd);
 
-            len = send(in->fd->fd, buf->data, buf->len, 0);
+            if(e == event_WRITEV)
+                len = writev(in->fd->fd, ((sx_wvec_t *) data)->iov, ((sx_wvec_t *) data)->niov);
+            else
+                len = send(in->fd->fd, buf->data, buf->len, 0);
             if(len >= 0) {
                 log_debug(ZONE, "%d bytes written", len);
                 return len;
@@ -271,6 +280,8 @@ static int _in_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
 
             /* update last packet timestamp */
             in->last_packet = time(NULL);
+            if(in->check_timer == NULL)
+                s2s_conn_check_schedule(in, 0);
 
             /* dialback packets */
             if(NAD_NURI_L(nad, NAD_ENS(nad, 0)) == strlen(uri_DIALBACK) && strncmp(uri_DIALBACK, NAD_NURI(nad, NAD_ENS(nad, 0)), strlen(uri_DIALBACK)) == 0) {
@@ -400,6 +411,9 @@ static void _in_result(conn_t in, nad_t nad) {
     now = time(NULL);
     xhash_put(in->states_time, pstrdup(xhash_pool(in->states_time), rkey), (void *) now);
 
+    /* make sure the dialback timeout gets checked */
+    s2s_conn_check_schedule(in, 0);
+
     free(rkey);
 
     /* new packet */
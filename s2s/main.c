@@ -37,6 +37,7 @@ static void _s2s_signal_hup(int signum) {
 
 static void _conn_t_free(conn_t conn) {
     if (!conn) return;
+    s2s_conn_check_cancel(conn);
     xhash_free(conn->states);
     xhash_free(conn->states_time);
     xhash_free(conn->routes);
@@ -161,6 +162,13 @@ static void _s2s_config_expand(s2s_t s2s) {
 
     s2s->io_max_fds = j_atoi(config_get_one(s2s->config, "io.max_fds", 0), 1024);
 
+    nad_cache_config(j_atoi(config_get_one(s2s->config, "io.nad_cache.max", 0), NAD_CACHE_MAX),
+                     j_atoi(config_get_one(s2s->config, "io.nad_cache.size", 0), NAD_CACHE_SIZE));
+
+    jid_cache_config(j_atoi(config_get_one(s2s->config, "io.jid_cache", 0), JID_CACHE_SIZE));
+
+    pool_cache_config(j_atoi(config_get_one(s2s->config, "io.pool_cache", 0), POOL_CACHE_SIZE));
+
     s2s->stanza_size_limit = j_atoi(config_get_one(s2s->config, "io.limits.stanzasize", 0), 0);
 
     s2s->check_interval = j_atoi(config_get_one(s2s->config, "check.interval", 0), 60);
@@ -256,7 +264,7 @@ static int _s2s_router_connect(s2s_t s2s) {
     }
 
     s2s->router = sx_new(s2s->sx_env, s2s->fd->fd, s2s_router_sx_callback, (void *) s2s);
-    sx_client_init(s2s->router, 0, NULL, NULL, NULL, "1.0");
+    sx_client_init(s2s->router, SX_WRITEV, NULL, NULL, NULL, "1.0");
 
     return 0;
 }
@@ -302,291 +310,232 @@ int _s2s_check_conn_routes(s2s_t s2s, conn_t conn, const char *direction)
     return 1;
 }
 
-static void _s2s_time_checks(s2s_t s2s) {
-    conn_t conn;
-    time_t now;
-    jqueue_t q;
-    dnscache_t dns;
-    char *c;
-    union xhashv xhv;
+/** earliest time one of the conn checks is due, or 0 if none is */
+static time_t _s2s_conn_deadline(conn_t conn, int outgoing) {
+    s2s_t s2s = conn->s2s;
+    time_t when = 0, t;
+    char *rkey;
+    int rkey_len;
 
-    now = time(NULL);
+#define DEADLINE(x) do { t = (x); if(when == 0 || t < when) when = t; } while(0)
 
-    /* queue expiry */
     if(s2s->check_queue > 0) {
-        if(xhash_iter_first(s2s->outq))
+        /* connect or stream initiation timeout */
+        if(!conn->online)
+            DEADLINE(conn->init_time + s2s->check_queue);
+
+        /* no dialback initiated */
+        else if(!outgoing && !xhash_count(conn->states))
+            DEADLINE(conn->init_time + s2s->check_queue);
+
+        /* dialbacks in progress */
+        if(xhash_iter_first(conn->states))
             do {
-                xhv.jq_val = &q;
-                char * rkey;
-                int rkey_len;
-                xhash_iter_get(s2s->outq, (const char **) &rkey, &rkey_len, xhv.val);
-                char * local_rkey = (char *) malloc(rkey_len + 1);
-                memcpy(local_rkey, rkey, rkey_len);
-                local_rkey[rkey_len] = 0;
-
-                log_debug(ZONE, "running time checks for %s\n", local_rkey);
-                c = strchr(rkey, '/');
-                c++;
-
-                /* dns lookup timeout check first */
-                dns = xhash_get(s2s->dnscache, c);
-                if(dns != NULL && dns->pending) {
-                    log_debug(ZONE, "dns lookup pending for %s", c);
-                    if(now > dns->init_time + s2s->check_queue) {
-                        log_write(s2s->log, LOG_NOTICE, "dns lookup for %s timed out", c);
-
-                        /* bounce queue */
-                        out_bounce_route_queue(s2s, local_rkey, stanza_err_REMOTE_SERVER_NOT_FOUND);
-
-                        /* expire pending dns entry */
-                        xhash_zap(s2s->dnscache, dns->name);
-                        xhash_free(dns->results);
-                        if (dns->query != NULL) {
-                            if (dns->query->have_async_id)
-                                ub_cancel(s2s->ub_ctx, dns->query->async_id);
-                            xhash_free(dns->query->hosts);
-                            xhash_free(dns->query->results);
-                            free(dns->query->name);
-                            free(dns->query);
-                        }
-                        free(dns);
-                    }
+                xhash_iter_get(conn->states, (const char **) &rkey, &rkey_len, NULL);
+                if((conn_state_t) xhash_getx(conn->states, rkey, rkey_len) == conn_INPROGRESS)
+                    DEADLINE((time_t) xhash_getx(conn->states_time, rkey, rkey_len) + s2s->check_queue);
+            } while(xhash_iter_next(conn->states));
+
+        /* outstanding verify requests */
+        if(conn->verify > 0)
+            DEADLINE(conn->last_verify + s2s->check_queue);
+    }
 
-                    continue;
-                }
+    /* keepalives and idle timeouts wait for the stream to come up */
+    if(conn->s->state >= state_STREAM) {
+        if(outgoing && s2s->check_keepalive > 0 && conn->last_activity > 0)
+            DEADLINE(conn->last_activity + s2s->check_keepalive);
 
-                /* get the conn */
-                conn = xhash_get(s2s->out_dest, c);
-                if(conn == NULL) {
-                    if(jqueue_size(q) > 0) {
-                       /* no pending conn? perhaps it failed? */
-                       log_debug(ZONE, "no pending connection for %s, bouncing %i packets in queue", c, jqueue_size(q));
+        if(s2s->check_idle > 0 && conn->last_packet > 0)
+            DEADLINE(conn->last_packet + s2s->check_idle);
+    }
 
-                       /* bounce queue */
-                       out_bounce_route_queue(s2s, local_rkey, stanza_err_REMOTE_SERVER_TIMEOUT);
-                    }
+#undef DEADLINE
 
-                    continue;
-                }
+    return when;
+}
 
-                /* connect timeout check */
-                if(!conn->online && now > conn->init_time + s2s->check_queue) {
-                    dnsres_t bad;
-                    char *ipport;
-
-                    log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] connection to %s timed out", conn->fd->fd, conn->ip, conn->port, c);
-
-                    if (s2s->dns_bad_timeout > 0) {
-                        /* mark this host as bad */
-                        ipport = dns_make_ipport(conn->ip, conn->port);
-                        bad = xhash_get(s2s->dns_bad, ipport);
-                        if (bad == NULL) {
-                            bad = (dnsres_t) calloc(1, sizeof(struct dnsres_st));
-                            bad->key = ipport;
-                            xhash_put(s2s->dns_bad, ipport, bad);
-                        } else {
-                            free(ipport);
-                        }
-                        bad->expiry = time(NULL) + s2s->dns_bad_timeout;
-                    }
+/** run the checks that are due on a conn, then rearm for the next one */
+static int _s2s_conn_check(conn_t conn, int outgoing) {
+    s2s_t s2s = conn->s2s;
+    time_t now;
 
-                    /* close connection as per XMPP/RFC3920 */
-                    /* the close function will retry or bounce the queue */
-                    sx_close(conn->s);
-                }
-            } while(xhash_iter_next(s2s->outq));
-    }
+    conn->check_timer = NULL;
+
+    now = time(NULL);
 
-    /* expiry of connected routes in conn_INPROGRESS state */
     if(s2s->check_queue > 0) {
+        /* connect or stream initiation timeout */
+        if(!conn->online && now > conn->init_time + s2s->check_queue) {
+            if(outgoing) {
+                log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] connection to %s timed out", conn->fd->fd, conn->ip, conn->port, conn->dkey != NULL ? conn->dkey : conn->key);
 
-        /* outgoing connections */
-        if(s2s->out_reuse) {
-            if(xhash_iter_first(s2s->out_host))
-                do {
-                    xhv.conn_val = &conn;
-                    char * key;
-                    int key_len;
-                    xhash_iter_get(s2s->out_host, (const char **) &key, &key_len, xhv.val);
-                    log_debug(ZONE, "checking dialback state for outgoing conn %.*s", key_len, key);
-                    if (_s2s_check_conn_routes(s2s, conn, "outgoing")) {
-                        log_debug(ZONE, "checking pending verify requests for outgoing conn %.*s", key_len, key);
-                        if (conn->verify > 0 && now > conn->last_verify + s2s->check_queue) {
-                            log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] dialback verify request timed out", conn->fd->fd, conn->ip, conn->port);
-                            sx_error(conn->s, stream_err_CONNECTION_TIMEOUT, "dialback verify request timed out");
-                            sx_close(conn->s);
-                        }
-                    }
-                } while(xhash_iter_next(s2s->out_host));
-        } else {
-            if(xhash_iter_first(s2s->out_dest))
-                do {
-                    xhv.conn_val = &conn;
-                    xhash_iter_get(s2s->out_dest, NULL, NULL, xhv.val);
-                    log_debug(ZONE, "checking dialback state for outgoing conn %s (%s)", conn->dkey, conn->key);
-                    if (_s2s_check_conn_routes(s2s, conn, "outgoing")) {
-                        log_debug(ZONE, "checking pending verify requests for outgoing conn %s (%s)", conn->dkey, conn->key);
-                        if (conn->verify > 0 && now > conn->last_verify + s2s->check_queue) {
-                            log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] dialback verify request timed out", conn->fd->fd, conn->ip, conn->port);
-                            sx_error(conn->s, stream_err_CONNECTION_TIMEOUT, "dialback verify request timed out");
-                            sx_close(conn->s);
-                        }
-                    }
-                } while(xhash_iter_next(s2s->out_dest));
+                /* mark this host as bad */
+                dns_mark_bad(s2s, conn->ip, conn->port);
+            } else
+                log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] stream initiation timed out", conn->fd->fd, conn->ip, conn->port);
+
+            /* close connection as per XMPP/RFC3920 */
+            /* the close function will retry or bounce the queue */
+            sx_close(conn->s);
+
+            return 0;
         }
 
-        /* incoming open streams */
-        if(xhash_iter_first(s2s->in))
-            do {
-                xhv.conn_val = &conn;
-                char * key;
-                int key_len;
-                xhash_iter_get(s2s->in, (const char **) &key, &key_len, xhv.val);
-
-                log_debug(ZONE, "checking dialback state for incoming conn %.*s", key_len, key);
-                if (_s2s_check_conn_routes(s2s, conn, "incoming"))
-                    /* if the connection is still valid, check that dialbacks have been initiated */
-                    if(!xhash_count(conn->states) && now > conn->init_time + s2s->check_queue) {
-                        log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] no dialback started", conn->fd->fd, conn->ip, conn->port); 
-                        sx_error(conn->s, stream_err_CONNECTION_TIMEOUT, "no dialback initiated");
-                        sx_close(conn->s);
-                    }
-            } while(xhash_iter_next(s2s->in));
+        log_debug(ZONE, "checking dialback state for %s conn %d", outgoing ? "outgoing" : "incoming", conn->fd->fd);
+        if(!_s2s_check_conn_routes(s2s, conn, outgoing ? "outgoing" : "incoming"))
+            return 0;
 
-        /* incoming open connections (not yet streams) */
-        if(xhash_iter_first(s2s->in_accept))
-            do {
-                xhv.conn_val = &conn;
-                xhash_iter_get(s2s->in_accept, NULL, NULL, xhv.val);
+        if(conn->verify > 0 && now > conn->last_verify + s2s->check_queue) {
+            log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] dialback verify request timed out", conn->fd->fd, conn->ip, conn->port);
+            sx_error(conn->s, stream_err_CONNECTION_TIMEOUT, "dialback verify request timed out");
+            sx_close(conn->s);
 
-                log_debug(ZONE, "checking stream connection state for incoming conn %i", conn->fd->fd);
-                if(!conn->online && now > conn->init_time + s2s->check_queue) {
-                    log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] stream initiation timed out", conn->fd->fd, conn->ip, conn->port);
-                    sx_close(conn->s);
-                }
-            } while(xhash_iter_next(s2s->in_accept));
+            return 0;
+        }
 
+        if(!outgoing && conn->online && !xhash_count(conn->states) && now > conn->init_time + s2s->check_queue) {
+            log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] no dialback started", conn->fd->fd, conn->ip, conn->port);
+            sx_error(conn->s, stream_err_CONNECTION_TIMEOUT, "no dialback initiated");
+            sx_close(conn->s);
+
+            return 0;
+        }
     }
 
-    /* keepalives */
-    if(s2s->out_reuse) {
-        if(xhash_iter_first(s2s->out_host))
-            do {
-                xhv.conn_val = &conn;
-                xhash_iter_get(s2s->out_host, NULL, NULL, xhv.val);
+    /* idle timeouts - disconnect connections through which no packets have been sent for <idle> seconds */
+    if(s2s->check_idle > 0 && conn->last_packet > 0 && now > conn->last_packet + s2s->check_idle && conn->s->state >= state_STREAM) {
+        log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] idle timeout", conn->fd->fd, conn->ip, conn->port);
+        sx_close(conn->s);
 
-                if(s2s->check_keepalive > 0 && conn->last_activity > 0 && now > conn->last_activity + s2s->check_keepalive && conn->s->state >= state_STREAM) {
-                    log_debug(ZONE, "sending keepalive for %d", conn->fd->fd);
+        return 0;
+    }
 
-                    sx_raw_write(conn->s, " ", 1);
-                }
-            } while(xhash_iter_next(s2s->out_host));
-    } else {
-        if(xhash_iter_first(s2s->out_dest))
-            do {
-                xhv.conn_val = &conn;
-                xhash_iter_get(s2s->out_dest, NULL, NULL, xhv.val);
+    /* keepalives */
+    if(outgoing && s2s->check_keepalive > 0 && conn->last_activity > 0 && now > conn->last_activity + s2s->check_keepalive && conn->s->state >= state_STREAM) {
+        log_debug(ZONE, "sending keepalive for %d", conn->fd->fd);
 
-                if(s2s->check_keepalive > 0 && conn->last_activity > 0 && now > conn->last_activity + s2s->check_keepalive && conn->s->state >= state_STREAM) {
-                    log_debug(ZONE, "sending keepalive for %d", conn->fd->fd);
+        sx_raw_write(conn->s, " ", 1);
 
-                    sx_raw_write(conn->s, " ", 1);
-                }
-            } while(xhash_iter_next(s2s->out_dest));
+        /* count the keepalive as activity so the next one is a full period away */
+        conn->last_activity = now;
     }
 
-    /* idle timeouts - disconnect connections through which no packets have been sent for <idle> seconds */
-    if(s2s->check_idle > 0) {
-
-        /* outgoing connections */
-        if(s2s->out_reuse) {
-            if(xhash_iter_first(s2s->out_host))
-                do {
-                    xhv.conn_val = &conn;
-                    char * key;
-                    int key_len;
-                    xhash_iter_get(s2s->out_host, (const char **) &key, &key_len, xhv.val);
-                    log_debug(ZONE, "checking idle state for %.*s", key_len, key);
-                    if (conn->last_packet > 0 && now > conn->last_packet + s2s->check_idle && conn->s->state >= state_STREAM) {
-                        log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] idle timeout", conn->fd->fd, conn->ip, conn->port);
-                        sx_close(conn->s);
-                    }
-                } while(xhash_iter_next(s2s->out_host));
-        } else {
-            if(xhash_iter_first(s2s->out_dest))
-                do {
-                    xhv.conn_val = &conn;
-                    xhash_iter_get(s2s->out_dest, NULL, NULL, xhv.val);
-                    log_debug(ZONE, "checking idle state for %s (%s)", conn->dkey, conn->key);
-                    if (conn->last_packet > 0 && now > conn->last_packet + s2s->check_idle && conn->s->state >= state_STREAM) {
-                        log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] idle timeout", conn->fd->fd, conn->ip, conn->port);
-                        sx_close(conn->s);
-                    }
-                } while(xhash_iter_next(s2s->out_dest));
-        }
+    s2s_conn_check_schedule(conn, outgoing);
 
-        /* incoming connections */
-        if(xhash_iter_first(s2s->in))
-            do {
-                xhv.conn_val = &conn;
-                char * key;
-                int key_len;
-                xhash_iter_get(s2s->in, (const char **) &key, &key_len, xhv.val);
-                log_debug(ZONE, "checking idle state for %s", key);
-                if (conn->last_packet > 0 && now > conn->last_packet + s2s->check_idle && conn->s->state >= state_STREAM) {
-                    log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] idle timeout", conn->fd->fd, conn->ip, conn->port);
-                    sx_close(conn->s);
-                }
-            } while(xhash_iter_next(s2s->in));
+    return 0;
+}
+
+static int _s2s_conn_check_in(void *data1, void *data2) {
+    return _s2s_conn_check((conn_t) data1, 0);
+}
+
+static int _s2s_conn_check_out(void *data1, void *data2) {
+    return _s2s_conn_check((conn_t) data1, 1);
+}
+
+/** (re)arm the conn check timer if a check is now due before it fires */
+void s2s_conn_check_schedule(conn_t conn, int outgoing) {
+    s2s_t s2s = conn->s2s;
+    time_t when, now;
 
+    if(s2s->check_interval <= 0)
+        return;
+
+    when = _s2s_conn_deadline(conn, outgoing);
+    if(when == 0)
+        return;
+
+    /* checks trigger once the deadline has passed */
+    when++;
+
+    now = time(NULL);
+    if(when <= now)
+        when = now + 1;
+
+    if(conn->check_timer != NULL) {
+        if(conn->check_at <= when)
+            return;
+        mio_cancel_timeout(s2s->mio, conn->check_timer);
     }
 
-    return;
+    log_debug(ZONE, "next check for conn %d in %d seconds", conn->fd->fd, (int) (when - now));
+
+    conn->check_at = when;
+    conn->check_timer = mio_add_timeout(s2s->mio, outgoing ? _s2s_conn_check_out : _s2s_conn_check_in, (void *) conn, NULL, (unsigned long long) (when - now) * 1000);
 }
 
-static void _s2s_dns_expiry(s2s_t s2s) {
-    time_t now;
+void s2s_conn_check_cancel(conn_t conn) {
+    if(conn->check_timer != NULL) {
+        mio_cancel_timeout(conn->s2s->mio, conn->check_timer);
+        conn->check_timer = NULL;
+    }
+}
+
+/** bounce queues that no lookup or connection is working on */
+static int _s2s_queue_check(void *data1, void *data2) {
+    s2s_t s2s = (s2s_t) data1;
+    jqueue_t q;
     dnscache_t dns;
-    dnsres_t res;
+    char *rkey, *local_rkey, *c;
+    int rkey_len;
     union xhashv xhv;
 
-    now = time(NULL);
+    s2s->queue_timer = NULL;
 
-    /* dnscache timeouts */
-    if(xhash_iter_first(s2s->dnscache))
+    if(xhash_iter_first(s2s->outq))
         do {
-            xhv.dns_val = &dns;
-            xhash_iter_get(s2s->dnscache, NULL, NULL, xhv.val);
-            if (!dns->pending && now > dns->expiry) {
-                log_debug(ZONE, "expiring DNS cache for %s", dns->name);
-                xhash_iter_zap(s2s->dnscache);
-
-                xhash_free(dns->results);
-                if (dns->query != NULL) {
-                    if (dns->query->have_async_id)
-                        ub_cancel(s2s->ub_ctx, dns->query->async_id);
-                    xhash_free(dns->query->hosts);
-                    xhash_free(dns->query->results);
-                    free(dns->query->name);
-                    free(dns->query);
-                }
-                free(dns);
-            }
-        } while(xhash_iter_next(s2s->dnscache));
+            xhv.jq_val = &q;
+            xhash_iter_get(s2s->outq, (const char **) &rkey, &rkey_len, xhv.val);
 
-    if(xhash_iter_first(s2s->dns_bad))
-        do {
-            xhv.dnsres_val = &res;
-            xhash_iter_get(s2s->dns_bad, NULL, NULL, xhv.val);
-            if (now > res->expiry) {
-                log_debug(ZONE, "expiring DNS bad host %s", res->key);
-                xhash_iter_zap(s2s->dns_bad);
-
-                free(res->key);
-                free(res);
+            c = memchr(rkey, '/', rkey_len);
+            c++;
+
+            /* the lookup and the connection have their own timeouts */
+            dns = xhash_getx(s2s->dnscache, c, rkey_len - (c - rkey));
+            if(dns != NULL && dns->pending)
+                continue;
+
+            if(xhash_getx(s2s->out_dest, c, rkey_len - (c - rkey)) != NULL)
+                continue;
+
+            if(jqueue_size(q) > 0) {
+                /* no pending conn? perhaps it failed? */
+                log_debug(ZONE, "no pending connection for %.*s, bouncing %i packets in queue", rkey_len - (c - rkey), c, jqueue_size(q));
+
+                /* bounce queue */
+                local_rkey = (char *) malloc(rkey_len + 1);
+                memcpy(local_rkey, rkey, rkey_len);
+                local_rkey[rkey_len] = '\0';
+
+                out_bounce_route_queue(s2s, local_rkey, stanza_err_REMOTE_SERVER_TIMEOUT);
+                free(local_rkey);
             }
-        } while(xhash_iter_next(s2s->dns_bad));
+        } while(xhash_iter_next(s2s->outq));
+
+    s2s_queue_check_schedule(s2s);
+
+    return 0;
+}
+
+/** arm the queue check timer, if there are queues for it to look at */
+void s2s_queue_check_schedule(s2s_t s2s) {
+    if(s2s->queue_timer != NULL || s2s->check_interval <= 0 || s2s->check_queue <= 0)
+        return;
+
+    if(xhash_count(s2s->outq) == 0)
+        return;
+
+    s2s->queue_timer = mio_add_timeout(s2s->mio, _s2s_queue_check, (void *) s2s, NULL, (unsigned long long) s2s->check_queue * 1000);
 }
+
+void s2s_queue_check_cancel(s2s_t s2s) {
+    if(s2s->queue_timer != NULL) {
+        mio_cancel_timeout(s2s->mio, s2s->queue_timer);
+        s2s->queue_timer = NULL;
+    }
+}
+
 /** responses from the resolver */
 static int _mio_resolver_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
 
@@ -615,6 +564,9 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
     dnsres_t res;
     union xhashv xhv;
     time_t check_time = 0, now = 0;
+    nad_cache_stats_t nad_stats;
+    jid_cache_stats_t jid_stats;
+    pool_cache_stats_t pool_stats;
 
 #ifdef HAVE_UMASK
     umask((mode_t) 0027);
@@ -816,26 +768,6 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
             _conn_t_free(conn);
         }
 
-        /* time checks */
-        if(s2s->check_interval > 0 && now >= s2s->next_check) {
-            log_debug(ZONE, "running time checks");
-
-            _s2s_time_checks(s2s);
-
-            s2s->next_check = now + s2s->check_interval;
-            log_debug(ZONE, "next time check at %d", s2s->next_check);
-        }
-
-        /* dnscache expiry */
-        if(s2s->check_dnscache > 0 && now >= s2s->next_expiry) {
-            log_debug(ZONE, "running dns expiry");
-
-            _s2s_dns_expiry(s2s);
-
-            s2s->next_expiry = now + s2s->check_dnscache;
-            log_debug(ZONE, "next dns expiry at %d", s2s->next_expiry);
-        }
-
         if(now > check_time + 60) {
 #ifdef POOL_DEBUG
             pool_stat(1);
@@ -861,6 +793,15 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
 
     log_write(s2s->log, LOG_NOTICE, "shutting down");
 
+    nad_cache_stats(&nad_stats);
+    log_write(s2s->log, LOG_INFO, "nad cache: %lu of %lu nads reused, %lu dropped, %lu buffer reallocs", nad_stats.hits, nad_stats.news, nad_stats.drops, nad_stats.reallocs);
+
+    jid_cache_stats(&jid_stats);
+    log_write(s2s->log, LOG_INFO, "jid cache: %lu of %lu jid parts prepped from the cache (%lu invalid), %lu too long to cache", jid_stats.hits, jid_stats.lookups, jid_stats.invalid, jid_stats.skipped);
+
+    pool_cache_stats(&pool_stats);
+    log_write(s2s->log, LOG_INFO, "pool cache: %lu of %lu blocks reused, %lu dropped, %lu bytes held, %lu of %lu bytes lost to rounding and unused heap space", pool_stats.hits, pool_stats.allocs, pool_stats.drops, pool_stats.held, pool_stats.slack + pool_stats.unused, pool_stats.requested);
+
     /* close active streams gracefully  */
     xhv.conn_val = &conn;
     if(s2s->out_reuse) {
@@ -912,6 +853,7 @@ JABBER_MAIN("jabberd2s2s", "Jabber 2 S2S", "Jabber Open Source Server: Server to
     while(jqueue_size(s2s->dead_conn) > 0) _conn_t_free((conn_t) jqueue_pull(s2s->dead_conn));
 
     /* free outgoing queues  */
+    s2s_queue_check_cancel(s2s);
     xhv.jq_val = &q;
     if(xhash_iter_first(s2s->outq))
         do {
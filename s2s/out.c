@@ -104,6 +104,7 @@ static void _out_result(conn_t out, nad_t nad);
 static void _out_verify(conn_t out, nad_t nad);
 static void _dns_result_aaaa(void *data, int err, struct ub_result *result);
 static void _dns_result_a(void *data, int err, struct ub_result *result);
+static void _dns_schedule_expiry(s2s_t s2s, dnscache_t dns);
 
 /** queue the packet */
 static void _out_packet_queue(s2s_t s2s, pkt_t pkt) {
@@ -115,6 +116,9 @@ static void _out_packet_queue(s2s_t s2s, pkt_t pkt) {
         q = jqueue_new();
         q->key = rkey;
         xhash_put(s2s->outq, q->key, (void *) q);
+
+        /* make sure it can't be left behind */
+        s2s_queue_check_schedule(s2s);
     } else {
         free(rkey);
     }
@@ -164,6 +168,9 @@ static void _out_dialback(conn_t out, char *rkey) {
 
     /* record the time that we set conn_INPROGRESS state */
     xhash_put(out->states_time, pstrdup(xhash_pool(out->states_time), rkey), (void *) now);
+
+    /* make sure the dialback timeout gets checked */
+    s2s_conn_check_schedule(out, 1);
 }
 
 int dns_select(s2s_t s2s, char *ip, int *port, time_t now, dnscache_t dns, int allow_bad) {
@@ -424,6 +431,7 @@ int out_route(s2s_t s2s, char *route, conn_t *out, int allow_bad) {
 
             dns->init_time = time(NULL);
             dns->pending = 1;
+            _dns_schedule_expiry(s2s, dns);
 
             dns_resolve_domain(s2s, dns);
             free(dkey);
@@ -444,6 +452,7 @@ int out_route(s2s_t s2s, char *route, conn_t *out, int allow_bad) {
 
             dns->init_time = time(NULL);
             dns->pending = 1;
+            _dns_schedule_expiry(s2s, dns);
 
             dns_resolve_domain(s2s, dns);
 
@@ -499,20 +508,10 @@ int out_route(s2s_t s2s, char *route, conn_t *out, int allow_bad) {
             (*out)->fd = mio_connect(s2s->mio, port, ip, s2s->origin_ip, _out_mio_callback, (void *) *out);
 
             if ((*out)->fd == NULL) {
-                dnsres_t bad;
-
                 log_write(s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] mio_connect error: %s (%d)", -1, (*out)->ip, (*out)->port, MIO_STRERROR(MIO_ERROR), MIO_ERROR);
 
-                if (s2s->dns_bad_timeout > 0) {
-                    /* mark this host as bad */
-                    bad = xhash_get(s2s->dns_bad, ipport);
-                    if (bad == NULL) {
-                        bad = (dnsres_t) calloc(1, sizeof(struct dnsres_st));
-                        bad->key = strdup(ipport);
-                        xhash_put(s2s->dns_bad, bad->key, bad);
-                    }
-                    bad->expiry = time(NULL) + s2s->dns_bad_timeout;
-                }
+                /* mark this host as bad */
+                dns_mark_bad(s2s, ip, port);
 
                 if (s2s->out_reuse)
                    xhash_zap(s2s->out_host, (*out)->key);
@@ -535,17 +534,20 @@ int out_route(s2s_t s2s, char *route, conn_t *out, int allow_bad) {
 
                 (*out)->s = sx_new(s2s->sx_env, (*out)->fd->fd, _out_sx_callback, (void *) *out);
 
+                /* connect timeout */
+                s2s_conn_check_schedule(*out, 1);
+
 #ifdef HAVE_SSL
                 /* Send a stream version of 1.0 if we can do STARTTLS */
                 if(s2s->sx_ssl != NULL) {
                     *c = '\0';
-                    sx_client_init((*out)->s, S2S_DB_HEADER, uri_SERVER, dkey, route, "1.0");
+                    sx_client_init((*out)->s, S2S_DB_HEADER | SX_WRITEV, uri_SERVER, dkey, route, "1.0");
                     *c = '/';
                 } else {
-                    sx_client_init((*out)->s, S2S_DB_HEADER, uri_SERVER, NULL, NULL, NULL);
+                    sx_client_init((*out)->s, S2S_DB_HEADER | SX_WRITEV, uri_SERVER, NULL, NULL, NULL);
                 }
 #else
-                sx_client_init((*out)->s, S2S_DB_HEADER, uri_SERVER, NULL, NULL, NULL);
+                sx_client_init((*out)->s, S2S_DB_HEADER | SX_WRITEV, uri_SERVER, NULL, NULL, NULL);
 #endif
                 /* dkey is now used by the hash table */
                 return 0;
@@ -626,6 +628,7 @@ int out_packet(s2s_t s2s, pkt_t pkt) {
             if(NAD_ENAME_L(pkt->nad, 0) == 6 && strncmp("verify", NAD_ENAME(pkt->nad, 0), 6) == 0) {
                 out->verify++;
                 out->last_verify = time(NULL);
+                s2s_conn_check_schedule(out, 1);
             }
 
             /* dialback packet */
@@ -647,6 +650,8 @@ int out_packet(s2s_t s2s, pkt_t pkt) {
 
         /* update timestamp */
         out->last_packet = time(NULL);
+        if(out->check_timer == NULL)
+            s2s_conn_check_schedule(out, 1);
 
         jid_free(pkt->from);
         jid_free(pkt->to);
@@ -681,6 +686,124 @@ char *dns_make_ipport(char *host, int port) {
     return c;
 }
 
+/** drop a dns cache entry */
+static void _dns_free(s2s_t s2s, dnscache_t dns) {
+    if (dns->timer != NULL)
+        mio_cancel_timeout(s2s->mio, dns->timer);
+
+    xhash_zap(s2s->dnscache, dns->name);
+    xhash_free(dns->results);
+    if (dns->query != NULL) {
+        if (dns->query->have_async_id)
+            ub_cancel(s2s->ub_ctx, dns->query->async_id);
+        xhash_free(dns->query->hosts);
+        xhash_free(dns->query->results);
+        free(dns->query->name);
+        free(dns->query);
+    }
+    free(dns);
+}
+
+/** dns cache entry timer - lookup timeout while pending, cache expiry once resolved */
+static int _dns_expiry(void *data1, void *data2) {
+    s2s_t s2s = (s2s_t) data1;
+    dnscache_t dns = (dnscache_t) data2;
+    time_t now = time(NULL);
+
+    dns->timer = NULL;
+
+    if (dns->pending) {
+        if (now > dns->init_time + s2s->check_queue) {
+            log_write(s2s->log, LOG_NOTICE, "dns lookup for %s timed out", dns->name);
+
+            /* bounce queue */
+            out_bounce_domain_queues(s2s, dns->name, stanza_err_REMOTE_SERVER_NOT_FOUND);
+
+            /* expire pending dns entry */
+            _dns_free(s2s, dns);
+            return 0;
+        }
+    } else if (now > dns->expiry) {
+        log_debug(ZONE, "expiring DNS cache for %s", dns->name);
+        _dns_free(s2s, dns);
+        return 0;
+    }
+
+    _dns_schedule_expiry(s2s, dns);
+    return 0;
+}
+
+/** (re)arm the timer for a dns cache entry */
+static void _dns_schedule_expiry(s2s_t s2s, dnscache_t dns) {
+    time_t when, now;
+
+    if (dns->timer != NULL) {
+        mio_cancel_timeout(s2s->mio, dns->timer);
+        dns->timer = NULL;
+    }
+
+    if (dns->pending) {
+        if (s2s->check_interval <= 0 || s2s->check_queue <= 0)
+            return;
+        when = dns->init_time + s2s->check_queue;
+    } else {
+        if (s2s->check_dnscache <= 0)
+            return;
+        when = dns->expiry;
+    }
+
+    now = time(NULL);
+    when = (when < now) ? 1 : when - now + 1;
+
+    dns->timer = mio_add_timeout(s2s->mio, _dns_expiry, (void *) s2s, (void *) dns, (unsigned long long) when * 1000);
+}
+
+/** bad host expiry */
+static int _dns_bad_expiry(void *data1, void *data2) {
+    s2s_t s2s = (s2s_t) data1;
+    dnsres_t bad = (dnsres_t) data2;
+    time_t now = time(NULL);
+
+    bad->timer = NULL;
+
+    /* marked bad again since the timer was armed */
+    if (!(now > bad->expiry)) {
+        bad->timer = mio_add_timeout(s2s->mio, _dns_bad_expiry, (void *) s2s, (void *) bad, (unsigned long long) (bad->expiry - now + 1) * 1000);
+        return 0;
+    }
+
+    log_debug(ZONE, "expiring DNS bad host %s", bad->key);
+    xhash_zap(s2s->dns_bad, bad->key);
+
+    free(bad->key);
+    free(bad);
+
+    return 0;
+}
+
+/** mark a host as bad, so it is only used as a last resort for the next bad-host-timeout seconds */
+void dns_mark_bad(s2s_t s2s, char *ip, int port) {
+    dnsres_t bad;
+    char *ipport;
+
+    if (s2s->dns_bad_timeout <= 0)
+        return;
+
+    ipport = dns_make_ipport(ip, port);
+    bad = xhash_get(s2s->dns_bad, ipport);
+    if (bad == NULL) {
+        bad = (dnsres_t) calloc(1, sizeof(struct dnsres_st));
+        bad->key = ipport;
+        xhash_put(s2s->dns_bad, ipport, bad);
+    } else {
+        free(ipport);
+    }
+    bad->expiry = time(NULL) + s2s->dns_bad_timeout;
+
+    if (bad->timer == NULL && s2s->check_dnscache > 0)
+        bad->timer = mio_add_timeout(s2s->mio, _dns_bad_expiry, (void *) s2s, (void *) bad, (unsigned long long) (s2s->dns_bad_timeout + 1) * 1000);
+}
+
 static void _dns_add_result(dnsquery_t query, char *ip, int port, int prio, int weight, unsigned int ttl) {
     char *ipport = dns_make_ipport(ip, port);
     dnsres_t res = xhash_get(query->results, ipport);
@@ -1113,6 +1236,7 @@ void out_resolve(s2s_t s2s, char *domain, xht results, time_t expiry) {
             dns->results = NULL;
             dns->expiry = expiry;
             dns->pending = 0;
+            _dns_schedule_expiry(s2s, dns);
         }
 
         log_write(s2s->log, LOG_NOTICE, "dns lookup for %s failed", domain);
@@ -1142,15 +1266,13 @@ void out_resolve(s2s_t s2s, char *domain, xht results, time_t expiry) {
     dns->results = results;
     dns->expiry = expiry;
     dns->pending = 0;
+    _dns_schedule_expiry(s2s, dns);
 
     out_flush_domain_queues(s2s, domain);
 
     /* delete the cache entry if caching is disabled */
-    if (!s2s->dns_cache_enabled && !dns->pending) {
-        xhash_free(dns->results);
-        xhash_zap(s2s->dnscache, domain);
-        free(dns);
-    }
+    if (!s2s->dns_cache_enabled && !dns->pending)
+        _dns_free(s2s, dns);
 }
 
 /** mio callback for outgoing conns */
@@ -1185,6 +1307,8 @@ static int _out_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, v
         case action_CLOSE:
             log_debug(ZONE, "close action on fd %d", fd->fd);
 
+            s2s_conn_check_cancel(out);
+
             jqueue_push(out->s2s->dead, (void *) out->s, 0);
 
             log_write(out->s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] disconnect, packets: %i", fd->fd, out->ip, out->port, out->packet_count);
@@ -1277,6 +1401,8 @@ void send_dialbacks(conn_t out)
 
         if (bad != NULL) {
             log_debug(ZONE, "removing bad host entry for '%s'", out->key);
+            if (bad->timer != NULL)
+                mio_cancel_timeout(out->s2s->mio, bad->timer);
             xhash_zap(out->s2s->dns_bad, out->key);
             free(bad->key);
             free(bad);
@@ -1332,24 +1458,9 @@ static int _out_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
 
                 log_write(out->s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] read error: %s (%d)", out->fd->fd, out->ip, out->port, MIO_STRERROR(MIO_ERROR), MIO_ERROR);
 
-                if (!out->online) {
-                    dnsres_t bad;
-                    char *ipport;
-
-                    if (out->s2s->dns_bad_timeout > 0) {
-                        /* mark this host as bad */
-                        ipport = dns_make_ipport(out->ip, out->port);
-                        bad = xhash_get(out->s2s->dns_bad, ipport);
-                        if (bad == NULL) {
-                            bad = (dnsres_t) calloc(1, sizeof(struct dnsres_st));
-                            bad->key = ipport;
-                            xhash_put(out->s2s->dns_bad, ipport, bad);
-                        } else {
-                            free(ipport);
-                        }
-                        bad->expiry = time(NULL) + out->s2s->dns_bad_timeout;
-                    }
-                }
+                /* mark this host as bad */
+                if (!out->online)
+                    dns_mark_bad(out->s2s, out->ip, out->port);
 
                 sx_kill(s);
                 
@@ -1370,9 +1481,13 @@ static int _out_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             return len;
 
         case event_WRITE:
+        case event_WRITEV:
             log_debug(ZONE, "writing to %d", out->fd->fd);
 
-            len = send(out->fd->fd, buf->data, buf->len, 0);
+            if(e == event_WRITEV)
+                len = writev(out->fd->fd, ((sx_wvec_t *) data)->iov, ((sx_wvec_t *) data)->niov);
+            else
+                len = send(out->fd->fd, buf->data, buf->len, 0);
             if(len >= 0) {
                 log_debug(ZONE, "%d bytes written", len);
                 return len;
@@ -1383,24 +1498,9 @@ static int _out_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
 
             log_write(out->s2s->log, LOG_NOTICE, "[%d] [%s, port=%d] write error: %s (%d)", out->fd->fd, out->ip, out->port, MIO_STRERROR(MIO_ERROR), MIO_ERROR);
 
-            if (!out->online) {
-                dnsres_t bad;
-                char *ipport;
-
-                if (out->s2s->dns_bad_timeout > 0) {
-                    /* mark this host as bad */
-                    ipport = dns_make_ipport(out->ip, out->port);
-                    bad = xhash_get(out->s2s->dns_bad, ipport);
-                    if (bad == NULL) {
-                        bad = (dnsres_t) calloc(1, sizeof(struct dnsres_st));
-                        bad->key = ipport;
-                        xhash_put(out->s2s->dns_bad, ipport, bad);
-                    } else {
-                        free(ipport);
-                    }
-                    bad->expiry = time(NULL) + out->s2s->dns_bad_timeout;
-                }
-            }
+            /* mark this host as bad */
+            if (!out->online)
+                dns_mark_bad(out->s2s, out->ip, out->port);
 
             sx_kill(s);
 
@@ -1426,22 +1526,8 @@ static int _out_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                          strstr(sxe->specific, "unsupported-version")          /* they do not support our stream version */
                         )))
             {
-                dnsres_t bad;
-                char *ipport;
-
-                if (out->s2s->dns_bad_timeout > 0) {
-                    /* mark this host as bad */
-                    ipport = dns_make_ipport(out->ip, out->port);
-                    bad = xhash_get(out->s2s->dns_bad, ipport);
-                    if (bad == NULL) {
-                        bad = (dnsres_t) calloc(1, sizeof(struct dnsres_st));
-                        bad->key = ipport;
-                        xhash_put(out->s2s->dns_bad, ipport, bad);
-                    } else {
-                        free(ipport);
-                    }
-                    bad->expiry = time(NULL) + out->s2s->dns_bad_timeout;
-                }
+                /* mark this host as bad */
+                dns_mark_bad(out->s2s, out->ip, out->port);
             }
 
             sx_kill(s);
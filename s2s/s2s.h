@@ -161,8 +161,8 @@ struct s2s_st {
     time_t              last_queue_check;
     time_t              last_invalid_check;
 
-    time_t              next_check;
-    time_t              next_expiry;
+    /** timer for bouncing queues that nothing is working on */
+    void                *queue_timer;
 
     /** list of sx_t on the way out */
     jqueue_t            dead;
@@ -259,6 +259,10 @@ struct conn_st {
     time_t              last_activity;
     time_t              last_packet;
 
+    /** timer for the earliest pending check, and when it fires */
+    void                *check_timer;
+    time_t              check_at;
+
     unsigned int        packet_count;
 };
 
@@ -319,6 +323,9 @@ struct dnscache_st {
     /** set when we're waiting for a resolve response */
     int                 pending;
     dnsquery_t          query;
+
+    /** resolve timeout or cache expiry timer */
+    void                *timer;
 };
 
 /** dns resolution results */
@@ -334,6 +341,9 @@ struct dnsres_st {
 
     /** time that this entry expires */
     time_t              expiry;
+
+    /** bad host expiry timer */
+    void                *timer;
 };
 
 extern sig_atomic_t s2s_lost_router;
@@ -346,10 +356,16 @@ int             s2s_route_key_match(char *local, const char *remote, char *rkey)
 char            *s2s_db_key(pool_t p, char *secret, char *remote, char *id);
 char            *dns_make_ipport(char *host, int port);
 
+void            s2s_conn_check_schedule(conn_t conn, int outgoing);
+void            s2s_conn_check_cancel(conn_t conn);
+void            s2s_queue_check_schedule(s2s_t s2s);
+void            s2s_queue_check_cancel(s2s_t s2s);
+
 int             out_packet(s2s_t s2s, pkt_t pkt);
 int             out_route(s2s_t s2s, char *route, conn_t *out, int allow_bad);
 int             dns_select(s2s_t s2s, char *ip, int *port, time_t now, dnscache_t dns, int allow_bad);
 void            dns_resolve_domain(s2s_t s2s, dnscache_t dns);
+void            dns_mark_bad(s2s_t s2s, char *ip, int port);
 void            out_resolve(s2s_t s2s, char *domain, xht results, time_t expiry);
 void            out_dialback(s2s_t s2s, pkt_t pkt);
 int             out_bounce_domain_queues(s2s_t s2s, const char *domain, int err);
@@ -166,7 +166,7 @@ void dispatch(sm_t sm, pkt_t pkt) {
         }
     }
 
-    /* if they have no sessions, they were only loaded to do delivery, so free them */
+    /* if they have no sessions, they were only loaded to do delivery, so let them go */
     if(user->sessions == NULL)
-        user_free(user);
+        user_unload(user);
 }
@@ -113,11 +113,20 @@ static void _sm_config_expand(sm_t sm)
 
     sm->router_pemfile = config_get_one(sm->config, "router.pemfile", 0);
 
+    sm->router_weight = config_get_one(sm->config, "router.weight", 0);
+
     sm->retry_init = j_atoi(config_get_one(sm->config, "router.retry.init", 0), 3);
     sm->retry_lost = j_atoi(config_get_one(sm->config, "router.retry.lost", 0), 3);
     if((sm->retry_sleep = j_atoi(config_get_one(sm->config, "router.retry.sleep", 0), 2)) < 1)
         sm->retry_sleep = 1;
 
+    nad_cache_config(j_atoi(config_get_one(sm->config, "io.nad_cache.max", 0), NAD_CACHE_MAX),
+                     j_atoi(config_get_one(sm->config, "io.nad_cache.size", 0), NAD_CACHE_SIZE));
+
+    jid_cache_config(j_atoi(config_get_one(sm->config, "io.jid_cache", 0), JID_CACHE_SIZE));
+
+    pool_cache_config(j_atoi(config_get_one(sm->config, "io.pool_cache", 0), POOL_CACHE_SIZE));
+
     sm->log_type = log_STDOUT;
     if(config_get(sm->config, "log") != NULL) {
         if((str = config_get_attr(sm->config, "log", 0, "type")) != NULL) {
@@ -179,7 +188,7 @@ static int _sm_router_connect(sm_t sm) {
     }
 
     sm->router = sx_new(sm->sx_env, sm->fd->fd, sm_sx_callback, (void *) sm);
-    sx_client_init(sm->router, 0, NULL, NULL, NULL, "1.0");
+    sx_client_init(sm->router, SX_WRITEV, NULL, NULL, NULL, "1.0");
 
     return 0;
 }
@@ -189,6 +198,9 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
     int optchar;
     sess_t sess;
     char id[1024];
+    nad_cache_stats_t nad_stats;
+    jid_cache_stats_t jid_stats;
+    pool_cache_stats_t pool_stats;
 #ifdef POOL_DEBUG
     time_t pool_time = 0;
 #endif
@@ -317,6 +329,14 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
     /* supported features */
     sm->features = xhash_new(101);
 
+    /* route addresses we've seen */
+    sm->jids = xhash_new(101);
+
+    /* arenas of freed packets, for the next ones */
+    sm->arenas_max = j_atoi(config_get_one(sm->config, "io.pkt_cache", 0), pkt_ARENA_MAX);
+    if(sm->arenas_max > 0)
+        sm->arenas = (pool_t *) calloc(sm->arenas_max, sizeof(pool_t));
+
     /* load acls */
     sm->acls = aci_load(sm);
 
@@ -332,6 +352,11 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
 
     sm->users = xhash_new(401);
 
+    /* users without sessions we keep around */
+    sm->ucache_max = j_atoi(config_get_one(sm->config, "user.cache.max", 0), 1000);
+    sm->ucache_max_bytes = j_atoi(config_get_one(sm->config, "user.cache.bytes", 0), 16777216);
+    sm->ucache_ttl = j_atoi(config_get_one(sm->config, "user.cache.ttl", 0), 300);
+
     sm->sx_env = sx_env_new();
 
 #ifdef HAVE_SSL
@@ -364,6 +389,9 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
         mio_run(sm->mio, -1); /* -1 = wait indefinitely - SIGINT and others will break out of this */
 
         if(sm_logrotate) { /* received SIGHUP */
+            /* storage workers log too, so let them finish up first */
+            storage_drain(sm->st);
+
             log_write(sm->log, LOG_NOTICE, "reopening log ...");
             log_free(sm->log);
             sm->log = log_new(sm->log_type, sm->log_ident, sm->log_facility);
@@ -405,6 +433,15 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
 
     log_write(sm->log, LOG_NOTICE, "shutting down");
 
+    nad_cache_stats(&nad_stats);
+    log_write(sm->log, LOG_INFO, "nad cache: %lu of %lu nads reused, %lu dropped, %lu buffer reallocs", nad_stats.hits, nad_stats.news, nad_stats.drops, nad_stats.reallocs);
+
+    jid_cache_stats(&jid_stats);
+    log_write(sm->log, LOG_INFO, "jid cache: %lu of %lu jid parts prepped from the cache (%lu invalid), %lu too long to cache", jid_stats.hits, jid_stats.lookups, jid_stats.invalid, jid_stats.skipped);
+
+    pool_cache_stats(&pool_stats);
+    log_write(sm->log, LOG_INFO, "pool cache: %lu of %lu blocks reused, %lu dropped, %lu bytes held, %lu of %lu bytes lost to rounding and unused heap space", pool_stats.hits, pool_stats.allocs, pool_stats.drops, pool_stats.held, pool_stats.slack + pool_stats.unused, pool_stats.requested);
+
     /* shut down sessions */
     if(xhash_iter_first(sm->sessions))
         do {
@@ -415,12 +452,20 @@ JABBER_MAIN("jabberd2sm", "Jabber 2 Session Manager", "Jabber Open Source Server
 
     xhash_free(sm->sessions);
 
+    user_cache_free(sm);
+
+    /* let outstanding storage requests finish while the modules are still around */
+    storage_drain(sm->st);
+
     if (sm->fd) mio_close(sm->mio, sm->fd);
     mio_free(sm->mio);
 
     mm_free(sm->mm);
     storage_free(sm->st);
 
+    pkt_jids_free(sm);
+    pkt_arenas_free(sm);
+
     aci_unload(sm->acls);
     xhash_free(sm->acls);
     xhash_free(sm->features);
@@ -44,6 +44,223 @@
    else it will only search in LD_LIBRARY_PATH or c:\windows\system32
  */
 
+/** kinds of packet the packet chains are dispatched on */
+typedef enum {
+    class_MESSAGE,
+    class_PRESENCE,
+    class_S10N,
+    class_IQ,
+    class_SESS,
+    class_OTHER,
+    class_COUNT
+} mm_class_t;
+
+/** a packet chain, split up by the kind of packet. each list keeps the chain order,
+ *  and only has the instances that have a handler and want that kind of packet */
+struct mm_dispatch_st {
+    mod_instance_t      *list[class_COUNT];
+    int                 nlist[class_COUNT];
+
+    /** iqs by namespace, for namespaces that modules asked for - the rest use list[class_IQ] */
+    mod_instance_t      **iq;
+    int                 *niq;
+    int                 nns;
+};
+
+static const char *_mm_chain_names[mm_CHAINS] = {
+    "sess-start", "sess-end", "in-sess", "in-router", "out-sess", "out-router",
+    "pkt-sm", "pkt-user", "pkt-router", "user-load", "user-create", "user-delete", "disco-extend"
+};
+
+static mm_class_t _mm_class(pkt_type_t type) {
+    if(type & pkt_MESSAGE) return class_MESSAGE;
+    if(type & pkt_PRESENCE) return class_PRESENCE;
+    if(type & pkt_S10N) return class_S10N;
+    if(type & pkt_IQ) return class_IQ;
+    if(type & pkt_SESS) return class_SESS;
+    return class_OTHER;
+}
+
+/** the instances in a chain */
+static mod_instance_t *_mm_chain(mm_t mm, mod_chain_t chain, int *nlist) {
+    switch(chain) {
+        case chain_SESS_START:   *nlist = mm->nsess_start;   return mm->sess_start;
+        case chain_SESS_END:     *nlist = mm->nsess_end;     return mm->sess_end;
+        case chain_IN_SESS:      *nlist = mm->nin_sess;      return mm->in_sess;
+        case chain_IN_ROUTER:    *nlist = mm->nin_router;    return mm->in_router;
+        case chain_OUT_SESS:     *nlist = mm->nout_sess;     return mm->out_sess;
+        case chain_OUT_ROUTER:   *nlist = mm->nout_router;   return mm->out_router;
+        case chain_PKT_SM:       *nlist = mm->npkt_sm;       return mm->pkt_sm;
+        case chain_PKT_USER:     *nlist = mm->npkt_user;     return mm->pkt_user;
+        case chain_PKT_ROUTER:   *nlist = mm->npkt_router;   return mm->pkt_router;
+        case chain_USER_LOAD:    *nlist = mm->nuser_load;    return mm->user_load;
+        case chain_USER_CREATE:  *nlist = mm->nuser_create;  return mm->user_create;
+        case chain_USER_DELETE:  *nlist = mm->nuser_delete;  return mm->user_delete;
+        case chain_DISCO_EXTEND: *nlist = mm->ndisco_extend; return mm->disco_extend;
+    }
+
+    *nlist = 0;
+    return NULL;
+}
+
+/** true if the module has a handler for the packet chain */
+static int _mm_handles(module_t mod, mod_chain_t chain) {
+    switch(chain) {
+        case chain_IN_SESS:      return mod->in_sess != NULL;
+        case chain_IN_ROUTER:    return mod->in_router != NULL;
+        case chain_OUT_SESS:     return mod->out_sess != NULL;
+        case chain_OUT_ROUTER:   return mod->out_router != NULL;
+        case chain_PKT_SM:       return mod->pkt_sm != NULL;
+        case chain_PKT_USER:     return mod->pkt_user != NULL;
+        case chain_PKT_ROUTER:   return mod->pkt_router != NULL;
+        default:                 return 0;
+    }
+}
+
+/** true if the module wants this kind of packet, in this namespace (for iqs, -1 for any namespace) */
+static int _mm_wants(module_t mod, mod_chain_t chain, mm_class_t class, int ns) {
+    struct mod_interest_st *in = &mod->interest[chain];
+    int i;
+
+    if(in->types == 0)
+        return 1;
+
+    if(!(in->types & (1 << class)))
+        return 0;
+
+    if(class != class_IQ || in->nns == 0)
+        return 1;
+
+    for(i = 0; i < in->nns; i++)
+        if(in->ns[i] == ns)
+            return 1;
+
+    return 0;
+}
+
+static void _mm_dispatch_free(struct mm_dispatch_st *d) {
+    int i;
+
+    for(i = 0; i < class_COUNT; i++)
+        free(d->list[i]);
+    for(i = 0; i < d->nns; i++)
+        free(d->iq[i]);
+    free(d->iq);
+    free(d->niq);
+    free(d);
+}
+
+/** add the instances that want this kind of packet to a list */
+static int _mm_dispatch_list(mod_instance_t *chain, int nchain, mod_chain_t c, mm_class_t class, int ns, mod_instance_t **list) {
+    int i, n = 0;
+
+    *list = (mod_instance_t *) malloc(sizeof(mod_instance_t) * (nchain + 1));
+
+    for(i = 0; i < nchain; i++)
+        if(chain[i] != NULL && _mm_handles(chain[i]->mod, c) && _mm_wants(chain[i]->mod, c, class, ns))
+            (*list)[n++] = chain[i];
+
+    return n;
+}
+
+static struct mm_dispatch_st *_mm_dispatch_build(mm_t mm, mod_chain_t c) {
+    struct mm_dispatch_st *d;
+    mod_instance_t *chain;
+    int nchain, i, j, class;
+
+    d = (struct mm_dispatch_st *) calloc(1, sizeof(struct mm_dispatch_st));
+
+    chain = _mm_chain(mm, c, &nchain);
+
+    for(class = 0; class < class_COUNT; class++)
+        d->nlist[class] = _mm_dispatch_list(chain, nchain, c, class, -1, &d->list[class]);
+
+    /* namespaces that someone asked for get their own list */
+    for(i = 0; i < nchain; i++)
+        if(chain[i] != NULL)
+            for(j = 0; j < chain[i]->mod->interest[c].nns; j++)
+                if(chain[i]->mod->interest[c].ns[j] >= d->nns)
+                    d->nns = chain[i]->mod->interest[c].ns[j] + 1;
+
+    if(d->nns > 0) {
+        d->iq = (mod_instance_t **) calloc(d->nns, sizeof(mod_instance_t *));
+        d->niq = (int *) calloc(d->nns, sizeof(int));
+        for(i = 0; i < d->nns; i++)
+            d->niq[i] = _mm_dispatch_list(chain, nchain, c, class_IQ, i, &d->iq[i]);
+    }
+
+    for(class = 0; class < class_COUNT; class++)
+        log_debug(ZONE, "%s chain has %d of %d instances for packet class %d", _mm_chain_names[c], d->nlist[class], nchain, class);
+
+    return d;
+}
+
+/** the instances that could want this packet */
+static mod_instance_t *_mm_dispatch(mm_t mm, mod_chain_t chain, pkt_t pkt, int *nlist) {
+    struct mm_dispatch_st *d;
+    mm_class_t class;
+
+    if(mm->dispatch[chain] == NULL)
+        mm->dispatch[chain] = _mm_dispatch_build(mm, chain);
+
+    d = mm->dispatch[chain];
+    class = _mm_class(pkt->type);
+
+    if(class == class_IQ && pkt->ns > 0 && pkt->ns < d->nns) {
+        *nlist = d->niq[pkt->ns];
+        return d->iq[pkt->ns];
+    }
+
+    *nlist = d->nlist[class];
+    return d->list[class];
+}
+
+/** count a call into a module, and say if this is one we're timing */
+static int _mm_start(mod_instance_t mi, struct timeval *start) {
+    if((mi->calls++ % mm_TIME_EVERY) != 0)
+        return 0;
+
+    gettimeofday(start, NULL);
+
+    return 1;
+}
+
+/** add the time a call took to the module's total */
+static void _mm_account(mod_instance_t mi, struct timeval *start) {
+    struct timeval end;
+
+    gettimeofday(&end, NULL);
+
+    mi->timed++;
+    mi->usecs += (end.tv_sec - start->tv_sec) * 1000000 + (end.tv_usec - start->tv_usec);
+}
+
+/** tell the module manager which packets a module's handler on a packet chain wants - it won't
+ *  be called for the rest. types is a mask of pkt_MESSAGE, pkt_PRESENCE, pkt_S10N, pkt_IQ and
+ *  pkt_SESS, and for iqs, ns limits it to a namespace (from sm_register_ns(), or 0 for all of them).
+ *  call it more than once to add more. modules that never call it get everything */
+void mm_interest(module_t mod, mod_chain_t chain, int types, int ns) {
+    struct mod_interest_st *in = &mod->interest[chain];
+
+    if(types & pkt_MESSAGE) in->types |= 1 << class_MESSAGE;
+    if(types & pkt_PRESENCE) in->types |= 1 << class_PRESENCE;
+    if(types & pkt_S10N) in->types |= 1 << class_S10N;
+    if(types & pkt_IQ) in->types |= 1 << class_IQ;
+    if(types & pkt_SESS) in->types |= 1 << class_SESS;
+
+    if(types & pkt_IQ && ns > 0) {
+        in->ns = (int *) realloc(in->ns, sizeof(int) * (in->nns + 1));
+        in->ns[in->nns] = ns;
+        in->nns++;
+    }
+
+    /* rebuild next time */
+    if(mod->mm->dispatch[chain] != NULL) {
+        _mm_dispatch_free(mod->mm->dispatch[chain]);
+        mod->mm->dispatch[chain] = NULL;
+    }
+}
+
 mm_t mm_new(sm_t sm) {
     mm_t mm;
     int celem, melem, attr, *nlist = NULL;
@@ -266,10 +483,15 @@ mm_t mm_new(sm_t sm) {
 
 static void _mm_reaper(const char *module, int module_len, void *val, void *arg) {
     module_t mod = (module_t) val;
+    int i;
 
     if(mod->free != NULL)
         (mod->free)(mod);
 
+    for(i = 0; i < mm_CHAINS; i++)
+        if(mod->interest[i].ns != NULL)
+            free(mod->interest[i].ns);
+
     #ifndef _WIN32
         if (mod->handle != NULL)
             dlclose(mod->handle);
@@ -283,8 +505,21 @@ static void _mm_reaper(const char *module, int module_len, void *val, void *arg)
 }
 
 void mm_free(mm_t mm) {
-    int i, j, *nlist = NULL;
-    mod_instance_t **list = NULL, mi;
+    int i, j, n, *nlist = NULL;
+    mod_instance_t **list = NULL, *chain, mi;
+
+    /* what the modules did with their packets */
+    for(i = 0; i < mm_CHAINS; i++) {
+        chain = _mm_chain(mm, i, &n);
+        for(j = 0; j < n; j++) {
+            mi = chain[j];
+            if(mi != NULL && mi->timed > 0)
+                log_write(mm->sm->log, LOG_INFO, "module '%s' in chain '%s': %lu packets, %lu ns average", mi->mod->name, _mm_chain_names[i], mi->calls, mi->usecs * 1000 / mi->timed);
+        }
+
+        if(mm->dispatch[i] != NULL)
+            _mm_dispatch_free(mm->dispatch[i]);
+    }
 
     /* close down modules */
     xhash_walk(mm->modules, _mm_reaper, NULL);
@@ -433,27 +668,24 @@ void mm_sess_end(mm_t mm, sess_t sess) {
 
 /** packets from active session */
 mod_ret_t mm_in_sess(mm_t mm, sess_t sess, pkt_t pkt) {
-    int n;
-    mod_instance_t mi;
+    int n, nlist, timed;
+    mod_instance_t mi, *list;
     mod_ret_t ret = mod_PASS;
+    struct timeval start;
 
     log_debug(ZONE, "dispatching in-sess chain");
 
-    ret = mod_PASS;
-    for(n = 0; n < mm->nin_sess; n++) {
-        mi = mm->in_sess[n];
-        if(mi == NULL) {
-            log_debug(ZONE, "module at index %d is not loaded yet", n);
-            continue;
-        }
-        if(mi->mod->in_sess == NULL) {
-            log_debug(ZONE, "module %s has no handler for this chain", mi->mod->name);
-            continue;
-        }
+    list = _mm_dispatch(mm, chain_IN_SESS, pkt, &nlist);
+    for(n = 0; n < nlist; n++) {
+        mi = list[n];
 
         log_debug(ZONE, "calling module %s", mi->mod->name);
 
+        timed = _mm_start(mi, &start);
         ret = (mi->mod->in_sess)(mi, sess, pkt);
+        if(timed)
+            _mm_account(mi, &start);
+
         if(ret != mod_PASS)
             break;
     }
@@ -465,27 +697,24 @@ mod_ret_t mm_in_sess(mm_t mm, sess_t sess, pkt_t pkt) {
 
 /** packets from router */
 mod_ret_t mm_in_router(mm_t mm, pkt_t pkt) {
-    int n;
-    mod_instance_t mi;
+    int n, nlist, timed;
+    mod_instance_t mi, *list;
     mod_ret_t ret = mod_PASS;
+    struct timeval start;
 
     log_debug(ZONE, "dispatching in-router chain");
 
-    if (mm != NULL && pkt != NULL )
-    for(n = 0; n < mm->nin_router; n++) {
-        mi = mm->in_router[n];
-        if(mi == NULL) {
-            log_debug(ZONE, "module at index %d is not loaded yet", n);
-            continue;
-        }
-        if(mi->mod == NULL || mi->mod->in_router == NULL) {
-            log_debug(ZONE, "module %s has no handler for this chain", mi->mod->name);
-            continue;
-        }
+    list = _mm_dispatch(mm, chain_IN_ROUTER, pkt, &nlist);
+    for(n = 0; n < nlist; n++) {
+        mi = list[n];
 
         log_debug(ZONE, "calling module %s", mi->mod->name);
 
+        timed = _mm_start(mi, &start);
         ret = (mi->mod->in_router)(mi, pkt);
+        if(timed)
+            _mm_account(mi, &start);
+
         if(ret != mod_PASS)
             break;
     }
@@ -497,26 +726,24 @@ mod_ret_t mm_in_router(mm_t mm, pkt_t pkt) {
 
 /** packets to active session */
 mod_ret_t mm_out_sess(mm_t mm, sess_t sess, pkt_t pkt) {
-    int n;
-    mod_instance_t mi;
+    int n, nlist, timed;
+    mod_instance_t mi, *list;
     mod_ret_t ret = mod_PASS;
+    struct timeval start;
 
     log_debug(ZONE, "dispatching out-sess chain");
 
-    for(n = 0; n < mm->nout_sess; n++) {
-        mi = mm->out_sess[n];
-        if(mi == NULL) {
-            log_debug(ZONE, "module at index %d is not loaded yet", n);
-            continue;
-        }
-        if(mi->mod->out_sess == NULL) {
-            log_debug(ZONE, "module %s has no handler for this chain", mi->mod->name);
-            continue;
-        }
+    list = _mm_dispatch(mm, chain_OUT_SESS, pkt, &nlist);
+    for(n = 0; n < nlist; n++) {
+        mi = list[n];
 
         log_debug(ZONE, "calling module %s", mi->mod->name);
 
+        timed = _mm_start(mi, &start);
         ret = (mi->mod->out_sess)(mi, sess, pkt);
+        if(timed)
+            _mm_account(mi, &start);
+
         if(ret != mod_PASS)
             break;
     }
@@ -528,26 +755,24 @@ mod_ret_t mm_out_sess(mm_t mm, sess_t sess, pkt_t pkt) {
 
 /** packets to router */
 mod_ret_t mm_out_router(mm_t mm, pkt_t pkt) {
-    int n;
-    mod_instance_t mi;
+    int n, nlist, timed;
+    mod_instance_t mi, *list;
     mod_ret_t ret = mod_PASS;
+    struct timeval start;
 
     log_debug(ZONE, "dispatching out-router chain");
 
-    for(n = 0; n < mm->nout_router; n++) {
-        mi = mm->out_router[n];
-        if(mi == NULL) {
-            log_debug(ZONE, "module at index %d is not loaded yet", n);
-            continue;
-        }
-        if(mi->mod->out_router == NULL) {
-            log_debug(ZONE, "module %s has no handler for this chain", mi->mod->name);
-            continue;
-        }
+    list = _mm_dispatch(mm, chain_OUT_ROUTER, pkt, &nlist);
+    for(n = 0; n < nlist; n++) {
+        mi = list[n];
 
         log_debug(ZONE, "calling module %s", mi->mod->name);
 
+        timed = _mm_start(mi, &start);
         ret = (mi->mod->out_router)(mi, pkt);
+        if(timed)
+            _mm_account(mi, &start);
+
         if(ret != mod_PASS)
             break;
     }
@@ -559,25 +784,24 @@ mod_ret_t mm_out_router(mm_t mm, pkt_t pkt) {
 
 /** packets for sm */
 mod_ret_t mm_pkt_sm(mm_t mm, pkt_t pkt) {
-    int n, ret = 0;
-    mod_instance_t mi;
+    int n, nlist, timed;
+    mod_instance_t mi, *list;
+    mod_ret_t ret = mod_PASS;
+    struct timeval start;
 
     log_debug(ZONE, "dispatching pkt-sm chain");
 
-    for(n = 0; n < mm->npkt_sm; n++) {
-        mi = mm->pkt_sm[n];
-        if(mi == NULL) {
-            log_debug(ZONE, "module at index %d is not loaded yet", n);
-            continue;
-        }
-        if(mi->mod->pkt_sm == NULL) {
-            log_debug(ZONE, "module %s has no handler for this chain", mi->mod->name);
-            continue;
-        }
+    list = _mm_dispatch(mm, chain_PKT_SM, pkt, &nlist);
+    for(n = 0; n < nlist; n++) {
+        mi = list[n];
 
         log_debug(ZONE, "calling module %s", mi->mod->name);
 
+        timed = _mm_start(mi, &start);
         ret = (mi->mod->pkt_sm)(mi, pkt);
+        if(timed)
+            _mm_account(mi, &start);
+
         if(ret != mod_PASS)
             break;
     }
@@ -589,26 +813,24 @@ mod_ret_t mm_pkt_sm(mm_t mm, pkt_t pkt) {
 
 /** packets for user */
 mod_ret_t mm_pkt_user(mm_t mm, user_t user, pkt_t pkt) {
-    int n;
-    mod_instance_t mi;
+    int n, nlist, timed;
+    mod_instance_t mi, *list;
     mod_ret_t ret = mod_PASS;
+    struct timeval start;
 
     log_debug(ZONE, "dispatching pkt-user chain");
 
-    for(n = 0; n < mm->npkt_user; n++) {
-        mi = mm->pkt_user[n];
-        if(mi == NULL) {
-            log_debug(ZONE, "module at index %d is not loaded yet", n);
-            continue;
-        }
-        if(mi->mod->pkt_user == NULL) {
-            log_debug(ZONE, "module %s has no handler for this chain", mi->mod->name);
-            continue;
-        }
+    list = _mm_dispatch(mm, chain_PKT_USER, pkt, &nlist);
+    for(n = 0; n < nlist; n++) {
+        mi = list[n];
 
         log_debug(ZONE, "calling module %s", mi->mod->name);
 
+        timed = _mm_start(mi, &start);
         ret = (mi->mod->pkt_user)(mi, user, pkt);
+        if(timed)
+            _mm_account(mi, &start);
+
         if(ret != mod_PASS)
             break;
     }
@@ -620,26 +842,24 @@ mod_ret_t mm_pkt_user(mm_t mm, user_t user, pkt_t pkt) {
 
 /** packets from the router */
 mod_ret_t mm_pkt_router(mm_t mm, pkt_t pkt) {
-    int n;
-    mod_instance_t mi;
+    int n, nlist, timed;
+    mod_instance_t mi, *list;
     mod_ret_t ret = mod_PASS;
+    struct timeval start;
 
     log_debug(ZONE, "dispatching pkt-router chain");
 
-    for(n = 0; n < mm->npkt_router; n++) {
-        mi = mm->pkt_router[n];
-        if(mi == NULL) {
-            log_debug(ZONE, "module at index %d is not loaded yet", n);
-            continue;
-        }
-        if(mi->mod->pkt_router == NULL) {
-            log_debug(ZONE, "module %s has no handler for this chain", mi->mod->name);
-            continue;
-        }
+    list = _mm_dispatch(mm, chain_PKT_ROUTER, pkt, &nlist);
+    for(n = 0; n < nlist; n++) {
+        mi = list[n];
 
         log_debug(ZONE, "calling module %s", mi->mod->name);
 
+        timed = _mm_start(mi, &start);
         ret = (mi->mod->pkt_router)(mi, pkt);
+        if(timed)
+            _mm_account(mi, &start);
+
         if(ret != mod_PASS)
             break;
     }
@@ -439,5 +439,10 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
 
     feature_register(mod->mm->sm, uri_AMP);
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_IN_SESS, pkt_MESSAGE, 0);
+    mm_interest(mod, chain_PKT_USER, pkt_MESSAGE, 0);
+    mm_interest(mod, chain_PKT_SM, pkt_IQ, ns_DISCO_INFO);
+
     return 0;
 }
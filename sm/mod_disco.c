@@ -654,6 +654,10 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg)
     if(d->agents)
         feature_register(mod->mm->sm, uri_AGENTS);
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_IN_SESS, pkt_IQ, ns_DISCO_INFO);
+    mm_interest(mod, chain_IN_SESS, pkt_IQ, ns_AGENTS);
+
     /* populate the static list from the config file */
     if((items = nad_find_elem(nad, 0, -1, "discovery", 1)) < 0 || (items = nad_find_elem(nad, items, -1, "items", 1)) < 0)
         return 0;
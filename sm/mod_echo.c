@@ -67,5 +67,8 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
     /* data is static so nothing to free */
     /* mod->free = _echo_free; */
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_PKT_SM, pkt_MESSAGE | pkt_PRESENCE | pkt_S10N, 0);
+
     return 0;
 }
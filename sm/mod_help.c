@@ -76,18 +76,15 @@ static mod_ret_t _help_pkt_sm(mod_instance_t mi, pkt_t pkt)
     subj = nad_find_elem(pkt->nad, 1, NAD_ENS(pkt->nad, 1), "subject", 1);
     if(subj >= 0 && NAD_CDATA_L(pkt->nad, subj) > 0)
     {
-        org_subject = strndup(NAD_CDATA(pkt->nad, subj), NAD_CDATA_L(pkt->nad, subj));
+        org_subject = pstrdupx(pkt->p, NAD_CDATA(pkt->nad, subj), NAD_CDATA_L(pkt->nad, subj));
     } else {
         org_subject = "(none)";
     }
     subjectl = strlen(org_subject) + strlen(jid_full(pkt->from)) + 8;
-    subject = (char *) malloc(sizeof(char) * subjectl);
+    subject = (char *) pmalloc(pkt->p, sizeof(char) * subjectl);
     snprintf(subject, subjectl, "Fwd[%s]: %s", jid_full(pkt->from), org_subject);
     if(subj >= 0 && NAD_CDATA_L(pkt->nad, subj) > 0)
-    {
-        free(org_subject);
         nad_drop_elem(pkt->nad, subj);
-    }
     nad_insert_elem(pkt->nad, 1, NAD_ENS(pkt->nad, 1), "subject", subject);
 
     for(jid = all; jid != NULL; jid = jid->next)
@@ -119,7 +116,6 @@ static mod_ret_t _help_pkt_sm(mod_instance_t mi, pkt_t pkt)
 
     /* !!! autoreply */
 
-    free(subject);
     pkt_free(pkt);
 
     return mod_HANDLED;
@@ -181,5 +177,8 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
     /* module data is static so nothing to free */
     /* mod->free = _help_free; */
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_PKT_SM, pkt_MESSAGE | pkt_PRESENCE | pkt_S10N, 0);
+
     return 0;
 }
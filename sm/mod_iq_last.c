@@ -162,5 +162,9 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
     ns_LAST = sm_register_ns(mod->mm->sm, uri_LAST);
     feature_register(mod->mm->sm, uri_LAST);
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_PKT_USER, pkt_IQ, ns_LAST);
+    mm_interest(mod, chain_PKT_SM, pkt_IQ, ns_LAST);
+
     return 0;
 }
@@ -75,5 +75,9 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
     ns_PING = sm_register_ns(mod->mm->sm, urn_PING);
     feature_register(mod->mm->sm, urn_PING);
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_IN_SESS, pkt_IQ, ns_PING);
+    mm_interest(mod, chain_PKT_SM, pkt_IQ, ns_PING);
+
     return 0;
 }
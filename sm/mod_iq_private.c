@@ -218,5 +218,8 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
     ns_PRIVATE = sm_register_ns(mod->mm->sm, uri_PRIVATE);
     feature_register(mod->mm->sm, uri_PRIVATE);
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_IN_SESS, pkt_IQ, ns_PRIVATE);
+
     return 0;
 }
@@ -114,5 +114,11 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
     ns_URN_TIME = sm_register_ns(mod->mm->sm, urn_TIME);
     feature_register(mod->mm->sm, urn_TIME);
 
+    /* only the packets we act on */
+#ifdef ENABLE_SUPERSEDED
+    mm_interest(mod, chain_PKT_SM, pkt_IQ, ns_TIME);
+#endif
+    mm_interest(mod, chain_PKT_SM, pkt_IQ, ns_URN_TIME);
+
     return 0;
 }
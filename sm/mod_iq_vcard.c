@@ -325,32 +325,26 @@ static mod_ret_t _iq_vcard_pkt_sm(mod_instance_t mi, pkt_t pkt) {
     return mod_HANDLED;
 }
 
-static mod_ret_t _iq_vcard_pkt_user(mod_instance_t mi, user_t user, pkt_t pkt) {
-    os_t os;
-    st_ret_t ret;
+/** someone else's vcard has come back from storage, answer them */
+static void _iq_vcard_user_result(st_ret_t ret, os_t os, int count, void *arg) {
+    pkt_t pkt = (pkt_t) arg;
     pkt_t result;
 
-    /* only handle vcard sets and gets, without resource */
-    if((pkt->type != pkt_IQ && pkt->type != pkt_IQ_SET) || pkt->ns != ns_VCARD || pkt->to->resource[0] !='\0')
-        return mod_PASS;
-
-    /* error them if they're trying to do a set */
-    if(pkt->type == pkt_IQ_SET)
-        return -stanza_err_FORBIDDEN;
-
-    ret = storage_get(user->sm->st, "vcard", jid_user(user->jid), NULL, &os);
     switch(ret) {
         case st_FAILED:
-            return -stanza_err_INTERNAL_SERVER_ERROR;
+            pkt_router(pkt_error(pkt, stanza_err_INTERNAL_SERVER_ERROR));
+            return;
 
         case st_NOTIMPL:
-            return -stanza_err_FEATURE_NOT_IMPLEMENTED;
+            pkt_router(pkt_error(pkt, stanza_err_FEATURE_NOT_IMPLEMENTED));
+            return;
 
         case st_NOTFOUND:
-            return -stanza_err_SERVICE_UNAVAILABLE;
+            pkt_router(pkt_error(pkt, stanza_err_SERVICE_UNAVAILABLE));
+            return;
 
         case st_SUCCESS:
-            result = _iq_vcard_to_pkt(user->sm, os);
+            result = _iq_vcard_to_pkt(pkt->sm, os);
             os_free(os);
 
             result->to = jid_dup(pkt->from);
@@ -365,12 +359,33 @@ static mod_ret_t _iq_vcard_pkt_user(mod_instance_t mi, user_t user, pkt_t pkt) {
 
             pkt_free(pkt);
 
-            return mod_HANDLED;
+            return;
     }
+}
 
-    /* we never get here */
-    pkt_free(pkt);
-    return mod_HANDLED;
+static mod_ret_t _iq_vcard_pkt_user(mod_instance_t mi, user_t user, pkt_t pkt) {
+    st_ret_t ret;
+
+    /* only handle vcard sets and gets, without resource */
+    if((pkt->type != pkt_IQ && pkt->type != pkt_IQ_SET) || pkt->ns != ns_VCARD || pkt->to->resource[0] !='\0')
+        return mod_PASS;
+
+    /* error them if they're trying to do a set */
+    if(pkt->type == pkt_IQ_SET)
+        return -stanza_err_FORBIDDEN;
+
+    /* the packet waits for the storage result, and the user may be gone by then */
+    ret = storage_get_async(user->sm->st, "vcard", jid_user(user->jid), NULL, _iq_vcard_user_result, (void *) pkt);
+    switch(ret) {
+        case st_SUCCESS:
+            return mod_HANDLED;
+
+        case st_NOTIMPL:
+            return -stanza_err_FEATURE_NOT_IMPLEMENTED;
+
+        default:
+            return -stanza_err_INTERNAL_SERVER_ERROR;
+    }
 }
 
 static void _iq_vcard_user_delete(mod_instance_t mi, jid_t jid) {
@@ -400,6 +415,11 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
     ns_VCARD = sm_register_ns(mod->mm->sm, uri_VCARD);
     feature_register(mod->mm->sm, uri_VCARD);
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_IN_SESS, pkt_IQ, ns_VCARD);
+    mm_interest(mod, chain_PKT_SM, pkt_IQ, ns_VCARD);
+    mm_interest(mod, chain_PKT_USER, pkt_IQ, ns_VCARD);
+
     iq_vcard = (mod_iq_vcard_t) calloc(1, sizeof(struct _mod_iq_vcard_st));
     iq_vcard->vcard_max_field_size_default = j_atoi(config_get_one(mod->mm->sm->config, "user.vcard.max-field-size.default", 0), VCARD_MAX_FIELD_SIZE);
     iq_vcard->vcard_max_field_size_avatar = j_atoi(config_get_one(mod->mm->sm->config, "user.vcard.max-field-size.avatar", 0), VCARD_MAX_FIELD_SIZE);
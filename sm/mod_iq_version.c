@@ -280,5 +280,8 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
     ns_VERSION = sm_register_ns(mod->mm->sm, uri_VERSION);
     feature_register(mod->mm->sm, uri_VERSION);
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_PKT_SM, pkt_IQ, ns_VERSION);
+
     return 0;
 }
@@ -310,5 +310,9 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
 
     feature_register(mod->mm->sm, "msgoffline");
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_IN_SESS, pkt_PRESENCE, 0);
+    mm_interest(mod, chain_PKT_USER, pkt_MESSAGE | pkt_S10N, 0);
+
     return 0;
 }
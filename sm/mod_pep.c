@@ -86,5 +86,9 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
     ns_PUBSUB = sm_register_ns(mod->mm->sm, uri_PUBSUB);
     feature_register(mod->mm->sm, uri_PUBSUB);
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_IN_SESS, pkt_IQ, ns_PUBSUB);
+    mm_interest(mod, chain_OUT_SESS, pkt_IQ, ns_DISCO_INFO);
+
     return 0;
 }
@@ -193,5 +193,11 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
 
     feature_register(mod->mm->sm, "presence");
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_IN_SESS, pkt_PRESENCE, 0);
+    mm_interest(mod, chain_IN_ROUTER, pkt_PRESENCE, 0);
+    mm_interest(mod, chain_PKT_USER, pkt_PRESENCE, 0);
+    mm_interest(mod, chain_PKT_SM, pkt_PRESENCE | pkt_S10N, 0);
+
     return 0;
 }
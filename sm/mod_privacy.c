@@ -33,6 +33,7 @@ static int ns_BLOCKING = 0;
 typedef struct zebra_st         *zebra_t;
 typedef struct zebra_list_st    *zebra_list_t;
 typedef struct zebra_item_st    *zebra_item_t;
+typedef struct zebra_compiled_st *zebra_compiled_t;
 
 typedef enum {
     zebra_NONE,
@@ -49,6 +50,18 @@ typedef enum {
     block_IQ = 0x08
 } zebra_block_type_t;
 
+/** what a packet is, as far as item blocking goes - an item applies to a class if its
+ *  block types cover it, items without block types apply to all of them */
+typedef enum {
+    class_MESSAGE_IN,
+    class_PRES_IN,
+    class_IQ_IN,
+    class_MESSAGE_OUT,
+    class_PRES_OUT,
+    class_OTHER,
+    class_COUNT
+} zebra_class_t;
+
 /** zebra data for a single user */
 struct zebra_st {
     xht             lists;
@@ -62,6 +75,34 @@ struct zebra_list_st {
     char            *name;
 
     zebra_item_t    items, last;
+
+    /** items indexed for matching, built when the list is first used after a change */
+    zebra_compiled_t    compiled;
+    int                 compiled_cleanup;
+};
+
+/** a compiled list. for each class of packet, and each thing an item can match on, we keep
+ *  the position of the first item that would match - the answer is the lowest of the positions
+ *  a packet hits, so list order (XEP-0016 2.2) is kept without walking the items */
+struct zebra_compiled_st {
+    pool_t          p;
+
+    /** items in list order */
+    zebra_item_t    *items;
+    int             nitems;
+
+    /** classes that any item applies to, anything else gets through without a look */
+    int             classes;
+
+    /** fall-through items */
+    int             none[class_COUNT];
+
+    /** subscription items, indexed by (to << 1) | from */
+    int             s10n[4][class_COUNT];
+
+    /** jid and group items, key is the jid or group, value is an int[class_COUNT] */
+    xht             jids;
+    xht             groups;
 };
 
 struct zebra_item_st {
@@ -120,6 +161,158 @@ static void _privacy_user_free(zebra_t *z) {
         _privacy_free_z(*z);
 }
 
+/** the classes an item's block types cover */
+static int _privacy_item_classes(zebra_item_t zitem) {
+    int classes = 0;
+
+    if(zitem->block == block_NONE)
+        return (1 << class_COUNT) - 1;
+
+    /* XXX block_MESSAGE goes both ways for XEP-0191 while it violates XEP-0016 */
+    if(zitem->block & block_MESSAGE)
+        classes |= (1 << class_MESSAGE_IN) | (1 << class_MESSAGE_OUT);
+    if(zitem->block & block_PRES_IN)
+        classes |= 1 << class_PRES_IN;
+    if(zitem->block & block_IQ)
+        classes |= 1 << class_IQ_IN;
+    if(zitem->block & block_PRES_OUT)
+        classes |= 1 << class_PRES_OUT;
+
+    return classes;
+}
+
+/** the class of a packet */
+static zebra_class_t _privacy_class(pkt_type_t ptype, int in) {
+    if(in) {
+        if(ptype & pkt_MESSAGE)
+            return class_MESSAGE_IN;
+        if(ptype & pkt_PRESENCE)
+            return class_PRES_IN;
+        if(ptype & pkt_IQ)
+            return class_IQ_IN;
+    } else {
+        if(ptype & pkt_PRESENCE && ptype != pkt_PRESENCE_PROBE)
+            return class_PRES_OUT;
+        if(ptype & pkt_MESSAGE)
+            return class_MESSAGE_OUT;
+    }
+
+    return class_OTHER;
+}
+
+/** record an item against a key, if nothing before it already has the key for that class */
+static void _privacy_compile_key(zebra_compiled_t zc, xht index, const char *key, int pos, int classes) {
+    int *first, c;
+
+    first = (int *) xhash_get(index, key);
+    if(first == NULL) {
+        first = (int *) pmalloc(zc->p, sizeof(int) * class_COUNT);
+        for(c = 0; c < class_COUNT; c++)
+            first[c] = zc->nitems;
+        xhash_put(index, pstrdup(zc->p, key), (void *) first);
+    }
+
+    for(c = 0; c < class_COUNT; c++)
+        if(classes & (1 << c) && first[c] > pos)
+            first[c] = pos;
+}
+
+static void _privacy_uncompile(zebra_list_t zlist) {
+    if(zlist->compiled == NULL)
+        return;
+
+    xhash_free(zlist->compiled->jids);
+    xhash_free(zlist->compiled->groups);
+    pool_free(zlist->compiled->p);
+    zlist->compiled = NULL;
+}
+
+/** the list's items changed, the index has to be rebuilt */
+static void _privacy_list_changed(zebra_list_t zlist) {
+    _privacy_uncompile(zlist);
+}
+
+/** index the list's items */
+static zebra_compiled_t _privacy_compile(zebra_list_t zlist) {
+    zebra_compiled_t zc;
+    zebra_item_t scan;
+    pool_t p;
+    int pos, classes, c, i;
+
+    if(zlist->compiled != NULL)
+        return zlist->compiled;
+
+    p = pool_new();
+
+    zc = (zebra_compiled_t) pmalloco(p, sizeof(struct zebra_compiled_st));
+    zc->p = p;
+
+    for(scan = zlist->items; scan != NULL; scan = scan->next)
+        zc->nitems++;
+
+    zc->items = (zebra_item_t *) pmalloc(p, sizeof(zebra_item_t) * (zc->nitems + 1));
+    zc->jids = xhash_new(101);
+    zc->groups = xhash_new(31);
+
+    /* nothing matches until an item says otherwise */
+    for(c = 0; c < class_COUNT; c++) {
+        zc->none[c] = zc->nitems;
+        for(i = 0; i < 4; i++)
+            zc->s10n[i][c] = zc->nitems;
+    }
+
+    for(pos = 0, scan = zlist->items; scan != NULL; pos++, scan = scan->next) {
+        zc->items[pos] = scan;
+
+        classes = _privacy_item_classes(scan);
+        zc->classes |= classes;
+
+        switch(scan->type) {
+            case zebra_NONE:
+                for(c = 0; c < class_COUNT; c++)
+                    if(classes & (1 << c) && zc->none[c] > pos)
+                        zc->none[c] = pos;
+                break;
+
+            case zebra_JID:
+                _privacy_compile_key(zc, zc->jids, jid_full(scan->jid), pos, classes);
+                break;
+
+            case zebra_GROUP:
+                _privacy_compile_key(zc, zc->groups, scan->group, pos, classes);
+                break;
+
+            case zebra_S10N:
+                i = (scan->to << 1) | scan->from;
+                for(c = 0; c < class_COUNT; c++)
+                    if(classes & (1 << c) && zc->s10n[i][c] > pos)
+                        zc->s10n[i][c] = pos;
+                break;
+        }
+    }
+
+    zlist->compiled = zc;
+
+    /* the index goes when the list does */
+    if(!zlist->compiled_cleanup) {
+        pool_cleanup(zlist->p, (void (*))(void *) _privacy_uncompile, zlist);
+        zlist->compiled_cleanup = 1;
+    }
+
+    log_debug(ZONE, "compiled list %s, %d items, %d jids, %d groups", zlist->name, zc->nitems, xhash_count(zc->jids), xhash_count(zc->groups));
+
+    return zc;
+}
+
+/** lower the match to the first item that has this key, if it's earlier */
+static void _privacy_match_key(xht index, const char *key, zebra_class_t class, int *match) {
+    int *first;
+
+    first = (int *) xhash_get(index, key);
+    if(first != NULL && first[class] < *match)
+        *match = first[class];
+}
+
 static int _privacy_user_load(mod_instance_t mi, user_t user) {
     module_t mod = mi->mod;
     zebra_t z;
@@ -260,6 +453,7 @@ static int _privacy_user_load(mod_instance_t mi, user_t user) {
                 log_debug(ZONE, "block 0x%x", zitem->block);
 
                 /* insert it */
+                _privacy_list_changed(zlist);
                 for(scan = zlist->items; scan != NULL; scan = scan->next)
                     if(zitem->order < scan->order)
                         break;
@@ -317,88 +511,55 @@ static int _privacy_user_load(mod_instance_t mi, user_t user) {
 
 /** returns 0 if the packet should be allowed, otherwise 1 */
 static int _privacy_action(user_t user, zebra_list_t zlist, jid_t jid, pkt_type_t ptype, int in) {
-    zebra_item_t scan;
+    zebra_compiled_t zc;
+    zebra_class_t class;
     int match, i;
     item_t ritem;
-    unsigned char domres[2048];
+    char domres[2048];
 
     log_debug(ZONE, "running match on list %s for %s (packet type 0x%x) (%s)", zlist->name, jid_full(jid), ptype, in ? "incoming" : "outgoing");
 
-    /* loop over the list, trying to find a match */
-    for(scan = zlist->items; scan != NULL; scan = scan->next) {
-        match = 0;
+    zc = _privacy_compile(zlist);
+    class = _privacy_class(ptype, in);
 
-        switch(scan->type) {
-            case zebra_NONE:
-                /* fall through, all packets match this */
-                match = 1;
-                break;
-
-            case zebra_JID:
-                sprintf(domres, "%s/%s", jid->domain, jid->resource);
- 
-                /* jid check - match node@dom/res, then node@dom, then dom/resource, then dom */
-                if(jid_compare_full(scan->jid, jid) == 0 ||
-                   strcmp(jid_full(scan->jid), jid_user(jid)) == 0 ||
-                   strcmp(jid_full(scan->jid), domres) == 0 ||
-                   strcmp(jid_full(scan->jid), jid->domain) == 0)
-                    match = 1;
+    /* nothing in the list cares about this kind of packet */
+    if(!(zc->classes & (1 << class)))
+        return 0;
 
-                break;
+    match = zc->none[class];
 
-            case zebra_GROUP:
-                /* roster group check - get the roster item, node@dom/res, then node@dom, then dom */
-                ritem = xhash_get(user->roster, jid_full(jid));
-                if(ritem == NULL) ritem = xhash_get(user->roster, jid_user(jid));
-                if(ritem == NULL) ritem = xhash_get(user->roster, jid->domain);
-
-                /* got it, do the check */
-                if(ritem != NULL)
-                    for(i = 0; i < ritem->ngroups; i++)
-                        if(strcmp(scan->group, ritem->groups[i]) == 0)
-                            match = 1;
-
-                break;
-
-            case zebra_S10N:
-                /* roster item check - get the roster item, node@dom/res, then node@dom, then dom */
-                ritem = xhash_get(user->roster, jid_full(jid));
-                if(ritem == NULL) ritem = xhash_get(user->roster, jid_user(jid));
-                if(ritem == NULL) ritem = xhash_get(user->roster, jid->domain);
+    /* jid check - match node@dom/res, then node@dom, then dom/resource, then dom */
+    if(xhash_count(zc->jids) > 0) {
+        _privacy_match_key(zc->jids, jid_full(jid), class, &match);
+        _privacy_match_key(zc->jids, jid_user(jid), class, &match);
+        if(jid->resource[0] != '\0') {
+            snprintf(domres, sizeof(domres), "%s/%s", jid->domain, jid->resource);
+            _privacy_match_key(zc->jids, domres, class, &match);
+        }
+        _privacy_match_key(zc->jids, jid->domain, class, &match);
+    }
 
-                /* got it, do the check */
-                if(ritem != NULL)
-                    if(scan->to == ritem->to && scan->from == ritem->from)
-                        match = 1;
+    /* roster checks - get the roster item, node@dom/res, then node@dom, then dom */
+    ritem = xhash_get(user->roster, jid_full(jid));
+    if(ritem == NULL) ritem = xhash_get(user->roster, jid_user(jid));
+    if(ritem == NULL) ritem = xhash_get(user->roster, jid->domain);
 
-                break;
-        }
+    if(ritem != NULL) {
+        for(i = 0; i < ritem->ngroups && xhash_count(zc->groups) > 0; i++)
+            _privacy_match_key(zc->groups, ritem->groups[i], class, &match);
 
-        /* if we matched a rule, we have to do packet block matching */
-        if(match) {
-            /* no packet blocking, matching done */
-            if(scan->block == block_NONE)
-                return scan->deny;
-
-            /* incoming checks block_MESSAGE, block_PRES_IN and block_IQ */
-            if(in) {
-                if(ptype & pkt_MESSAGE && scan->block & block_MESSAGE)
-                    return scan->deny;
-                if(ptype & pkt_PRESENCE && scan->block & block_PRES_IN)
-                    return scan->deny;
-                if(ptype & pkt_IQ && scan->block & block_IQ)
-                    return scan->deny;
-            } else if((ptype & pkt_PRESENCE && scan->block & block_PRES_OUT && ptype != pkt_PRESENCE_PROBE) ||
-                      (ptype & pkt_MESSAGE && scan->block & block_MESSAGE)) {
-                /* outgoing check, block_PRES_OUT */
-                /* XXX and block_MESSAGE for XEP-0191 while it violates XEP-0016 */
-                return scan->deny;
-            }
-        }
+        i = zc->s10n[(ritem->to << 1) | ritem->from][class];
+        if(i < match)
+            match = i;
     }
 
     /* didn't match the list, so allow */
-    return 0;
+    if(match == zc->nitems)
+        return 0;
+
+    log_debug(ZONE, "matched item %d (order %d)", match, zc->items[match]->order);
+
+    return zc->items[match]->deny;
 }
 
 /** check incoming packets */
@@ -613,6 +774,8 @@ static void _unblock_jid(user_t user, storage_t st, zebra_list_t zlist, jid_t ji
 
     for(scan = zlist->items; scan != NULL; scan = scan->next) {
         if(scan->type == zebra_JID && scan->deny && (jid == NULL || jid_compare_full(scan->jid, jid) == 0)) {
+            _privacy_list_changed(zlist);
+
             if(zlist->items == scan) {
                 zlist->items = scan->next;
                 if(zlist->items != NULL)
@@ -796,6 +959,7 @@ static mod_ret_t _privacy_in_sess(mod_instance_t mi, sess_t sess, pkt_t pkt) {
                         zitem->block = block_NONE;
 
                         /* insert it in front of list */
+                        _privacy_list_changed(zlist);
                         zitem->order = 0;
                         if(zlist->last == NULL) {
                             zlist->items = zlist->last = zitem;
@@ -1336,5 +1500,9 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
     ns_BLOCKING = sm_register_ns(mod->mm->sm, urn_BLOCKING);
     feature_register(mod->mm->sm, urn_BLOCKING);
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_IN_SESS, pkt_IQ, ns_PRIVACY);
+    mm_interest(mod, chain_IN_SESS, pkt_IQ, ns_BLOCKING);
+
     return 0;
 }
@@ -92,12 +92,12 @@ static void _roster_save_item(user_t user, item_t item) {
 
     snprintf(filter, 4096, "(jid=%zu:%s)", strlen(jid_full(item->jid)), jid_full(item->jid));
 
-    storage_replace(user->sm->st, "roster-items", jid_user(user->jid), filter, os);
+    storage_replace_deferred(user->sm->st, "roster-items", jid_user(user->jid), filter, os);
 
     os_free(os);
 
     if(item->ngroups == 0) {
-        storage_delete(user->sm->st, "roster-groups", jid_user(user->jid), filter);
+        storage_delete_deferred(user->sm->st, "roster-groups", jid_user(user->jid), filter);
         return;
     }
 
@@ -110,7 +110,7 @@ static void _roster_save_item(user_t user, item_t item) {
         os_object_put(o, "group", item->groups[i], os_type_STRING);
     }
 
-    storage_replace(user->sm->st, "roster-groups", jid_user(user->jid), filter, os);
+    storage_replace_deferred(user->sm->st, "roster-groups", jid_user(user->jid), filter, os);
 
     os_free(os);
 }
@@ -294,10 +294,9 @@ static void _roster_update_walker(const char *id, int id_len, void *val, void *a
     ns = nad_add_namespace(push->nad, uri_ROSTER, NULL);
     elem = nad_append_elem(push->nad, ns, "query", 3);
 
-    buf = (char *) malloc(sizeof(char) * 128);
+    buf = (char *) pmalloc(push->p, sizeof(char) * 128);
     sprintf(buf, "%d", item->ver);
     nad_set_attr(push->nad, elem, -1, "ver", buf, 0);
-    free(buf);
 
     _roster_insert_item(push, item, elem);
 
@@ -351,8 +350,8 @@ static void _roster_set_item(pkt_t pkt, int elem, sess_t sess, mod_instance_t mi
             _roster_freeuser_walker(NULL, 0, (void *) item, NULL);
 
             snprintf(filter, 4096, "(jid=%zu:%s)", strlen(jid_full(jid)), jid_full(jid));
-            storage_delete(sess->user->sm->st, "roster-items", jid_user(sess->jid), filter);
-            storage_delete(sess->user->sm->st, "roster-groups", jid_user(sess->jid), filter);
+            storage_delete_deferred(sess->user->sm->st, "roster-items", jid_user(sess->jid), filter);
+            storage_delete_deferred(sess->user->sm->st, "roster-groups", jid_user(sess->jid), filter);
         }
 
         log_debug(ZONE, "removed %s from roster", jid_full(jid));
@@ -509,10 +508,8 @@ static mod_ret_t _roster_in_sess(mod_instance_t mi, sess_t sess, pkt_t pkt)
          &&(attr = nad_find_attr(pkt->nad, elem, -1, "ver", NULL)) >= 0) {
             if (NAD_AVAL_L(pkt->nad, attr) > 0)
             {
-                buf = (char *) malloc(sizeof(char) * (NAD_AVAL_L(pkt->nad, attr) + 1));
-                sprintf(buf, "%.*s", NAD_AVAL_L(pkt->nad, attr), NAD_AVAL(pkt->nad, attr));
+                buf = pstrdupx(pkt->p, NAD_AVAL(pkt->nad, attr), NAD_AVAL_L(pkt->nad, attr));
                 ver = j_atoi(buf, 0);
-                free(buf);
             }
         }
 
@@ -533,10 +530,9 @@ static mod_ret_t _roster_in_sess(mod_instance_t mi, sess_t sess, pkt_t pkt)
         else {
             xhash_walk(sess->user->roster, _roster_get_walker, (void *) rw);
             if(elem >= 0 && attr >= 0) {
-                buf = (char *) malloc(sizeof(char) * 128);
+                buf = (char *) pmalloc(pkt->p, sizeof(char) * 128);
                 sprintf(buf, "%d", rw->ver);
                 nad_set_attr(pkt->nad, elem, -1, "ver", buf, 0);
-                free(buf);
             }
             pkt_sess(pkt_tofrom(pkt), sess);
         }
@@ -839,5 +835,10 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
 
     feature_register(mod->mm->sm, uri_ROSTER);
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_IN_SESS, pkt_S10N, 0);
+    mm_interest(mod, chain_IN_SESS, pkt_IQ, ns_ROSTER);
+    mm_interest(mod, chain_PKT_USER, pkt_S10N, 0);
+
     return 0;
 }
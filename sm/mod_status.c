@@ -247,5 +247,9 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
     mod->user_delete = _status_user_delete;
     mod->free = _status_free;
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_IN_SESS, pkt_PRESENCE, 0);
+    mm_interest(mod, chain_PKT_SM, pkt_PRESENCE | pkt_S10N, 0);
+
     return 0;
 }
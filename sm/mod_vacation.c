@@ -252,5 +252,9 @@ DLLEXPORT int module_init(mod_instance_t mi, char *arg) {
     ns_VACATION = sm_register_ns(mod->mm->sm, uri_VACATION);
     feature_register(mod->mm->sm, uri_VACATION);
 
+    /* only the packets we act on */
+    mm_interest(mod, chain_IN_SESS, pkt_IQ, ns_VACATION);
+    mm_interest(mod, chain_PKT_USER, pkt_MESSAGE, 0);
+
     return 0;
 }
@@ -256,11 +256,11 @@ int os_object_get(os_t os, os_object_t o, const char *key, void **val, os_type_t
             if (osf->type == os_type_NAD) {
                    *val = osf->val;  
             } else {
-                   /* parse the string into a NAD */
-                   nad = nad_parse(((char *) osf->val) + 3, strlen(osf->val) - 3); 
+                   /* unpack the string into a NAD (or parse it, if it was stored as xml) */
+                   nad = nad_decode(((char *) osf->val) + 3, strlen(osf->val) - 3);
                    if(nad == NULL) {
                             /* unparseable NAD */
-                            log_debug(ZONE, "cell returned from storage for key %s has unparseable XML content (%lu bytes)", key, strlen(osf->val)-3);
+                            log_debug(ZONE, "cell returned from storage for key %s has undecodable NAD content (%lu bytes)", key, strlen(osf->val)-3);
                             *val = NULL;
                             return 0;
                    } 
@@ -27,6 +27,87 @@
   * $Revision: 1.35 $
   */
 
+/** drop a route address, if it's ours to drop */
+static void _pkt_rjid_free(pkt_t pkt, jid_t *rjid, int which) {
+    if(*rjid != NULL && pkt->rown & which)
+        jid_free(*rjid);
+
+    *rjid = NULL;
+    pkt->rown &= ~which;
+}
+
+/** set a route address. these are component names, so the same few turn up
+ *  over and over - we share a prepared copy of each from sm->jids rather than
+ *  parsing and stringprepping them again for every packet */
+static jid_t _pkt_rjid(pkt_t pkt, jid_t *rjid, int which, const char *addr, int len) {
+    sm_t sm = pkt->sm;
+    jid_t jid;
+    int own = 0;
+
+    if(len < 0)
+        len = strlen(addr);
+
+    jid = (jid_t) xhash_getx(sm->jids, addr, len);
+    if(jid != NULL)
+        sm->jids_hits++;
+
+    else {
+        sm->jids_misses++;
+
+        jid = jid_new(addr, len);
+
+        /* users can address anywhere, so don't let the table grow forever; past the limit, packets get their own copy */
+        if(jid != NULL && xhash_count(sm->jids) >= pkt_JIDS_MAX)
+            own = 1;
+        else if(jid != NULL) {
+            /* expand now, so nobody has to touch it later */
+            jid_expand(jid);
+            xhash_put(sm->jids, pstrdupx(xhash_pool(sm->jids), addr, len), (void *) jid);
+        }
+    }
+
+    /* addr may have come from the old one, so it goes last */
+    _pkt_rjid_free(pkt, rjid, which);
+
+    if(own)
+        pkt->rown |= which;
+
+    *rjid = jid;
+    return jid;
+}
+
+/** get a new packet, in an arena of its own (a recycled one, if we have it) */
+static pkt_t _pkt_alloc(sm_t sm) {
+    pool_t p;
+    pkt_t pkt;
+
+    if(sm->narenas > 0) {
+        p = sm->arenas[--sm->narenas];
+        sm->arenas_reused++;
+    } else
+        p = pool_heap(pkt_ARENA_SIZE);
+
+    sm->arenas_new++;
+
+    pkt = (pkt_t) pmalloco(p, sizeof(struct pkt_st));
+    pkt->sm = sm;
+    pkt->p = p;
+
+    return pkt;
+}
+
+/** release a packet's arena, and the packet with it */
+static void _pkt_release(pkt_t pkt) {
+    sm_t sm = pkt->sm;
+    pool_t p = pkt->p;
+
+    if(sm->narenas < sm->arenas_max) {
+        pool_reset(p);
+        sm->arenas[sm->narenas++] = p;
+    } else
+        pool_free(p);
+}
+
 pkt_t pkt_error(pkt_t pkt, int err) {
     if(pkt == NULL) return NULL;
 
@@ -66,6 +147,7 @@ pkt_t pkt_tofrom(pkt_t pkt) {
     tmp = pkt->rfrom;
     pkt->rfrom = pkt->rto;
     pkt->rto = tmp;
+    pkt->rown = (pkt->rown & pkt_ROUTE_TO ? pkt_ROUTE_FROM : 0) | (pkt->rown & pkt_ROUTE_FROM ? pkt_ROUTE_TO : 0);
 
     /* update attrs */
     if(pkt->to != NULL)
@@ -86,9 +168,8 @@ pkt_t pkt_dup(pkt_t pkt, const char *to, const char *from) {
 
     if(pkt == NULL) return NULL;
 
-    pnew = (pkt_t) calloc(1, sizeof(struct pkt_st));
+    pnew = _pkt_alloc(pkt->sm);
 
-    pnew->sm = pkt->sm;
     pnew->type = pkt->type;
     pnew->nad = nad_copy(pkt->nad);
 
@@ -126,18 +207,17 @@ pkt_t pkt_new(sm_t sm, nad_t nad) {
     }
 
     /* create the pkt holder */
-    pkt = (pkt_t) calloc(1, sizeof(struct pkt_st));
+    pkt = _pkt_alloc(sm);
 
-    pkt->sm = sm;
     pkt->nad = nad;
 
     /* routes */
     if(NAD_ENAME_L(nad, 0) == 5 && strncmp("route", NAD_ENAME(nad, 0), 5) == 0) {
         /* route element */
         if((attr = nad_find_attr(nad, 0, -1, "to", NULL)) >= 0)
-            pkt->rto = jid_new(NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
+            _pkt_rjid(pkt, &pkt->rto, pkt_ROUTE_TO, NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
         if((attr = nad_find_attr(nad, 0, -1, "from", NULL)) >= 0)
-            pkt->rfrom = jid_new(NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
+            _pkt_rjid(pkt, &pkt->rfrom, pkt_ROUTE_FROM, NAD_AVAL(nad, attr), NAD_AVAL_L(nad, attr));
 
         /* route type */
         attr = nad_find_attr(nad, 0, -1, "type", NULL);
@@ -308,20 +388,48 @@ pkt_t pkt_new(sm_t sm, nad_t nad) {
 
     log_debug(ZONE, "invalid component packet");
 
-    free(pkt);
+    _pkt_release(pkt);
     return NULL;
 }
 
+/** free the interned route addresses */
+void pkt_jids_free(sm_t sm) {
+    jid_t jid;
+
+    log_write(sm->log, LOG_INFO, "route addresses: %d interned, %lu lookups found, %lu parsed", xhash_count(sm->jids), sm->jids_hits, sm->jids_misses);
+
+    if(xhash_iter_first(sm->jids))
+        do {
+            xhash_iter_get(sm->jids, NULL, NULL, (void *) &jid);
+            jid_free(jid);
+        } while(xhash_iter_next(sm->jids));
+
+    xhash_free(sm->jids);
+    sm->jids = NULL;
+}
+
+/** free the spare packet arenas */
+void pkt_arenas_free(sm_t sm) {
+    log_write(sm->log, LOG_INFO, "packet arenas: %lu of %lu packets in a reused arena", sm->arenas_reused, sm->arenas_new);
+
+    while(sm->narenas > 0)
+        pool_free(sm->arenas[--sm->narenas]);
+
+    free(sm->arenas);
+    sm->arenas = NULL;
+    sm->arenas_max = 0;
+}
+
 void pkt_free(pkt_t pkt) {
     log_debug(ZONE, "freeing pkt");
 
     if (pkt != NULL) {
-        if(pkt->rto != NULL) jid_free(pkt->rto);
-        if(pkt->rfrom != NULL) jid_free(pkt->rfrom);
+        _pkt_rjid_free(pkt, &pkt->rto, pkt_ROUTE_TO);
+        _pkt_rjid_free(pkt, &pkt->rfrom, pkt_ROUTE_FROM);
         if(pkt->to != NULL) jid_free(pkt->to);
         if(pkt->from != NULL) jid_free(pkt->from);
         if(pkt->nad != NULL) nad_free(pkt->nad);
-        free(pkt);
+        _pkt_release(pkt);
     }
 }
 
@@ -376,9 +484,32 @@ void pkt_id_new(pkt_t pkt) {
     return;
 }
 
+/** remove sm specifics from a stanza on its way out, if it has no session elements in it */
+static void _pkt_strip_sm(nad_t nad) {
+    int ns, scan;
+
+    ns = nad_find_namespace(nad, 1, uri_SESSION, NULL);
+    if(ns < 0 || nad_find_elem(nad, 0, ns, NULL, 1) >= 0)
+        return;
+
+    nad_set_attr(nad, 1, ns, "c2s", NULL, 0);
+    nad_set_attr(nad, 1, ns, "sm", NULL, 0);
+
+    /* forget about the internal namespace too */
+    if(nad->elems[1].ns == ns)
+        nad->elems[1].ns = nad->nss[ns].next;
+
+    else {
+        for(scan = nad->elems[1].ns; nad->nss[scan].next != -1 && nad->nss[scan].next != ns; scan = nad->nss[scan].next);
+
+        /* got it */
+        if(nad->nss[scan].next != -1)
+            nad->nss[scan].next = nad->nss[ns].next;
+    }
+}
+
 void pkt_router(pkt_t pkt) {
     mod_ret_t ret;
-    int ns, scan;
 
     if(pkt == NULL) return;
 
@@ -390,11 +521,7 @@ void pkt_router(pkt_t pkt) {
         return;
     }
 
-    if(pkt->rto != NULL)
-        jid_free(pkt->rto);
-    pkt->rto = jid_new(pkt->to->domain, -1);
-
-    if(pkt->rto == NULL) {
+    if(_pkt_rjid(pkt, &pkt->rto, pkt_ROUTE_TO, pkt->to->domain, -1) == NULL) {
         log_debug(ZONE, "invalid to address on packet, unable to route");
         pkt_free(pkt);
         return;
@@ -402,11 +529,7 @@ void pkt_router(pkt_t pkt) {
 
     nad_set_attr(pkt->nad, 0, -1, "to", pkt->rto->domain, 0);
 
-    if(pkt->rfrom != NULL)
-        jid_free(pkt->rfrom);
-    pkt->rfrom = jid_new(pkt->sm->id, -1);
-
-    if(pkt->rfrom == NULL) {
+    if(_pkt_rjid(pkt, &pkt->rfrom, pkt_ROUTE_FROM, pkt->sm->id, -1) == NULL) {
         log_debug(ZONE, "invalid from address on packet, unable to route");
         pkt_free(pkt);
         return;
@@ -422,24 +545,7 @@ void pkt_router(pkt_t pkt) {
         case mod_PASS:
             
             /* remove sm specifics */
-            ns = nad_find_namespace(pkt->nad, 1, uri_SESSION, NULL);
-            /* remove them if there is no session elements in packet */
-            if(ns >= 0 && nad_find_elem(pkt->nad, 0, ns, NULL, 1) < 0) {
-                nad_set_attr(pkt->nad, 1, ns, "c2s", NULL, 0);
-                nad_set_attr(pkt->nad, 1, ns, "sm", NULL, 0);
-
-                /* forget about the internal namespace too */
-                if(pkt->nad->elems[1].ns == ns)
-                    pkt->nad->elems[1].ns = pkt->nad->nss[ns].next;
-
-                else {
-                    for(scan = pkt->nad->elems[1].ns; pkt->nad->nss[scan].next != -1 && pkt->nad->nss[scan].next != ns; scan = pkt->nad->nss[scan].next);
-
-                    /* got it */
-                    if(pkt->nad->nss[scan].next != -1)
-                        pkt->nad->nss[scan].next = pkt->nad->nss[ns].next;
-                }
-            }
+            _pkt_strip_sm(pkt->nad);
 
             sx_nad_write(pkt->sm->router, pkt->nad);
 
@@ -456,6 +562,124 @@ void pkt_router(pkt_t pkt) {
     }
 }
 
+/** an address waiting to go out in a multicast route */
+typedef struct _fanout_addr_st {
+    char                    *jid;
+    struct _fanout_addr_st  *next;
+} *_fanout_addr_t;
+
+/** start sending a copy of pkt, from the given address, to a set of recipients. pkt is not ours, but has to stay around until pkt_fanout_send() */
+pkt_fanout_t pkt_fanout_new(pkt_t pkt, const char *from) {
+    pkt_fanout_t f;
+
+    /* the packet outlives the fanout, so it can carry it */
+    f = (pkt_fanout_t) pmalloco(pkt->p, sizeof(struct pkt_fanout_st));
+
+    f->sm = pkt->sm;
+    f->pkt = pkt;
+    f->from = pstrdup(pkt->p, from);
+    f->domains = xhash_new(31);
+
+    return f;
+}
+
+/** add a recipient. without multicast it goes now; with it, the out-router chain still sees
+ *  each recipient (so privacy lists apply per contact), but only to decide, not to send */
+void pkt_fanout_add(pkt_fanout_t f, const char *to) {
+    pkt_t pkt;
+    mod_ret_t ret;
+    _fanout_addr_t addr, head;
+    pool_t p;
+
+    pkt = pkt_dup(f->pkt, to, f->from);
+
+    if(!f->sm->multicast) {
+        pkt_router(pkt);
+        return;
+    }
+
+    if(pkt->to == NULL) {
+        log_debug(ZONE, "no to address on packet, unable to route");
+        pkt_free(pkt);
+        return;
+    }
+
+    ret = mm_out_router(f->sm->mm, pkt);
+    switch(ret) {
+        case mod_HANDLED:
+            return;
+
+        case mod_PASS:
+            break;
+
+        default:
+            pkt_router(pkt_error(pkt, -ret));
+            return;
+    }
+
+    p = xhash_pool(f->domains);
+
+    addr = (_fanout_addr_t) pmalloco(p, sizeof(struct _fanout_addr_st));
+    addr->jid = pstrdup(p, jid_full(pkt->to));
+
+    /* first one for the domain heads its list, the rest go in behind it */
+    head = (_fanout_addr_t) xhash_get(f->domains, pkt->to->domain);
+    if(head == NULL)
+        xhash_put(f->domains, pstrdup(p, pkt->to->domain), (void *) addr);
+    else {
+        addr->next = head->next;
+        head->next = addr;
+    }
+
+    f->count++;
+
+    pkt_free(pkt);
+}
+
+/** send one multicast route per domain (or a plain route, where there's only one recipient), and free the fanout */
+void pkt_fanout_send(pkt_fanout_t f) {
+    const char *domain;
+    int dlen;
+    _fanout_addr_t addr;
+    pkt_t pkt;
+    nad_t nad;
+
+    if(xhash_iter_first(f->domains))
+        do {
+            xhash_iter_get(f->domains, &domain, &dlen, (void *) &addr);
+
+            /* already through the out-router chain, so straight out */
+            if(addr->next == NULL) {
+                pkt = pkt_dup(f->pkt, addr->jid, f->from);
+                nad = pkt->nad;
+                pkt->nad = NULL;
+                pkt_free(pkt);
+            }
+
+            else {
+                nad = nad_copy(f->pkt->nad);
+                nad_set_attr(nad, 1, -1, "from", f->from, 0);
+                nad_set_attr(nad, 1, -1, "to", NULL, 0);
+                nad_set_attr(nad, 0, -1, "type", "multicast", 9);
+
+                for(; addr != NULL; addr = addr->next)
+                    nad_multicast_add(nad, addr->jid);
+            }
+
+            nad_set_attr(nad, 0, -1, "to", domain, dlen);
+            nad_set_attr(nad, 0, -1, "from", f->sm->id, 0);
+
+            /* the addresses go on the end, so the stanza is still elem 1 */
+            _pkt_strip_sm(nad);
+
+            sx_nad_write(f->sm->router, nad);
+        } while(xhash_iter_next(f->domains));
+
+    log_debug(ZONE, "fanout of %d recipients to %d domains", f->count, xhash_count(f->domains));
+
+    xhash_free(f->domains);
+}
+
 void pkt_sess(pkt_t pkt, sess_t sess) {
     mod_ret_t ret;
 
@@ -463,11 +687,7 @@ void pkt_sess(pkt_t pkt, sess_t sess) {
 
     log_debug(ZONE, "delivering pkt to session %s", jid_full(sess->jid));
 
-    if(pkt->rto != NULL)
-        jid_free(pkt->rto);
-    pkt->rto = jid_new(sess->c2s, -1);
-
-    if(pkt->rto == NULL) {
+    if(_pkt_rjid(pkt, &pkt->rto, pkt_ROUTE_TO, sess->c2s, -1) == NULL) {
         log_debug(ZONE, "invalid to address on packet, unable to route");
         pkt_free(pkt);
         return;
@@ -475,11 +695,7 @@ void pkt_sess(pkt_t pkt, sess_t sess) {
 
     nad_set_attr(pkt->nad, 0, -1, "to", pkt->rto->domain, 0);
 
-    if(pkt->rfrom != NULL)
-        jid_free(pkt->rfrom);
-    pkt->rfrom = jid_new(pkt->sm->id, -1);
-
-    if(pkt->rfrom == NULL) {
+    if(_pkt_rjid(pkt, &pkt->rfrom, pkt_ROUTE_FROM, pkt->sm->id, -1) == NULL) {
         log_debug(ZONE, "invalid from address on packet, unable to route");
         pkt_free(pkt);
         return;
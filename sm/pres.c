@@ -69,6 +69,8 @@ void pres_update(sess_t sess, pkt_t pkt) {
     int self;
     jid_t scan, next;
     sess_t sscan;
+    pkt_t probe;
+    pkt_fanout_t fwd, probes = NULL;
 
     switch(pkt->type) {
         case pkt_PRESENCE:
@@ -81,6 +83,14 @@ void pres_update(sess_t sess, pkt_t pkt) {
 
             /* B1: forward to all in T, unless in E */
 
+            /* probes and forwards are gathered up, so each domain gets one route of each */
+            fwd = pkt_fanout_new(pkt, jid_full(sess->jid));
+            probe = NULL;
+            if(!sess->available) {
+                probe = pkt_create(sess->user->sm, "presence", "probe", NULL, jid_user(sess->jid));
+                probes = pkt_fanout_new(probe, jid_user(sess->jid));
+            }
+
             /* loop the roster, looking for trusted */
             self = 0;
             if(xhash_iter_first(sess->user->roster))
@@ -90,7 +100,7 @@ void pres_update(sess_t sess, pkt_t pkt) {
                 /* if we're coming available, and we can see them, we need to probe them */
                 if(!sess->available && item->to) {
                     log_debug(ZONE, "probing %s", jid_full(item->jid));
-                    pkt_router(pkt_create(sess->user->sm, "presence", "probe", jid_full(item->jid), jid_user(sess->jid))); 
+                    pkt_fanout_add(probes, jid_full(item->jid));
 
                     /* flag if we probed ourselves */
                     if(strcmp(jid_user(sess->jid), jid_full(item->jid)) == 0)
@@ -100,10 +110,16 @@ void pres_update(sess_t sess, pkt_t pkt) {
                 /* if they can see us, forward */
                 if(item->from && !jid_search(sess->E, item->jid)) {
                     log_debug(ZONE, "forwarding available to %s", jid_full(item->jid));
-                    pkt_router(pkt_dup(pkt, jid_full(item->jid), jid_full(sess->jid)));
+                    pkt_fanout_add(fwd, jid_full(item->jid));
                 }
             } while(xhash_iter_next(sess->user->roster));
 
+            pkt_fanout_send(fwd);
+            if(probe != NULL) {
+                pkt_fanout_send(probes);
+                pkt_free(probe);
+            }
+
             /* probe ourselves if we need to and didn't already */
             if(!self && !sess->available) {
                 log_debug(ZONE, "probing ourselves");
@@ -140,6 +156,8 @@ void pres_update(sess_t sess, pkt_t pkt) {
 
             /* B2: forward to all in T and A, unless in E */
 
+            fwd = pkt_fanout_new(pkt, jid_full(sess->jid));
+
             /* loop the roster, looking for trusted */
             if(xhash_iter_first(sess->user->roster))
             do {
@@ -149,7 +167,7 @@ void pres_update(sess_t sess, pkt_t pkt) {
                 if(item->from && !jid_search(sess->E, item->jid)) {
 
                     log_debug(ZONE, "forwarding unavailable to %s", jid_full(item->jid));
-                    pkt_router(pkt_dup(pkt, jid_full(item->jid), jid_full(sess->jid)));
+                    pkt_fanout_add(fwd, jid_full(item->jid));
                 }
             } while(xhash_iter_next(sess->user->roster));
 
@@ -157,9 +175,11 @@ void pres_update(sess_t sess, pkt_t pkt) {
             for(scan = sess->A; scan != NULL; scan = scan->next)
                 if(!pres_trust(sess->user, scan)) {
                     log_debug(ZONE, "forwarding unavailable to %s", jid_full(scan));
-                    pkt_router(pkt_dup(pkt, jid_full(scan), jid_full(sess->jid)));
+                    pkt_fanout_add(fwd, jid_full(scan));
                 }
 
+            pkt_fanout_send(fwd);
+
             /* forward to our active sessions */
             for(sscan = sess->user->sessions; sscan != NULL; sscan = sscan->next) {
                 if(sscan != sess && sscan->available) {
@@ -362,9 +382,14 @@ void pres_roster(sess_t sess, item_t item) {
 
 void pres_probe(user_t user) {
     item_t item;
+    pkt_t probe;
+    pkt_fanout_t probes;
 
     log_debug(ZONE, "full roster probe for %s", jid_user(user->jid));
 
+    probe = pkt_create(user->sm, "presence", "probe", NULL, jid_user(user->jid));
+    probes = pkt_fanout_new(probe, jid_user(user->jid));
+
     /* loop the roster, looked for trusted */
     if(xhash_iter_first(user->roster))
     do {
@@ -373,7 +398,10 @@ void pres_probe(user_t user) {
         /* don't probe unless they trust us */
         if(item->to) {
             log_debug(ZONE, "probing %s", jid_full(item->jid));
-            pkt_router(pkt_create(user->sm, "presence", "probe", jid_full(item->jid), jid_user(user->jid)));
+            pkt_fanout_add(probes, jid_full(item->jid));
         }
     } while(xhash_iter_next(user->roster));
+
+    pkt_fanout_send(probes);
+    pkt_free(probe);
 }
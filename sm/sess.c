@@ -51,12 +51,9 @@ void sess_route(sess_t sess, pkt_t pkt) {
     /* and send it out */
     sx_nad_write(sess->user->sm->router, pkt->nad);
 
-    /* free up the packet */
-    if(pkt->rto != NULL) jid_free(pkt->rto);
-    if(pkt->rfrom != NULL) jid_free(pkt->rfrom);
-    if(pkt->to != NULL) jid_free(pkt->to);
-    if(pkt->from != NULL) jid_free(pkt->from);
-    free(pkt);
+    /* free up the packet, the nad is gone already */
+    pkt->nad = NULL;
+    pkt_free(pkt);
 }
 
 static void _sess_end_guts(sess_t sess) {
@@ -89,9 +86,9 @@ void sess_end(sess_t sess) {
 
     log_write(sess->user->sm->log, LOG_NOTICE, "session ended: jid=%s", jid_full(sess->jid));
 
-    /* if it was the last session, free the user */
+    /* if it was the last session, let the user go */
     if(sess->user->sessions == NULL)
-        user_free(sess->user);
+        user_unload(sess->user);
 
     /* free the session */
     pool_free(sess->p);
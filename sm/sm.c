@@ -29,6 +29,20 @@
 
 sig_atomic_t sm_lost_router = 0;
 
+/** one address of a multicast route, handled as if it came on its own */
+static void _sm_multicast_packet(nad_t nad, void *arg) {
+    sm_t sm = (sm_t) arg;
+    pkt_t pkt;
+
+    pkt = pkt_new(sm, nad);
+    if (pkt == NULL) {
+        log_debug(ZONE, "invalid packet, dropping");
+        return;
+    }
+
+    dispatch(sm, pkt);
+}
+
 /** our master callback */
 int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
     sm_t sm = (sm_t) arg;
@@ -82,9 +96,13 @@ int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             return len;
 
         case event_WRITE:
+        case event_WRITEV:
             log_debug(ZONE, "writing to %d", sm->fd->fd);
 
-            len = send(sm->fd->fd, buf->data, buf->len, 0);
+            if(e == event_WRITEV)
+                len = writev(sm->fd->fd, ((sx_wvec_t *) data)->iov, ((sx_wvec_t *) data)->niov);
+            else
+                len = send(sm->fd->fd, buf->data, buf->len, 0);
             if (len >= 0) {
                 log_debug(ZONE, "%d bytes written", len);
                 return len;
@@ -117,10 +135,14 @@ int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
             /* set connection attempts counter */
             sm->retry_left = sm->retry_lost;
 
+            /* until the router says otherwise */
+            sm->multicast = 0;
+
             nad = nad_new();
             ns = nad_add_namespace(nad, uri_COMPONENT, NULL);
             nad_append_elem(nad, ns, "bind", 0);
             nad_append_attr(nad, -1, "name", sm->id);
+            nad_append_elem(nad, ns, "multicast", 1);
             log_debug(ZONE, "requesting component bind for '%s'", sm->id);
             sx_nad_write(sm->router, nad);
 
@@ -139,6 +161,11 @@ int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
                 nad_append_elem(nad, ns, "bind", 0);
                 nad_set_attr(nad, nad->ecur - 1, -1, "name", domain, domain_len);
                 nad_append_attr(nad, -1, "multi", "to");
+                if(sm->router_weight != NULL)
+                    nad_append_attr(nad, -1, "weight", sm->router_weight);
+                /* our id, so the router gives us back the same users when we reconnect */
+                nad_append_attr(nad, -1, "instance", sm->id);
+                nad_append_elem(nad, ns, "multicast", 1);
                 log_debug(ZONE, "requesting domain bind for '%.*s'", domain_len, domain);
                 sx_nad_write(sm->router, nad);
             
@@ -209,6 +236,12 @@ int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
 
                 log_debug(ZONE, "coming online");
 
+                /* routers that know multicast say so, older ones just echo our request back */
+                if(nad_find_attr(nad, 0, -1, "multicast", "true") >= 0) {
+                    log_debug(ZONE, "router takes multicast routes");
+                    sm->multicast = 1;
+                }
+
                 /* we're online */
                 sm->online = sm->started = 1;
                 log_write(sm->log, LOG_NOTICE, "%s ready for sessions", sm->id);
@@ -219,6 +252,12 @@ int sm_sx_callback(sx_t s, sx_event_t e, void *data, void *arg) {
 
             log_debug(ZONE, "got a packet");
 
+            /* multicast routes come apart here, one packet per address */
+            if (NAD_ENAME_L(nad, 0) == 5 && strncmp("route", NAD_ENAME(nad, 0), 5) == 0 && nad_find_attr(nad, 0, -1, "type", "multicast") >= 0) {
+                nad_multicast_expand(nad, _sm_multicast_packet, (void *) sm);
+                return 0;
+            }
+
             pkt = pkt_new(sm, nad);
             if (pkt == NULL) {
                 log_debug(ZONE, "invalid packet, dropping");
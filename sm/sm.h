@@ -125,13 +125,25 @@ typedef enum {
     route_ERROR = 0x40          /**< route error */
 } route_type_t;
 
+/** route addresses we own */
+#define pkt_ROUTE_TO    (0x1)
+#define pkt_ROUTE_FROM  (0x2)
+
+/** most route addresses to intern */
+#define pkt_JIDS_MAX    (1024)
+
+/** packet arenas - the first heap size, and how many freed ones to keep for reuse */
+#define pkt_ARENA_SIZE  (512)
+#define pkt_ARENA_MAX   (256)
+
 /** packet summary data wrapper */
 typedef struct pkt_st {
     sm_t                sm;         /**< sm context */
 
     sess_t              source;     /**< session this packet came from */
 
-    jid_t               rto, rfrom; /**< addressing of enclosing route */
+    jid_t               rto, rfrom; /**< addressing of enclosing route (shared from sm->jids unless we own them) */
+    int                 rown;       /**< which of rto (pkt_ROUTE_TO) and rfrom (pkt_ROUTE_FROM) are our own copies */
 
     route_type_t        rtype;      /**< type of enclosing route */
 
@@ -144,8 +156,23 @@ typedef struct pkt_st {
     int                 pri;        /**< presence priority */
 
     nad_t               nad;        /**< nad of the entire packet */
+
+    pool_t              p;          /**< arena the packet lives in; anything that lives only as long as the packet can go here too */
 } *pkt_t;
 
+/** one stanza going to many recipients, gathered into a multicast route per domain */
+typedef struct pkt_fanout_st {
+    sm_t                sm;         /**< sm context */
+
+    pkt_t               pkt;        /**< the stanza everyone gets */
+
+    char                *from;      /**< who it's from */
+
+    xht                 domains;    /**< recipients, key is domain, value is a list of addresses */
+
+    int                 count;      /**< recipients so far */
+} *pkt_fanout_t;
+
 /** roster items */
 typedef struct item_st {
     jid_t               jid;        /**< id of this item */
@@ -173,6 +200,7 @@ struct sm_st {
     char                *router_pass;       /**< password to authenticate to the router with */
     char                *router_pemfile;    /**< name of file containing a SSL certificate &
                                                  key for channel to the router */
+    char                *router_weight;     /**< share of the domain's users we ask the router for */
 
     mio_t               mio;                /**< mio context */
 
@@ -185,6 +213,15 @@ struct sm_st {
 
     xht                 users;              /**< pointers to currently loaded users (key is user@@domain) */
 
+    user_t              ucache_head;        /**< loaded users without sessions, most recently used first */
+    user_t              ucache_tail;
+    int                 ucache_count;       /**< number of users in the cache */
+    int                 ucache_bytes;       /**< memory they're using */
+    int                 ucache_max;         /**< most users to keep (0 to not keep any) */
+    int                 ucache_max_bytes;   /**< most memory to use */
+    int                 ucache_ttl;         /**< seconds to keep a user for */
+    unsigned long       ucache_hits, ucache_misses, ucache_evictions;
+
     xht                 sessions;           /**< pointers to all connected sessions (key is random sm id) */
 
     xht                 xmlns;              /**< index of namespaces (for iq sub-namespace in pkt_t) */
@@ -192,6 +229,14 @@ struct sm_st {
 
     xht                 features;           /**< feature index (key is feature string */
 
+    xht                 jids;               /**< interned route addresses (key is address as sent, value is prepared jid_t) */
+    unsigned long       jids_hits, jids_misses;
+
+    pool_t              *arenas;            /**< freed packet arenas, ready for reuse */
+    int                 narenas;
+    int                 arenas_max;         /**< most to keep (0 to not keep any) */
+    unsigned long       arenas_new, arenas_reused;
+
     config_t            config;             /**< config context */
 
     log_t               log;                /**< log context */
@@ -218,6 +263,8 @@ struct sm_st {
 
     int                 online;             /**< true if we're currently bound in the router */
 
+    int                 multicast;          /**< true if the router takes multicast routes from us */
+
     xht                 hosts;              /**< vHosts map */
 
 };
@@ -238,6 +285,11 @@ struct user_st {
     time_t              active;             /**< time that user first logged in (ever) */
 
     void                **module_data;      /**< per-user module data */
+
+    int                 cached;             /**< true if we're being kept around without sessions */
+    user_t              cache_prev, cache_next;
+    int                 cache_bytes;        /**< memory we were using when we went into the cache */
+    time_t              cache_time;         /**< when we went into the cache */
 };
 
 /** data for a single session */
@@ -290,6 +342,8 @@ SM_API pkt_t           pkt_tofrom(pkt_t pkt);
 SM_API pkt_t           pkt_dup(pkt_t pkt, const char *to, const char *from);
 SM_API pkt_t           pkt_new(sm_t sm, nad_t nad);
 SM_API void            pkt_free(pkt_t pkt);
+SM_API void            pkt_jids_free(sm_t sm);
+SM_API void            pkt_arenas_free(sm_t sm);
 SM_API pkt_t           pkt_create(sm_t sm, const char *elem, const char *type, const char *to, const char *from);
 SM_API void            pkt_id(pkt_t src, pkt_t dest);
 SM_API void            pkt_id_new(pkt_t pkt);
@@ -298,6 +352,10 @@ SM_API void            pkt_delay(pkt_t pkt, time_t t, const char *from);
 SM_API void            pkt_router(pkt_t pkt);
 SM_API void            pkt_sess(pkt_t pkt, sess_t sess);
 
+SM_API pkt_fanout_t    pkt_fanout_new(pkt_t pkt, const char *from);
+SM_API void            pkt_fanout_add(pkt_fanout_t f, const char *to);
+SM_API void            pkt_fanout_send(pkt_fanout_t f);
+
 SM_API int             pres_trust(user_t user, jid_t jid);
 SM_API void            pres_roster(sess_t sess, item_t item);
 SM_API void            pres_update(sess_t sess, pkt_t pres);
@@ -313,6 +371,12 @@ SM_API sess_t          sess_match(user_t user, char *resource);
 
 SM_API user_t          user_load(sm_t sm, jid_t jid);
 SM_API void            user_free(user_t user);
+/** done with a user that has no sessions; keeps them around for a while in case they're wanted again */
+SM_API void            user_unload(user_t user);
+/** throw away a user that has no sessions, so the next load sees what's in storage */
+SM_API void            user_invalidate(sm_t sm, jid_t jid);
+/** free all the users we've been keeping around */
+SM_API void            user_cache_free(sm_t sm);
 SM_API int             user_create(sm_t sm, jid_t jid);
 SM_API void            user_delete(sm_t sm, jid_t jid);
 
@@ -348,6 +412,19 @@ typedef enum {
 typedef struct module_st *module_t;
 typedef struct mod_instance_st *mod_instance_t;
 
+/** number of chains */
+#define mm_CHAINS (chain_DISCO_EXTEND + 1)
+
+/** time one in this many calls into each module instance */
+#define mm_TIME_EVERY (16)
+
+/** what a module's handler on one of the packet chains wants to see, see mm_interest() */
+struct mod_interest_st {
+    int                 types;      /**< packet types (pkt_MESSAGE, pkt_IQ, ...), 0 for everything */
+    int                 *ns;        /**< iq namespaces, if it only wants some of them */
+    int                 nns;
+};
+
 /** module manager data */
 struct mm_st {
     sm_t                sm;         /**< sm context */
@@ -382,6 +459,9 @@ struct mm_st {
     mod_instance_t      *user_delete;   int nuser_delete;
     /** disco-extend chain */
     mod_instance_t      *disco_extend;  int ndisco_extend;
+
+    /** packet chains, by the kind of packet - built from the chains and what the modules said they want */
+    struct mm_dispatch_st *dispatch[mm_CHAINS];
 };
 
 /** data for a single module */
@@ -424,6 +504,8 @@ struct module_st {
     void                (*disco_extend)(mod_instance_t mi, pkt_t pkt);              /**< disco-extend handler */
 
     void                (*free)(module_t mod);                                      /**< called when module is freed */
+
+    struct mod_interest_st interest[mm_CHAINS];     /**< packets the handlers want */
 };
 
 /** single instance of a module in a chain */
@@ -437,12 +519,17 @@ struct mod_instance_st {
     mod_chain_t         chain;      /**< chain this instance is in */
 
     char                *arg;       /**< option arg that this instance was started with */
+
+    unsigned long       calls;      /**< packets given to this instance */
+    unsigned long       timed;      /**< how many of those we timed */
+    unsigned long       usecs;      /**< and how long the timed ones took */
 };
 
 /** allocate a module manager instance, and loads the modules */
 SM_API mm_t                    mm_new(sm_t sm);
 /** free a mm instance */
 SM_API void                    mm_free(mm_t mm);
+SM_API void                    mm_interest(module_t mod, mod_chain_t chain, int types, int ns);
 
 /** fire sess-start chain */
 SM_API int                     mm_sess_start(mm_t mm, sess_t sess);
@@ -582,6 +669,39 @@ typedef enum {
 
 typedef struct st_driver_st *st_driver_t;
 
+/** storage calls */
+typedef enum {
+    st_call_PUT,
+    st_call_GET,
+    st_call_COUNT,
+    st_call_DELETE,
+    st_call_REPLACE
+} st_call_t;
+
+/** async completion callback. the objects from a get belong to the callback, and are NULL on failure */
+typedef void (*st_callback_t)(st_ret_t ret, os_t os, int count, void *arg);
+
+typedef struct st_op_st *st_op_t;
+/** a storage request */
+struct st_op_st {
+    storage_t   st;             /**< storage manager context */
+    st_driver_t drv;            /**< driver doing the work */
+
+    st_call_t   call;           /**< what to do */
+    char        *type;          /**< data type */
+    char        *owner;         /**< owner */
+    char        *filter;        /**< filter, may be NULL */
+
+    os_t        os;             /**< objects to store, or objects found */
+    int         count;          /**< count result */
+    st_ret_t    ret;            /**< result */
+
+    st_callback_t cb;           /**< completion callback */
+    void        *arg;           /**< callback argument */
+
+    st_op_t     next;           /**< next request in a queue */
+};
+
 /** storage manager data */
 struct storage_st {
     sm_t        sm;             /**< sm context */
@@ -591,6 +711,12 @@ struct storage_st {
 
     st_driver_t default_drv;    /**< default driver (used when there is no module
                                      explicitly registered for a type) */
+
+    int         threads;        /**< worker threads to start for each driver */
+    struct st_async_st *async;  /**< completed async requests, waiting for the main loop */
+    struct st_batch_st *batch;  /**< deferred writes, waiting to go out together */
+
+    int         packed_nads;    /**< write nads in packed form, rather than as xml */
 };
 
 /** data for a single storage driver */
@@ -618,6 +744,21 @@ struct st_driver_st {
 
     /** called when driver is freed */
     void        (*free)(st_driver_t drv);
+
+    /** async submit handler, for drivers that can run requests without blocking. the driver
+     *  fills in the result and hands the request to storage_complete() when it's done */
+    void        (*submit)(st_driver_t drv, st_op_t op);
+    /** called to finish everything given to submit, for drivers that need the main loop to do it */
+    void        (*drain)(st_driver_t drv);
+
+    /** called in each worker thread as it starts and stops */
+    void        (*thread_init)(st_driver_t drv);
+    void        (*thread_free)(st_driver_t drv);
+
+    /** set if the handlers can be called from several threads at once */
+    int         threadsafe;
+
+    struct st_workers_st *workers;  /**< worker threads running requests for this driver */
 };
 
 /** allocate a storage manager instance */
@@ -639,6 +780,34 @@ SM_API st_ret_t        storage_delete(storage_t st, const char *type, const char
 /** replace objects matching this filter with objects in this set (atomic delete + get) */
 SM_API st_ret_t        storage_replace(storage_t st, const char *type, const char *owner, const char *filter, os_t os);
 
+/** async versions of the above. these return straight away, and the callback is called from the
+ *  main loop once the driver is done. put and replace take the object set, and free it when done */
+SM_API st_ret_t        storage_put_async(storage_t st, const char *type, const char *owner, os_t os, st_callback_t cb, void *arg);
+SM_API st_ret_t        storage_get_async(storage_t st, const char *type, const char *owner, const char *filter, st_callback_t cb, void *arg);
+SM_API st_ret_t        storage_count_async(storage_t st, const char *type, const char *owner, const char *filter, st_callback_t cb, void *arg);
+SM_API st_ret_t        storage_delete_async(storage_t st, const char *type, const char *owner, const char *filter, st_callback_t cb, void *arg);
+SM_API st_ret_t        storage_replace_async(storage_t st, const char *type, const char *owner, const char *filter, os_t os, st_callback_t cb, void *arg);
+
+/** deferred versions of put, replace and delete. the write is held back and goes out along with
+ *  others for the same owner, once enough have built up or a little time has passed. reads and
+ *  other writes for the owner send it first, so callers always see their own writes. a write that
+ *  fails is kept and tried again, so don't defer anything that must be stored before it's
+ *  acknowledged (like messages). the caller keeps the object set. objects given to a deferred
+ *  replace must match its filter */
+SM_API st_ret_t        storage_put_deferred(storage_t st, const char *type, const char *owner, os_t os);
+SM_API st_ret_t        storage_replace_deferred(storage_t st, const char *type, const char *owner, const char *filter, os_t os);
+SM_API st_ret_t        storage_delete_deferred(storage_t st, const char *type, const char *owner, const char *filter);
+/** write out all deferred writes now */
+SM_API void            storage_flush(storage_t st);
+
+/** hand a finished async request back to the main loop (drivers with a submit handler call this, from any thread) */
+SM_API void            storage_complete(st_op_t op);
+/** wait for all outstanding async requests, and run their callbacks */
+SM_API void            storage_drain(storage_t st);
+
+/** write a nad out the way the config asks for; the caller frees the buffer */
+SM_API void            storage_nad_encode(storage_t st, nad_t nad, char **buf, int *len);
+
 /** type for the driver init function */
 typedef st_ret_t (*st_driver_init_fn)(st_driver_t);
 
@@ -33,7 +33,103 @@
 #else
   #include <dlfcn.h>
 #endif /* _WIN32 */
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+# include <signal.h>
+#endif
+
+/** completed async requests, waiting to be delivered from the main loop */
+struct st_async_st {
+    st_op_t             head, tail;
+    int                 woken;          /**< a wakeup is already on its way */
+    int                 pending;        /**< requests submitted, but not delivered yet (main thread only) */
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;           /**< signalled as requests complete */
+    int                 wake[2];        /**< pipe the workers wake the main loop with */
+    mio_fd_t            wake_fd;
+#endif
+};
+
+#ifdef HAVE_PTHREAD_H
+/** a driver's worker threads */
+struct st_workers_st {
+    pthread_mutex_t     call;           /**< held around driver calls, unless the driver is threadsafe */
+
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    st_op_t             head, tail;     /**< requests waiting for a worker */
+    int                 stop;
+
+    pthread_t           *threads;
+    int                 nthreads;
+};
+
+static void _storage_workers_start(st_driver_t drv, int nthreads);
+static void _storage_workers_stop(st_driver_t drv);
+#endif
+
+/** a deferred write */
+typedef struct st_wb_op_st *st_wb_op_t;
+struct st_wb_op_st {
+    st_call_t           call;           /**< put, replace or delete */
+    char                *filter;
+    os_t                os;
+    int                 size;           /**< objects, or 1 for a delete */
+    st_wb_op_t          next;
+};
+
+/** deferred writes and the object count for one type/owner pair */
+typedef struct st_wb_st {
+    char                *key;           /**< "type owner" */
+    char                *type;
+    char                *owner;
+
+    st_wb_op_t          ops, last;      /**< writes waiting to go out, in order */
+    int                 nwaiting;       /**< objects and deletes waiting */
+
+    int                 count;          /**< objects stored, counting those waiting (-1 if we don't know) */
+    time_t              used;
+} *st_wb_t;
+
+/** deferred writes */
+struct st_batch_st {
+    xht                 wbs;            /**< st_wb_t, keyed by "type owner" */
+    int                 size;           /**< write a pair out once this much is waiting */
+    int                 interval;       /**< and write everything out this often (ms) */
+    void                *timer;
+
+    unsigned long       deferred;       /**< writes we held back */
+    unsigned long       written;        /**< driver calls they turned into */
+};
+
+/** pairs with nothing waiting are forgotten after this many seconds */
+#define ST_WB_IDLE  (60)
+
+/* union for xhash_iter_get to comply with strict-alias rules for gcc3 */
+union xhashv
+{
+  void **val;
+  st_wb_t *wb_val;
+};
+
+static void _storage_async_free(storage_t st);
+static void _storage_batch_free(storage_t st);
+
+/** hold off other threads while we're in the driver */
+static void _storage_call_lock(st_driver_t drv) {
+#ifdef HAVE_PTHREAD_H
+    if(drv->workers != NULL && !drv->threadsafe)
+        pthread_mutex_lock(&drv->workers->call);
+#endif
+}
 
+static void _storage_call_unlock(st_driver_t drv) {
+#ifdef HAVE_PTHREAD_H
+    if(drv->workers != NULL && !drv->threadsafe)
+        pthread_mutex_unlock(&drv->workers->call);
+#endif
+}
 
 storage_t storage_new(sm_t sm) {
     storage_t st;
@@ -48,6 +144,38 @@ storage_t storage_new(sm_t sm) {
     st->drivers = xhash_new(101);
     st->types = xhash_new(101);
 
+    st->async = (struct st_async_st *) calloc(1, sizeof(struct st_async_st));
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&st->async->lock, NULL);
+    pthread_cond_init(&st->async->cond, NULL);
+    st->async->wake[0] = st->async->wake[1] = -1;
+
+    st->threads = j_atoi(config_get_one(sm->config, "storage.threads", 0), 0);
+    if(st->threads > 0) {
+        if(pipe(st->async->wake) < 0) {
+            log_write(sm->log, LOG_ERR, "couldn't create storage wakeup pipe (%s), async requests will run in the main loop", strerror(errno));
+            st->async->wake[0] = st->async->wake[1] = -1;
+            st->threads = 0;
+        } else {
+            fcntl(st->async->wake[0], F_SETFL, O_NONBLOCK);
+            fcntl(st->async->wake[1], F_SETFL, O_NONBLOCK);
+        }
+    }
+#endif
+
+    /* write-behind */
+    i = j_atoi(config_get_one(sm->config, "storage.batch.size", 0), 100);
+    if(i > 0) {
+        st->batch = (struct st_batch_st *) calloc(1, sizeof(struct st_batch_st));
+        st->batch->wbs = xhash_new(1023);
+        st->batch->size = i;
+        st->batch->interval = j_atoi(config_get_one(sm->config, "storage.batch.interval", 0), 1000);
+    }
+
+    /* servers from before packed nads can't read them, so they're only written if asked for */
+    if(config_get(sm->config, "storage.packed-nads") != NULL)
+        st->packed_nads = 1;
+
     /* register types declared in the config file */
     elem = config_get(sm->config, "storage.driver");
     if(elem != NULL) {
@@ -56,7 +184,7 @@ storage_t storage_new(sm_t sm) {
             ret = storage_add_type(st, elem->values[i], type);
             /* Initialisation of storage type failed */
             if (ret != st_SUCCESS) {
-              free(st);
+              storage_free(st);
               return NULL;
             }
         }
@@ -68,6 +196,10 @@ storage_t storage_new(sm_t sm) {
 static void _st_driver_reaper(const char *driver, int driver_len, void *val, void *arg) {
     st_driver_t drv = (st_driver_t) val;
 
+#ifdef HAVE_PTHREAD_H
+    if (drv->workers != NULL) _storage_workers_stop(drv);
+#endif
+
     if (drv->free) (drv->free)(drv);
 
     if (drv->dlh != NULL) {
@@ -81,9 +213,14 @@ static void _st_driver_reaper(const char *driver, int driver_len, void *val, voi
 }
 
 void storage_free(storage_t st) {
+    /* get the deferred writes out while we still have drivers */
+    _storage_batch_free(st);
+
     /* close down drivers */
     xhash_walk(st->drivers, _st_driver_reaper, NULL);
 
+    _storage_async_free(st);
+
     xhash_free(st->drivers);
     xhash_free(st->types);
     free(st);
@@ -177,6 +314,12 @@ st_ret_t storage_add_type(storage_t st, const char *driver, const char *type) {
         xhash_put(st->drivers, drv->name, (void *) drv);
 
         log_write(st->sm->log, LOG_NOTICE, "initialised storage driver '%s'", driver);
+
+#ifdef HAVE_PTHREAD_H
+        /* workers for the async requests, unless the driver can do it without them */
+        if(st->threads > 0 && drv->submit == NULL)
+            _storage_workers_start(drv, st->threads);
+#endif
     }
 
     /* if its a default, set it up as such */
@@ -186,7 +329,11 @@ st_ret_t storage_add_type(storage_t st, const char *driver, const char *type) {
     }
 
     /* its a real type, so let the driver know */
-    if(type != NULL && (ret = (drv->add_type)(drv, type)) != st_SUCCESS) {
+    _storage_call_lock(drv);
+    ret = (drv->add_type)(drv, type);
+    _storage_call_unlock(drv);
+
+    if(ret != st_SUCCESS) {
         log_debug(ZONE, "driver '%s' can't handle '%s' data", driver, type);
         return ret;
     }
@@ -197,136 +344,900 @@ st_ret_t storage_add_type(storage_t st, const char *driver, const char *type) {
     return st_SUCCESS;
 }
 
-st_ret_t storage_put(storage_t st, const char *type, const char *owner, os_t os) {
+/** find the driver for a type, handing it to the default driver the first time we see it */
+static st_driver_t _storage_driver(storage_t st, const char *type, st_ret_t *ret) {
     st_driver_t drv;
-    st_ret_t ret;
-
-    log_debug(ZONE, "storage_put: type=%s owner=%s os=%X", type, owner, os);
 
     /* find the handler for this type */
     drv = xhash_get(st->types, type);
+    if(drv != NULL)
+        return drv;
+
+    /* never seen it before, so it goes to the default driver */
+    drv = st->default_drv;
     if(drv == NULL) {
-        /* never seen it before, so it goes to the default driver */
-        drv = st->default_drv;
-        if(drv == NULL) {
-            log_debug(ZONE, "no driver associated with type, and no default driver");
+        log_debug(ZONE, "no driver associated with type, and no default driver");
 
-            return st_NOTIMPL;
-        }
+        *ret = st_NOTIMPL;
+        return NULL;
+    }
+
+    /* register the type */
+    *ret = storage_add_type(st, drv->name, type);
+    if(*ret != st_SUCCESS)
+        return NULL;
+
+    return drv;
+}
+
+/** make the driver call for a request */
+static void _storage_run(st_op_t op) {
+    st_driver_t drv = op->drv;
+
+    _storage_call_lock(drv);
 
-        /* register the type */
-        ret = storage_add_type(st, drv->name, type);
-        if(ret != st_SUCCESS)
-            return ret;
+    switch(op->call) {
+        case st_call_PUT:
+            op->ret = (drv->put)(drv, op->type, op->owner, op->os);
+            break;
+
+        case st_call_GET:
+            op->ret = (drv->get)(drv, op->type, op->owner, op->filter, &op->os);
+            break;
+
+        case st_call_COUNT:
+            op->ret = ((drv->count != NULL) ? (drv->count)(drv, op->type, op->owner, op->filter, &op->count) : st_NOTIMPL);
+            break;
+
+        case st_call_DELETE:
+            op->ret = (drv->delete)(drv, op->type, op->owner, op->filter);
+            break;
+
+        case st_call_REPLACE:
+            op->ret = (drv->replace)(drv, op->type, op->owner, op->filter, op->os);
+            break;
     }
 
-    return (drv->put)(drv, type, owner, os);
+    _storage_call_unlock(drv);
 }
 
-st_ret_t storage_get(storage_t st, const char *type, const char *owner, const char *filter, os_t *os) {
-    st_driver_t drv;
+/** run a request right now, on the stack */
+static st_ret_t _storage_call(storage_t st, st_op_t op, st_call_t call, const char *type, const char *owner, const char *filter, os_t os) {
     st_ret_t ret;
 
-    log_debug(ZONE, "storage_get: type=%s owner=%s filter=%s", type, owner, filter);
+    memset(op, 0, sizeof(struct st_op_st));
 
-    /* find the handler for this type */
-    drv = xhash_get(st->types, type);
-    if(drv == NULL) {
-        /* never seen it before, so it goes to the default driver */
-        drv = st->default_drv;
-        if(drv == NULL) {
-            log_debug(ZONE, "no driver associated with type, and no default driver");
+    op->drv = _storage_driver(st, type, &ret);
+    if(op->drv == NULL)
+        return ret;
+
+    op->st = st;
+    op->call = call;
+    op->type = (char *) type;
+    op->owner = (char *) owner;
+    op->filter = (char *) filter;
+    op->os = os;
+
+    _storage_run(op);
+
+    return op->ret;
+}
+
+/** copy the objects from one set onto the end of another */
+static void _storage_os_append(os_t dst, os_t src) {
+    os_object_t so, o;
+    char *key;
+    void *val;
+    os_type_t type;
+
+    if(!os_iter_first(src))
+        return;
+
+    do {
+        so = os_iter_object(src);
+        o = os_object_new(dst);
+
+        if(os_object_iter_first(so))
+            do {
+                os_object_iter_get(so, &key, &val, &type);
+
+                /* ints come back in val itself, but go in by reference */
+                if(type == os_type_BOOLEAN || type == os_type_INTEGER)
+                    os_object_put(o, key, &val, type);
+                else
+                    os_object_put(o, key, val, type);
+            } while(os_object_iter_next(so));
+    } while(os_iter_next(src));
+}
+
+static st_wb_t _storage_wb_get(storage_t st, const char *type, const char *owner, int create) {
+    st_wb_t wb;
+    char key[4096];
+
+    snprintf(key, sizeof(key), "%s %s", type, owner);
+
+    wb = (st_wb_t) xhash_get(st->batch->wbs, key);
+    if(wb != NULL || !create)
+        return wb;
+
+    wb = (st_wb_t) calloc(1, sizeof(struct st_wb_st));
+    wb->key = strdup(key);
+    wb->type = strdup(type);
+    wb->owner = strdup(owner);
+    wb->count = -1;
+
+    xhash_put(st->batch->wbs, wb->key, (void *) wb);
+
+    return wb;
+}
+
+static st_wb_op_t _storage_wb_op(st_wb_t wb, st_call_t call, const char *filter) {
+    st_wb_op_t op;
+
+    op = (st_wb_op_t) calloc(1, sizeof(struct st_wb_op_st));
+    op->call = call;
+    if(filter != NULL) op->filter = strdup(filter);
+
+    if(wb->last != NULL)
+        wb->last->next = op;
+    else
+        wb->ops = op;
+    wb->last = op;
+
+    return op;
+}
+
+static void _storage_wb_op_free(st_wb_op_t op) {
+    if(op->filter != NULL) free(op->filter);
+    if(op->os != NULL) os_free(op->os);
+    free(op);
+}
+
+/** throw away waiting replaces and deletes with this filter (or everything waiting, if there's no filter), since a new write is about to undo them */
+static void _storage_wb_supersede(st_wb_t wb, const char *filter) {
+    st_wb_op_t op, prev = NULL, next;
+
+    for(op = wb->ops; op != NULL; op = next) {
+        next = op->next;
+
+        if(filter == NULL || (op->call != st_call_PUT && op->filter != NULL && strcmp(op->filter, filter) == 0)) {
+            if(prev != NULL)
+                prev->next = next;
+            else
+                wb->ops = next;
+            if(wb->last == op)
+                wb->last = prev;
+
+            wb->nwaiting -= op->size;
+            _storage_wb_op_free(op);
+            continue;
+        }
+
+        prev = op;
+    }
+}
+
+/** write out everything waiting for a pair. if a write fails, it and the ones behind it stay queued for the next try */
+static st_ret_t _storage_wb_write(storage_t st, st_wb_t wb) {
+    struct st_op_st sop;
+    st_wb_op_t op;
+    st_ret_t ret;
 
-            return st_NOTIMPL;
+    while((op = wb->ops) != NULL) {
+        ret = _storage_call(st, &sop, op->call, wb->type, wb->owner, op->filter, op->os);
+        st->batch->written++;
+
+        if(ret != st_SUCCESS && !(op->call == st_call_DELETE && ret == st_NOTFOUND)) {
+            log_write(st->sm->log, LOG_ERR, "storage: couldn't write out deferred %s for %s (%d), will try again", wb->type, wb->owner, ret);
+            wb->count = -1;
+            return st_FAILED;
         }
 
-        /* register the type */
-        ret = storage_add_type(st, drv->name, type);
-        if(ret != st_SUCCESS)
-            return ret;
+        wb->ops = op->next;
+        wb->nwaiting -= op->size;
+        _storage_wb_op_free(op);
+    }
+
+    wb->last = NULL;
+    wb->nwaiting = 0;
+
+    return st_SUCCESS;
+}
+
+static void _storage_wb_free(storage_t st, st_wb_t wb) {
+    _storage_wb_supersede(wb, NULL);
+
+    xhash_zap(st->batch->wbs, wb->key);
+
+    free(wb->key);
+    free(wb->type);
+    free(wb->owner);
+    free(wb);
+}
+
+/** write everything out, and forget pairs that haven't been used for a while */
+static int _storage_batch_timer(void *data1, void *data2) {
+    storage_t st = (storage_t) data1;
+    struct st_batch_st *b = st->batch;
+    st_wb_t wb;
+    time_t now = time(NULL);
+    union xhashv xhv;
+    int more;
+
+    b->timer = NULL;
+
+    xhv.wb_val = &wb;
+    more = xhash_iter_first(b->wbs);
+    while(more) {
+        xhash_iter_get(b->wbs, NULL, NULL, xhv.val);
+
+        if(wb->ops != NULL)
+            _storage_wb_write(st, wb);
+
+        if(wb->ops == NULL && wb->used + ST_WB_IDLE < now) {
+            /* zapping moves the iterator along for us */
+            _storage_wb_free(st, wb);
+            more = xhash_iter_get(b->wbs, NULL, NULL, xhv.val);
+        } else
+            more = xhash_iter_next(b->wbs);
     }
 
-    return (drv->get)(drv, type, owner, filter, os);
+    if(xhash_count(b->wbs) > 0 && st->sm->mio != NULL)
+        b->timer = mio_add_timeout(st->sm->mio, _storage_batch_timer, (void *) st, NULL, b->interval);
+
+    return 0;
+}
+
+/** a deferred write was added to this pair; send it now if enough is waiting, or make sure it goes later */
+static st_ret_t _storage_batch_queued(storage_t st, st_wb_t wb) {
+    struct st_batch_st *b = st->batch;
+
+    b->deferred++;
+    wb->used = time(NULL);
+
+    if(wb->nwaiting >= b->size && _storage_wb_write(st, wb) == st_SUCCESS)
+        return st_SUCCESS;
+
+    if(b->timer == NULL)
+        b->timer = mio_add_timeout(st->sm->mio, _storage_batch_timer, (void *) st, NULL, b->interval);
+
+    return st_SUCCESS;
+}
+
+/** called before every other request. writes out what's waiting for the pair, and keeps the count straight. fails if that can't be done, so nothing overtakes the waiting writes */
+static st_ret_t _storage_batch_sync(storage_t st, st_call_t call, const char *type, const char *owner, const char *filter, os_t os) {
+    st_wb_t wb;
+
+    if(st->batch == NULL || owner == NULL || xhash_count(st->batch->wbs) == 0)
+        return st_SUCCESS;
+
+    wb = _storage_wb_get(st, type, owner, 0);
+    if(wb == NULL)
+        return st_SUCCESS;
+
+    wb->used = time(NULL);
+
+    switch(call) {
+        case st_call_DELETE:
+            /* everything is going, so there's no point writing it first */
+            if(filter == NULL) {
+                _storage_wb_supersede(wb, NULL);
+                wb->count = 0;
+                return st_SUCCESS;
+            }
+
+            wb->count = -1;
+            break;
+
+        case st_call_REPLACE:
+            wb->count = -1;
+            break;
+
+        case st_call_PUT:
+            if(wb->count >= 0)
+                wb->count += os_count(os);
+            break;
+
+        default:
+            break;
+    }
+
+    if(wb->ops != NULL)
+        return _storage_wb_write(st, wb);
+
+    return st_SUCCESS;
+}
+
+/** remember (or forget, with -1) how many objects a pair has */
+static void _storage_batch_count(storage_t st, const char *type, const char *owner, int count) {
+    st_wb_t wb;
+
+    if(st->batch == NULL || owner == NULL)
+        return;
+
+    wb = _storage_wb_get(st, type, owner, count >= 0);
+    if(wb == NULL)
+        return;
+
+    wb->count = count;
+    wb->used = time(NULL);
+
+    /* make sure it gets forgotten eventually */
+    if(st->batch->timer == NULL && st->sm->mio != NULL)
+        st->batch->timer = mio_add_timeout(st->sm->mio, _storage_batch_timer, (void *) st, NULL, st->batch->interval);
+}
+
+st_ret_t storage_put(storage_t st, const char *type, const char *owner, os_t os) {
+    struct st_op_st op;
+
+    st_ret_t ret;
+
+    log_debug(ZONE, "storage_put: type=%s owner=%s os=%X", type, owner, os);
+
+    if(_storage_batch_sync(st, st_call_PUT, type, owner, NULL, os) != st_SUCCESS)
+        return st_FAILED;
+
+    ret = _storage_call(st, &op, st_call_PUT, type, owner, NULL, os);
+    if(ret != st_SUCCESS)
+        _storage_batch_count(st, type, owner, -1);
+
+    return ret;
+}
+
+st_ret_t storage_get(storage_t st, const char *type, const char *owner, const char *filter, os_t *os) {
+    struct st_op_st op;
+    st_ret_t ret;
+
+    log_debug(ZONE, "storage_get: type=%s owner=%s filter=%s", type, owner, filter);
+
+    if(_storage_batch_sync(st, st_call_GET, type, owner, filter, NULL) != st_SUCCESS) {
+        *os = NULL;
+        return st_FAILED;
+    }
+
+    ret = _storage_call(st, &op, st_call_GET, type, owner, filter, NULL);
+    *os = op.os;
+
+    return ret;
 }
 
 st_ret_t storage_count(storage_t st, const char *type, const char *owner, const char *filter, int *count) {
-    st_driver_t drv;
+    struct st_op_st op;
     st_ret_t ret;
+    st_wb_t wb;
 
     log_debug(ZONE, "storage_count: type=%s owner=%s filter=%s", type, owner, filter);
 
-    /* find the handler for this type */
-    drv = xhash_get(st->types, type);
-    if(drv == NULL) {
-        /* never seen it before, so it goes to the default driver */
-        drv = st->default_drv;
-        if(drv == NULL) {
-            log_debug(ZONE, "no driver associated with type, and no default driver");
-            return st_NOTIMPL;
-        }
+    /* we might know already */
+    if(filter == NULL && st->batch != NULL && owner != NULL && (wb = _storage_wb_get(st, type, owner, 0)) != NULL && wb->count >= 0) {
+        wb->used = time(NULL);
+        *count = wb->count;
+        return st_SUCCESS;
+    }
+
+    if(_storage_batch_sync(st, st_call_COUNT, type, owner, filter, NULL) != st_SUCCESS)
+        return st_FAILED;
+
+    ret = _storage_call(st, &op, st_call_COUNT, type, owner, filter, NULL);
+    if(op.drv != NULL)
+        *count = op.count;
+
+    if(ret == st_SUCCESS && filter == NULL)
+        _storage_batch_count(st, type, owner, op.count);
+
+    return ret;
+}
+
+st_ret_t storage_delete(storage_t st, const char *type, const char *owner, const char *filter) {
+    struct st_op_st op;
+
+    log_debug(ZONE, "storage_zap: type=%s owner=%s filter=%s", type, owner, filter);
+
+    if(_storage_batch_sync(st, st_call_DELETE, type, owner, filter, NULL) != st_SUCCESS)
+        return st_FAILED;
+
+    return _storage_call(st, &op, st_call_DELETE, type, owner, filter, NULL);
+}
+
+st_ret_t storage_replace(storage_t st, const char *type, const char *owner, const char *filter, os_t os) {
+    struct st_op_st op;
+
+    log_debug(ZONE, "storage_replace: type=%s owner=%s filter=%s os=%X", type, owner, filter, os);
+
+    if(_storage_batch_sync(st, st_call_REPLACE, type, owner, filter, os) != st_SUCCESS)
+        return st_FAILED;
+
+    return _storage_call(st, &op, st_call_REPLACE, type, owner, filter, os);
+}
+
+st_ret_t storage_put_deferred(storage_t st, const char *type, const char *owner, os_t os) {
+    st_wb_t wb;
+    st_wb_op_t op;
+    st_ret_t ret;
+
+    log_debug(ZONE, "storage_put_deferred: type=%s owner=%s os=%X", type, owner, os);
+
+    if(st->batch == NULL || st->sm->mio == NULL)
+        return storage_put(st, type, owner, os);
+
+    /* tell them now if there's nowhere for it to go */
+    if(_storage_driver(st, type, &ret) == NULL)
+        return ret;
+
+    wb = _storage_wb_get(st, type, owner, 1);
 
-        /* register the type */
-        ret = storage_add_type(st, drv->name, type);
-        if(ret != st_SUCCESS)
-            return ret;
+    /* a run of puts goes out as one */
+    op = wb->last;
+    if(op == NULL || op->call != st_call_PUT) {
+        op = _storage_wb_op(wb, st_call_PUT, NULL);
+        op->os = os_new();
     }
 
-    return ((drv->count != NULL) ? (drv->count)(drv, type, owner, filter, count) : st_NOTIMPL);
+    _storage_os_append(op->os, os);
+    op->size += os_count(os);
+
+    wb->nwaiting += os_count(os);
+    if(wb->count >= 0)
+        wb->count += os_count(os);
+
+    return _storage_batch_queued(st, wb);
 }
 
+st_ret_t storage_replace_deferred(storage_t st, const char *type, const char *owner, const char *filter, os_t os) {
+    st_wb_t wb;
+    st_wb_op_t op;
+    st_ret_t ret;
 
-st_ret_t storage_delete(storage_t st, const char *type, const char *owner, const char *filter) {
-    st_driver_t drv;
+    log_debug(ZONE, "storage_replace_deferred: type=%s owner=%s filter=%s os=%X", type, owner, filter, os);
+
+    if(st->batch == NULL || st->sm->mio == NULL)
+        return storage_replace(st, type, owner, filter, os);
+
+    if(_storage_driver(st, type, &ret) == NULL)
+        return ret;
+
+    wb = _storage_wb_get(st, type, owner, 1);
+
+    /* only the last replace for a filter matters */
+    _storage_wb_supersede(wb, filter);
+
+    op = _storage_wb_op(wb, st_call_REPLACE, filter);
+    op->os = os_new();
+    _storage_os_append(op->os, os);
+    op->size = os_count(os) + 1;
+
+    wb->nwaiting += op->size;
+    wb->count = (filter == NULL) ? os_count(os) : -1;
+
+    return _storage_batch_queued(st, wb);
+}
+
+st_ret_t storage_delete_deferred(storage_t st, const char *type, const char *owner, const char *filter) {
+    st_wb_t wb;
+    st_wb_op_t op;
     st_ret_t ret;
 
-    log_debug(ZONE, "storage_zap: type=%s owner=%s filter=%s", type, owner, filter);
+    log_debug(ZONE, "storage_zap_deferred: type=%s owner=%s filter=%s", type, owner, filter);
 
-    /* find the handler for this type */
-    drv = xhash_get(st->types, type);
-    if(drv == NULL) {
-        /* never seen it before, so it goes to the default driver */
-        drv = st->default_drv;
-        if(drv == NULL) {
-            log_debug(ZONE, "no driver associated with type, and no default driver");
+    if(st->batch == NULL || st->sm->mio == NULL)
+        return storage_delete(st, type, owner, filter);
+
+    if(_storage_driver(st, type, &ret) == NULL)
+        return ret;
+
+    wb = _storage_wb_get(st, type, owner, 1);
+
+    _storage_wb_supersede(wb, filter);
+
+    op = _storage_wb_op(wb, st_call_DELETE, filter);
+    op->size = 1;
+
+    wb->nwaiting += op->size;
+    wb->count = (filter == NULL) ? 0 : -1;
+
+    return _storage_batch_queued(st, wb);
+}
+
+void storage_flush(storage_t st) {
+    st_wb_t wb;
+    union xhashv xhv;
+
+    if(st->batch == NULL)
+        return;
+
+    xhv.wb_val = &wb;
+    if(xhash_iter_first(st->batch->wbs))
+        do {
+            xhash_iter_get(st->batch->wbs, NULL, NULL, xhv.val);
 
-            return st_NOTIMPL;
+            if(wb->ops != NULL)
+                _storage_wb_write(st, wb);
+        } while(xhash_iter_next(st->batch->wbs));
+}
+
+static void _storage_batch_free(storage_t st) {
+    st_wb_t wb;
+    union xhashv xhv;
+    int more;
+
+    if(st->batch == NULL)
+        return;
+
+    storage_flush(st);
+
+    if(st->batch->deferred > 0)
+        log_write(st->sm->log, LOG_NOTICE, "storage: %lu deferred writes went out in %lu driver calls", st->batch->deferred, st->batch->written);
+
+    /* the timer went with mio. zapping moves the iterator along */
+    xhv.wb_val = &wb;
+    more = xhash_iter_first(st->batch->wbs);
+    while(more) {
+        xhash_iter_get(st->batch->wbs, NULL, NULL, xhv.val);
+        if(wb->ops != NULL)
+            log_write(st->sm->log, LOG_ERR, "storage: couldn't write out deferred %s for %s before shutting down, %d objects have been lost", wb->type, wb->owner, wb->nwaiting);
+        _storage_wb_free(st, wb);
+        more = xhash_iter_get(st->batch->wbs, NULL, NULL, xhv.val);
+    }
+
+    xhash_free(st->batch->wbs);
+    free(st->batch);
+    st->batch = NULL;
+}
+
+/** hand out completed requests */
+static void _storage_deliver(storage_t st) {
+    struct st_async_st *a = st->async;
+    st_op_t op, next;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&a->lock);
+#endif
+    op = a->head;
+    a->head = a->tail = NULL;
+    a->woken = 0;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&a->lock);
+#endif
+
+    for(; op != NULL; op = next) {
+        next = op->next;
+        a->pending--;
+
+        log_debug(ZONE, "storage request %d for %s/%s done: %d", op->call, op->type, op->owner, op->ret);
+
+        if(op->call == st_call_GET) {
+            if(op->ret != st_SUCCESS && op->os != NULL) {
+                os_free(op->os);
+                op->os = NULL;
+            }
+
+            /* the objects are the callback's now */
+            if(op->cb != NULL)
+                (op->cb)(op->ret, op->os, op->count, op->arg);
+            else if(op->os != NULL)
+                os_free(op->os);
+        } else {
+            if(op->cb != NULL)
+                (op->cb)(op->ret, NULL, op->count, op->arg);
+            if(op->os != NULL)
+                os_free(op->os);
         }
 
-        /* register the type */
-        ret = storage_add_type(st, drv->name, type);
-        if(ret != st_SUCCESS)
-            return ret;
+        free(op->type);
+        if(op->owner != NULL) free(op->owner);
+        if(op->filter != NULL) free(op->filter);
+        free(op);
+    }
+}
+
+static int _storage_deliver_immed(void *data1, void *data2) {
+    _storage_deliver((storage_t) data1);
+    return 0;
+}
+
+#ifdef HAVE_PTHREAD_H
+static int _storage_wake_mio_callback(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+    char buf[64];
+
+    if(a != action_READ)
+        return 0;
+
+    /* clear the wakeups out first, anything finishing after this wakes us again */
+    while(read(fd->fd, buf, sizeof(buf)) > 0);
+
+    _storage_deliver((storage_t) arg);
+
+    return 1;
+}
+#endif
+
+void storage_complete(st_op_t op) {
+    struct st_async_st *a = op->st->async;
+
+    op->next = NULL;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&a->lock);
+#endif
+
+    if(a->tail != NULL)
+        a->tail->next = op;
+    else
+        a->head = op;
+    a->tail = op;
+
+    if(!a->woken) {
+#ifdef HAVE_PTHREAD_H
+        if(a->wake[1] >= 0) {
+            a->woken = 1;
+            if(write(a->wake[1], "", 1) < 0)
+                log_debug(ZONE, "storage wakeup failed: %s", strerror(errno));
+        } else
+#endif
+        if(op->st->sm->mio != NULL) {
+            a->woken = 1;
+            mio_add_immed_timeout(op->st->sm->mio, _storage_deliver_immed, op->st, NULL);
+        }
     }
 
-    return (drv->delete)(drv, type, owner, filter);
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_signal(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+#endif
 }
 
-st_ret_t storage_replace(storage_t st, const char *type, const char *owner, const char *filter, os_t os) {
+/** queue up an async request */
+static st_ret_t _storage_submit(storage_t st, st_call_t call, const char *type, const char *owner, const char *filter, os_t os, st_callback_t cb, void *arg) {
     st_driver_t drv;
+    st_op_t op;
     st_ret_t ret;
 
-    log_debug(ZONE, "storage_replace: type=%s owner=%s filter=%s os=%X", type, owner, filter, os);
+    drv = _storage_driver(st, type, &ret);
+    if(drv == NULL)
+        return ret;
 
-    /* find the handler for this type */
-    drv = xhash_get(st->types, type);
-    if(drv == NULL) {
-        /* never seen it before, so it goes to the default driver */
-        drv = st->default_drv;
-        if(drv == NULL) {
-            log_debug(ZONE, "no driver associated with type, and no default driver");
+    /* deferred writes go first. we won't know how an async put went, so stop counting */
+    if(_storage_batch_sync(st, call, type, owner, filter, os) != st_SUCCESS)
+        return st_FAILED;
+    if(call == st_call_PUT)
+        _storage_batch_count(st, type, owner, -1);
+
+    op = (st_op_t) calloc(1, sizeof(struct st_op_st));
+    op->st = st;
+    op->drv = drv;
+    op->call = call;
+    op->type = strdup(type);
+    if(owner != NULL) op->owner = strdup(owner);
+    if(filter != NULL) op->filter = strdup(filter);
+    op->os = os;
+    op->cb = cb;
+    op->arg = arg;
+
+    st->async->pending++;
+
+#ifdef HAVE_PTHREAD_H
+    /* completions come back through the wakeup pipe if there is one, so make sure we're listening */
+    if(st->async->wake[0] >= 0 && st->async->wake_fd == NULL && st->sm->mio != NULL) {
+        st->async->wake_fd = mio_register(st->sm->mio, st->async->wake[0], _storage_wake_mio_callback, (void *) st);
+        mio_read(st->sm->mio, st->async->wake_fd);
+    }
+#endif
 
-            return st_NOTIMPL;
-        }
+    /* drivers that can do it themselves */
+    if(drv->submit != NULL) {
+        (drv->submit)(drv, op);
+        return st_SUCCESS;
+    }
 
-        /* register the type */
-        ret = storage_add_type(st, drv->name, type);
-        if(ret != st_SUCCESS)
-            return ret;
+#ifdef HAVE_PTHREAD_H
+    if(drv->workers != NULL) {
+        pthread_mutex_lock(&drv->workers->lock);
+        if(drv->workers->tail != NULL)
+            drv->workers->tail->next = op;
+        else
+            drv->workers->head = op;
+        drv->workers->tail = op;
+        pthread_cond_signal(&drv->workers->cond);
+        pthread_mutex_unlock(&drv->workers->lock);
+
+        return st_SUCCESS;
     }
+#endif
+
+    /* nobody to pass it to, so do it now - the callback still comes from the main loop */
+    _storage_run(op);
+    storage_complete(op);
+
+    return st_SUCCESS;
+}
+
+st_ret_t storage_put_async(storage_t st, const char *type, const char *owner, os_t os, st_callback_t cb, void *arg) {
+    log_debug(ZONE, "storage_put_async: type=%s owner=%s os=%X", type, owner, os);
 
-    return (drv->replace)(drv, type, owner, filter, os);
+    return _storage_submit(st, st_call_PUT, type, owner, NULL, os, cb, arg);
 }
 
+st_ret_t storage_get_async(storage_t st, const char *type, const char *owner, const char *filter, st_callback_t cb, void *arg) {
+    log_debug(ZONE, "storage_get_async: type=%s owner=%s filter=%s", type, owner, filter);
+
+    return _storage_submit(st, st_call_GET, type, owner, filter, NULL, cb, arg);
+}
+
+st_ret_t storage_count_async(storage_t st, const char *type, const char *owner, const char *filter, st_callback_t cb, void *arg) {
+    log_debug(ZONE, "storage_count_async: type=%s owner=%s filter=%s", type, owner, filter);
+
+    return _storage_submit(st, st_call_COUNT, type, owner, filter, NULL, cb, arg);
+}
+
+st_ret_t storage_delete_async(storage_t st, const char *type, const char *owner, const char *filter, st_callback_t cb, void *arg) {
+    log_debug(ZONE, "storage_zap_async: type=%s owner=%s filter=%s", type, owner, filter);
+
+    return _storage_submit(st, st_call_DELETE, type, owner, filter, NULL, cb, arg);
+}
+
+st_ret_t storage_replace_async(storage_t st, const char *type, const char *owner, const char *filter, os_t os, st_callback_t cb, void *arg) {
+    log_debug(ZONE, "storage_replace_async: type=%s owner=%s filter=%s os=%X", type, owner, filter, os);
+
+    return _storage_submit(st, st_call_REPLACE, type, owner, filter, os, cb, arg);
+}
+
+void storage_drain(storage_t st) {
+    struct st_async_st *a = st->async;
+    st_driver_t drv;
+
+    log_debug(ZONE, "waiting for %d storage requests", a->pending);
+
+    /* some drivers need a hand to get their requests finished without the main loop */
+    if(xhash_iter_first(st->drivers))
+        do {
+            xhash_iter_get(st->drivers, NULL, NULL, (void *) &drv);
+            if(drv->drain != NULL)
+                (drv->drain)(drv);
+        } while(xhash_iter_next(st->drivers));
+
+    while(a->pending > 0) {
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_lock(&a->lock);
+        while(a->head == NULL)
+            pthread_cond_wait(&a->cond, &a->lock);
+        pthread_mutex_unlock(&a->lock);
+#else
+        if(a->head == NULL)
+            break;
+#endif
+
+        _storage_deliver(st);
+    }
+}
+
+/** anything not delivered by now is just thrown away */
+static void _storage_async_free(storage_t st) {
+    struct st_async_st *a = st->async;
+    st_op_t op;
+
+    while((op = a->head) != NULL) {
+        a->head = op->next;
+
+        if(op->os != NULL)
+            os_free(op->os);
+        free(op->type);
+        if(op->owner != NULL) free(op->owner);
+        if(op->filter != NULL) free(op->filter);
+        free(op);
+    }
+
+#ifdef HAVE_PTHREAD_H
+    if(a->wake[0] >= 0) close(a->wake[0]);
+    if(a->wake[1] >= 0) close(a->wake[1]);
+
+    pthread_cond_destroy(&a->cond);
+    pthread_mutex_destroy(&a->lock);
+#endif
+
+    free(a);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *_storage_worker(void *arg) {
+    st_driver_t drv = (st_driver_t) arg;
+    struct st_workers_st *w = drv->workers;
+    st_op_t op;
+
+    if(drv->thread_init != NULL)
+        (drv->thread_init)(drv);
+
+    pthread_mutex_lock(&w->lock);
+    while(1) {
+        while(w->head == NULL && !w->stop)
+            pthread_cond_wait(&w->cond, &w->lock);
+
+        /* we finish what's queued before stopping */
+        if((op = w->head) == NULL)
+            break;
+
+        w->head = op->next;
+        if(w->head == NULL)
+            w->tail = NULL;
+
+        pthread_mutex_unlock(&w->lock);
+
+        _storage_run(op);
+        storage_complete(op);
+
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    if(drv->thread_free != NULL)
+        (drv->thread_free)(drv);
+
+    /* the blocks and nads we kept would be lost with the thread */
+    pool_cache_free();
+    nad_cache_free();
+
+    return NULL;
+}
+
+static void _storage_workers_start(st_driver_t drv, int nthreads) {
+    struct st_workers_st *w;
+    sigset_t all, old;
+    int i;
+
+    /* they'd only take turns */
+    if(!drv->threadsafe)
+        nthreads = 1;
+
+    w = (struct st_workers_st *) calloc(1, sizeof(struct st_workers_st));
+    pthread_mutex_init(&w->call, NULL);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+
+    drv->workers = w;
+
+    /* signals are for the main loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    for(i = 0; i < nthreads; i++) {
+        if(pthread_create(&w->threads[i], NULL, _storage_worker, (void *) drv) != 0)
+            break;
+        w->nthreads++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if(w->nthreads == 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "couldn't start worker threads for storage driver '%s', async requests will run in the main loop", drv->name);
+        _storage_workers_stop(drv);
+        return;
+    }
+
+    log_write(drv->st->sm->log, LOG_NOTICE, "started %d worker thread(s) for storage driver '%s'", w->nthreads, drv->name);
+}
+
+static void _storage_workers_stop(st_driver_t drv) {
+    struct st_workers_st *w = drv->workers;
+    int i;
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    for(i = 0; i < w->nthreads; i++)
+        pthread_join(w->threads[i], NULL);
+
+    drv->workers = NULL;
+
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    pthread_mutex_destroy(&w->call);
+    free(w->threads);
+    free(w);
+}
+#endif
+
 static st_filter_t _storage_filter(pool_t p, const char *f, int len) {
     char *c, *key, *val, *sub;
     int vallen;
@@ -415,6 +1326,20 @@ static st_filter_t _storage_filter(pool_t p, const char *f, int len) {
     return res;
 }
 
+void storage_nad_encode(storage_t st, nad_t nad, char **buf, int *len) {
+    char *xml;
+
+    if(st->packed_nads) {
+        nad_encode(nad, buf, len);
+        return;
+    }
+
+    nad_print(nad, 0, &xml, len);
+    *buf = (char *) malloc(*len + 1);
+    memcpy(*buf, xml, *len);
+    (*buf)[*len] = '\0';
+}
+
 st_filter_t storage_filter(const char *filter) {
     pool_t p;
     st_filter_t f;
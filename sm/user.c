@@ -48,17 +48,64 @@ static user_t _user_alloc(sm_t sm, jid_t jid) {
     return user;
 }
 
+/** take a user out of the cache */
+static void _user_cache_unlink(user_t user) {
+    sm_t sm = user->sm;
+
+    if(user->cache_prev != NULL)
+        user->cache_prev->cache_next = user->cache_next;
+    else
+        sm->ucache_head = user->cache_next;
+
+    if(user->cache_next != NULL)
+        user->cache_next->cache_prev = user->cache_prev;
+    else
+        sm->ucache_tail = user->cache_prev;
+
+    user->cache_prev = user->cache_next = NULL;
+    user->cached = 0;
+
+    sm->ucache_count--;
+    sm->ucache_bytes -= user->cache_bytes;
+}
+
+/** roughly how much memory a user is using */
+static int _user_bytes(user_t user) {
+    int bytes = pool_size(user->p);
+
+    if(user->roster != NULL)
+        bytes += pool_size(xhash_pool(user->roster));
+
+    return bytes;
+}
+
 /** fetch user data */
 user_t user_load(sm_t sm, jid_t jid) {
     user_t user;
 
     /* already loaded */
     user = xhash_get(sm->users, jid_user(jid));
+    if(user != NULL && user->cached && user->cache_time + sm->ucache_ttl < time(NULL)) {
+        log_debug(ZONE, "cached user data for %s is too old, reloading", jid_user(jid));
+        sm->ucache_evictions++;
+        user_free(user);
+        user = NULL;
+    }
+
     if(user != NULL) {
+        if(user->cached) {
+            log_debug(ZONE, "returning cached user data for %s", jid_user(jid));
+            _user_cache_unlink(user);
+            sm->ucache_hits++;
+            return user;
+        }
+
         log_debug(ZONE, "returning previously-created user data for %s", jid_user(jid));
         return user;
     }
 
+    sm->ucache_misses++;
+
     /* make a new one */
     user = _user_alloc(sm, jid);
 
@@ -80,10 +127,72 @@ user_t user_load(sm_t sm, jid_t jid) {
 void user_free(user_t user) {
     log_debug(ZONE, "freeing user %s", jid_user(user->jid));
 
+    if(user->cached)
+        _user_cache_unlink(user);
+
     xhash_zap(user->sm->users, jid_user(user->jid));
     pool_free(user->p);
 }
 
+void user_unload(user_t user) {
+    sm_t sm = user->sm;
+    time_t now;
+
+    /* still in use, or already kept */
+    if(user->sessions != NULL || user->cached)
+        return;
+
+    if(sm->ucache_max <= 0) {
+        user_free(user);
+        return;
+    }
+
+    log_debug(ZONE, "keeping user %s in the cache", jid_user(user->jid));
+
+    now = time(NULL);
+
+    user->cached = 1;
+    user->cache_time = now;
+    user->cache_bytes = _user_bytes(user);
+
+    user->cache_prev = NULL;
+    user->cache_next = sm->ucache_head;
+    if(sm->ucache_head != NULL)
+        sm->ucache_head->cache_prev = user;
+    else
+        sm->ucache_tail = user;
+    sm->ucache_head = user;
+
+    sm->ucache_count++;
+    sm->ucache_bytes += user->cache_bytes;
+
+    /* make room, oldest first */
+    while(sm->ucache_tail != NULL && (sm->ucache_count > sm->ucache_max || sm->ucache_bytes > sm->ucache_max_bytes || sm->ucache_tail->cache_time + sm->ucache_ttl < now)) {
+        log_debug(ZONE, "dropping user %s from the cache", jid_user(sm->ucache_tail->jid));
+        sm->ucache_evictions++;
+        user_free(sm->ucache_tail);
+    }
+}
+
+void user_invalidate(sm_t sm, jid_t jid) {
+    user_t user;
+
+    user = xhash_get(sm->users, jid_user(jid));
+    if(user == NULL || user->sessions != NULL)
+        return;
+
+    log_debug(ZONE, "invalidating user data for %s", jid_user(jid));
+
+    user_free(user);
+}
+
+void user_cache_free(sm_t sm) {
+    log_write(sm->log, LOG_INFO, "user cache: %lu hits, %lu misses, %lu evictions, %d users (%d bytes) left", sm->ucache_hits, sm->ucache_misses, sm->ucache_evictions, sm->ucache_count, sm->ucache_bytes);
+
+    while(sm->ucache_head != NULL)
+        user_free(sm->ucache_head);
+}
+
 /** initialise a user */
 int user_create(sm_t sm, jid_t jid) {
     user_t user;
@@ -141,5 +250,8 @@ void user_delete(sm_t sm, jid_t jid) {
 
     mm_user_delete(sm->mm, jid);
 
+    /* their data is gone, so don't keep it around */
+    user_invalidate(sm, jid);
+
     log_write(sm->log, LOG_NOTICE, "deleted user: jid=%s", jid_user(jid));
 }
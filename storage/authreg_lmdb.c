@@ -0,0 +1,281 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002 Jeremie Miller, Thomas Muldowney,
+ *                    Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+/* this module uses lmdb to store the auth credentials */
+
+/*
+ * all realms share one named database. the key is the username, a nul, then
+ * the realm; the value is the password with its nul. registrations are rare
+ * enough that every write waits for the disk.
+ */
+
+#include "c2s.h"
+#include <lmdb.h>
+
+/** internal structure, holds our data */
+typedef struct moddata_st
+{
+    MDB_env *env;
+    MDB_dbi dbi;
+} *moddata_t;
+
+/** build the key for this user, returns a buffer for the caller to free */
+static char *_ar_lmdb_key(MDB_val *key, char *username, char *realm)
+{
+    int ulen = strlen(username), rlen = strlen(realm);
+    char *buf;
+
+    buf = (char *) malloc(ulen + 1 + rlen);
+    memcpy(buf, username, ulen + 1);
+    memcpy(buf + ulen + 1, realm, rlen);
+
+    key->mv_data = buf;
+    key->mv_size = ulen + 1 + rlen;
+
+    return buf;
+}
+
+/** pull a user's password out of the db, 0 if found, 1 if not, -1 on error */
+static int _ar_lmdb_fetch_user(authreg_t ar, char *username, char *realm, char password[257])
+{
+    moddata_t data = (moddata_t) ar->private;
+    MDB_txn *txn;
+    MDB_val key, val;
+    char *kbuf;
+    int err;
+
+    log_debug(ZONE, "fetching auth creds for user '%s' realm '%s'", username, realm);
+
+    err = mdb_txn_begin(data->env, NULL, MDB_RDONLY, &txn);
+    if(err != 0)
+    {
+        log_write(ar->c2s->log, LOG_ERR, "lmdb: couldn't begin transaction: %s", mdb_strerror(err));
+        return -1;
+    }
+
+    kbuf = _ar_lmdb_key(&key, username, realm);
+
+    err = mdb_get(txn, data->dbi, &key, &val);
+    if(err == 0 && password != NULL)
+    {
+        /* the value lives in the map, so copy it out before the txn goes away */
+        if(val.mv_size > 257)
+            val.mv_size = 257;
+        memcpy(password, val.mv_data, val.mv_size);
+        password[val.mv_size > 0 ? val.mv_size - 1 : 0] = '\0';
+    }
+
+    mdb_txn_abort(txn);
+    free(kbuf);
+
+    if(err == MDB_NOTFOUND)
+        return 1;
+
+    if(err != 0)
+    {
+        log_write(ar->c2s->log, LOG_ERR, "lmdb: couldn't fetch auth creds for user '%s' (realm '%s'): %s", username, realm, mdb_strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+/** store the user into the db, or take them out if password is NULL */
+static int _ar_lmdb_store_user(authreg_t ar, char *username, char *realm, char *password)
+{
+    moddata_t data = (moddata_t) ar->private;
+    MDB_txn *txn;
+    MDB_val key, val;
+    char *kbuf;
+    int err;
+
+    log_debug(ZONE, "%s auth creds for user '%s' realm '%s'", password != NULL ? "storing" : "deleting", username, realm);
+
+    err = mdb_txn_begin(data->env, NULL, 0, &txn);
+    if(err != 0)
+    {
+        log_write(ar->c2s->log, LOG_ERR, "lmdb: couldn't begin transaction: %s", mdb_strerror(err));
+        return 1;
+    }
+
+    kbuf = _ar_lmdb_key(&key, username, realm);
+
+    if(password != NULL)
+    {
+        val.mv_data = password;
+        val.mv_size = strlen(password) + 1;
+
+        err = mdb_put(txn, data->dbi, &key, &val, 0);
+    }
+    else
+        err = mdb_del(txn, data->dbi, &key, NULL);
+
+    free(kbuf);
+
+    if(err != 0)
+    {
+        log_write(ar->c2s->log, LOG_ERR, "lmdb: couldn't %s auth creds for user '%s' (realm '%s'): %s", password != NULL ? "store" : "delete", username, realm, mdb_strerror(err));
+        mdb_txn_abort(txn);
+        return 1;
+    }
+
+    err = mdb_txn_commit(txn);
+    if(err != 0)
+    {
+        log_write(ar->c2s->log, LOG_ERR, "lmdb: couldn't commit auth creds for user '%s' (realm '%s'): %s", username, realm, mdb_strerror(err));
+        return 1;
+    }
+
+    return 0;
+}
+
+static int _ar_lmdb_user_exists(authreg_t ar, char *username, char *realm)
+{
+    return _ar_lmdb_fetch_user(ar, username, realm, NULL) == 0;
+}
+
+static int _ar_lmdb_get_password(authreg_t ar, char *username, char *realm, char password[257])
+{
+    if(_ar_lmdb_fetch_user(ar, username, realm, password) != 0)
+        return 1;
+
+    return 0;
+}
+
+static int _ar_lmdb_check_password(authreg_t ar, char *username, char *realm, char password[257])
+{
+    char db_pw[257];
+
+    if(_ar_lmdb_fetch_user(ar, username, realm, db_pw) != 0)
+        return 1;
+
+    return (strcmp(password, db_pw) == 0) ? 0 : 1;
+}
+
+static int _ar_lmdb_set_password(authreg_t ar, char *username, char *realm, char password[257])
+{
+    if(_ar_lmdb_fetch_user(ar, username, realm, NULL) != 0)
+        return 1;
+
+    return _ar_lmdb_store_user(ar, username, realm, password);
+}
+
+static int _ar_lmdb_create_user(authreg_t ar, char *username, char *realm)
+{
+    /* only if they're definitely not there */
+    if(_ar_lmdb_fetch_user(ar, username, realm, NULL) != 1)
+        return 1;
+
+    return _ar_lmdb_store_user(ar, username, realm, "");
+}
+
+static int _ar_lmdb_delete_user(authreg_t ar, char *username, char *realm)
+{
+    if(_ar_lmdb_fetch_user(ar, username, realm, NULL) != 0)
+        return 1;
+
+    return _ar_lmdb_store_user(ar, username, realm, NULL);
+}
+
+static void _ar_lmdb_free(authreg_t ar)
+{
+    moddata_t data = (moddata_t) ar->private;
+
+    log_debug(ZONE, "lmdb module shutting down");
+
+    mdb_env_close(data->env);
+
+    free(data);
+}
+
+/** start me up */
+int ar_init(authreg_t ar)
+{
+    char *path;
+    int err, size;
+    MDB_env *env;
+    MDB_txn *txn;
+    MDB_dbi dbi;
+    moddata_t data;
+
+    path = config_get_one(ar->c2s->config, "authreg.lmdb.path", 0);
+    if(path == NULL)
+    {
+        log_write(ar->c2s->log, LOG_ERR, "lmdb: no authreg path specified in config file");
+        return 1;
+    }
+
+    size = j_atoi(config_get_one(ar->c2s->config, "authreg.lmdb.size", 0), 64);
+    if(size <= 0)
+        size = 64;
+
+    err = mdb_env_create(&env);
+    if(err != 0)
+    {
+        log_write(ar->c2s->log, LOG_ERR, "lmdb: couldn't create environment: %s", mdb_strerror(err));
+        return 1;
+    }
+
+    mdb_env_set_mapsize(env, (size_t) size * 1024 * 1024);
+    mdb_env_set_maxdbs(env, 1);
+
+    err = mdb_env_open(env, path, 0, 0600);
+    if(err != 0)
+    {
+        log_write(ar->c2s->log, LOG_ERR, "lmdb: couldn't open environment in %s: %s", path, mdb_strerror(err));
+        mdb_env_close(env);
+        return 1;
+    }
+
+    /* the handle stays valid for the life of the environment */
+    err = mdb_txn_begin(env, NULL, 0, &txn);
+    if(err == 0)
+    {
+        err = mdb_dbi_open(txn, "authreg", MDB_CREATE, &dbi);
+        if(err == 0)
+            err = mdb_txn_commit(txn);
+        else
+            mdb_txn_abort(txn);
+    }
+
+    if(err != 0)
+    {
+        log_write(ar->c2s->log, LOG_ERR, "lmdb: couldn't open authreg database: %s", mdb_strerror(err));
+        mdb_env_close(env);
+        return 1;
+    }
+
+    data = (moddata_t) calloc(1, sizeof(struct moddata_st));
+
+    data->env = env;
+    data->dbi = dbi;
+
+    ar->private = data;
+
+    ar->user_exists = _ar_lmdb_user_exists;
+    ar->get_password = _ar_lmdb_get_password;
+    ar->check_password = _ar_lmdb_check_password;
+    ar->set_password = _ar_lmdb_set_password;
+    ar->create_user = _ar_lmdb_create_user;
+    ar->delete_user = _ar_lmdb_delete_user;
+    ar->free = _ar_lmdb_free;
+
+    return 0;
+}
@@ -35,12 +35,19 @@
 #define MYSQL_LR   256   /* maximum length of realm - should correspond to field length */
 #define MYSQL_LP   256   /* maximum length of password - should correspond to field length */
 
+#define MYSQL_CHECK_IDLE (60)   /* seconds a connection can sit idle before we check it's still there */
+
 enum mysql_pws_crypt { MPC_PLAIN, MPC_CRYPT };
 
 static char salter[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ./";
 
 typedef struct mysqlcontext_st {
-  MYSQL * conn;
+  connpool_t pool;
+  char * host;
+  char * port;
+  char * dbname;
+  char * user;
+  char * pass;
   char * sql_create;
   char * sql_select;
   char * sql_setpassword;
@@ -49,17 +56,68 @@ typedef struct mysqlcontext_st {
   enum mysql_pws_crypt password_type;
 } *mysqlcontext_t;
 
+/** open a connection for the pool */
+static void *_ar_mysql_conn_open(void *arg) {
+    authreg_t ar = (authreg_t) arg;
+    mysqlcontext_t ctx = (mysqlcontext_t) ar->private;
+    MYSQL *conn;
+
+    log_debug( ZONE, "mysql connecting as '%s' to database '%s' on %s:%s", ctx->user, ctx->dbname, ctx->host, ctx->port );
+
+    conn = mysql_init(NULL);
+
+    if(conn == NULL) {
+        log_write(ar->c2s->log, LOG_ERR, "mysql: unable to allocate database connection state");
+        return NULL;
+    }
+
+    mysql_options(conn, MYSQL_READ_DEFAULT_GROUP, "jabberd");
+    mysql_options(conn, MYSQL_SET_CHARSET_NAME, "utf8");
+
+    /* connect with CLIENT_INTERACTIVE to get a (possibly) higher timeout value than default */
+    if(mysql_real_connect(conn, ctx->host, ctx->user, ctx->pass, ctx->dbname, atoi(ctx->port), NULL, CLIENT_INTERACTIVE) == NULL) {
+        log_write(ar->c2s->log, LOG_ERR, "mysql: connection to database failed: %s", mysql_error(conn));
+        mysql_close(conn);
+        return NULL;
+    }
+
+    mysql_query(conn, "SET NAMES 'utf8'");
+
+    /* Set reconnect flag to 1 (set to 0 by default from mysql 5 on) */
+    conn->reconnect = 1;
+
+    return (void *) conn;
+}
+
+/** make sure a connection that's been idle is still there (this reconnects it if it can) */
+static int _ar_mysql_conn_check(void *conn, void *arg) {
+    return mysql_ping((MYSQL *) conn) != 0;
+}
+
+static void _ar_mysql_conn_close(void *conn, void *arg) {
+    mysql_close((MYSQL *) conn);
+}
+
+/** get the connection from the pool */
+static MYSQL *_ar_mysql_conn_get(authreg_t ar) {
+    mysqlcontext_t ctx = (mysqlcontext_t) ar->private;
+    MYSQL *conn;
+
+    if((conn = (MYSQL *) connpool_get(ctx->pool)) == NULL)
+        log_write(ar->c2s->log, LOG_ERR, "mysql: connection to database lost");
+
+    return conn;
+}
+
 static MYSQL_RES *_ar_mysql_get_user_tuple(authreg_t ar, char *username, char *realm) {
     mysqlcontext_t ctx = (mysqlcontext_t) ar->private;
-    MYSQL *conn = ctx->conn;
+    MYSQL *conn;
     char iuser[MYSQL_LU+1], irealm[MYSQL_LR+1];
     char euser[MYSQL_LU*2+1], erealm[MYSQL_LR*2+1], sql[1024 + MYSQL_LU*2 + MYSQL_LR*2 + 1];  /* query(1024) + euser + erealm + \0(1) */
     MYSQL_RES *res;
     
-    if(mysql_ping(conn) != 0) {
-        log_write(ar->c2s->log, LOG_ERR, "mysql: connection to database lost");
+    if((conn = _ar_mysql_conn_get(ar)) == NULL)
         return NULL;
-    }
 
     snprintf(iuser, MYSQL_LU+1, "%s", username);
     snprintf(irealm, MYSQL_LR+1, "%s", realm);
@@ -73,14 +131,19 @@ static MYSQL_RES *_ar_mysql_get_user_tuple(authreg_t ar, char *username, char *r
 
     if(mysql_query(conn, sql) != 0) {
         log_write(ar->c2s->log, LOG_ERR, "mysql: sql select failed: %s", mysql_error(conn));
+        connpool_put(ctx->pool, (void *) conn, 0);
         return NULL;
     }
 
     res = mysql_store_result(conn);
-    if(res == NULL) {
+    if(res == NULL)
         log_write(ar->c2s->log, LOG_ERR, "mysql: sql result retrieval failed: %s", mysql_error(conn));
+
+    /* the result is all on our side now */
+    connpool_put(ctx->pool, (void *) conn, 0);
+
+    if(res == NULL)
         return NULL;
-    }
 
     if(mysql_num_rows(res) != 1) {
         mysql_free_result(res);
@@ -103,7 +166,6 @@ static int _ar_mysql_user_exists(authreg_t ar, char *username, char *realm) {
 
 static int _ar_mysql_get_password(authreg_t ar, char *username, char *realm, char password[257]) {
     mysqlcontext_t ctx = (mysqlcontext_t) ar->private;
-    MYSQL *conn = ctx->conn;
     MYSQL_RES *res = _ar_mysql_get_user_tuple(ar, username, realm);
     MYSQL_FIELD *field;
     MYSQL_ROW tuple;
@@ -121,7 +183,7 @@ static int _ar_mysql_get_password(authreg_t ar, char *username, char *realm, cha
     }
 
     if((tuple = mysql_fetch_row(res)) == NULL) {
-        log_write(ar->c2s->log, LOG_ERR, "mysql: sql tuple retrieval failed: %s", mysql_error(conn));
+        log_write(ar->c2s->log, LOG_ERR, "mysql: sql tuple retrieval failed");
         mysql_free_result(res);
         return 1;
     }
@@ -171,14 +233,12 @@ static int _ar_mysql_check_password(authreg_t ar, char *username, char *realm, c
 
 static int _ar_mysql_set_password(authreg_t ar, char *username, char *realm, char password[257]) {
     mysqlcontext_t ctx = (mysqlcontext_t) ar->private;
-    MYSQL *conn = ctx->conn;
+    MYSQL *conn;
     char iuser[MYSQL_LU+1], irealm[MYSQL_LR+1];
     char euser[MYSQL_LU*2+1], erealm[MYSQL_LR*2+1], epass[513], sql[1024+MYSQL_LU*2+MYSQL_LR*2+512+1];  /* query(1024) + euser + erealm + epass(512) + \0(1) */
 
-    if(mysql_ping(conn) != 0) {
-        log_write(ar->c2s->log, LOG_ERR, "mysql: connection to database lost");
+    if((conn = _ar_mysql_conn_get(ar)) == NULL)
         return 1;
-    }
 
     snprintf(iuser, MYSQL_LU+1, "%s", username);
     snprintf(irealm, MYSQL_LR+1, "%s", realm);
@@ -206,15 +266,18 @@ static int _ar_mysql_set_password(authreg_t ar, char *username, char *realm, cha
 
     if(mysql_query(conn, sql) != 0) {
         log_write(ar->c2s->log, LOG_ERR, "mysql: sql update failed: %s", mysql_error(conn));
+        connpool_put(ctx->pool, (void *) conn, 0);
         return 1;
     }
 
+    connpool_put(ctx->pool, (void *) conn, 0);
+
     return 0;
 }
 
 static int _ar_mysql_create_user(authreg_t ar, char *username, char *realm) {
     mysqlcontext_t ctx = (mysqlcontext_t) ar->private;
-    MYSQL *conn = ctx->conn;
+    MYSQL *conn;
     char iuser[MYSQL_LU+1], irealm[MYSQL_LR+1];
     char euser[MYSQL_LU*2+1], erealm[MYSQL_LR*2+1], sql[1024+MYSQL_LU*2+MYSQL_LR*2+1];    /* query(1024) + euser + erealm + \0(1) */
     MYSQL_RES *res = _ar_mysql_get_user_tuple(ar, username, realm);
@@ -226,10 +289,8 @@ static int _ar_mysql_create_user(authreg_t ar, char *username, char *realm) {
 
     mysql_free_result(res);
 
-    if(mysql_ping(conn) != 0) {
-        log_write(ar->c2s->log, LOG_ERR, "mysql: connection to database lost");
+    if((conn = _ar_mysql_conn_get(ar)) == NULL)
         return 1;
-    }
 
     snprintf(iuser, MYSQL_LU+1, "%s", username);
     snprintf(irealm, MYSQL_LR+1, "%s", realm);
@@ -243,22 +304,23 @@ static int _ar_mysql_create_user(authreg_t ar, char *username, char *realm) {
 
     if(mysql_query(conn, sql) != 0) {
         log_write(ar->c2s->log, LOG_ERR, "mysql: sql insert failed: %s", mysql_error(conn));
+        connpool_put(ctx->pool, (void *) conn, 0);
         return 1;
     }
 
+    connpool_put(ctx->pool, (void *) conn, 0);
+
     return 0;
 }
 
 static int _ar_mysql_delete_user(authreg_t ar, char *username, char *realm) {
     mysqlcontext_t ctx = (mysqlcontext_t) ar->private;
-    MYSQL *conn = ctx->conn;
+    MYSQL *conn;
     char iuser[MYSQL_LU+1], irealm[MYSQL_LR+1];
     char euser[MYSQL_LU*2+1], erealm[MYSQL_LR*2+1], sql[1024+MYSQL_LU*2+MYSQL_LR*2+1];    /* query(1024) + euser + erealm + \0(1) */
 
-    if(mysql_ping(conn) != 0) {
-        log_write(ar->c2s->log, LOG_ERR, "mysql: connection to database lost");
+    if((conn = _ar_mysql_conn_get(ar)) == NULL)
         return 1;
-    }
 
     snprintf(iuser, MYSQL_LU+1, "%s", username);
     snprintf(irealm, MYSQL_LR+1, "%s", realm);
@@ -272,18 +334,25 @@ static int _ar_mysql_delete_user(authreg_t ar, char *username, char *realm) {
 
     if(mysql_query(conn, sql) != 0) {
         log_write(ar->c2s->log, LOG_ERR, "mysql: sql insert failed: %s", mysql_error(conn));
+        connpool_put(ctx->pool, (void *) conn, 0);
         return 1;
     }
 
+    connpool_put(ctx->pool, (void *) conn, 0);
+
     return 0;
 }
 
 static void _ar_mysql_free(authreg_t ar) {
     mysqlcontext_t ctx = (mysqlcontext_t) ar->private;
-    MYSQL *conn = ctx->conn;
+    connpool_stats_t stats;
 
-    if(conn != NULL)
-       mysql_close(conn);
+    if(ctx->pool != NULL) {
+        connpool_stats(ctx->pool, &stats);
+        log_write(ar->c2s->log, LOG_INFO, "mysql: %lu queries, %lu connection checks, %lu connection errors", stats.gets, stats.checks, stats.errors);
+
+        connpool_free(ctx->pool);
+    }
 
     free(ctx->sql_create);
     free(ctx->sql_select);
@@ -364,7 +433,7 @@ DLLEXPORT int ar_init(authreg_t ar) {
     mysqlcontext_t mysqlcontext;
 
     /* configure the database context with field names and SQL statements */
-    mysqlcontext = (mysqlcontext_t) malloc( sizeof( struct mysqlcontext_st ) );
+    mysqlcontext = (mysqlcontext_t) calloc( 1, sizeof( struct mysqlcontext_st ) );
     ar->private = mysqlcontext;
     ar->free = _ar_mysql_free;
 
@@ -461,29 +530,18 @@ DLLEXPORT int ar_init(authreg_t ar) {
         return 1;
     }
 
-    log_debug( ZONE, "mysql connecting as '%s' to database '%s' on %s:%s", user, dbname, host, port );
+    mysqlcontext->host = host;
+    mysqlcontext->port = port;
+    mysqlcontext->dbname = dbname;
+    mysqlcontext->user = user;
+    mysqlcontext->pass = pass;
 
-    conn = mysql_init(NULL);
-    mysqlcontext->conn = conn;
+    /* c2s only ever makes one call at a time, so one connection does. the pool looks after its health */
+    mysqlcontext->pool = connpool_new(1, MYSQL_CHECK_IDLE, _ar_mysql_conn_open, _ar_mysql_conn_check, _ar_mysql_conn_close, (void *) ar);
 
-    if(conn == NULL) {
-        log_write(ar->c2s->log, LOG_ERR, "mysql: unable to allocate database connection state");
+    if((conn = (MYSQL *) connpool_get(mysqlcontext->pool)) == NULL)
         return 1;
-    }
-
-    mysql_options(conn, MYSQL_READ_DEFAULT_GROUP, "jabberd");
-    mysql_options(conn, MYSQL_SET_CHARSET_NAME, "utf8");
-
-    /* connect with CLIENT_INTERACTIVE to get a (possibly) higher timeout value than default */
-    if(mysql_real_connect(conn, host, user, pass, dbname, atoi(port), NULL, CLIENT_INTERACTIVE) == NULL) {
-        log_write(ar->c2s->log, LOG_ERR, "mysql: connection to database failed: %s", mysql_error(conn));
-        return 1;
-    }
-
-    mysql_query(conn, "SET NAMES 'utf8'");
-
-    /* Set reconnect flag to 1 (set to 0 by default from mysql 5 on) */
-    conn->reconnect = 1;
+    connpool_put(mysqlcontext->pool, (void *) conn, 0);
 
     ar->user_exists = _ar_mysql_user_exists;
     if (MPC_PLAIN == mysqlcontext->password_type) {
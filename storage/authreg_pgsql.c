@@ -27,8 +27,16 @@
 #define PGSQL_LR   256   /* maximum length of realm - should correspond to field length */
 #define PGSQL_LP   256   /* maximum length of password - should correspond to field length */
 
+#define PGSQL_CHECK_IDLE (60)   /* seconds a connection can sit idle before we check it's still there */
+
 typedef struct pgsqlcontext_st {
-  PGconn * conn;
+  connpool_t pool;
+  char * host;
+  char * port;
+  char * dbname;
+  char * user;
+  char * pass;
+  char * conninfo;
   char * sql_create;
   char * sql_select;
   char * sql_setpassword;
@@ -36,10 +44,76 @@ typedef struct pgsqlcontext_st {
   char * field_password;
   } *pgsqlcontext_t;
 
-static PGresult *_ar_pgsql_get_user_tuple(authreg_t ar, char *username, char *realm) {
+/** open a connection for the pool */
+static void *_ar_pgsql_conn_open(void *arg) {
+    authreg_t ar = (authreg_t) arg;
+    pgsqlcontext_t ctx = (pgsqlcontext_t) ar->private;
+    PGconn *conn;
+
+    if(ctx->conninfo) {
+        /* don't log connection info for it can contain password */
+        log_debug( ZONE, "pgsql connecting to the databse");
+        conn = PQconnectdb(ctx->conninfo);
+    } else {
+        /* compatibility settings */
+        log_debug( ZONE, "pgsql connecting as '%s' to database '%s' on %s:%s", ctx->user, ctx->dbname, ctx->host, ctx->port );
+        conn = PQsetdbLogin(ctx->host, ctx->port, NULL, NULL, ctx->dbname, ctx->user, ctx->pass);
+    }
+
+    if(conn == NULL) {
+        log_write(ar->c2s->log, LOG_ERR, "pgsql: unable to allocate database connection state");
+        return NULL;
+    }
+
+    if(PQstatus(conn) != CONNECTION_OK) {
+        log_write(ar->c2s->log, LOG_ERR, "pgsql: connection to database failed, will retry later: %s", PQerrorMessage(conn));
+        PQfinish(conn);
+        return NULL;
+    }
+
+    return (void *) conn;
+}
+
+/** make sure a connection that's been idle is still there. an empty query is the cheapest round trip there is */
+static int _ar_pgsql_conn_check(void *conn, void *arg) {
+    PQclear(PQexec((PGconn *) conn, ""));
+
+    if(PQstatus((PGconn *) conn) != CONNECTION_OK)
+        PQreset((PGconn *) conn);
+
+    return PQstatus((PGconn *) conn) != CONNECTION_OK;
+}
+
+static void _ar_pgsql_conn_close(void *conn, void *arg) {
+    PQfinish((PGconn *) conn);
+}
+
+/** run a query on the pooled connection, reconnecting once if it went away underneath us */
+static PGresult *_ar_pgsql_exec(authreg_t ar, const char *sql, ExecStatusType ok) {
     pgsqlcontext_t ctx = (pgsqlcontext_t) ar->private;
-    PGconn *conn = ctx->conn;
+    PGconn *conn;
+    PGresult *res;
+
+    if((conn = (PGconn *) connpool_get(ctx->pool)) == NULL) {
+        log_write(ar->c2s->log, LOG_ERR, "pgsql: connection to database lost");
+        return NULL;
+    }
+
+    res = PQexec(conn, sql);
+    if(PQresultStatus(res) != ok && PQstatus(conn) != CONNECTION_OK) {
+        log_write(ar->c2s->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
+        PQclear(res);
+        PQreset(conn);
+        res = PQexec(conn, sql);
+    }
+
+    connpool_put(ctx->pool, (void *) conn, PQstatus(conn) != CONNECTION_OK);
+
+    return res;
+}
 
+static PGresult *_ar_pgsql_get_user_tuple(authreg_t ar, char *username, char *realm) {
+    pgsqlcontext_t ctx = (pgsqlcontext_t) ar->private;
     char iuser[PGSQL_LU+1], irealm[PGSQL_LR+1];
     char euser[PGSQL_LU*2+1], erealm[PGSQL_LR*2+1], sql[1024+PGSQL_LU*2+PGSQL_LR*2+1];  /* query(1024) + euser + erealm + \0(1) */
     PGresult *res;
@@ -54,13 +128,8 @@ static PGresult *_ar_pgsql_get_user_tuple(authreg_t ar, char *username, char *re
 
     log_debug(ZONE, "prepared sql: %s", sql);
 
-    res = PQexec(conn, sql);
-    if(PQresultStatus(res) != PGRES_TUPLES_OK && PQstatus(conn) != CONNECTION_OK) {
-        log_write(ar->c2s->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(conn);
-        res = PQexec(conn, sql);
-    }
+    if((res = _ar_pgsql_exec(ar, sql, PGRES_TUPLES_OK)) == NULL)
+        return NULL;
     if(PQresultStatus(res) != PGRES_TUPLES_OK) {
         log_write(ar->c2s->log, LOG_ERR, "pgsql: sql select failed: %s", PQresultErrorMessage(res));
         PQclear(res);
@@ -115,7 +184,6 @@ static int _ar_pgsql_get_password(authreg_t ar, char *username, char *realm, cha
 
 static int _ar_pgsql_set_password(authreg_t ar, char *username, char *realm, char password[257]) {
     pgsqlcontext_t ctx = (pgsqlcontext_t) ar->private;
-    PGconn *conn = ctx->conn;
     char iuser[PGSQL_LU+1], irealm[PGSQL_LR+1];
     char euser[PGSQL_LU*2+1], erealm[PGSQL_LR*2+1], epass[513], sql[1024+PGSQL_LU*2+PGSQL_LR*2+512+1];  /* query(1024) + euser + erealm + epass(512) + \0(1) */
     PGresult *res;
@@ -131,13 +199,8 @@ static int _ar_pgsql_set_password(authreg_t ar, char *username, char *realm, cha
 
     log_debug(ZONE, "prepared sql: %s", sql);
 
-    res = PQexec(conn, sql);
-    if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(conn) != CONNECTION_OK) {
-        log_write(ar->c2s->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(conn);
-        res = PQexec(conn, sql);
-    }
+    if((res = _ar_pgsql_exec(ar, sql, PGRES_COMMAND_OK)) == NULL)
+        return 1;
     if(PQresultStatus(res) != PGRES_COMMAND_OK) {
         log_write(ar->c2s->log, LOG_ERR, "pgsql: sql update failed: %s", PQresultErrorMessage(res));
         PQclear(res);
@@ -151,7 +214,6 @@ static int _ar_pgsql_set_password(authreg_t ar, char *username, char *realm, cha
 
 static int _ar_pgsql_create_user(authreg_t ar, char *username, char *realm) {
     pgsqlcontext_t ctx = (pgsqlcontext_t) ar->private;
-    PGconn *conn = ctx->conn;
     char iuser[PGSQL_LU+1], irealm[PGSQL_LR+1];
     char euser[PGSQL_LU*2+1], erealm[PGSQL_LR*2+1], sql[1024+PGSQL_LU*2+PGSQL_LR*2+1];  /* query(1024) + euser + erealm + \0(1) */
     PGresult *res;
@@ -174,13 +236,8 @@ static int _ar_pgsql_create_user(authreg_t ar, char *username, char *realm) {
 
     log_debug(ZONE, "prepared sql: %s", sql);
 
-    res = PQexec(conn, sql);
-    if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(conn) != CONNECTION_OK) {
-        log_write(ar->c2s->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(conn);
-        res = PQexec(conn, sql);
-    }
+    if((res = _ar_pgsql_exec(ar, sql, PGRES_COMMAND_OK)) == NULL)
+        return 1;
     if(PQresultStatus(res) != PGRES_COMMAND_OK) {
         log_write(ar->c2s->log, LOG_ERR, "pgsql: sql insert failed: %s", PQresultErrorMessage(res));
         PQclear(res);
@@ -194,7 +251,6 @@ static int _ar_pgsql_create_user(authreg_t ar, char *username, char *realm) {
 
 static int _ar_pgsql_delete_user(authreg_t ar, char *username, char *realm) {
     pgsqlcontext_t ctx = (pgsqlcontext_t) ar->private;
-    PGconn *conn = ctx->conn;
     char iuser[PGSQL_LU+1], irealm[PGSQL_LR+1];
     char euser[PGSQL_LU*2+1], erealm[PGSQL_LR*2+1], sql[1024+PGSQL_LU*2+PGSQL_LR*2+1];    /* query(1024) + euser + erealm + \0(1) */
     PGresult *res;
@@ -209,13 +265,8 @@ static int _ar_pgsql_delete_user(authreg_t ar, char *username, char *realm) {
 
     log_debug(ZONE, "prepared sql: %s", sql);
 
-    res = PQexec(conn, sql);
-    if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(conn) != CONNECTION_OK) {
-        log_write(ar->c2s->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(conn);
-        res = PQexec(conn, sql);
-    }
+    if((res = _ar_pgsql_exec(ar, sql, PGRES_COMMAND_OK)) == NULL)
+        return 1;
     if(PQresultStatus(res) != PGRES_COMMAND_OK) {
         log_write(ar->c2s->log, LOG_ERR, "pgsql: sql delete failed: %s", PQresultErrorMessage(res));
         PQclear(res);
@@ -229,10 +280,14 @@ static int _ar_pgsql_delete_user(authreg_t ar, char *username, char *realm) {
 
 static void _ar_pgsql_free(authreg_t ar) {
     pgsqlcontext_t ctx = (pgsqlcontext_t) ar->private;
-    PGconn *conn = ctx->conn;
+    connpool_stats_t stats;
 
-    if(conn != NULL)
-       PQfinish(conn);
+    if(ctx->pool != NULL) {
+        connpool_stats(ctx->pool, &stats);
+        log_write(ar->c2s->log, LOG_INFO, "pgsql: %lu queries, %lu connection checks, %lu connection errors", stats.gets, stats.checks, stats.errors);
+
+        connpool_free(ctx->pool);
+    }
 
     free(ctx->sql_create);
     free(ctx->sql_select);
@@ -308,7 +363,6 @@ extern int sx_openssl_initialized;
 
 /** start me up */
 int ar_init(authreg_t ar) {
-    char *host, *port, *dbname, *user, *pass, *conninfo;
     char *create, *select, *setpassword, *delete;
     char *table, *username, *realm;
     char *template;
@@ -399,32 +453,19 @@ int ar_init(authreg_t ar) {
 	PQinitSSL(0);
 #endif
 
-    host = config_get_one(ar->c2s->config, "authreg.pgsql.host", 0);
-    port = config_get_one(ar->c2s->config, "authreg.pgsql.port", 0);
-    dbname = config_get_one(ar->c2s->config, "authreg.pgsql.dbname", 0);
-    user = config_get_one(ar->c2s->config, "authreg.pgsql.user", 0);
-    pass = config_get_one(ar->c2s->config, "authreg.pgsql.pass", 0);
-    conninfo = config_get_one(ar->c2s->config,"authreg.pgsql.conninfo",0);
-
-    if(conninfo) {
-        /* don't log connection info for it can contain password */
-        log_debug( ZONE, "pgsql connecting to the databse");
-        conn = PQconnectdb(conninfo);
-    } else {
-        /* compatibility settings */
-        log_debug( ZONE, "pgsql connecting as '%s' to database '%s' on %s:%s", user, dbname, host, port );
-        conn = PQsetdbLogin(host, port, NULL, NULL, dbname, user, pass);
-    }
+    pgsqlcontext->host = config_get_one(ar->c2s->config, "authreg.pgsql.host", 0);
+    pgsqlcontext->port = config_get_one(ar->c2s->config, "authreg.pgsql.port", 0);
+    pgsqlcontext->dbname = config_get_one(ar->c2s->config, "authreg.pgsql.dbname", 0);
+    pgsqlcontext->user = config_get_one(ar->c2s->config, "authreg.pgsql.user", 0);
+    pgsqlcontext->pass = config_get_one(ar->c2s->config, "authreg.pgsql.pass", 0);
+    pgsqlcontext->conninfo = config_get_one(ar->c2s->config,"authreg.pgsql.conninfo",0);
 
-    if(conn == NULL) {
-        log_write(ar->c2s->log, LOG_ERR, "pgsql: unable to allocate database connection state");
-        return 1;
-    }
-
-    if(PQstatus(conn) != CONNECTION_OK)
-        log_write(ar->c2s->log, LOG_ERR, "pgsql: connection to database failed, will retry later: %s", PQerrorMessage(conn));
+    /* c2s only ever makes one call at a time, so one connection does. the pool looks after its health */
+    pgsqlcontext->pool = connpool_new(1, PGSQL_CHECK_IDLE, _ar_pgsql_conn_open, _ar_pgsql_conn_check, _ar_pgsql_conn_close, (void *) ar);
 
-    pgsqlcontext->conn = conn;
+    /* if it's not there yet, we'll try again when the first query comes in */
+    if((conn = (PGconn *) connpool_get(pgsqlcontext->pool)) != NULL)
+        connpool_put(pgsqlcontext->pool, (void *) conn, 0);
 
     ar->user_exists = _ar_pgsql_user_exists;
     ar->get_password = _ar_pgsql_get_password;
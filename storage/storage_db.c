@@ -142,8 +142,8 @@ static st_ret_t _st_db_cursor_free(st_driver_t drv, dbdata_t dbd, DBC *cursor, D
     return st_SUCCESS;
 }
 
-static void _st_db_object_serialise(os_object_t o, char **buf, int *len) {
-    char *key, *xml, *xmlstr;
+static void _st_db_object_serialise(st_driver_t drv, os_object_t o, char **buf, int *len) {
+    char *key, *xml;
     void *val;
     os_type_t ot;
     int cur = 0, xlen;
@@ -176,11 +176,9 @@ static void _st_db_object_serialise(os_object_t o, char **buf, int *len) {
                     break;
 
                 case os_type_NAD:
-                    nad_print((nad_t) val, 0, &xml, &xlen);
-                    xmlstr = (char *) malloc(sizeof(char) * (xlen + 1));
-                    sprintf(xmlstr, "%.*s", xlen, xml);
-                    ser_string_set(xmlstr, &cur, buf, len);
-                    free(xmlstr);
+                    storage_nad_encode(drv->st, (nad_t) val, &xml, &xlen);
+                    ser_string_set(xml, &cur, buf, len);
+                    free(xml);
                     break;
 
                 case os_type_UNKNOWN:
@@ -232,10 +230,10 @@ static os_object_t _st_db_object_deserialise(st_driver_t drv, os_t os, const cha
 
             case os_type_NAD:
                 ser_string_get(&sval, &cur, buf, len);
-                nad = nad_parse(sval, strlen(sval));
+                nad = nad_decode(sval, strlen(sval));
                 free(sval);
                 if(nad == NULL) {
-                    log_write(drv->st->sm->log, LOG_ERR, "db: unable to parse stored XML - database corruption?");
+                    log_write(drv->st->sm->log, LOG_ERR, "db: unable to decode stored NAD - database corruption?");
                     return NULL;
                 }
                 os_object_put(o, key, nad, os_type_NAD);
@@ -267,7 +265,7 @@ static st_ret_t _st_db_put_guts(st_driver_t drv, const char *type, const char *o
     if(os_iter_first(os))
         do {
             o = os_iter_object(os);
-            _st_db_object_serialise(o, &buf, &len);
+            _st_db_object_serialise(drv, o, &buf, &len);
 
             val.data = buf;
             val.size = len;
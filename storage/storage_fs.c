@@ -174,8 +174,9 @@ static st_ret_t _st_fs_put(st_driver_t drv, const char *type, const char *owner,
                             break;
 
                         case os_type_NAD:
-                            nad_print((nad_t) val, 0, &xml, &len);
+                            storage_nad_encode(drv->st, (nad_t) val, &xml, &len);
                             fprintf(f, "%s %d %.*s\n", key, ot, len, xml);
+                            free(xml);
                             break;
 
                         case os_type_UNKNOWN:
@@ -266,16 +267,16 @@ static st_ret_t _st_fs_get(st_driver_t drv, const char *type, const char *owner,
                     break;
 
                 case os_type_NAD:
-                    nad = nad_parse(val, 0);
+                    nad = nad_decode(val, 0);
                     if(nad == NULL) {
                         while(fgets(buf + size, STORAGE_FS_READ_BLOCKSIZE - size, f) != NULL
                               && nad == NULL && size < STORAGE_FS_READ_BLOCKSIZE) {
                             size += strlen(buf + size);
-                            nad = nad_parse(val, 0);
+                            nad = nad_decode(val, 0);
                         }
                     }
                     if(nad == NULL) {
-                        log_write(drv->st->sm->log, LOG_ERR, "fs: unable to parse stored XML; type=%s, owner=%s", type, owner);
+                        log_write(drv->st->sm->log, LOG_ERR, "fs: unable to decode stored NAD; type=%s, owner=%s", type, owner);
                         os_free(*os);
                         fclose(f);
                         closedir(dir);
@@ -405,16 +406,16 @@ static st_ret_t _st_fs_delete(st_driver_t drv, const char *type, const char *own
                     break;
 
                 case os_type_NAD:
-                    nad = nad_parse(val, 0);
+                    nad = nad_decode(val, 0);
                     if(nad == NULL) {
                         while(fgets(buf + size, STORAGE_FS_READ_BLOCKSIZE - size, f) != NULL
                               && nad == NULL && size < STORAGE_FS_READ_BLOCKSIZE) {
                             size += strlen(buf + size);
-                            nad = nad_parse(val, 0);
+                            nad = nad_decode(val, 0);
                         }
                     }
                     if(nad == NULL)
-                        log_write(drv->st->sm->log, LOG_ERR, "fs: unable to parse stored XML; type=%s, owner=%s", type, owner);
+                        log_write(drv->st->sm->log, LOG_ERR, "fs: unable to decode stored NAD; type=%s, owner=%s", type, owner);
                     else {
                         os_object_put(o, buf, nad, ot);
                         nad_free(nad);
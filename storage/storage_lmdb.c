@@ -0,0 +1,799 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002 Jeremie Miller, Thomas Muldowney,
+ *                    Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+/** @file storage/storage_lmdb.c
+  * @brief lmdb storage module
+  */
+
+/*
+ * each type is a named database in one lmdb environment. objects are keyed by
+ * owner, a nul, then a big-endian sequence number, so all of an owner's
+ * objects sit together, oldest first, and one cursor walk finds them. values
+ * are serialised the same way as the berkeley db driver does it, so its data
+ * can be copied across as it is (see tools/migrate-lmdb.pl).
+ *
+ * reads are done straight out of the map. by default every write waits for
+ * its own flush. with <sync> set, writes are committed without syncing and a
+ * flusher thread syncs the environment for them: it waits up to <sync>
+ * milliseconds for more commits to gather, then flushes them all at once.
+ * writers still don't return until the flush covering their commit is done.
+ */
+
+#include "sm.h"
+#include <lmdb.h>
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+/** internal structure, holds our data */
+typedef struct drvdata_st {
+    MDB_env *env;
+
+    char *path;
+    int sync;           /**< milliseconds to gather commits for a flush, 0 to flush on every commit */
+
+    xht dbs;            /**< database handles, key is type */
+    xht filters;
+
+    unsigned long commits, flushes;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;   /**< held around dbs, filters and the flusher state */
+
+    pthread_t flusher;
+    pthread_cond_t dirty_cond;
+    int dirty, flushing, shutdown;
+
+    pthread_cond_t synced_cond;
+    unsigned long synced;   /**< commits up to this one are on disk */
+    int sync_err;           /**< how the last flush went */
+#endif
+} *drvdata_t;
+
+#define LMDB_SEQ_LEN    (4)
+
+static void _st_lmdb_lock(drvdata_t data) {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&data->lock);
+#endif
+}
+
+static void _st_lmdb_unlock(drvdata_t data) {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&data->lock);
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+/** group commit. waits for a commit, lets others gather behind it, then flushes them all at once */
+static void *_st_lmdb_flusher(void *arg) {
+    drvdata_t data = (drvdata_t) arg;
+    struct timespec ts;
+    unsigned long seq;
+    int err;
+
+    pthread_mutex_lock(&data->lock);
+    while(!data->shutdown) {
+        if(!data->dirty) {
+            pthread_cond_wait(&data->dirty_cond, &data->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&data->lock);
+
+        ts.tv_sec = data->sync / 1000;
+        ts.tv_nsec = (data->sync % 1000) * 1000000;
+        nanosleep(&ts, NULL);
+
+        pthread_mutex_lock(&data->lock);
+        seq = data->commits;
+        data->dirty = 0;
+        data->flushes++;
+        pthread_mutex_unlock(&data->lock);
+
+        err = mdb_env_sync(data->env, 1);
+
+        /* let the writers go */
+        pthread_mutex_lock(&data->lock);
+        data->sync_err = err;
+        data->synced = seq;
+        pthread_cond_broadcast(&data->synced_cond);
+    }
+    pthread_mutex_unlock(&data->lock);
+
+    return NULL;
+}
+#endif
+
+/** commit a write, and get it to disk (now or soon) */
+static st_ret_t _st_lmdb_commit(st_driver_t drv, MDB_txn *txn, const char *type, const char *owner) {
+    drvdata_t data = (drvdata_t) drv->private;
+    unsigned long seq;
+    int err;
+
+    if((err = mdb_txn_commit(txn)) != 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't commit transaction for type %s owner %s: %s", type, owner, mdb_strerror(err));
+        if(err == MDB_MAP_FULL)
+            log_write(drv->st->sm->log, LOG_ERR, "lmdb: the database is full, raise <size> and restart");
+        return st_FAILED;
+    }
+
+    _st_lmdb_lock(data);
+    seq = ++data->commits;
+#ifdef HAVE_PTHREAD_H
+    /* hand it to the flusher, and wait until it's on disk */
+    if(data->flushing) {
+        data->dirty = 1;
+        pthread_cond_signal(&data->dirty_cond);
+
+        while(data->synced < seq)
+            pthread_cond_wait(&data->synced_cond, &data->lock);
+        err = data->sync_err;
+        _st_lmdb_unlock(data);
+
+        if(err != 0) {
+            log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't flush transaction for type %s owner %s: %s", type, owner, mdb_strerror(err));
+            return st_FAILED;
+        }
+
+        return st_SUCCESS;
+    }
+#endif
+    /* otherwise the commit flushed it */
+    data->flushes++;
+    _st_lmdb_unlock(data);
+
+    return st_SUCCESS;
+}
+
+static st_ret_t _st_lmdb_add_type(st_driver_t drv, const char *type) {
+    drvdata_t data = (drvdata_t) drv->private;
+    MDB_txn *txn;
+    MDB_dbi dbi;
+    int err;
+
+    _st_lmdb_lock(data);
+
+    if(xhash_get(data->dbs, type) != NULL) {
+        _st_lmdb_unlock(data);
+        return st_SUCCESS;
+    }
+
+    if((err = mdb_txn_begin(data->env, NULL, 0, &txn)) != 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't begin transaction: %s", mdb_strerror(err));
+        _st_lmdb_unlock(data);
+        return st_FAILED;
+    }
+
+    if((err = mdb_dbi_open(txn, type, MDB_CREATE, &dbi)) != 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't open database for type %s: %s", type, mdb_strerror(err));
+        mdb_txn_abort(txn);
+        _st_lmdb_unlock(data);
+        return st_FAILED;
+    }
+
+    if((err = mdb_txn_commit(txn)) != 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't create database for type %s: %s", type, mdb_strerror(err));
+        _st_lmdb_unlock(data);
+        return st_FAILED;
+    }
+
+    /* stored plus one, so handle 0 doesn't look like a miss */
+    xhash_put(data->dbs, pstrdup(xhash_pool(data->dbs), type), (void *) (long) (dbi + 1));
+
+    _st_lmdb_unlock(data);
+
+    log_debug(ZONE, "database for type %s is online", type);
+
+    return st_SUCCESS;
+}
+
+/** get the handle for a type */
+static st_ret_t _st_lmdb_dbi(st_driver_t drv, const char *type, MDB_dbi *dbi) {
+    drvdata_t data = (drvdata_t) drv->private;
+    long val;
+
+    _st_lmdb_lock(data);
+    val = (long) xhash_get(data->dbs, type);
+    _st_lmdb_unlock(data);
+
+    if(val == 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: no database for type %s", type);
+        return st_FAILED;
+    }
+
+    *dbi = (MDB_dbi) (val - 1);
+
+    return st_SUCCESS;
+}
+
+/** get a parsed filter, from the cache if we've seen it before */
+static st_filter_t _st_lmdb_filter(st_driver_t drv, const char *filter) {
+    drvdata_t data = (drvdata_t) drv->private;
+    st_filter_t f;
+    char *cfilter;
+
+    if(filter == NULL)
+        return NULL;
+
+    _st_lmdb_lock(data);
+
+    f = xhash_get(data->filters, filter);
+    if(f == NULL) {
+        f = storage_filter(filter);
+        if(f != NULL) {
+            cfilter = pstrdup(xhash_pool(data->filters), filter);
+            xhash_put(data->filters, cfilter, (void *) f);
+            pool_cleanup(xhash_pool(data->filters), (pool_cleanup_t) pool_free, f->p);
+        }
+    }
+
+    _st_lmdb_unlock(data);
+
+    return f;
+}
+
+/** build a key. with seq < 0, it's the key just past all of the owner's objects */
+static char *_st_lmdb_key(MDB_val *key, const char *owner, long seq) {
+    int olen = strlen(owner);
+    unsigned char *buf;
+
+    buf = (unsigned char *) malloc(olen + 1 + LMDB_SEQ_LEN);
+    memcpy(buf, owner, olen);
+
+    if(seq < 0) {
+        buf[olen] = '\1';
+        key->mv_size = olen + 1;
+    } else {
+        buf[olen] = '\0';
+        buf[olen + 1] = (unsigned char) ((seq >> 24) & 0xff);
+        buf[olen + 2] = (unsigned char) ((seq >> 16) & 0xff);
+        buf[olen + 3] = (unsigned char) ((seq >> 8) & 0xff);
+        buf[olen + 4] = (unsigned char) (seq & 0xff);
+        key->mv_size = olen + 1 + LMDB_SEQ_LEN;
+    }
+
+    key->mv_data = buf;
+
+    return (char *) buf;
+}
+
+/** see if a key belongs to this owner */
+static int _st_lmdb_key_match(MDB_val *key, const char *owner, int olen) {
+    return key->mv_size == olen + 1 + LMDB_SEQ_LEN && memcmp(key->mv_data, owner, olen) == 0 && ((char *) key->mv_data)[olen] == '\0';
+}
+
+static void _st_lmdb_object_serialise(st_driver_t drv, os_object_t o, char **buf, int *len) {
+    char *key, *xml;
+    void *val;
+    os_type_t ot;
+    int cur = 0, xlen;
+
+    *buf = NULL;
+    *len = 0;
+
+    if(os_object_iter_first(o))
+        do {
+            os_object_iter_get(o, &key, &val, &ot);
+
+            ser_string_set(key, &cur, buf, len);
+            ser_int_set(ot, &cur, buf, len);
+
+            switch(ot) {
+                case os_type_BOOLEAN:
+                    ser_int_set(((int) (long) val) != 0, &cur, buf, len);
+                    break;
+
+                case os_type_INTEGER:
+                    ser_int_set((int) (long) val, &cur, buf, len);
+                    break;
+
+                case os_type_STRING:
+                    ser_string_set((char *) val, &cur, buf, len);
+                    break;
+
+                case os_type_NAD:
+                    storage_nad_encode(drv->st, (nad_t) val, &xml, &xlen);
+                    ser_string_set(xml, &cur, buf, len);
+                    free(xml);
+                    break;
+
+                case os_type_UNKNOWN:
+                    break;
+            }
+        } while(os_object_iter_next(o));
+
+    *len = cur;
+}
+
+/** pull a string out of a stored object. it stays where it is, in the map */
+static const char *_st_lmdb_string(const char *buf, int len, int *cur) {
+    const char *str = buf + *cur, *end;
+
+    if(*cur >= len || (end = memchr(str, '\0', len - *cur)) == NULL)
+        return NULL;
+
+    *cur = end - buf + 1;
+
+    return str;
+}
+
+static int _st_lmdb_int(const char *buf, int len, int *cur, int *val) {
+    if(*cur + (int) sizeof(int) > len)
+        return 1;
+
+    memcpy(val, buf + *cur, sizeof(int));
+    *cur += sizeof(int);
+
+    return 0;
+}
+
+/** read an object straight out of the map */
+static os_object_t _st_lmdb_object_deserialise(st_driver_t drv, os_t os, const char *buf, int len) {
+    os_object_t o;
+    const char *key, *sval;
+    int cur = 0, ot, ival;
+    nad_t nad;
+
+    o = os_object_new(os);
+
+    while(cur < len) {
+        if((key = _st_lmdb_string(buf, len, &cur)) == NULL || _st_lmdb_int(buf, len, &cur, &ot) != 0) {
+            log_debug(ZONE, "ran off the end of the buffer");
+            return o;
+        }
+
+        switch((os_type_t) ot) {
+            case os_type_BOOLEAN:
+            case os_type_INTEGER:
+                if(_st_lmdb_int(buf, len, &cur, &ival) != 0)
+                    return o;
+                if(ot == os_type_BOOLEAN)
+                    ival = (ival != 0);
+                os_object_put(o, key, &ival, (os_type_t) ot);
+                break;
+
+            case os_type_STRING:
+                if((sval = _st_lmdb_string(buf, len, &cur)) == NULL)
+                    return o;
+                os_object_put(o, key, sval, os_type_STRING);
+                break;
+
+            case os_type_NAD:
+                if((sval = _st_lmdb_string(buf, len, &cur)) == NULL)
+                    return o;
+                nad = nad_decode(sval, strlen(sval));
+                if(nad == NULL) {
+                    log_write(drv->st->sm->log, LOG_ERR, "lmdb: unable to decode stored NAD - database corruption?");
+                    os_object_free(o);
+                    return NULL;
+                }
+                os_object_put(o, key, nad, os_type_NAD);
+                nad_free(nad);
+                break;
+
+            case os_type_UNKNOWN:
+                break;
+        }
+    }
+
+    return o;
+}
+
+static st_ret_t _st_lmdb_put_guts(st_driver_t drv, const char *type, const char *owner, os_t os, MDB_txn *txn, MDB_dbi dbi) {
+    MDB_cursor *c;
+    MDB_val key, val;
+    os_object_t o;
+    char *kbuf, *buf;
+    int olen = strlen(owner), len, err;
+    long seq = 0;
+
+    if((err = mdb_cursor_open(txn, dbi, &c)) != 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't create cursor: %s", mdb_strerror(err));
+        return st_FAILED;
+    }
+
+    /* new objects go after the owner's last one */
+    kbuf = _st_lmdb_key(&key, owner, -1);
+    err = mdb_cursor_get(c, &key, &val, MDB_SET_RANGE);
+    if(err == 0)
+        err = mdb_cursor_get(c, &key, &val, MDB_PREV);
+    else if(err == MDB_NOTFOUND)
+        err = mdb_cursor_get(c, &key, &val, MDB_LAST);
+    free(kbuf);
+
+    if(err == 0 && _st_lmdb_key_match(&key, owner, olen)) {
+        kbuf = (char *) key.mv_data + olen + 1;
+        seq = ((long) (unsigned char) kbuf[0] << 24 | (long) (unsigned char) kbuf[1] << 16 |
+               (long) (unsigned char) kbuf[2] << 8 | (long) (unsigned char) kbuf[3]) + 1;
+    } else if(err != 0 && err != MDB_NOTFOUND) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't move cursor for type %s owner %s: %s", type, owner, mdb_strerror(err));
+        mdb_cursor_close(c);
+        return st_FAILED;
+    }
+
+    if(os_iter_first(os))
+        do {
+            o = os_iter_object(os);
+            _st_lmdb_object_serialise(drv, o, &buf, &len);
+
+            kbuf = _st_lmdb_key(&key, owner, seq++);
+
+            val.mv_data = buf;
+            val.mv_size = len;
+
+            err = mdb_cursor_put(c, &key, &val, 0);
+
+            free(kbuf);
+            free(buf);
+
+            if(err != 0) {
+                log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't store value for type %s owner %s: %s", type, owner, mdb_strerror(err));
+                mdb_cursor_close(c);
+                return st_FAILED;
+            }
+
+        } while(os_iter_next(os));
+
+    mdb_cursor_close(c);
+
+    return st_SUCCESS;
+}
+
+static st_ret_t _st_lmdb_put(st_driver_t drv, const char *type, const char *owner, os_t os) {
+    drvdata_t data = (drvdata_t) drv->private;
+    MDB_txn *txn;
+    MDB_dbi dbi;
+    int err;
+
+    if(os_count(os) == 0)
+        return st_SUCCESS;
+
+    if(_st_lmdb_dbi(drv, type, &dbi) != st_SUCCESS)
+        return st_FAILED;
+
+    if((err = mdb_txn_begin(data->env, NULL, 0, &txn)) != 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't begin transaction: %s", mdb_strerror(err));
+        return st_FAILED;
+    }
+
+    if(_st_lmdb_put_guts(drv, type, owner, os, txn, dbi) != st_SUCCESS) {
+        mdb_txn_abort(txn);
+        return st_FAILED;
+    }
+
+    return _st_lmdb_commit(drv, txn, type, owner);
+}
+
+/** walk the owner's objects. with os, the ones matching the filter are collected; with count, they're counted */
+static st_ret_t _st_lmdb_walk(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t os, int *count) {
+    drvdata_t data = (drvdata_t) drv->private;
+    MDB_txn *txn;
+    MDB_dbi dbi;
+    MDB_cursor *c;
+    MDB_val key, val;
+    st_filter_t f;
+    os_t fos = NULL;
+    os_object_t o;
+    char *kbuf;
+    int olen = strlen(owner), err;
+
+    if(_st_lmdb_dbi(drv, type, &dbi) != st_SUCCESS)
+        return st_FAILED;
+
+    f = _st_lmdb_filter(drv, filter);
+
+    if((err = mdb_txn_begin(data->env, NULL, MDB_RDONLY, &txn)) != 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't begin transaction: %s", mdb_strerror(err));
+        return st_FAILED;
+    }
+
+    if((err = mdb_cursor_open(txn, dbi, &c)) != 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't create cursor: %s", mdb_strerror(err));
+        mdb_txn_abort(txn);
+        return st_FAILED;
+    }
+
+    /* counting only needs objects to test the filter against */
+    if(os == NULL && f != NULL)
+        fos = os_new();
+
+    kbuf = _st_lmdb_key(&key, owner, 0);
+    key.mv_size = olen + 1;
+
+    err = mdb_cursor_get(c, &key, &val, MDB_SET_RANGE);
+    while(err == 0 && _st_lmdb_key_match(&key, owner, olen)) {
+        if(os != NULL) {
+            o = _st_lmdb_object_deserialise(drv, os, val.mv_data, val.mv_size);
+            if(o != NULL && !storage_match(f, o, os))
+                os_object_free(o);
+        } else if(f == NULL)
+            (*count)++;
+        else {
+            o = _st_lmdb_object_deserialise(drv, fos, val.mv_data, val.mv_size);
+            if(o != NULL && storage_match(f, o, fos))
+                (*count)++;
+            if(o != NULL)
+                os_object_free(o);
+        }
+
+        err = mdb_cursor_get(c, &key, &val, MDB_NEXT);
+    }
+
+    free(kbuf);
+
+    if(fos != NULL)
+        os_free(fos);
+
+    mdb_cursor_close(c);
+    mdb_txn_abort(txn);
+
+    if(err != 0 && err != MDB_NOTFOUND) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't move cursor for type %s owner %s: %s", type, owner, mdb_strerror(err));
+        return st_FAILED;
+    }
+
+    return st_SUCCESS;
+}
+
+static st_ret_t _st_lmdb_get(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t *os) {
+    st_ret_t ret;
+
+    *os = os_new();
+
+    ret = _st_lmdb_walk(drv, type, owner, filter, *os, NULL);
+    if(ret != st_SUCCESS) {
+        os_free(*os);
+        *os = NULL;
+        return ret;
+    }
+
+    if(os_count(*os) == 0) {
+        os_free(*os);
+        *os = NULL;
+        return st_NOTFOUND;
+    }
+
+    return st_SUCCESS;
+}
+
+static st_ret_t _st_lmdb_count(st_driver_t drv, const char *type, const char *owner, const char *filter, int *count) {
+    *count = 0;
+
+    return _st_lmdb_walk(drv, type, owner, filter, NULL, count);
+}
+
+static st_ret_t _st_lmdb_delete_guts(st_driver_t drv, const char *type, const char *owner, const char *filter, MDB_txn *txn, MDB_dbi dbi) {
+    MDB_cursor *c;
+    MDB_val key, val;
+    st_filter_t f;
+    os_t os;
+    os_object_t o;
+    char *kbuf;
+    int olen = strlen(owner), err, del;
+
+    f = _st_lmdb_filter(drv, filter);
+
+    if((err = mdb_cursor_open(txn, dbi, &c)) != 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't create cursor: %s", mdb_strerror(err));
+        return st_FAILED;
+    }
+
+    os = os_new();
+
+    kbuf = _st_lmdb_key(&key, owner, 0);
+    key.mv_size = olen + 1;
+
+    err = mdb_cursor_get(c, &key, &val, MDB_SET_RANGE);
+    while(err == 0 && _st_lmdb_key_match(&key, owner, olen)) {
+        del = 1;
+        if(f != NULL) {
+            o = _st_lmdb_object_deserialise(drv, os, val.mv_data, val.mv_size);
+            del = (o != NULL && storage_match(f, o, os));
+            if(o != NULL)
+                os_object_free(o);
+        }
+
+        /* after a delete, the cursor is already on the next one, and MDB_NEXT knows it */
+        if(del)
+            err = mdb_cursor_del(c, 0);
+
+        if(err == 0)
+            err = mdb_cursor_get(c, &key, &val, MDB_NEXT);
+    }
+
+    free(kbuf);
+    os_free(os);
+    mdb_cursor_close(c);
+
+    if(err != 0 && err != MDB_NOTFOUND) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't move cursor for type %s owner %s: %s", type, owner, mdb_strerror(err));
+        return st_FAILED;
+    }
+
+    return st_SUCCESS;
+}
+
+static st_ret_t _st_lmdb_delete(st_driver_t drv, const char *type, const char *owner, const char *filter) {
+    drvdata_t data = (drvdata_t) drv->private;
+    MDB_txn *txn;
+    MDB_dbi dbi;
+    int err;
+
+    if(_st_lmdb_dbi(drv, type, &dbi) != st_SUCCESS)
+        return st_FAILED;
+
+    if((err = mdb_txn_begin(data->env, NULL, 0, &txn)) != 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't begin transaction: %s", mdb_strerror(err));
+        return st_FAILED;
+    }
+
+    if(_st_lmdb_delete_guts(drv, type, owner, filter, txn, dbi) != st_SUCCESS) {
+        mdb_txn_abort(txn);
+        return st_FAILED;
+    }
+
+    return _st_lmdb_commit(drv, txn, type, owner);
+}
+
+static st_ret_t _st_lmdb_replace(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t os) {
+    drvdata_t data = (drvdata_t) drv->private;
+    MDB_txn *txn;
+    MDB_dbi dbi;
+    int err;
+
+    if(_st_lmdb_dbi(drv, type, &dbi) != st_SUCCESS)
+        return st_FAILED;
+
+    if((err = mdb_txn_begin(data->env, NULL, 0, &txn)) != 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't begin transaction: %s", mdb_strerror(err));
+        return st_FAILED;
+    }
+
+    if(_st_lmdb_delete_guts(drv, type, owner, filter, txn, dbi) != st_SUCCESS ||
+       (os_count(os) > 0 && _st_lmdb_put_guts(drv, type, owner, os, txn, dbi) != st_SUCCESS)) {
+        mdb_txn_abort(txn);
+        return st_FAILED;
+    }
+
+    return _st_lmdb_commit(drv, txn, type, owner);
+}
+
+static void _st_lmdb_free(st_driver_t drv) {
+    drvdata_t data = (drvdata_t) drv->private;
+
+#ifdef HAVE_PTHREAD_H
+    if(data->flushing) {
+        pthread_mutex_lock(&data->lock);
+        data->shutdown = 1;
+        pthread_cond_signal(&data->dirty_cond);
+        pthread_mutex_unlock(&data->lock);
+
+        pthread_join(data->flusher, NULL);
+    }
+#endif
+
+    /* whatever the flusher didn't get to */
+    mdb_env_sync(data->env, 1);
+
+    log_write(drv->st->sm->log, LOG_NOTICE, "lmdb: %lu commits written in %lu flushes", data->commits, data->flushes);
+
+    xhash_free(data->dbs);
+    xhash_free(data->filters);
+
+    mdb_env_close(data->env);
+
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_destroy(&data->dirty_cond);
+    pthread_cond_destroy(&data->synced_cond);
+    pthread_mutex_destroy(&data->lock);
+#endif
+
+    free(data);
+}
+
+st_ret_t st_init(st_driver_t drv) {
+    char *path;
+    int err, size, sync, dead, group = 0;
+    MDB_env *env;
+    drvdata_t data;
+
+    path = config_get_one(drv->st->sm->config, "storage.lmdb.path", 0);
+    if(path == NULL) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: no path specified in config file");
+        return st_FAILED;
+    }
+
+    /* the map is reserved up front, but only takes up disk as it's used */
+    size = j_atoi(config_get_one(drv->st->sm->config, "storage.lmdb.size", 0), 1024);
+    if(size <= 0)
+        size = 1024;
+
+    sync = j_atoi(config_get_one(drv->st->sm->config, "storage.lmdb.sync", 0), 0);
+    if(sync < 0)
+        sync = 0;
+
+    if((err = mdb_env_create(&env)) != 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't create environment: %s", mdb_strerror(err));
+        return st_FAILED;
+    }
+
+    mdb_env_set_mapsize(env, (size_t) size * 1024 * 1024);
+    mdb_env_set_maxdbs(env, 256);
+
+    /* without a flusher to do it later, every commit waits for the disk */
+#ifdef HAVE_PTHREAD_H
+    err = mdb_env_open(env, path, sync > 0 ? MDB_NOSYNC : 0, 0600);
+#else
+    err = mdb_env_open(env, path, 0, 0600);
+#endif
+    if(err != 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "lmdb: couldn't open environment in %s: %s", path, mdb_strerror(err));
+        mdb_env_close(env);
+        return st_FAILED;
+    }
+
+    /* clear out reader slots left behind by a crash */
+    if(mdb_reader_check(env, &dead) == 0 && dead > 0)
+        log_write(drv->st->sm->log, LOG_NOTICE, "lmdb: cleared %d stale readers", dead);
+
+    data = (drvdata_t) calloc(1, sizeof(struct drvdata_st));
+
+    data->env = env;
+    data->path = path;
+    data->sync = sync;
+
+    data->dbs = xhash_new(101);
+
+    data->filters = xhash_new(17);
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&data->lock, NULL);
+    pthread_cond_init(&data->dirty_cond, NULL);
+    pthread_cond_init(&data->synced_cond, NULL);
+
+    if(sync > 0) {
+        if(pthread_create(&data->flusher, NULL, _st_lmdb_flusher, (void *) data) == 0)
+            data->flushing = group = 1;
+        else {
+            log_write(drv->st->sm->log, LOG_WARNING, "lmdb: couldn't start flusher thread, flushing every commit instead");
+            mdb_env_set_flags(env, MDB_NOSYNC, 0);
+        }
+    }
+#endif
+
+    log_write(drv->st->sm->log, LOG_NOTICE, "lmdb: environment in %s, %d MB map, %s", path, size,
+              group ? "group commit" : "flush on every commit");
+
+    drv->private = (void *) data;
+
+    drv->add_type = _st_lmdb_add_type;
+    drv->put = _st_lmdb_put;
+    drv->get = _st_lmdb_get;
+    drv->count = _st_lmdb_count;
+    drv->replace = _st_lmdb_replace;
+    drv->delete = _st_lmdb_delete;
+    drv->free = _st_lmdb_free;
+
+    /* lmdb keeps writers apart, and readers don't need to be */
+    drv->threadsafe = 1;
+
+    return st_SUCCESS;
+}
@@ -27,150 +27,261 @@
 
 #include "sm.h"
 #include <mysql.h>
+#include <errmsg.h>
+#include <mysqld_error.h>
+
+/** most statements prepared on a connection; if we need more we start again */
+#define MYSQL_STMTS_MAX (256)
+
+/** idle connections are checked before they're used again after this many seconds */
+#define MYSQL_CHECK_IDLE (60)
 
 /** internal structure, holds our data */
 typedef struct drvdata_st {
-    MYSQL *conn;
+    connpool_t pool;
+
+    char *host, *port, *dbname, *user, *pass;
 
     char *prefix;
 
     int txn;
 } *drvdata_t;
 
-#define FALLBACK_BLOCKSIZE (4096)
-
-/** internal: do and return the math and ensure it gets realloc'd */
-static size_t _st_mysql_realloc(char **oblocks, size_t len) {
-    void *nblocks;
-    size_t nlen;
-    static size_t block_size = 0;
-
-    if (block_size == 0) {
-#ifdef HAVE_GETPAGESIZE
-        block_size = getpagesize();
-#elif defined(_SC_PAGESIZE)
-        block_size = sysconf(_SC_PAGESIZE);
-#elif defined(_SC_PAGE_SIZE)
-        block_size = sysconf(_SC_PAGE_SIZE);    
-#else
-        block_size = FALLBACK_BLOCKSIZE;
-#endif
+/** one database connection */
+typedef struct dbconn_st {
+    MYSQL *conn;
+    unsigned long id;
+
+    /** prepared statements, keyed by their sql. they only live as long as the connection */
+    xht stmts;
+
+    /** set while we're inside BEGIN .. COMMIT, so a lost connection isn't quietly retried */
+    int intxn;
+
+    /** set if it's beyond saving, so it's closed rather than given back to the pool */
+    int broken;
+} *dbconn_t;
+
+/** a query being put together: its sql, with a placeholder for each parameter */
+typedef struct query_st {
+    pool_t p;
+    spool sql;
+
+    int nparams, maxparams;
+    MYSQL_BIND *binds;
+} *query_t;
+
+static query_t _st_mysql_query(pool_t p) {
+    query_t q;
+
+    q = (query_t) pmalloco(p, sizeof(struct query_st));
+    q->p = p;
+    q->sql = spool_new(p);
+
+    return q;
+}
+
+/** add a parameter, and its placeholder. it's sent as it is, so nothing needs escaping */
+static void _st_mysql_param(query_t q, enum enum_field_types type, void *val, unsigned long len) {
+    MYSQL_BIND *binds;
+
+    if(q->nparams == q->maxparams) {
+        q->maxparams = q->maxparams ? q->maxparams * 2 : 8;
+
+        binds = (MYSQL_BIND *) pmalloco(q->p, sizeof(MYSQL_BIND) * q->maxparams);
+        if(q->nparams > 0)
+            memcpy(binds, q->binds, sizeof(MYSQL_BIND) * q->nparams);
+
+        q->binds = binds;
     }
-    /* round up to standard block sizes */
-    nlen = (((len-1)/block_size)+1)*block_size;
 
-    /* keep trying till we get it */
-    while((nblocks = realloc(*oblocks, nlen)) == NULL) sleep(1);
-    *oblocks = nblocks;
-    return nlen;
+    q->binds[q->nparams].buffer_type = (val != NULL) ? type : MYSQL_TYPE_NULL;
+    q->binds[q->nparams].buffer = val;
+    q->binds[q->nparams].buffer_length = len;
+    q->nparams++;
+
+    spool_add(q->sql, "?");
 }
 
-/** this is the safety check used to make sure there's always enough mem */
-#define MYSQL_SAFE(blocks, size, len) if((size) >= len) len = _st_mysql_realloc(&(blocks),(size + 1));
+static void _st_mysql_stmts_free(dbconn_t c) {
+    MYSQL_STMT *stmt;
 
-static void _st_mysql_convert_filter_recursive(st_driver_t drv, st_filter_t f, char **buf, int *buflen, int *nbuf) {
-    drvdata_t data = (drvdata_t) drv->private;
-    st_filter_t scan; 
-    char *cval;
-    int vlen;
+    if(c->stmts == NULL)
+        return;
 
-    switch(f->type) {
-        case st_filter_type_PAIR:
+    if(xhash_iter_first(c->stmts))
+        do {
+            xhash_iter_get(c->stmts, NULL, NULL, (void *) &stmt);
+            mysql_stmt_close(stmt);
+        } while(xhash_iter_next(c->stmts));
 
-            /* do sql escape processing of f->val */
-            cval = (char *) malloc(sizeof(char) * ((strlen((char *) f->val) * 2) + 1));
-            vlen = mysql_real_escape_string(data->conn, cval, (char *) f->val, strlen((char *) f->val));
+    xhash_free(c->stmts);
+    c->stmts = NULL;
+}
 
-            MYSQL_SAFE((*buf), *buflen + 12 + strlen(f->key) + vlen, *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), "( `%s` = \'%s\' ) ", f->key, cval);
-            free(cval);
+/** forget the statements we prepared, because the connection they were on has gone, or we have too many */
+static void _st_mysql_stmts_reset(dbconn_t c) {
+    _st_mysql_stmts_free(c);
 
-            break;
+    c->stmts = xhash_new(101);
+}
 
-        case st_filter_type_AND:
-            MYSQL_SAFE((*buf), *buflen + 2, *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), "( ");
+/** run a query, preparing it first if it's the first of its shape on this connection. returns the statement, ready for its results */
+static MYSQL_STMT *_st_mysql_run(st_driver_t drv, dbconn_t c, query_t q, const char *sql) {
+    MYSQL_STMT *stmt;
+    int i, retry;
 
-            for(scan = f->sub; scan != NULL; scan = scan->next) {
-                _st_mysql_convert_filter_recursive(drv, scan, buf, buflen, nbuf);
+    for(i = 0; i < q->nparams; i++)
+        q->binds[i].length = &q->binds[i].buffer_length;
 
-                if(scan->next != NULL) {
-                    MYSQL_SAFE((*buf), *buflen + 4, *buflen);
-                    *nbuf += sprintf(&((*buf)[*nbuf]), "AND ");
-                }
+    for(retry = 0; ; retry++) {
+        stmt = (MYSQL_STMT *) xhash_get(c->stmts, sql);
+
+        if(stmt == NULL) {
+            if(xhash_count(c->stmts) >= MYSQL_STMTS_MAX)
+                _st_mysql_stmts_reset(c);
+
+            log_debug(ZONE, "preparing: %s", sql);
+
+            stmt = mysql_stmt_init(c->conn);
+            if(stmt == NULL) {
+                log_write(drv->st->sm->log, LOG_ERR, "mysql: unable to allocate statement: %s", mysql_error(c->conn));
+                return NULL;
             }
 
-            MYSQL_SAFE((*buf), *buflen + 2, *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
+            if(mysql_stmt_prepare(stmt, sql, strlen(sql)) == 0)
+                xhash_put(c->stmts, pstrdup(xhash_pool(c->stmts), sql), (void *) stmt);
+        }
+
+        if(xhash_get(c->stmts, sql) == stmt && mysql_stmt_bind_param(stmt, q->binds) == 0 && mysql_stmt_execute(stmt) == 0)
+            return stmt;
 
-            return;
+        /* the statements went with the old connection */
+        if(retry || c->intxn || (mysql_stmt_errno(stmt) != CR_SERVER_GONE_ERROR && mysql_stmt_errno(stmt) != CR_SERVER_LOST && mysql_stmt_errno(stmt) != ER_UNKNOWN_STMT_HANDLER)) {
+            log_write(drv->st->sm->log, LOG_ERR, "mysql: sql statement failed: %s", mysql_stmt_error(stmt));
+            if(xhash_get(c->stmts, sql) != stmt)
+                mysql_stmt_close(stmt);
+            return NULL;
+        }
+
+        log_write(drv->st->sm->log, LOG_ERR, "mysql: lost connection to database, attempting reconnect");
+
+        if(xhash_get(c->stmts, sql) != stmt)
+            mysql_stmt_close(stmt);
+        _st_mysql_stmts_reset(c);
+
+        if(mysql_ping(c->conn) != 0) {
+            log_write(drv->st->sm->log, LOG_ERR, "mysql: connection to database lost");
+            c->broken = 1;
+            return NULL;
+        }
+
+        c->id = mysql_thread_id(c->conn);
+    }
+}
+
+/** start a transaction. the isolation level was set when we connected */
+static int _st_mysql_begin(st_driver_t drv, dbconn_t c) {
+
+    if(mysql_query(c->conn, "BEGIN") != 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "mysql: sql transaction begin failed: %s", mysql_error(c->conn));
+        return 1;
+    }
+
+    c->intxn = 1;
+
+    return 0;
+}
+
+/** finish a transaction, either committing it or rolling it back */
+static int _st_mysql_end(st_driver_t drv, dbconn_t c, int commit) {
+
+    c->intxn = 0;
+
+    if(!commit) {
+        mysql_query(c->conn, "ROLLBACK");
+        return 1;
+    }
+
+    if(mysql_query(c->conn, "COMMIT") != 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "mysql: sql transaction commit failed: %s", mysql_error(c->conn));
+        mysql_query(c->conn, "ROLLBACK");
+        return 1;
+    }
+
+    return 0;
+}
+
+static void _st_mysql_convert_filter_recursive(query_t q, st_filter_t f) {
+    st_filter_t scan;
+    char *val;
+
+    switch(f->type) {
+        case st_filter_type_PAIR:
+            spooler(q->sql, "( `", f->key, "` = ", q->sql);
+            val = pstrdup(q->p, f->val);
+            _st_mysql_param(q, MYSQL_TYPE_STRING, val, strlen(val));
+            spool_add(q->sql, " ) ");
 
+            break;
+
+        case st_filter_type_AND:
         case st_filter_type_OR:
-            MYSQL_SAFE((*buf), *buflen + 2, *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), "( ");
+            spool_add(q->sql, "( ");
 
             for(scan = f->sub; scan != NULL; scan = scan->next) {
-                _st_mysql_convert_filter_recursive(drv, scan, buf, buflen, nbuf);
+                _st_mysql_convert_filter_recursive(q, scan);
 
-                if(scan->next != NULL) {
-                    MYSQL_SAFE((*buf), *buflen + 3, *buflen);
-                    *nbuf += sprintf(&((*buf)[*nbuf]), "OR ");
-                }
+                if(scan->next != NULL)
+                    spool_add(q->sql, f->type == st_filter_type_AND ? "AND " : "OR ");
             }
 
-            MYSQL_SAFE((*buf), *buflen + 2, *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
+            spool_add(q->sql, ") ");
 
             return;
 
         case st_filter_type_NOT:
-            MYSQL_SAFE((*buf), *buflen + 6, *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), "( NOT ");
+            spool_add(q->sql, "( NOT ");
 
-            _st_mysql_convert_filter_recursive(drv, f->sub, buf, buflen, nbuf);
+            _st_mysql_convert_filter_recursive(q, f->sub);
 
-            MYSQL_SAFE((*buf), *buflen + 2, *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
+            spool_add(q->sql, ") ");
 
             return;
     }
 }
 
-static char *_st_mysql_convert_filter(st_driver_t drv, const char *owner, const char *filter) {
-    char *buf = NULL;
-    int buflen = 0, nbuf = 0;
+/** add the where clause for an owner and filter */
+static void _st_mysql_convert_filter(query_t q, const char *owner, const char *filter) {
     st_filter_t f;
 
-    MYSQL_SAFE(buf, 23 + strlen(owner), buflen);
-
-    nbuf = sprintf(buf, "`collection-owner` = '%s'", owner);
+    spool_add(q->sql, "`collection-owner` = ");
+    _st_mysql_param(q, MYSQL_TYPE_STRING, (void *) owner, strlen(owner));
 
     f = storage_filter(filter);
     if(f == NULL)
-        return buf;
+        return;
 
-    MYSQL_SAFE(buf, buflen + 5, buflen);
-    nbuf += sprintf(&buf[nbuf], " AND ");
+    spool_add(q->sql, " AND ");
 
-    _st_mysql_convert_filter_recursive(drv, f, &buf, &buflen, &nbuf);
+    _st_mysql_convert_filter_recursive(q, f);
 
     pool_free(f->p);
-
-    return buf;
 }
 
 static st_ret_t _st_mysql_add_type(st_driver_t drv, const char *type) {
     return st_SUCCESS;
 }
 
-static st_ret_t _st_mysql_put_guts(st_driver_t drv, const char *type, const char *owner, os_t os) {
+static st_ret_t _st_mysql_put_guts(st_driver_t drv, dbconn_t c, const char *type, const char *owner, os_t os) {
     drvdata_t data = (drvdata_t) drv->private;
-    char *left = NULL, *right = NULL;
-    int lleft = 0, lright = 0, nleft, nright;
+    pool_t p;
+    query_t q;
+    spool cols;
     os_object_t o;
-    char *key, *cval = NULL;
+    char *key, *cval;
     void *val;
-    int vlen;
+    int *ival;
     os_type_t ot;
     char *xml;
     int xlen;
@@ -184,199 +295,209 @@ static st_ret_t _st_mysql_put_guts(st_driver_t drv, const char *type, const char
         type = tbuf;
     }
 
+    p = pool_new();
+
     if(os_iter_first(os))
         do {
-            MYSQL_SAFE(left, strlen(type) + 35, lleft);
-            nleft = sprintf(left, "INSERT INTO `%s` ( `collection-owner`", type);
-    
-            MYSQL_SAFE(right, strlen(owner) + 14, lright);
-            nright = sprintf(right, " ) VALUES ( '%s'", owner);
-    
+            q = _st_mysql_query(p);
+
+            cols = spool_new(p);
+            spooler(cols, "INSERT INTO `", type, "` ( `collection-owner`", cols);
+
+            spool_add(q->sql, " ) VALUES ( ");
+            _st_mysql_param(q, MYSQL_TYPE_STRING, (void *) owner, strlen(owner));
+
             o = os_iter_object(os);
             if(os_object_iter_first(o))
                 do {
                     os_object_iter_get(o, &key, &val, &ot);
-        
+
+                    log_debug(ZONE, "key %s type %d", key, ot);
+
+                    spooler(cols, ", `", key, "`", cols);
+                    spool_add(q->sql, ", ");
+
                     switch(ot) {
                         case os_type_BOOLEAN:
-                            cval = val ? strdup("1") : strdup("0");
-                            vlen = 1;
+                            cval = (char *) pmalloc(p, 1);
+                            cval[0] = ((int) (long) val) ? 1 : 0;
+                            _st_mysql_param(q, MYSQL_TYPE_TINY, cval, 1);
                             break;
-        
+
                         case os_type_INTEGER:
-                            cval = (char *) malloc(sizeof(char) * 20);
-                            sprintf(cval, "%d", (int) val);
-                            vlen = strlen(cval);
+                            ival = (int *) pmalloc(p, sizeof(int));
+                            *ival = (int) (long) val;
+                            _st_mysql_param(q, MYSQL_TYPE_LONG, ival, sizeof(int));
                             break;
-        
+
                         case os_type_STRING:
-                            cval = (char *) malloc(sizeof(char) * ((strlen((char *) val) * 2) + 1));
-                            vlen = mysql_real_escape_string(data->conn, cval, (char *) val, strlen((char *) val));
+                            _st_mysql_param(q, MYSQL_TYPE_STRING, val, strlen((char *) val));
                             break;
-        
+
                         case os_type_NAD:
-                            nad_print((nad_t) val, 0, &xml, &xlen);
-                            cval = (char *) malloc(sizeof(char) * ((xlen * 2) + 4));
-                            vlen = mysql_real_escape_string(data->conn, &cval[3], xml, xlen) + 3;
-                            strncpy(cval, "NAD", 3);
+                            storage_nad_encode(drv->st, (nad_t) val, &xml, &xlen);
+                            cval = (char *) pmalloc(p, xlen + 3);
+                            memcpy(cval, "NAD", 3);
+                            memcpy(&cval[3], xml, xlen);
+                            free(xml);
+                            _st_mysql_param(q, MYSQL_TYPE_STRING, cval, xlen + 3);
                             break;
 
-			case os_type_UNKNOWN:
+                        case os_type_UNKNOWN:
+                            _st_mysql_param(q, MYSQL_TYPE_NULL, NULL, 0);
                             break;
                     }
-        
-                    log_debug(ZONE, "key %s val %s", key, cval);
-        
-                    MYSQL_SAFE(left, lleft + strlen(key) + 4, lleft);
-                    nleft += sprintf(&left[nleft], ", `%s`", key);
-        
-                    MYSQL_SAFE(right, lright + strlen(cval) + 4, lright);
-                    nright += sprintf(&right[nright], ", '%s'", cval);
-        
-                    free(cval);
                 } while(os_object_iter_next(o));
-    
-            MYSQL_SAFE(left, lleft + strlen(right) + 2, lleft);
-            sprintf(&left[nleft], "%s )", right);
-        
-            log_debug(ZONE, "prepared sql: %s", left);
-    
-            if(mysql_query(data->conn, left) != 0) {
-                log_write(drv->st->sm->log, LOG_ERR, "mysql: sql insert failed: %s", mysql_error(data->conn));
-                free(left);
-                free(right);
+
+            spool_add(q->sql, " )");
+
+            if(_st_mysql_run(drv, c, q, spools(p, spool_print(cols), spool_print(q->sql), p)) == NULL) {
+                log_write(drv->st->sm->log, LOG_ERR, "mysql: sql insert failed");
+                pool_free(p);
                 return st_FAILED;
             }
-    
+
         } while(os_iter_next(os));
 
-    free(left);
-    free(right);
+    pool_free(p);
 
     return st_SUCCESS;
 }
 
+/** get a connection from the pool */
+static dbconn_t _st_mysql_conn_get(st_driver_t drv) {
+    drvdata_t data = (drvdata_t) drv->private;
+    dbconn_t c;
+
+    if((c = (dbconn_t) connpool_get(data->pool)) == NULL)
+        log_write(drv->st->sm->log, LOG_ERR, "mysql: no database connection available");
+
+    return c;
+}
+
+/** and give it back */
+static void _st_mysql_conn_put(st_driver_t drv, dbconn_t c) {
+    drvdata_t data = (drvdata_t) drv->private;
+
+    connpool_put(data->pool, (void *) c, c->broken);
+}
+
 static st_ret_t _st_mysql_put(st_driver_t drv, const char *type, const char *owner, os_t os) {
     drvdata_t data = (drvdata_t) drv->private;
+    dbconn_t c;
+    st_ret_t ret = st_FAILED;
+    int txn;
 
     if(os_count(os) == 0)
         return st_SUCCESS;
 
-    if(mysql_ping(data->conn) != 0) {
-        log_write(drv->st->sm->log, LOG_ERR, "mysql: connection to database lost");
+    if((c = _st_mysql_conn_get(drv)) == NULL)
         return st_FAILED;
-    }
 
-    if(data->txn) {
-        if(mysql_query(data->conn, "SET TRANSACTION ISOLATION LEVEL SERIALIZABLE") != 0) {
-            log_write(drv->st->sm->log, LOG_ERR, "mysql: sql transaction setup failed: %s", mysql_error(data->conn));
-            return st_FAILED;
-        }
+    /* one insert is atomic by itself */
+    txn = data->txn && os_count(os) > 1;
 
-        if(mysql_query(data->conn, "BEGIN") != 0) {
-            log_write(drv->st->sm->log, LOG_ERR, "mysql: sql transaction begin failed: %s", mysql_error(data->conn));
-            return st_FAILED;
-        }
+    if(!txn || _st_mysql_begin(drv, c) == 0) {
+        if(_st_mysql_put_guts(drv, c, type, owner, os) != st_SUCCESS) {
+            if(txn)
+                _st_mysql_end(drv, c, 0);
+        } else if(!txn || _st_mysql_end(drv, c, 1) == 0)
+            ret = st_SUCCESS;
     }
 
-    if(_st_mysql_put_guts(drv, type, owner, os) != st_SUCCESS) {
-        if(data->txn)
-            mysql_query(data->conn, "ROLLBACK");
-        return st_FAILED;
-    }
+    _st_mysql_conn_put(drv, c);
 
-    if(data->txn)
-        if(mysql_query(data->conn, "COMMIT") != 0) {
-            log_write(drv->st->sm->log, LOG_ERR, "mysql: sql transaction commit failed: %s", mysql_error(data->conn));
-            mysql_query(data->conn, "ROLLBACK");
-            return st_FAILED;
-        }
-
-    return st_SUCCESS;
+    return ret;
 }
 
-static st_ret_t _st_mysql_get(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t *os) {
+static st_ret_t _st_mysql_get_guts(st_driver_t drv, dbconn_t c, const char *type, const char *owner, const char *filter, os_t *os) {
     drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    int buflen = 0;
+    pool_t p;
+    query_t q;
+    MYSQL_STMT *stmt;
     MYSQL_RES *res;
-    int ntuples, nfields, i, j;
+    int ntuples, nfields, j;
     MYSQL_FIELD *fields;
-    MYSQL_ROW tuple;
+    MYSQL_BIND *binds;
     unsigned long *lengths;
+    my_bool *nulls, update = 1;
     os_object_t o;
     char *val;
     os_type_t ot;
     int ival;
     char tbuf[128];
 
-    if(mysql_ping(data->conn) != 0) {
-        log_write(drv->st->sm->log, LOG_ERR, "mysql: connection to database lost");
-        return st_FAILED;
-    }
-
     if(data->prefix != NULL) {
         snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
         type = tbuf;
     }
 
-    cond = _st_mysql_convert_filter(drv, owner, filter);
-    log_debug(ZONE, "generated filter: %s", cond);
-
-    MYSQL_SAFE(buf, strlen(type) + strlen(cond) + 50, buflen);
-    sprintf(buf, "SELECT * FROM `%s` WHERE %s ORDER BY `object-sequence`", type, cond);
-    free(cond);
+    p = pool_new();
+    q = _st_mysql_query(p);
 
-    log_debug(ZONE, "prepared sql: %s", buf);
+    spooler(q->sql, "SELECT * FROM `", type, "` WHERE ", q->sql);
+    _st_mysql_convert_filter(q, owner, filter);
+    spool_add(q->sql, " ORDER BY `object-sequence`");
 
-    if(mysql_query(data->conn, buf) != 0) {
-        log_write(drv->st->sm->log, LOG_ERR, "mysql: sql select failed: %s", mysql_error(data->conn));
-        free(buf);
+    if((stmt = _st_mysql_run(drv, c, q, spool_print(q->sql))) == NULL) {
+        log_write(drv->st->sm->log, LOG_ERR, "mysql: sql select failed");
+        pool_free(p);
         return st_FAILED;
     }
-    free(buf);
 
-    res = mysql_store_result(data->conn);
-    if(res == NULL) {
-        log_write(drv->st->sm->log, LOG_ERR, "mysql: sql result retrieval failed: %s", mysql_error(data->conn));
+    /* pull the whole lot over, so we know how big to make the buffers */
+    mysql_stmt_attr_set(stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &update);
+
+    if(mysql_stmt_store_result(stmt) != 0 || (res = mysql_stmt_result_metadata(stmt)) == NULL) {
+        log_write(drv->st->sm->log, LOG_ERR, "mysql: sql result retrieval failed: %s", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
+        pool_free(p);
         return st_FAILED;
     }
 
-    ntuples = mysql_num_rows(res);
-    if(ntuples == 0) {
+    ntuples = mysql_stmt_num_rows(stmt);
+    nfields = mysql_num_fields(res);
+
+    if(ntuples == 0 || nfields == 0) {
+        if(ntuples > 0)
+            log_debug(ZONE, "weird, tuples were returned but no fields *shrug*");
         mysql_free_result(res);
+        mysql_stmt_free_result(stmt);
+        pool_free(p);
         return st_NOTFOUND;
     }
 
     log_debug(ZONE, "%d tuples returned", ntuples);
 
-    nfields = mysql_num_fields(res);
+    fields = mysql_fetch_fields(res);
 
-    if(nfields == 0) {
-        log_debug(ZONE, "weird, tuples were returned but no fields *shrug*");
-        mysql_free_result(res);
-        return st_NOTFOUND;
+    /* everything comes back as text, like it did before */
+    binds = (MYSQL_BIND *) pmalloco(p, sizeof(MYSQL_BIND) * nfields);
+    lengths = (unsigned long *) pmalloco(p, sizeof(unsigned long) * nfields);
+    nulls = (my_bool *) pmalloco(p, sizeof(my_bool) * nfields);
+
+    for(j = 0; j < nfields; j++) {
+        binds[j].buffer_type = MYSQL_TYPE_STRING;
+        binds[j].buffer_length = fields[j].max_length + 1;
+        binds[j].buffer = pmalloc(p, binds[j].buffer_length);
+        binds[j].length = &lengths[j];
+        binds[j].is_null = &nulls[j];
     }
 
-    fields = mysql_fetch_fields(res);
+    mysql_stmt_bind_result(stmt, binds);
 
     *os = os_new();
 
-    for(i = 0; i < ntuples; i++) {
+    while(mysql_stmt_fetch(stmt) == 0) {
         o = os_object_new(*os);
 
-        if((tuple = mysql_fetch_row(res)) == NULL)
-            break;
-
         for(j = 0; j < nfields; j++) {
             if(strcmp(fields[j].name, "collection-owner") == 0)
                 continue;
 
-            if(tuple[j] == NULL)
+            if(nulls[j])
                 continue;
 
-            lengths = mysql_fetch_lengths(res);
-
             switch(fields[j].type) {
                 case FIELD_TYPE_TINY:   /* tinyint */
                     ot = os_type_BOOLEAN;
@@ -396,7 +517,8 @@ static st_ret_t _st_mysql_get(st_driver_t drv, const char *type, const char *own
                     continue;
             }
 
-            val = tuple[j];
+            val = (char *) binds[j].buffer;
+            val[lengths[j]] = '\0';
 
             switch(ot) {
                 case os_type_BOOLEAN:
@@ -421,201 +543,265 @@ static st_ret_t _st_mysql_get(st_driver_t drv, const char *type, const char *own
     }
 
     mysql_free_result(res);
+    mysql_stmt_free_result(stmt);
+    pool_free(p);
 
     return st_SUCCESS;
 }
 
-static st_ret_t _st_mysql_count(st_driver_t drv, const char *type, const char *owner, const char *filter, int *count) {
-    drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    int buflen = 0;
-    MYSQL_RES *res;
-    int ntuples, nfields;
-    MYSQL_ROW tuple;
-    char tbuf[128];
+static st_ret_t _st_mysql_get(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t *os) {
+    dbconn_t c;
+    st_ret_t ret;
 
-    if(mysql_ping(data->conn) != 0) {
-        log_write(drv->st->sm->log, LOG_ERR, "mysql: connection to database lost");
+    if((c = _st_mysql_conn_get(drv)) == NULL)
         return st_FAILED;
-    }
+
+    ret = _st_mysql_get_guts(drv, c, type, owner, filter, os);
+
+    _st_mysql_conn_put(drv, c);
+
+    return ret;
+}
+
+static st_ret_t _st_mysql_count_guts(st_driver_t drv, dbconn_t c, const char *type, const char *owner, const char *filter, int *count) {
+    drvdata_t data = (drvdata_t) drv->private;
+    pool_t p;
+    query_t q;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND bind;
+    long long n = 0;
+    int ret;
+    char tbuf[128];
 
     if(data->prefix != NULL) {
         snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
         type = tbuf;
     }
 
-    cond = _st_mysql_convert_filter(drv, owner, filter);
-    log_debug(ZONE, "generated filter: %s", cond);
+    p = pool_new();
+    q = _st_mysql_query(p);
 
-    MYSQL_SAFE(buf, strlen(type) + strlen(cond) + 31, buflen);
-    sprintf(buf, "SELECT COUNT(*) FROM `%s` WHERE %s", type, cond);
-    free(cond);
+    spooler(q->sql, "SELECT COUNT(*) FROM `", type, "` WHERE ", q->sql);
+    _st_mysql_convert_filter(q, owner, filter);
 
-    log_debug(ZONE, "prepared sql: %s", buf);
+    stmt = _st_mysql_run(drv, c, q, spool_print(q->sql));
 
-    if(mysql_query(data->conn, buf) != 0) {
-        log_write(drv->st->sm->log, LOG_ERR, "mysql: sql select failed: %s", mysql_error(data->conn));
-        free(buf);
-        return st_FAILED;
-    }
-    free(buf);
+    pool_free(p);
 
-    res = mysql_store_result(data->conn);
-    if(res == NULL) {
-        log_write(drv->st->sm->log, LOG_ERR, "mysql: sql result retrieval failed: %s", mysql_error(data->conn));
+    if(stmt == NULL) {
+        log_write(drv->st->sm->log, LOG_ERR, "mysql: sql select failed");
         return st_FAILED;
     }
 
-    ntuples = mysql_num_rows(res);
-    if(ntuples == 0) {
-        mysql_free_result(res);
-        return st_NOTFOUND;
-    }
+    memset(&bind, 0, sizeof(MYSQL_BIND));
+    bind.buffer_type = MYSQL_TYPE_LONGLONG;
+    bind.buffer = &n;
 
-    log_debug(ZONE, "%d tuples returned", ntuples);
+    mysql_stmt_bind_result(stmt, &bind);
 
-    nfields = mysql_num_fields(res);
+    ret = mysql_stmt_fetch(stmt);
 
-    if(nfields == 0) {
-        log_debug(ZONE, "weird, tuples were returned but no fields *shrug*");
-        mysql_free_result(res);
-        return st_NOTFOUND;
-    }
+    mysql_stmt_free_result(stmt);
 
-    if((tuple = mysql_fetch_row(res)) == NULL)
+    if(ret != 0)
         return st_NOTFOUND;
 
     if (count!=NULL)
-        *count = atoi(tuple[0]);
-
-    mysql_free_result(res);
+        *count = (int) n;
 
     return st_SUCCESS;
 }
 
-static st_ret_t _st_mysql_delete(st_driver_t drv, const char *type, const char *owner, const char *filter) {
-    drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    int buflen = 0;
-    char tbuf[128];
+static st_ret_t _st_mysql_count(st_driver_t drv, const char *type, const char *owner, const char *filter, int *count) {
+    dbconn_t c;
+    st_ret_t ret;
 
-    if(mysql_ping(data->conn) != 0) {
-        log_write(drv->st->sm->log, LOG_ERR, "mysql: connection to database lost");
+    if((c = _st_mysql_conn_get(drv)) == NULL)
         return st_FAILED;
-    }
+
+    ret = _st_mysql_count_guts(drv, c, type, owner, filter, count);
+
+    _st_mysql_conn_put(drv, c);
+
+    return ret;
+}
+
+static st_ret_t _st_mysql_delete_guts(st_driver_t drv, dbconn_t c, const char *type, const char *owner, const char *filter) {
+    drvdata_t data = (drvdata_t) drv->private;
+    pool_t p;
+    query_t q;
+    MYSQL_STMT *stmt;
+    char tbuf[128];
 
     if(data->prefix != NULL) {
         snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
         type = tbuf;
     }
 
-    cond = _st_mysql_convert_filter(drv, owner, filter);
-    log_debug(ZONE, "generated filter: %s", cond);
+    p = pool_new();
+    q = _st_mysql_query(p);
+
+    spooler(q->sql, "DELETE FROM `", type, "` WHERE ", q->sql);
+    _st_mysql_convert_filter(q, owner, filter);
 
-    MYSQL_SAFE(buf, strlen(type) + strlen(cond) + 21, buflen);
-    sprintf(buf, "DELETE FROM `%s` WHERE %s", type, cond);
-    free(cond);
+    stmt = _st_mysql_run(drv, c, q, spool_print(q->sql));
 
-    log_debug(ZONE, "prepared sql: %s", buf);
+    pool_free(p);
 
-    if(mysql_query(data->conn, buf) != 0) {
-        log_write(drv->st->sm->log, LOG_ERR, "mysql: sql delete failed: %s", mysql_error(data->conn));
-        free(buf);
+    if(stmt == NULL) {
+        log_write(drv->st->sm->log, LOG_ERR, "mysql: sql delete failed");
         return st_FAILED;
     }
-    free(buf);
 
     return st_SUCCESS;
 }
 
-static st_ret_t _st_mysql_replace(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t os) {
-    drvdata_t data = (drvdata_t) drv->private;
+static st_ret_t _st_mysql_delete(st_driver_t drv, const char *type, const char *owner, const char *filter) {
+    dbconn_t c;
+    st_ret_t ret;
 
-    if(mysql_ping(data->conn) != 0) {
-        log_write(drv->st->sm->log, LOG_ERR, "mysql: connection to database lost");
+    if((c = _st_mysql_conn_get(drv)) == NULL)
         return st_FAILED;
-    }
 
-    if(data->txn) {
-        if(mysql_query(data->conn, "SET TRANSACTION ISOLATION LEVEL SERIALIZABLE") != 0) {
-            log_write(drv->st->sm->log, LOG_ERR, "mysql: sql transaction setup failed: %s", mysql_error(data->conn));
-            return st_FAILED;
-        }
+    ret = _st_mysql_delete_guts(drv, c, type, owner, filter);
 
-        if(mysql_query(data->conn, "BEGIN") != 0) {
-            log_write(drv->st->sm->log, LOG_ERR, "mysql: sql transaction begin failed: %s", mysql_error(data->conn));
-            return st_FAILED;
-        }
-    }
+    _st_mysql_conn_put(drv, c);
 
-    if(_st_mysql_delete(drv, type, owner, filter) == st_FAILED) {
-        if(data->txn)
-            mysql_query(data->conn, "ROLLBACK");
-        return st_FAILED;
-    }
+    return ret;
+}
 
-    if(_st_mysql_put_guts(drv, type, owner, os) == st_FAILED) {
-        if(data->txn)
-            mysql_query(data->conn, "ROLLBACK");
+static st_ret_t _st_mysql_replace(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t os) {
+    drvdata_t data = (drvdata_t) drv->private;
+    dbconn_t c;
+    st_ret_t ret = st_FAILED;
+
+    if((c = _st_mysql_conn_get(drv)) == NULL)
         return st_FAILED;
+
+    if(!data->txn || _st_mysql_begin(drv, c) == 0) {
+        if(_st_mysql_delete_guts(drv, c, type, owner, filter) == st_FAILED || _st_mysql_put_guts(drv, c, type, owner, os) == st_FAILED) {
+            if(data->txn)
+                _st_mysql_end(drv, c, 0);
+        } else if(!data->txn || _st_mysql_end(drv, c, 1) == 0)
+            ret = st_SUCCESS;
     }
 
-    if(data->txn)
-        if(mysql_query(data->conn, "COMMIT") != 0) {
-            log_write(drv->st->sm->log, LOG_ERR, "mysql: sql transaction commit failed: %s", mysql_error(data->conn));
-            mysql_query(data->conn, "ROLLBACK");
-            return st_FAILED;
-        }
+    _st_mysql_conn_put(drv, c);
 
-    return st_SUCCESS;
+    return ret;
 }
 
 static void _st_mysql_free(st_driver_t drv) {
     drvdata_t data = (drvdata_t) drv->private;
+    connpool_stats_t stats;
+
+    connpool_stats(data->pool, &stats);
+    log_write(drv->st->sm->log, LOG_INFO, "mysql: %lu queries, %lu waited for a connection (%lu us on average), %d of %d connections busy at most, %lu connection checks, %lu connection errors",
+        stats.gets, stats.waits, stats.waits ? stats.wait_usecs / stats.waits : 0, stats.inuse_max, stats.open, stats.checks, stats.errors);
 
-    mysql_close(data->conn);
+    connpool_free(data->pool);
 
     free(data);
 }
 
-DLLEXPORT st_ret_t st_init(st_driver_t drv) {
-    char *host, *port, *dbname, *user, *pass;
+/** open a connection for the pool */
+static void *_st_mysql_conn_open(void *arg) {
+    st_driver_t drv = (st_driver_t) arg;
+    drvdata_t data = (drvdata_t) drv->private;
     MYSQL *conn;
-    drvdata_t data;
-
-    host = config_get_one(drv->st->sm->config, "storage.mysql.host", 0);
-    port = config_get_one(drv->st->sm->config, "storage.mysql.port", 0);
-    dbname = config_get_one(drv->st->sm->config, "storage.mysql.dbname", 0);
-    user = config_get_one(drv->st->sm->config, "storage.mysql.user", 0);
-    pass = config_get_one(drv->st->sm->config, "storage.mysql.pass", 0);
-
-    if(host == NULL || port == NULL || dbname == NULL || user == NULL || pass == NULL) {
-        log_write(drv->st->sm->log, LOG_ERR, "mysql: invalid driver config");
-        return st_FAILED;
-    }
+    dbconn_t c;
 
     conn = mysql_init(NULL);
     if(conn == NULL) {
         log_write(drv->st->sm->log, LOG_ERR, "mysql: unable to allocate database connection state");
-        return st_FAILED;
+        return NULL;
     }
 
     mysql_options(conn, MYSQL_READ_DEFAULT_GROUP, "jabberd");
     mysql_options(conn, MYSQL_SET_CHARSET_NAME, "utf8");
 
+    /* once per connection (and again if it reconnects), rather than before every transaction */
+    if(data->txn)
+        mysql_options(conn, MYSQL_INIT_COMMAND, "SET SESSION TRANSACTION ISOLATION LEVEL SERIALIZABLE");
+
     /* connect with CLIENT_INTERACTIVE to get a (possibly) higher timeout value than default */
-    if(mysql_real_connect(conn, host, user, pass, dbname, atoi(port), NULL, CLIENT_INTERACTIVE) == NULL) {
+    if(mysql_real_connect(conn, data->host, data->user, data->pass, data->dbname, atoi(data->port), NULL, CLIENT_INTERACTIVE) == NULL) {
         log_write(drv->st->sm->log, LOG_ERR, "mysql: connection to database failed: %s", mysql_error(conn));
         mysql_close(conn);
-        return st_FAILED;
+        return NULL;
     }
 
     /* Set reconnect flag to 1 (set to 0 by default from mysql 5 on) */
     conn->reconnect = 1;
 
+    c = (dbconn_t) calloc(1, sizeof(struct dbconn_st));
+
+    c->conn = conn;
+    c->id = mysql_thread_id(conn);
+
+    _st_mysql_stmts_reset(c);
+
+    return (void *) c;
+}
+
+/** make sure a connection that's been idle is still there. if it had to reconnect, the statements have gone */
+static int _st_mysql_conn_check(void *conn, void *arg) {
+    dbconn_t c = (dbconn_t) conn;
+
+    if(mysql_ping(c->conn) != 0)
+        return 1;
+
+    if(mysql_thread_id(c->conn) != c->id) {
+        c->id = mysql_thread_id(c->conn);
+        _st_mysql_stmts_reset(c);
+    }
+
+    return 0;
+}
+
+static void _st_mysql_conn_close(void *conn, void *arg) {
+    dbconn_t c = (dbconn_t) conn;
+
+    _st_mysql_stmts_free(c);
+
+    mysql_close(c->conn);
+
+    free(c);
+}
+
+/** libmysqlclient wants to know about each thread that uses it */
+static void _st_mysql_thread_init(st_driver_t drv) {
+    mysql_thread_init();
+}
+
+static void _st_mysql_thread_free(st_driver_t drv) {
+    mysql_thread_end();
+}
+
+DLLEXPORT st_ret_t st_init(st_driver_t drv) {
+    char *host, *port, *dbname, *user, *pass;
+    drvdata_t data;
+    dbconn_t c;
+    int size;
+
+    host = config_get_one(drv->st->sm->config, "storage.mysql.host", 0);
+    port = config_get_one(drv->st->sm->config, "storage.mysql.port", 0);
+    dbname = config_get_one(drv->st->sm->config, "storage.mysql.dbname", 0);
+    user = config_get_one(drv->st->sm->config, "storage.mysql.user", 0);
+    pass = config_get_one(drv->st->sm->config, "storage.mysql.pass", 0);
+
+    if(host == NULL || port == NULL || dbname == NULL || user == NULL || pass == NULL) {
+        log_write(drv->st->sm->log, LOG_ERR, "mysql: invalid driver config");
+        return st_FAILED;
+    }
+
     data = (drvdata_t) calloc(1, sizeof(struct drvdata_st));
 
-    data->conn = conn;
+    data->host = host;
+    data->port = port;
+    data->dbname = dbname;
+    data->user = user;
+    data->pass = pass;
 
     if(config_get_one(drv->st->sm->config, "storage.mysql.transactions", 0) != NULL)
         data->txn = 1;
@@ -624,8 +810,21 @@ DLLEXPORT st_ret_t st_init(st_driver_t drv) {
 
     data->prefix = config_get_one(drv->st->sm->config, "storage.mysql.prefix", 0);
 
+    /* one for each worker, and one for the main loop */
+    size = j_atoi(config_get_one(drv->st->sm->config, "storage.mysql.connections", 0), drv->st->threads + 1);
+
+    data->pool = connpool_new(size, MYSQL_CHECK_IDLE, _st_mysql_conn_open, _st_mysql_conn_check, _st_mysql_conn_close, (void *) drv);
+
     drv->private = (void *) data;
 
+    /* make sure we can get through before we say we're ready */
+    if((c = (dbconn_t) connpool_get(data->pool)) == NULL) {
+        connpool_free(data->pool);
+        free(data);
+        return st_FAILED;
+    }
+    connpool_put(data->pool, (void *) c, 0);
+
     drv->add_type = _st_mysql_add_type;
     drv->put = _st_mysql_put;
     drv->count = _st_mysql_count;
@@ -633,6 +832,11 @@ DLLEXPORT st_ret_t st_init(st_driver_t drv) {
     drv->delete = _st_mysql_delete;
     drv->replace = _st_mysql_replace;
     drv->free = _st_mysql_free;
+    drv->thread_init = _st_mysql_thread_init;
+    drv->thread_free = _st_mysql_thread_free;
+
+    /* each call takes its own connection */
+    drv->threadsafe = (size > 1);
 
     return st_SUCCESS;
 }
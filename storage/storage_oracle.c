@@ -411,6 +411,7 @@ static st_ret_t _st_oracle_put_guts(st_driver_t drv, char *type, char *owner, os
 
             /* !!! might not be a good idea to mark nads this way */
             case os_type_NAD:
+          /* Always xml here; packed nads are nearly twice the size, and values go in as literals of 4000 bytes at most. */
               nad_print((nad_t) val, 0, &xml, &xlen);
           /* Ensure that we have enough space for an escaped string. */
               cval = (char *) malloc(sizeof(char) * ((xlen * 2 + count_chars((char *) val,'&') * 8) + 4));
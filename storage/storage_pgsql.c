@@ -28,357 +28,422 @@
 #include "sm.h"
 #include <libpq-fe.h>
 
+/** most statements prepared on a connection; queries past that are sent unprepared */
+#define PGSQL_STMTS_MAX (256)
+
+/** idle connections are checked before they're used again after this many seconds */
+#define PGSQL_CHECK_IDLE (60)
+
+/** most async requests down the pipeline at once; the rest wait their turn */
+#define PGSQL_PIPELINE_DEPTH (256)
+
+/** request latency buckets: under 1ms, under 2ms, under 4ms .. under 1024ms, and the rest */
+#define PGSQL_LATENCY_BUCKETS (12)
+
+typedef struct pgpipe_st *pgpipe_t;
+
 /** internal structure, holds our data */
 typedef struct drvdata_st {
-    PGconn *conn;
+    connpool_t pool;
+
+    char *host, *port, *dbname, *user, *pass, *conninfo;
 
     char *prefix;
 
     int txn;
+
+    /** the pipelined connection async requests go down, if we're using one */
+    pgpipe_t pipe;
 } *drvdata_t;
 
-#define FALLBACK_BLOCKSIZE (4096)
-
-/** internal: do and return the math and ensure it gets realloc'd */
-static size_t _st_pgsql_realloc(char **oblocks, size_t len) {
-    void *nblocks;
-    size_t nlen;
-    static size_t block_size = 0;
-
-    if (block_size == 0) {
-#ifdef HAVE_GETPAGESIZE
-        block_size = getpagesize();
-#elif defined(_SC_PAGESIZE)
-        block_size = sysconf(_SC_PAGESIZE);
-#elif defined(_SC_PAGE_SIZE)
-        block_size = sysconf(_SC_PAGE_SIZE);    
-#else
-        block_size = FALLBACK_BLOCKSIZE;
-#endif
+/** one database connection */
+typedef struct dbconn_st {
+    PGconn *conn;
+
+    /** statement names, keyed by their sql. they only live as long as the connection */
+    xht stmts;
+    int nstmts;
+
+    /** set while we're inside BEGIN .. COMMIT, so a lost connection isn't quietly retried */
+    int intxn;
+
+    /** set if it's beyond saving, so it's closed rather than given back to the pool */
+    int broken;
+} *dbconn_t;
+
+/** a statement prepared for a request in the pipeline */
+typedef struct pgstmt_st {
+    const char *sql;
+    const char *name;
+    struct pgstmt_st *next;
+} *pgstmt_t;
+
+/** an async request on its way through the pipeline */
+typedef struct pgpipeop_st *pgpipeop_t;
+struct pgpipeop_st {
+    pool_t p;
+    st_op_t op;
+
+    struct timeval start;
+
+    /** rows from a get or count */
+    PGresult *res;
+    int failed;
+
+    /** statements prepared along with it. they're only used by others once it has gone through */
+    pgstmt_t stmts;
+
+    pgpipeop_t next;
+};
+
+/** the pipeline. requests go out back to back on one connection, without waiting for the
+ *  results of the ones before, and the results are picked up as they come in from the main loop */
+struct pgpipe_st {
+    struct dbconn_st c;
+
+    /** statements being prepared, keyed by their sql. they move to c.stmts once that's worked */
+    xht preparing;
+
+    int fd;                             /**< our own copy of the socket, for mio to watch (and close) */
+    mio_fd_t mfd;
+
+    int depth, inflight, inflight_max;
+    pgpipeop_t head, tail;              /**< sent, waiting for their results */
+    pgpipeop_t qhead, qtail;            /**< waiting to be sent */
+
+    unsigned long latency[st_call_REPLACE + 1][PGSQL_LATENCY_BUCKETS];
+};
+
+/** a query being put together: its sql, with a placeholder for each parameter */
+typedef struct query_st {
+    pool_t p;
+    spool sql;
+    char *text;     /**< the finished sql */
+
+    int nparams, maxparams;
+    Oid *types;
+    const char **vals;
+    int *lens, *fmts;
+} *query_t;
+
+static query_t _st_pgsql_query(pool_t p) {
+    query_t q;
+
+    q = (query_t) pmalloco(p, sizeof(struct query_st));
+    q->p = p;
+    q->sql = spool_new(p);
+
+    return q;
+}
+
+/** add a parameter, and its placeholder. type 0 lets the server work it out from the column */
+static void _st_pgsql_param(query_t q, Oid type, const char *val, int len, int fmt) {
+    Oid *types;
+    const char **vals;
+    int *lens, *fmts;
+    char ph[16];
+
+    if(q->nparams == q->maxparams) {
+        q->maxparams = q->maxparams ? q->maxparams * 2 : 8;
+
+        types = (Oid *) pmalloc(q->p, sizeof(Oid) * q->maxparams);
+        vals = (const char **) pmalloc(q->p, sizeof(char *) * q->maxparams);
+        lens = (int *) pmalloc(q->p, sizeof(int) * q->maxparams);
+        fmts = (int *) pmalloc(q->p, sizeof(int) * q->maxparams);
+
+        if(q->nparams > 0) {
+            memcpy(types, q->types, sizeof(Oid) * q->nparams);
+            memcpy(vals, q->vals, sizeof(char *) * q->nparams);
+            memcpy(lens, q->lens, sizeof(int) * q->nparams);
+            memcpy(fmts, q->fmts, sizeof(int) * q->nparams);
+        }
+
+        q->types = types;
+        q->vals = vals;
+        q->lens = lens;
+        q->fmts = fmts;
     }
-    /* round up to standard block sizes */
-    nlen = (((len-1)/block_size)+1)*block_size;
 
-    /* keep trying till we get it */
-    while((nblocks = realloc(*oblocks, nlen)) == NULL) sleep(1);
-    *oblocks = nblocks;
-    return nlen;
+    q->types[q->nparams] = type;
+    q->vals[q->nparams] = val;
+    q->lens[q->nparams] = len;
+    q->fmts[q->nparams] = fmt;
+    q->nparams++;
+
+    snprintf(ph, sizeof(ph), "$%d", q->nparams);
+    spool_add(q->sql, ph);
 }
 
-/** this is the safety check used to make sure there's always enough mem */
-#define PGSQL_SAFE(blocks, size, len) if((size) >= len) len = _st_pgsql_realloc(&(blocks),(size + 1));
+/** forget the statements we prepared, because the connection they were on has gone */
+static void _st_pgsql_stmts_reset(dbconn_t c) {
+    if(c->stmts != NULL)
+        xhash_free(c->stmts);
 
-static void _st_pgsql_convert_filter_recursive(st_driver_t drv, st_filter_t f, char **buf, unsigned int *buflen, unsigned int *nbuf) {
-    st_filter_t scan;
-    int vlen;
-    char *cval;
+    c->stmts = xhash_new(101);
+}
 
-    switch(f->type) {
-        case st_filter_type_PAIR:
-            /* do sql escaping for apostrophes */
-            cval = (char *) malloc(sizeof(char) * ((strlen(f->val) * 2) + 1));
-            vlen = PQescapeString(cval, f->val, strlen(f->val));
+/** run a query, preparing it first if it's the first of its shape on this connection */
+static PGresult *_st_pgsql_run(st_driver_t drv, dbconn_t c, query_t q) {
+    const char *sql = q->text;
+    PGresult *res;
+    char *name;
+    int retry;
 
-            PGSQL_SAFE((*buf), *buflen + 12 + vlen - strlen(f->val), *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), "( \"%s\" = \'%s\' ) ", f->key, f->val);
-            free(cval);
+    for(retry = 0; ; retry++) {
+        name = (char *) xhash_get(c->stmts, sql);
 
-            break;
+        if(name == NULL && xhash_count(c->stmts) < PGSQL_STMTS_MAX) {
+            name = (char *) pmalloc(xhash_pool(c->stmts), 16);
+            snprintf(name, 16, "jabberd%d", c->nstmts++);
 
-        case st_filter_type_AND:
-            PGSQL_SAFE((*buf), *buflen + 2, *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), "( ");
+            log_debug(ZONE, "preparing %s: %s", name, sql);
 
-            for(scan = f->sub; scan != NULL; scan = scan->next) {
-                _st_pgsql_convert_filter_recursive(drv, scan, buf, buflen, nbuf);
+            res = PQprepare(c->conn, name, sql, q->nparams, q->types);
+            if(PQresultStatus(res) == PGRES_COMMAND_OK)
+                xhash_put(c->stmts, pstrdup(xhash_pool(c->stmts), sql), (void *) name);
+            else
+                name = NULL;    /* running it unprepared will tell us what went wrong */
+            PQclear(res);
+        }
 
-                if(scan->next != NULL) {
-                    PGSQL_SAFE((*buf), *buflen + 4, *buflen);
-                    *nbuf += sprintf(&((*buf)[*nbuf]), "AND ");
-                }
-            }
+        if(name != NULL)
+            res = PQexecPrepared(c->conn, name, q->nparams, q->vals, q->lens, q->fmts, 0);
+        else
+            res = PQexecParams(c->conn, sql, q->nparams, q->types, q->vals, q->lens, q->fmts, 0);
 
-            PGSQL_SAFE((*buf), *buflen + 2, *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
+        if(PQstatus(c->conn) == CONNECTION_OK)
+            return res;
 
-            return;
+        if(retry || c->intxn) {
+            c->broken = 1;
+            return res;
+        }
+
+        log_write(drv->st->sm->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
+        PQclear(res);
+        PQreset(c->conn);
+        _st_pgsql_stmts_reset(c);
+    }
+}
+
+/** start a transaction */
+static int _st_pgsql_begin(st_driver_t drv, dbconn_t c) {
+    PGresult *res;
 
+    res = PQexec(c->conn, "BEGIN ISOLATION LEVEL SERIALIZABLE;");
+    if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(c->conn) != CONNECTION_OK) {
+        log_write(drv->st->sm->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
+        PQclear(res);
+        PQreset(c->conn);
+        _st_pgsql_stmts_reset(c);
+        res = PQexec(c->conn, "BEGIN ISOLATION LEVEL SERIALIZABLE;");
+    }
+    if(PQresultStatus(res) != PGRES_COMMAND_OK) {
+        log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql transaction begin failed: %s", PQresultErrorMessage(res));
+        if(PQstatus(c->conn) != CONNECTION_OK)
+            c->broken = 1;
+        PQclear(res);
+        return 1;
+    }
+    PQclear(res);
+
+    c->intxn = 1;
+
+    return 0;
+}
+
+/** finish a transaction, either committing it or rolling it back */
+static int _st_pgsql_end(st_driver_t drv, dbconn_t c, int commit) {
+    PGresult *res;
+
+    c->intxn = 0;
+
+    if(!commit) {
+        PQclear(PQexec(c->conn, "ROLLBACK;"));
+        return 1;
+    }
+
+    res = PQexec(c->conn, "COMMIT;");
+    if(PQresultStatus(res) != PGRES_COMMAND_OK) {
+        log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql transaction commit failed: %s", PQresultErrorMessage(res));
+        PQclear(res);
+        PQclear(PQexec(c->conn, "ROLLBACK;"));
+        return 1;
+    }
+    PQclear(res);
+
+    return 0;
+}
+
+static void _st_pgsql_convert_filter_recursive(query_t q, st_filter_t f) {
+    st_filter_t scan;
+
+    switch(f->type) {
+        case st_filter_type_PAIR:
+            spooler(q->sql, "( \"", f->key, "\" = ", q->sql);
+            _st_pgsql_param(q, 0, pstrdup(q->p, f->val), 0, 0);
+            spool_add(q->sql, " ) ");
+
+            break;
+
+        case st_filter_type_AND:
         case st_filter_type_OR:
-            PGSQL_SAFE((*buf), *buflen + 2, *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), "( ");
+            spool_add(q->sql, "( ");
 
             for(scan = f->sub; scan != NULL; scan = scan->next) {
-                _st_pgsql_convert_filter_recursive(drv, scan, buf, buflen, nbuf);
+                _st_pgsql_convert_filter_recursive(q, scan);
 
-                if(scan->next != NULL) {
-                    PGSQL_SAFE((*buf), *buflen + 3, *buflen);
-                    *nbuf += sprintf(&((*buf)[*nbuf]), "OR ");
-                }
+                if(scan->next != NULL)
+                    spool_add(q->sql, f->type == st_filter_type_AND ? "AND " : "OR ");
             }
 
-            PGSQL_SAFE((*buf), *buflen + 2, *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
+            spool_add(q->sql, ") ");
 
             return;
 
         case st_filter_type_NOT:
-            PGSQL_SAFE((*buf), *buflen + 6, *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), "( NOT ");
+            spool_add(q->sql, "( NOT ");
 
-            _st_pgsql_convert_filter_recursive(drv, f->sub, buf, buflen, nbuf);
+            _st_pgsql_convert_filter_recursive(q, f->sub);
 
-            PGSQL_SAFE((*buf), *buflen + 2, *buflen);
-            *nbuf += sprintf(&((*buf)[*nbuf]), ") ");
+            spool_add(q->sql, ") ");
 
             return;
     }
 }
 
-static char *_st_pgsql_convert_filter(st_driver_t drv, const char *owner, const char *filter) {
-    /* drvdata_t data = (drvdata_t) drv->private;*/
-    char *buf = NULL;
-    unsigned int buflen = 0, nbuf = 0;
+/** add the where clause for an owner and filter. the values go in as parameters, so nothing needs escaping */
+static void _st_pgsql_convert_filter(query_t q, const char *owner, const char *filter) {
     st_filter_t f;
 
-    PGSQL_SAFE(buf, 24 + strlen(owner), buflen);
-
-    nbuf = sprintf(buf, "\"collection-owner\" = '%s'", owner);
+    spool_add(q->sql, "\"collection-owner\" = ");
+    _st_pgsql_param(q, 0, owner, 0, 0);
 
     f = storage_filter(filter);
     if(f == NULL)
-        return buf;
+        return;
 
-    PGSQL_SAFE(buf, buflen + 5, buflen);
-    nbuf += sprintf(&buf[nbuf], " AND ");
+    spool_add(q->sql, " AND ");
 
-    _st_pgsql_convert_filter_recursive(drv, f, &buf, &buflen, &nbuf);
+    _st_pgsql_convert_filter_recursive(q, f);
 
     pool_free(f->p);
-
-    return buf;
 }
 
 static st_ret_t _st_pgsql_add_type(st_driver_t drv, const char *type) {
     return st_SUCCESS;
 }
 
-static st_ret_t _st_pgsql_put_guts(st_driver_t drv, const char *type, const char *owner, os_t os) {
+/** the table for a type, with the prefix if there is one */
+static const char *_st_pgsql_table(st_driver_t drv, pool_t p, const char *type) {
     drvdata_t data = (drvdata_t) drv->private;
-    char *left = NULL, *right = NULL;
-    int lleft = 0, lright = 0, nleft, nright;
-    os_object_t o;
-    char *key, *cval = NULL;
+
+    if(data->prefix == NULL)
+        return type;
+
+    return spools(p, data->prefix, type, p);
+}
+
+/** build the insert for one object */
+static query_t _st_pgsql_insert_query(st_driver_t drv, pool_t p, const char *type, const char *owner, os_object_t o) {
+    query_t q;
+    spool cols;
+    char *key, *cval;
     void *val;
-    int vlen;
     os_type_t ot;
     char *xml;
     int xlen;
-    PGresult *res;
-    char tbuf[128];
+    unsigned int ival;
 
-    if(os_count(os) == 0)
-        return st_SUCCESS;
-
-    if(data->prefix != NULL) {
-        snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
-        type = tbuf;
-    }
-
-    if(os_iter_first(os))
-        do {
-            PGSQL_SAFE(left, strlen(type) + 55, lleft);
-            nleft = sprintf(left, "INSERT INTO \"%s\" ( \"collection-owner\", \"object-sequence\"", type);
-
-            PGSQL_SAFE(right, strlen(owner) + 43, lright);
-            nright = sprintf(right, " ) VALUES ( '%s', nextval('object-sequence')", owner);
+    q = _st_pgsql_query(p);
 
-            o = os_iter_object(os);
-            if(os_object_iter_first(o))
-                do {
-                    os_object_iter_get(o, &key, &val, &ot);
-
-                    switch(ot) {
-                        case os_type_BOOLEAN:
-                            cval = val ? strdup("t") : strdup("f");
-                            vlen = 1;
-                            break;
-
-                        case os_type_INTEGER:
-                            cval = (char *) malloc(sizeof(char) * 20);
-                            sprintf(cval, "%d", (int) val);
-                            vlen = strlen(cval);
-                            break;
-
-                        case os_type_STRING:
-                            cval = (char *) malloc(sizeof(char) * ((strlen((char *) val) * 2) + 1));
-                            vlen = PQescapeString(cval, (char *) val, strlen((char *) val));
-                            break;
+    cols = spool_new(p);
+    spooler(cols, "INSERT INTO \"", _st_pgsql_table(drv, p, type), "\" ( \"collection-owner\", \"object-sequence\"", cols);
 
-                        case os_type_NAD:
-                            nad_print((nad_t) val, 0, &xml, &xlen);
-                            cval = (char *) malloc(sizeof(char) * ((xlen * 2) + 4));
-                            vlen = PQescapeString(&cval[3], xml, xlen) + 3;
-                            strncpy(cval, "NAD", 3);
-                            break;
+    spool_add(q->sql, " ) VALUES ( ");
+    _st_pgsql_param(q, 0, owner, 0, 0);
+    spool_add(q->sql, ", nextval('object-sequence')");
 
-                        case os_type_UNKNOWN:
-                            break;
-                    }
+    if(os_object_iter_first(o))
+        do {
+            os_object_iter_get(o, &key, &val, &ot);
 
-                    log_debug(ZONE, "key %s val %s", key, cval);
+            log_debug(ZONE, "key %s type %d", key, ot);
 
-                    PGSQL_SAFE(left, lleft + strlen(key) + 4, lleft);
-                    nleft += sprintf(&left[nleft], ", \"%s\"", key);
+            spooler(cols, ", \"", key, "\"", cols);
+            spool_add(q->sql, ", ");
 
-                    PGSQL_SAFE(right, lright + strlen(cval) + 4, lright);
-                    nright += sprintf(&right[nright], ", '%s'", cval);
+            /* booleans and integers go across in binary, text as it is */
+            switch(ot) {
+                case os_type_BOOLEAN:
+                    cval = (char *) pmalloc(p, 1);
+                    cval[0] = ((int) (long) val) ? 1 : 0;
+                    _st_pgsql_param(q, 16, cval, 1, 1);
+                    break;
 
-                    free(cval);
-                } while(os_object_iter_next(o));
+                case os_type_INTEGER:
+                    cval = (char *) pmalloc(p, 4);
+                    ival = htonl((unsigned int) (int) (long) val);
+                    memcpy(cval, &ival, 4);
+                    _st_pgsql_param(q, 23, cval, 4, 1);
+                    break;
 
-            PGSQL_SAFE(left, lleft + strlen(right) + 3, lleft);
-            sprintf(&left[nleft], "%s );", right);
-    
-            log_debug(ZONE, "prepared sql: %s", left);
+                case os_type_STRING:
+                    _st_pgsql_param(q, 0, (char *) val, 0, 0);
+                    break;
 
-            res = PQexec(data->conn, left);
+                case os_type_NAD:
+                    storage_nad_encode(drv->st, (nad_t) val, &xml, &xlen);
+                    cval = (char *) pmalloc(p, xlen + 4);
+                    memcpy(cval, "NAD", 3);
+                    memcpy(&cval[3], xml, xlen + 1);
+                    free(xml);
+                    _st_pgsql_param(q, 0, cval, 0, 0);
+                    break;
 
-            if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-                log_write(drv->st->sm->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-                PQclear(res);
-                PQreset(data->conn);
-                res = PQexec(data->conn, left);
-            }
-            if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-                log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql insert failed: %s", PQresultErrorMessage(res));
-                free(left);
-                free(right);
-                PQclear(res);
-                return st_FAILED;
+                case os_type_UNKNOWN:
+                    _st_pgsql_param(q, 0, NULL, 0, 0);
+                    break;
             }
+        } while(os_object_iter_next(o));
 
-            PQclear(res);
-
-        } while(os_iter_next(os));
+    spool_add(q->sql, " );");
 
-    free(left);
-    free(right);
+    q->text = spools(p, spool_print(cols), spool_print(q->sql), p);
 
-    return st_SUCCESS;
+    return q;
 }
 
-static st_ret_t _st_pgsql_put(st_driver_t drv, const char *type, const char *owner, os_t os) {
-    drvdata_t data = (drvdata_t) drv->private;
-    PGresult *res;
-
-    if(os_count(os) == 0)
-        return st_SUCCESS;
-
-    if(data->txn) {
-        res = PQexec(data->conn, "BEGIN;");
-        if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-            log_write(drv->st->sm->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-            PQclear(res);
-            PQreset(data->conn);
-            res = PQexec(data->conn, "BEGIN;");
-        }
-        if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-            log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql transaction begin failed: %s", PQresultErrorMessage(res));
-            PQclear(res);
-            return st_FAILED;
-        }
-        PQclear(res);
+/** build a select, count or delete of the objects an owner has that match a filter */
+static query_t _st_pgsql_filter_query(st_driver_t drv, pool_t p, char *verb, const char *type, const char *owner, const char *filter, char *tail) {
+    query_t q;
 
-        res = PQexec(data->conn, "SET TRANSACTION ISOLATION LEVEL SERIALIZABLE;");
-        if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-            log_write(drv->st->sm->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-            PQclear(res);
-            PQreset(data->conn);
-            res = PQexec(data->conn, "SET TRANSACTION ISOLATION LEVEL SERIALIZABLE;");
-        }
-        if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-            log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql transaction setup failed: %s", PQresultErrorMessage(res));
-            PQclear(res);
-            PQclear(PQexec(data->conn, "ROLLBACK;"));
-            return st_FAILED;
-        }
-        PQclear(res);
-    }
+    q = _st_pgsql_query(p);
 
-    if(_st_pgsql_put_guts(drv, type, owner, os) != st_SUCCESS) {
-        if(data->txn)
-            PQclear(PQexec(data->conn, "ROLLBACK;"));
-        return st_FAILED;
-    }
+    spooler(q->sql, verb, " \"", _st_pgsql_table(drv, p, type), "\" WHERE ", q->sql);
+    _st_pgsql_convert_filter(q, owner, filter);
+    spool_add(q->sql, tail);
 
-    if(data->txn) {
-        res = PQexec(data->conn, "COMMIT;");
-        if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-            log_write(drv->st->sm->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-            PQclear(res);
-            PQreset(data->conn);
-            res = PQexec(data->conn, "COMMIT;");
-        }
-        if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-            log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql transaction commit failed: %s", PQresultErrorMessage(res));
-            PQclear(res);
-            PQclear(PQexec(data->conn, "ROLLBACK;"));
-            return st_FAILED;
-        }
-        PQclear(res);
-    }
+    q->text = spool_print(q->sql);
 
-    return st_SUCCESS;
+    return q;
 }
 
-static st_ret_t _st_pgsql_get(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t *os) {
-    drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    int buflen = 0;
-    PGresult *res;
+#define _st_pgsql_select_query(drv, p, type, owner, filter) _st_pgsql_filter_query(drv, p, "SELECT * FROM", type, owner, filter, " ORDER BY \"object-sequence\";")
+#define _st_pgsql_count_query(drv, p, type, owner, filter) _st_pgsql_filter_query(drv, p, "SELECT COUNT(*) FROM", type, owner, filter, ";")
+#define _st_pgsql_delete_query(drv, p, type, owner, filter) _st_pgsql_filter_query(drv, p, "DELETE FROM", type, owner, filter, ";")
+
+/** turn the rows from a select into objects */
+static st_ret_t _st_pgsql_get_result(PGresult *res, os_t *os) {
     int ntuples, nfields, i, j;
     os_object_t o;
     char *fname, *val;
     os_type_t ot;
     int ival;
-    char tbuf[128];
-
-    if(data->prefix != NULL) {
-        snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
-        type = tbuf;
-    }
-
-    cond = _st_pgsql_convert_filter(drv, owner, filter);
-    log_debug(ZONE, "generated filter: %s", cond);
-
-    PGSQL_SAFE(buf, strlen(type) + strlen(cond) + 51, buflen);
-    sprintf(buf, "SELECT * FROM \"%s\" WHERE %s ORDER BY \"object-sequence\";", type, cond);
-    free(cond);
-
-    log_debug(ZONE, "prepared sql: %s", buf);
-
-    res = PQexec(data->conn, buf);
-
-    if(PQresultStatus(res) != PGRES_TUPLES_OK && PQstatus(data->conn) != CONNECTION_OK) {
-        log_write(drv->st->sm->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(data->conn);
-        res = PQexec(data->conn, buf);
-    }
-
-    free(buf);
-
-    if(PQresultStatus(res) != PGRES_TUPLES_OK) {
-        log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql select failed: %s", PQresultErrorMessage(res));
-        PQclear(res);
-        return st_FAILED;
-    }
 
     ntuples = PQntuples(res);
-    if(ntuples == 0) {
-        PQclear(res);
+    if(ntuples == 0)
         return st_NOTFOUND;
-    }
 
     log_debug(ZONE, "%d tuples returned", ntuples);
 
@@ -386,7 +451,6 @@ static st_ret_t _st_pgsql_get(st_driver_t drv, const char *type, const char *own
 
     if(nfields == 0) {
         log_debug(ZONE, "weird, tuples were returned but no fields *shrug*");
-        PQclear(res);
         return st_NOTFOUND;
     }
 
@@ -445,55 +509,16 @@ static st_ret_t _st_pgsql_get(st_driver_t drv, const char *type, const char *own
         }
     }
 
-    PQclear(res);
-
     return st_SUCCESS;
 }
 
-static st_ret_t _st_pgsql_count(st_driver_t drv, const char *type, const char *owner, const char *filter, int *count) {
-    drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    int buflen = 0;
-    PGresult *res;
+/** pull the number out of a count */
+static st_ret_t _st_pgsql_count_result(PGresult *res, int *count) {
     int ntuples, nfields;
-    char tbuf[128];
-
-    if(data->prefix != NULL) {
-        snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
-        type = tbuf;
-    }
-
-    cond = _st_pgsql_convert_filter(drv, owner, filter);
-    log_debug(ZONE, "generated filter: %s", cond);
-
-    PGSQL_SAFE(buf, strlen(type) + strlen(cond) + 31, buflen);
-    sprintf(buf, "SELECT COUNT(*) FROM \"%s\" WHERE %s", type, cond);
-    free(cond);
-
-    log_debug(ZONE, "prepared sql: %s", buf);
-
-    res = PQexec(data->conn, buf);
-
-    if(PQresultStatus(res) != PGRES_TUPLES_OK && PQstatus(data->conn) != CONNECTION_OK) {
-        log_write(drv->st->sm->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-        PQclear(res);
-        PQreset(data->conn);
-        res = PQexec(data->conn, buf);
-    }
-
-    free(buf);
-
-    if(PQresultStatus(res) != PGRES_TUPLES_OK) {
-        log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql select failed: %s", PQresultErrorMessage(res));
-        PQclear(res);
-        return st_FAILED;
-    }
 
     ntuples = PQntuples(res);
-    if(ntuples == 0) {
-        PQclear(res);
+    if(ntuples == 0)
         return st_NOTFOUND;
-    }
 
     log_debug(ZONE, "%d tuples returned", ntuples);
 
@@ -501,7 +526,6 @@ static st_ret_t _st_pgsql_count(st_driver_t drv, const char *type, const char *o
 
     if(nfields == 0) {
         log_debug(ZONE, "weird, tuples were returned but no fields *shrug*");
-        PQclear(res);
         return st_NOTFOUND;
     }
 
@@ -511,42 +535,169 @@ static st_ret_t _st_pgsql_count(st_driver_t drv, const char *type, const char *o
     if (count!=NULL)
         *count = atoi(PQgetvalue(res, 0, 0));
 
-    PQclear(res);
+    return st_SUCCESS;
+}
+
+static st_ret_t _st_pgsql_put_guts(st_driver_t drv, dbconn_t c, const char *type, const char *owner, os_t os) {
+    pool_t p;
+    PGresult *res;
+
+    if(os_count(os) == 0)
+        return st_SUCCESS;
+
+    p = pool_new();
+
+    if(os_iter_first(os))
+        do {
+            res = _st_pgsql_run(drv, c, _st_pgsql_insert_query(drv, p, type, owner, os_iter_object(os)));
+
+            if(PQresultStatus(res) != PGRES_COMMAND_OK) {
+                log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql insert failed: %s", PQresultErrorMessage(res));
+                PQclear(res);
+                pool_free(p);
+                return st_FAILED;
+            }
+
+            PQclear(res);
+
+        } while(os_iter_next(os));
+
+    pool_free(p);
 
     return st_SUCCESS;
 }
 
-static st_ret_t _st_pgsql_delete(st_driver_t drv, const char *type, const char *owner, const char *filter) {
+/** get a connection from the pool */
+static dbconn_t _st_pgsql_conn_get(st_driver_t drv) {
     drvdata_t data = (drvdata_t) drv->private;
-    char *cond, *buf = NULL;
-    int buflen = 0;
+    dbconn_t c;
+
+    if((c = (dbconn_t) connpool_get(data->pool)) == NULL)
+        log_write(drv->st->sm->log, LOG_ERR, "pgsql: no database connection available");
+
+    return c;
+}
+
+/** and give it back */
+static void _st_pgsql_conn_put(st_driver_t drv, dbconn_t c) {
+    drvdata_t data = (drvdata_t) drv->private;
+
+    connpool_put(data->pool, (void *) c, c->broken);
+}
+
+static st_ret_t _st_pgsql_put(st_driver_t drv, const char *type, const char *owner, os_t os) {
+    drvdata_t data = (drvdata_t) drv->private;
+    dbconn_t c;
+    st_ret_t ret = st_FAILED;
+    int txn;
+
+    if(os_count(os) == 0)
+        return st_SUCCESS;
+
+    if((c = _st_pgsql_conn_get(drv)) == NULL)
+        return st_FAILED;
+
+    /* one insert is atomic by itself */
+    txn = data->txn && os_count(os) > 1;
+
+    if(!txn || _st_pgsql_begin(drv, c) == 0) {
+        if(_st_pgsql_put_guts(drv, c, type, owner, os) != st_SUCCESS) {
+            if(txn)
+                _st_pgsql_end(drv, c, 0);
+        } else if(!txn || _st_pgsql_end(drv, c, 1) == 0)
+            ret = st_SUCCESS;
+    }
+
+    _st_pgsql_conn_put(drv, c);
+
+    return ret;
+}
+
+static st_ret_t _st_pgsql_get_guts(st_driver_t drv, dbconn_t c, const char *type, const char *owner, const char *filter, os_t *os) {
+    pool_t p;
     PGresult *res;
-    char tbuf[128];
+    st_ret_t ret;
 
-    if(data->prefix != NULL) {
-        snprintf(tbuf, sizeof(tbuf), "%s%s", data->prefix, type);
-        type = tbuf;
+    p = pool_new();
+
+    res = _st_pgsql_run(drv, c, _st_pgsql_select_query(drv, p, type, owner, filter));
+
+    pool_free(p);
+
+    if(PQresultStatus(res) != PGRES_TUPLES_OK) {
+        log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql select failed: %s", PQresultErrorMessage(res));
+        PQclear(res);
+        return st_FAILED;
     }
 
-    cond = _st_pgsql_convert_filter(drv, owner, filter);
-    log_debug(ZONE, "generated filter: %s", cond);
+    ret = _st_pgsql_get_result(res, os);
 
-    PGSQL_SAFE(buf, strlen(type) + strlen(cond) + 23, buflen);
-    sprintf(buf, "DELETE FROM \"%s\" WHERE %s;", type, cond);
-    free(cond);
+    PQclear(res);
 
-    log_debug(ZONE, "prepared sql: %s", buf);
+    return ret;
+}
 
-    res = PQexec(data->conn, buf);
+static st_ret_t _st_pgsql_get(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t *os) {
+    dbconn_t c;
+    st_ret_t ret;
 
-    if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-        log_write(drv->st->sm->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
+    if((c = _st_pgsql_conn_get(drv)) == NULL)
+        return st_FAILED;
+
+    ret = _st_pgsql_get_guts(drv, c, type, owner, filter, os);
+
+    _st_pgsql_conn_put(drv, c);
+
+    return ret;
+}
+
+static st_ret_t _st_pgsql_count_guts(st_driver_t drv, dbconn_t c, const char *type, const char *owner, const char *filter, int *count) {
+    pool_t p;
+    PGresult *res;
+    st_ret_t ret;
+
+    p = pool_new();
+
+    res = _st_pgsql_run(drv, c, _st_pgsql_count_query(drv, p, type, owner, filter));
+
+    pool_free(p);
+
+    if(PQresultStatus(res) != PGRES_TUPLES_OK) {
+        log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql select failed: %s", PQresultErrorMessage(res));
         PQclear(res);
-        PQreset(data->conn);
-        res = PQexec(data->conn, buf);
+        return st_FAILED;
     }
 
-    free(buf);
+    ret = _st_pgsql_count_result(res, count);
+
+    PQclear(res);
+
+    return ret;
+}
+
+static st_ret_t _st_pgsql_count(st_driver_t drv, const char *type, const char *owner, const char *filter, int *count) {
+    dbconn_t c;
+    st_ret_t ret;
+
+    if((c = _st_pgsql_conn_get(drv)) == NULL)
+        return st_FAILED;
+
+    ret = _st_pgsql_count_guts(drv, c, type, owner, filter, count);
+
+    _st_pgsql_conn_put(drv, c);
+
+    return ret;
+}
+
+static st_ret_t _st_pgsql_delete_guts(st_driver_t drv, dbconn_t c, const char *type, const char *owner, const char *filter) {
+    pool_t p;
+    PGresult *res;
+
+    p = pool_new();
+
+    res = _st_pgsql_run(drv, c, _st_pgsql_delete_query(drv, p, type, owner, filter));
+
+    pool_free(p);
 
     if(PQresultStatus(res) != PGRES_COMMAND_OK) {
         log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql delete failed: %s", PQresultErrorMessage(res));
@@ -559,110 +710,567 @@ static st_ret_t _st_pgsql_delete(st_driver_t drv, const char *type, const char *
     return st_SUCCESS;
 }
 
+static st_ret_t _st_pgsql_delete(st_driver_t drv, const char *type, const char *owner, const char *filter) {
+    dbconn_t c;
+    st_ret_t ret;
+
+    if((c = _st_pgsql_conn_get(drv)) == NULL)
+        return st_FAILED;
+
+    ret = _st_pgsql_delete_guts(drv, c, type, owner, filter);
+
+    _st_pgsql_conn_put(drv, c);
+
+    return ret;
+}
+
 static st_ret_t _st_pgsql_replace(st_driver_t drv, const char *type, const char *owner, const char *filter, os_t os) {
     drvdata_t data = (drvdata_t) drv->private;
+    dbconn_t c;
+    st_ret_t ret = st_FAILED;
+
+    if((c = _st_pgsql_conn_get(drv)) == NULL)
+        return st_FAILED;
+
+    if(!data->txn || _st_pgsql_begin(drv, c) == 0) {
+        if(_st_pgsql_delete_guts(drv, c, type, owner, filter) == st_FAILED || _st_pgsql_put_guts(drv, c, type, owner, os) == st_FAILED) {
+            if(data->txn)
+                _st_pgsql_end(drv, c, 0);
+        } else if(!data->txn || _st_pgsql_end(drv, c, 1) == 0)
+            ret = st_SUCCESS;
+    }
+
+    _st_pgsql_conn_put(drv, c);
+
+    return ret;
+}
+
+/** connect to the database */
+static PGconn *_st_pgsql_connect(st_driver_t drv) {
+    drvdata_t data = (drvdata_t) drv->private;
+    PGconn *conn;
+
+    if(data->conninfo) {
+        conn = PQconnectdb(data->conninfo);
+    } else {
+        conn = PQsetdbLogin(data->host, data->port, NULL, NULL, data->dbname, data->user, data->pass);
+    }
+
+    if(conn == NULL) {
+        log_write(drv->st->sm->log, LOG_ERR, "pgsql: unable to allocate database connection state");
+        return NULL;
+    }
+
+    if(PQstatus(conn) != CONNECTION_OK) {
+        log_write(drv->st->sm->log, LOG_ERR, "pgsql: connection to database failed: %s", PQerrorMessage(conn));
+        PQfinish(conn);
+        return NULL;
+    }
+
+    return conn;
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+static void _st_pgsql_pipe_next(st_driver_t drv);
+
+/** open the pipelined connection. there's no BEGIN .. COMMIT in the pipeline: everything
+ *  between two syncs runs as one transaction, so a request is atomic by itself */
+static int _st_pgsql_pipe_open(st_driver_t drv) {
+    drvdata_t data = (drvdata_t) drv->private;
+    pgpipe_t pipe = data->pipe;
+    PGconn *conn;
     PGresult *res;
 
+    if((conn = _st_pgsql_connect(drv)) == NULL)
+        return 1;
+
     if(data->txn) {
-        res = PQexec(data->conn, "BEGIN;");
-        if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-            log_write(drv->st->sm->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-            PQclear(res);
-            PQreset(data->conn);
-            res = PQexec(data->conn, "BEGIN;");
-        }
+        res = PQexec(conn, "SET SESSION CHARACTERISTICS AS TRANSACTION ISOLATION LEVEL SERIALIZABLE;");
         if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-            log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql transaction begin failed: %s", PQresultErrorMessage(res));
+            log_write(drv->st->sm->log, LOG_ERR, "pgsql: couldn't set the isolation level: %s", PQresultErrorMessage(res));
             PQclear(res);
-            return st_FAILED;
+            PQfinish(conn);
+            return 1;
         }
         PQclear(res);
+    }
 
-        res = PQexec(data->conn, "SET TRANSACTION ISOLATION LEVEL SERIALIZABLE;");
-        if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-            log_write(drv->st->sm->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-            PQclear(res);
-            PQreset(data->conn);
-            res = PQexec(data->conn, "SET TRANSACTION ISOLATION LEVEL SERIALIZABLE;");
-        }
-        if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-            log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql transaction setup failed: %s", PQresultErrorMessage(res));
-            PQclear(res);
-            PQclear(PQexec(data->conn, "ROLLBACK;"));
-            return st_FAILED;
-        }
-        PQclear(res);
+    if(PQsetnonblocking(conn, 1) != 0 || PQenterPipelineMode(conn) != 1) {
+        log_write(drv->st->sm->log, LOG_ERR, "pgsql: couldn't start pipelining: %s", PQerrorMessage(conn));
+        PQfinish(conn);
+        return 1;
     }
 
-    if(_st_pgsql_delete(drv, type, owner, filter) == st_FAILED) {
-        if(data->txn)
-            PQclear(PQexec(data->conn, "ROLLBACK;"));
-        return st_FAILED;
+    pipe->c.conn = conn;
+    _st_pgsql_stmts_reset(&pipe->c);
+
+    return 0;
+}
+
+/** mio closes what it's given, so it gets its own copy of the socket to watch */
+static int _st_pgsql_pipe_mio(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg);
+
+static void _st_pgsql_pipe_watch(st_driver_t drv) {
+    pgpipe_t pipe = ((drvdata_t) drv->private)->pipe;
+
+    if(pipe->mfd != NULL || pipe->c.conn == NULL || drv->st->sm->mio == NULL)
+        return;
+
+    if((pipe->fd = dup(PQsocket(pipe->c.conn))) < 0) {
+        log_write(drv->st->sm->log, LOG_ERR, "pgsql: couldn't watch the database connection: %s", strerror(errno));
+        return;
     }
 
-    if(_st_pgsql_put_guts(drv, type, owner, os) == st_FAILED) {
-        if(data->txn)
-            PQclear(PQexec(data->conn, "ROLLBACK;"));
-        return st_FAILED;
+    if((pipe->mfd = mio_register(drv->st->sm->mio, pipe->fd, _st_pgsql_pipe_mio, (void *) drv)) == NULL) {
+        close(pipe->fd);
+        pipe->fd = -1;
+        return;
     }
 
-    if(data->txn) {
-        res = PQexec(data->conn, "COMMIT;");
-        if(PQresultStatus(res) != PGRES_COMMAND_OK && PQstatus(data->conn) != CONNECTION_OK) {
-            log_write(drv->st->sm->log, LOG_ERR, "pgsql: lost connection to database, attempting reconnect");
-            PQclear(res);
-            PQreset(data->conn);
-            res = PQexec(data->conn, "COMMIT;");
+    mio_read(drv->st->sm->mio, pipe->mfd);
+}
+
+/** a request is done, so pass it back */
+static void _st_pgsql_pipe_done(st_driver_t drv, pgpipeop_t pop) {
+    pgpipe_t pipe = ((drvdata_t) drv->private)->pipe;
+    st_op_t op = pop->op;
+    pgstmt_t stmt;
+    struct timeval now;
+    unsigned long usecs;
+    int b;
+
+    if(pop->failed)
+        op->ret = st_FAILED;
+    else if(op->call == st_call_GET)
+        op->ret = pop->res != NULL ? _st_pgsql_get_result(pop->res, &op->os) : st_NOTFOUND;
+    else if(op->call == st_call_COUNT)
+        op->ret = pop->res != NULL ? _st_pgsql_count_result(pop->res, &op->count) : st_NOTFOUND;
+    else
+        op->ret = st_SUCCESS;
+
+    if(pop->res != NULL)
+        PQclear(pop->res);
+
+    /* if it failed, the prepares may not have worked, so they're forgotten */
+    for(stmt = pop->stmts; stmt != NULL; stmt = stmt->next) {
+        xhash_zap(pipe->preparing, stmt->sql);
+        if(!pop->failed && pipe->c.stmts != NULL)
+            xhash_put(pipe->c.stmts, pstrdup(xhash_pool(pipe->c.stmts), stmt->sql), pstrdup(xhash_pool(pipe->c.stmts), stmt->name));
+    }
+
+    gettimeofday(&now, NULL);
+    usecs = (now.tv_sec - pop->start.tv_sec) * 1000000 + (now.tv_usec - pop->start.tv_usec);
+
+    for(b = 0; b < PGSQL_LATENCY_BUCKETS - 1 && usecs >= (1000UL << b); b++);
+    pipe->latency[op->call][b]++;
+
+    pool_free(pop->p);
+
+    storage_complete(op);
+}
+
+/** the connection has gone. everything on it fails, and we'll try again with the next request */
+static void _st_pgsql_pipe_lost(st_driver_t drv) {
+    pgpipe_t pipe = ((drvdata_t) drv->private)->pipe;
+    pgpipeop_t pop;
+
+    log_write(drv->st->sm->log, LOG_ERR, "pgsql: lost pipelined connection to database: %s", PQerrorMessage(pipe->c.conn));
+
+    if(pipe->mfd != NULL)
+        mio_close(drv->st->sm->mio, pipe->mfd);
+
+    PQfinish(pipe->c.conn);
+    pipe->c.conn = NULL;
+
+    while((pop = pipe->head) != NULL || (pop = pipe->qhead) != NULL) {
+        if(pop == pipe->head)
+            pipe->head = pop->next;
+        else
+            pipe->qhead = pop->next;
+
+        pop->failed = 1;
+        _st_pgsql_pipe_done(drv, pop);
+    }
+
+    pipe->tail = pipe->qtail = NULL;
+    pipe->inflight = 0;
+}
+
+/** send a query down the pipeline, preparing it first if it's the first of its shape. while
+ *  someone else's prepare is still on its way, the query goes unprepared */
+static int _st_pgsql_pipe_query(pgpipe_t pipe, pgpipeop_t pop, query_t q) {
+    dbconn_t c = &pipe->c;
+    pgstmt_t stmt;
+    char *name;
+
+    name = (char *) xhash_get(c->stmts, q->text);
+
+    if(name == NULL && xhash_get(pipe->preparing, q->text) == NULL && xhash_count(c->stmts) + xhash_count(pipe->preparing) < PGSQL_STMTS_MAX) {
+        name = (char *) pmalloc(pop->p, 16);
+        snprintf(name, 16, "jabberd%d", c->nstmts++);
+
+        log_debug(ZONE, "preparing %s: %s", name, q->text);
+
+        if(!PQsendPrepare(c->conn, name, q->text, q->nparams, q->types))
+            return 1;
+
+        stmt = (pgstmt_t) pmalloc(pop->p, sizeof(struct pgstmt_st));
+        stmt->sql = pstrdup(pop->p, q->text);
+        stmt->name = name;
+        stmt->next = pop->stmts;
+        pop->stmts = stmt;
+
+        xhash_put(pipe->preparing, stmt->sql, (void *) stmt);
+    }
+
+    if(name != NULL)
+        return !PQsendQueryPrepared(c->conn, name, q->nparams, q->vals, q->lens, q->fmts, 0);
+
+    return !PQsendQueryParams(c->conn, q->text, q->nparams, q->types, q->vals, q->lens, q->fmts, 0);
+}
+
+/** send all the queries for a request, and a sync to finish it off */
+static int _st_pgsql_pipe_send(st_driver_t drv, pgpipeop_t pop) {
+    pgpipe_t pipe = ((drvdata_t) drv->private)->pipe;
+    st_op_t op = pop->op;
+    int err = 0;
+
+    switch(op->call) {
+        case st_call_GET:
+            err = _st_pgsql_pipe_query(pipe, pop, _st_pgsql_select_query(drv, pop->p, op->type, op->owner, op->filter));
+            break;
+
+        case st_call_COUNT:
+            err = _st_pgsql_pipe_query(pipe, pop, _st_pgsql_count_query(drv, pop->p, op->type, op->owner, op->filter));
+            break;
+
+        case st_call_REPLACE:
+        case st_call_DELETE:
+            err = _st_pgsql_pipe_query(pipe, pop, _st_pgsql_delete_query(drv, pop->p, op->type, op->owner, op->filter));
+            if(op->call == st_call_DELETE)
+                break;
+
+            /* and then the puts */
+
+        case st_call_PUT:
+            if(op->os != NULL && os_iter_first(op->os))
+                do {
+                    err = _st_pgsql_pipe_query(pipe, pop, _st_pgsql_insert_query(drv, pop->p, op->type, op->owner, os_iter_object(op->os)));
+                } while(!err && os_iter_next(op->os));
+            break;
+    }
+
+    return err || !PQpipelineSync(pipe->c.conn);
+}
+
+/** send as many waiting requests as the pipeline has room for */
+static void _st_pgsql_pipe_next(st_driver_t drv) {
+    pgpipe_t pipe = ((drvdata_t) drv->private)->pipe;
+    pgpipeop_t pop;
+    int sent = 0;
+
+    while(pipe->c.conn != NULL && pipe->qhead != NULL && pipe->inflight < pipe->depth) {
+        pop = pipe->qhead;
+        pipe->qhead = pop->next;
+        if(pipe->qhead == NULL)
+            pipe->qtail = NULL;
+
+        pop->next = NULL;
+        if(pipe->tail != NULL)
+            pipe->tail->next = pop;
+        else
+            pipe->head = pop;
+        pipe->tail = pop;
+
+        pipe->inflight++;
+        if(pipe->inflight > pipe->inflight_max)
+            pipe->inflight_max = pipe->inflight;
+
+        if(_st_pgsql_pipe_send(drv, pop) != 0) {
+            _st_pgsql_pipe_lost(drv);
+            return;
         }
-        if(PQresultStatus(res) != PGRES_COMMAND_OK) {
-            log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql transaction commit failed: %s", PQresultErrorMessage(res));
-            PQclear(res);
-            PQclear(PQexec(data->conn, "ROLLBACK;"));
-            return st_FAILED;
+
+        sent = 1;
+    }
+
+    /* the write handler does the flush, and asks for more if it doesn't all go */
+    if(sent && pipe->mfd != NULL)
+        mio_write(drv->st->sm->mio, pipe->mfd);
+}
+
+/** pick up whatever results have arrived. requests finish when their sync comes back */
+static void _st_pgsql_pipe_results(st_driver_t drv, int block) {
+    pgpipe_t pipe = ((drvdata_t) drv->private)->pipe;
+    pgpipeop_t pop;
+    PGresult *res;
+
+    while((pop = pipe->head) != NULL && pipe->c.conn != NULL) {
+        if(!block && PQisBusy(pipe->c.conn))
+            break;
+
+        /* one of these follows each query's results */
+        if((res = PQgetResult(pipe->c.conn)) == NULL) {
+            if(PQstatus(pipe->c.conn) != CONNECTION_OK)
+                _st_pgsql_pipe_lost(drv);
+            continue;
+        }
+
+        switch(PQresultStatus(res)) {
+            case PGRES_PIPELINE_SYNC:
+                PQclear(res);
+
+                pipe->head = pop->next;
+                if(pipe->head == NULL)
+                    pipe->tail = NULL;
+                pipe->inflight--;
+
+                _st_pgsql_pipe_done(drv, pop);
+                _st_pgsql_pipe_next(drv);
+                break;
+
+            case PGRES_TUPLES_OK:
+                if(pop->res == NULL)
+                    pop->res = res;
+                else
+                    PQclear(res);
+                break;
+
+            case PGRES_COMMAND_OK:
+                PQclear(res);
+                break;
+
+            case PGRES_PIPELINE_ABORTED:
+                pop->failed = 1;
+                PQclear(res);
+                break;
+
+            default:
+                log_write(drv->st->sm->log, LOG_ERR, "pgsql: sql request %d for %s failed: %s", pop->op->call, pop->op->type, PQresultErrorMessage(res));
+                pop->failed = 1;
+                PQclear(res);
+                break;
         }
-        PQclear(res);
     }
+}
 
-    return st_SUCCESS;
+static int _st_pgsql_pipe_mio(mio_t m, mio_action_t a, mio_fd_t fd, void *data, void *arg) {
+    st_driver_t drv = (st_driver_t) arg;
+    pgpipe_t pipe = ((drvdata_t) drv->private)->pipe;
+    int ret;
+
+    switch(a) {
+        case action_READ:
+            if(!PQconsumeInput(pipe->c.conn)) {
+                _st_pgsql_pipe_lost(drv);
+                return 0;
+            }
+
+            _st_pgsql_pipe_results(drv, 0);
+
+            return 1;
+
+        case action_WRITE:
+            if((ret = PQflush(pipe->c.conn)) < 0) {
+                _st_pgsql_pipe_lost(drv);
+                return 0;
+            }
+
+            return ret;
+
+        case action_CLOSE:
+            pipe->mfd = NULL;
+            pipe->fd = -1;
+            return 0;
+
+        default:
+            return 0;
+    }
 }
 
+/** run everything in the pipeline to completion, without the main loop */
+static void _st_pgsql_drain(st_driver_t drv) {
+    pgpipe_t pipe = ((drvdata_t) drv->private)->pipe;
+
+    if(pipe->c.conn == NULL || (pipe->head == NULL && pipe->qhead == NULL))
+        return;
+
+    log_debug(ZONE, "draining %d pipelined requests", pipe->inflight);
+
+    PQsetnonblocking(pipe->c.conn, 0);
+
+    while(pipe->c.conn != NULL && pipe->head != NULL) {
+        if(PQflush(pipe->c.conn) != 0) {
+            _st_pgsql_pipe_lost(drv);
+            break;
+        }
+
+        _st_pgsql_pipe_results(drv, 1);
+    }
+
+    if(pipe->c.conn != NULL)
+        PQsetnonblocking(pipe->c.conn, 1);
+}
+
+/** queue up an async request, and send it if there's room */
+static void _st_pgsql_submit(st_driver_t drv, st_op_t op) {
+    pgpipe_t pipe = ((drvdata_t) drv->private)->pipe;
+    pgpipeop_t pop;
+    pool_t p;
+
+    p = pool_new();
+    pop = (pgpipeop_t) pmalloco(p, sizeof(struct pgpipeop_st));
+    pop->p = p;
+    pop->op = op;
+    gettimeofday(&pop->start, NULL);
+
+    /* nothing to do */
+    if(op->call == st_call_PUT && (op->os == NULL || os_count(op->os) == 0)) {
+        _st_pgsql_pipe_done(drv, pop);
+        return;
+    }
+
+    if(pipe->c.conn == NULL && _st_pgsql_pipe_open(drv) != 0) {
+        pop->failed = 1;
+        _st_pgsql_pipe_done(drv, pop);
+        return;
+    }
+
+    if(pipe->qtail != NULL)
+        pipe->qtail->next = pop;
+    else
+        pipe->qhead = pop;
+    pipe->qtail = pop;
+
+    _st_pgsql_pipe_watch(drv);
+    _st_pgsql_pipe_next(drv);
+
+    /* no main loop to bring the results back, so wait for them */
+    if(pipe->mfd == NULL)
+        _st_pgsql_drain(drv);
+}
+
+static void _st_pgsql_pipe_free(st_driver_t drv) {
+    pgpipe_t pipe = ((drvdata_t) drv->private)->pipe;
+    static const char *calls[] = { "put", "get", "count", "delete", "replace" };
+    char buf[512], *sep;
+    unsigned long total;
+    int i, b, len;
+
+    log_write(drv->st->sm->log, LOG_INFO, "pgsql: %d pipelined requests in flight at most", pipe->inflight_max);
+
+    for(i = 0; i <= st_call_REPLACE; i++) {
+        for(total = 0, b = 0; b < PGSQL_LATENCY_BUCKETS; b++)
+            total += pipe->latency[i][b];
+
+        if(total == 0)
+            continue;
+
+        len = snprintf(buf, sizeof(buf), "pgsql: %lu %s requests:", total, calls[i]);
+        for(sep = "", b = 0; b < PGSQL_LATENCY_BUCKETS && len < sizeof(buf); b++)
+            if(pipe->latency[i][b] > 0) {
+                if(b < PGSQL_LATENCY_BUCKETS - 1)
+                    len += snprintf(&buf[len], sizeof(buf) - len, "%s %lu under %dms", sep, pipe->latency[i][b], 1 << b);
+                else
+                    len += snprintf(&buf[len], sizeof(buf) - len, "%s %lu took %dms or more", sep, pipe->latency[i][b], 1 << (b - 1));
+                sep = ",";
+            }
+
+        log_write(drv->st->sm->log, LOG_INFO, "%s", buf);
+    }
+
+    /* mio is gone by now, so the socket copy is ours to close */
+    if(pipe->fd >= 0)
+        close(pipe->fd);
+
+    if(pipe->c.conn != NULL)
+        PQfinish(pipe->c.conn);
+
+    if(pipe->c.stmts != NULL)
+        xhash_free(pipe->c.stmts);
+
+    xhash_free(pipe->preparing);
+
+    free(pipe);
+}
+#endif
+
 static void _st_pgsql_free(st_driver_t drv) {
     drvdata_t data = (drvdata_t) drv->private;
+    connpool_stats_t stats;
+
+    connpool_stats(data->pool, &stats);
+    log_write(drv->st->sm->log, LOG_INFO, "pgsql: %lu queries, %lu waited for a connection (%lu us on average), %d of %d connections busy at most, %lu connection checks, %lu connection errors",
+        stats.gets, stats.waits, stats.waits ? stats.wait_usecs / stats.waits : 0, stats.inuse_max, stats.open, stats.checks, stats.errors);
+
+    connpool_free(data->pool);
 
-    PQfinish(data->conn);
+#ifdef LIBPQ_HAS_PIPELINING
+    if(data->pipe != NULL)
+        _st_pgsql_pipe_free(drv);
+#endif
 
     free(data);
 }
 
-st_ret_t st_init(st_driver_t drv) {
-    char *host, *port, *dbname, *user, *pass, *conninfo;
+/** open a connection for the pool */
+static void *_st_pgsql_conn_open(void *arg) {
+    st_driver_t drv = (st_driver_t) arg;
     PGconn *conn;
-    drvdata_t data;
+    dbconn_t c;
 
-    host = config_get_one(drv->st->sm->config, "storage.pgsql.host", 0);
-    port = config_get_one(drv->st->sm->config, "storage.pgsql.port", 0);
-    dbname = config_get_one(drv->st->sm->config, "storage.pgsql.dbname", 0);
-    user = config_get_one(drv->st->sm->config, "storage.pgsql.user", 0);
-    pass = config_get_one(drv->st->sm->config, "storage.pgsql.pass", 0);
-    conninfo = config_get_one(drv->st->sm->config, "storage.pgsql.conninfo",0);
+    if((conn = _st_pgsql_connect(drv)) == NULL)
+        return NULL;
 
-    if(conninfo) {
-        conn = PQconnectdb(conninfo);
-    } else {
-        conn = PQsetdbLogin(host, port, NULL, NULL, dbname, user, pass);
-    }
+    c = (dbconn_t) calloc(1, sizeof(struct dbconn_st));
 
-    if(conn == NULL) {
-        log_write(drv->st->sm->log, LOG_ERR, "pgsql: unable to allocate database connection state");
-        return st_FAILED;
-    }
+    c->conn = conn;
 
-    if(PQstatus(conn) != CONNECTION_OK)
-        log_write(drv->st->sm->log, LOG_ERR, "pgsql: connection to database failed: %s", PQerrorMessage(conn));
+    _st_pgsql_stmts_reset(c);
+
+    return (void *) c;
+}
+
+/** make sure a connection that's been idle is still there. an empty query is the cheapest round trip there is */
+static int _st_pgsql_conn_check(void *conn, void *arg) {
+    dbconn_t c = (dbconn_t) conn;
+
+    PQclear(PQexec(c->conn, ""));
+
+    if(PQstatus(c->conn) == CONNECTION_OK)
+        return 0;
+
+    /* the statements went with the old connection */
+    PQreset(c->conn);
+    _st_pgsql_stmts_reset(c);
+
+    return PQstatus(c->conn) != CONNECTION_OK;
+}
+
+static void _st_pgsql_conn_close(void *conn, void *arg) {
+    dbconn_t c = (dbconn_t) conn;
+
+    xhash_free(c->stmts);
+
+    PQfinish(c->conn);
+
+    free(c);
+}
+
+st_ret_t st_init(st_driver_t drv) {
+    drvdata_t data;
+    dbconn_t c;
+    char *pipeline;
+    int size;
 
     data = (drvdata_t) calloc(1, sizeof(struct drvdata_st));
 
-    data->conn = conn;
+    data->host = config_get_one(drv->st->sm->config, "storage.pgsql.host", 0);
+    data->port = config_get_one(drv->st->sm->config, "storage.pgsql.port", 0);
+    data->dbname = config_get_one(drv->st->sm->config, "storage.pgsql.dbname", 0);
+    data->user = config_get_one(drv->st->sm->config, "storage.pgsql.user", 0);
+    data->pass = config_get_one(drv->st->sm->config, "storage.pgsql.pass", 0);
+    data->conninfo = config_get_one(drv->st->sm->config, "storage.pgsql.conninfo", 0);
 
     if(config_get_one(drv->st->sm->config, "storage.pgsql.transactions", 0) != NULL)
         data->txn = 1;
@@ -673,6 +1281,38 @@ st_ret_t st_init(st_driver_t drv) {
 
     drv->private = (void *) data;
 
+    pipeline = config_get_one(drv->st->sm->config, "storage.pgsql.pipeline", 0);
+
+#ifdef LIBPQ_HAS_PIPELINING
+    if(pipeline != NULL) {
+        data->pipe = (pgpipe_t) calloc(1, sizeof(struct pgpipe_st));
+        data->pipe->fd = -1;
+        data->pipe->preparing = xhash_new(101);
+
+        data->pipe->depth = j_atoi(pipeline, 0);
+        if(data->pipe->depth <= 0)
+            data->pipe->depth = PGSQL_PIPELINE_DEPTH;
+
+        /* like the pool, if the database isn't there yet we try again when the requests come in */
+        _st_pgsql_pipe_open(drv);
+
+        drv->submit = _st_pgsql_submit;
+        drv->drain = _st_pgsql_drain;
+    }
+#else
+    if(pipeline != NULL)
+        log_write(drv->st->sm->log, LOG_WARNING, "pgsql: libpq can't pipeline requests, asynchronous requests will go to the worker threads instead");
+#endif
+
+    /* one for each worker, and one for the main loop. if requests are pipelined the workers don't start */
+    size = j_atoi(config_get_one(drv->st->sm->config, "storage.pgsql.connections", 0), drv->submit != NULL ? 1 : drv->st->threads + 1);
+
+    data->pool = connpool_new(size, PGSQL_CHECK_IDLE, _st_pgsql_conn_open, _st_pgsql_conn_check, _st_pgsql_conn_close, (void *) drv);
+
+    /* we carry on if the database isn't there yet; we'll keep trying as the queries come in */
+    if((c = (dbconn_t) connpool_get(data->pool)) != NULL)
+        connpool_put(data->pool, (void *) c, 0);
+
     drv->add_type = _st_pgsql_add_type;
     drv->put = _st_pgsql_put;
     drv->count = _st_pgsql_count;
@@ -681,5 +1321,8 @@ st_ret_t st_init(st_driver_t drv) {
     drv->replace = _st_pgsql_replace;
     drv->free = _st_pgsql_free;
 
+    /* each call takes its own connection, and libpq is happy with that */
+    drv->threadsafe = (size > 1);
+
     return st_SUCCESS;
 }
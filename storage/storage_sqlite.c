@@ -314,10 +314,11 @@ static st_ret_t _st_sqlite_put_guts (st_driver_t drv, const char *type,
 
 		      /* !!! might not be a good idea to mark nads this way */
 		     case os_type_NAD:
-		      nad_print ((nad_t) val, 0, &xml, &xlen);
+		      storage_nad_encode (drv->st, (nad_t) val, &xml, &xlen);
 		      cval = (char *) malloc(sizeof(char) * (xlen + 4));
 		      memcpy (&cval[3], xml, xlen + 1);
 		      memcpy (cval, "NAD", 3);
+		      free (xml);
 
 		      sqlite3_bind_text (stmt, i + 2,
 					 cval, xlen + 3, free);
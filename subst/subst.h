@@ -112,4 +112,18 @@ JABBERD2_API char *strndup(char *str, size_t len);
 JABBERD2_API time_t timegm (struct tm *tm);
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
+
+#ifndef HAVE_WRITEV
+# ifndef HAVE_SYS_UIO_H
+struct iovec {
+    void    *iov_base;
+    size_t  iov_len;
+};
+# endif
+JABBERD2_API int writev(int fd, const struct iovec *iov, int iovcnt);
+#endif
+
 #endif
@@ -0,0 +1,34 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#ifndef HAVE_WRITEV
+
+#include "subst.h"
+
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+# include <sys/socket.h>
+#endif
+
+/* no gathered writes here, so send the buffers one at a time
+ * and stop at the first one that doesn't go out completely */
+JABBERD2_API int writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    int i, len, total = 0;
+
+    for(i = 0; i < iovcnt; i++) {
+        len = send(fd, iov[i].iov_base, iov[i].iov_len, 0);
+        if(len < 0)
+            return (total > 0) ? total : -1;
+
+        total += len;
+        if((size_t) len < iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+#endif /* HAVE_WRITEV */
@@ -36,6 +36,12 @@ void _sx_element_start(void *arg, const char *name, const char **atts) {
     if(s->nad == NULL)
         s->nad = nad_new();
 
+    /* note where a packet starts on the wire, and where it ends if it's empty */
+    if(s->depth == 1 && (s->flags & SX_RAW_READ)) {
+        s->rrawstart = XML_GetCurrentByteIndex(s->expat);
+        s->rrawend = s->rrawstart + XML_GetCurrentByteCount(s->expat);
+    }
+
     /* make a copy */
     strncpy(buf, name, 1024);
     buf[1023] = '\0';
@@ -123,6 +129,23 @@ void _sx_element_end(void *arg, const char *name) {
     s->depth--;
 
     if(s->depth == 1) {
+        /* and where it ended, kept alongside the nad */
+        if(s->flags & SX_RAW_READ) {
+            if(XML_GetCurrentByteCount(s->expat) > 0)
+                s->rrawend = XML_GetCurrentByteIndex(s->expat) + XML_GetCurrentByteCount(s->expat);
+
+            if(s->nrrawspan == s->rrawspanmax) {
+                s->rrawspanmax = s->rrawspanmax ? s->rrawspanmax * 2 : 8;
+                s->rrawspan = (long *) realloc(s->rrawspan, sizeof(long) * 2 * s->rrawspanmax);
+            }
+
+            s->rrawspan[s->nrrawspan * 2] = s->rrawstart;
+            s->rrawspan[s->nrrawspan * 2 + 1] = s->rrawend;
+            s->nrrawspan++;
+
+            s->rrawdone = s->rrawend;
+        }
+
         /* completed nad, save it for later processing */
         jqueue_push(s->rnadq, s->nad, 0);
         s->nad = NULL;
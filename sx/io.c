@@ -20,23 +20,55 @@
 
 #include "sx.h"
 
-/** handler for read data */
-void _sx_process_read(sx_t s, sx_buf_t buf) {
+/** keep a copy of the bytes going into the parser, so packets can be handed on as they arrived */
+static void _sx_raw_read(sx_t s, const char *data, int len) {
+    long keep;
+    int drop;
+
+    /* let go of everything before the oldest packet still queued, or the end of the last
+     * one parsed - whatever comes after that may be part of a packet not yet seen whole */
+    if(s->rrawspanhead < s->nrrawspan) {
+        keep = s->rrawspan[s->rrawspanhead * 2];
+
+        if(s->rrawspanhead > 0) {
+            memmove(s->rrawspan, s->rrawspan + s->rrawspanhead * 2, sizeof(long) * 2 * (s->nrrawspan - s->rrawspanhead));
+            s->nrrawspan -= s->rrawspanhead;
+            s->rrawspanhead = 0;
+        }
+    } else {
+        keep = s->rrawdone;
+        s->nrrawspan = s->rrawspanhead = 0;
+    }
+
+    drop = keep - s->rrawbase;
+    if(drop > 0) {
+        memmove(s->rraw, s->rraw + drop, s->rrawlen - drop);
+        s->rrawlen -= drop;
+        s->rrawbase = keep;
+    }
+
+    if(len <= 0)
+        return;
+
+    if(s->rrawlen + len > s->rrawsize) {
+        while(s->rrawlen + len > s->rrawsize)
+            s->rrawsize = s->rrawsize ? s->rrawsize * 2 : SX_READ_MIN;
+        s->rraw = (char *) realloc(s->rraw, s->rrawsize);
+    }
+
+    memcpy(s->rraw + s->rrawlen, data, len);
+    s->rrawlen += len;
+}
+
+/** deal with the parser's verdict on the data just read, and anything it completed */
+static void _sx_process_parsed(sx_t s, int parsed) {
     sx_error_t sxe;
     nad_t nad;
     char *errstring;
     int i;
     int ns, elem;
 
-    /* Note that buf->len can validly be 0 here, if we got data from
-       the socket but the plugin didn't return anything to us (e.g. a
-       SSL packet was split across a tcp segment boundary) */
-
-    /* count bytes read */
-    s->rbytes += buf->len;
-
-    /* parse it */
-    if(XML_Parse(s->expat, buf->data, buf->len, 0) == 0) {
+    if(parsed == 0) {
         /* only report error we haven't already */
         if(!s->fail) {
             /* parse error */
@@ -49,15 +81,11 @@ void _sx_process_read(sx_t s, sx_buf_t buf) {
             _sx_error(s, stream_err_XML_NOT_WELL_FORMED, errstring);
             _sx_close(s);
 
-            _sx_buffer_free(buf);
-
             return;
         }
 
         /* !!! is this the right thing to do? we should probably set
          *     s->fail and let the code further down handle it. */
-        _sx_buffer_free(buf);
-
         return;
     }
 
@@ -74,18 +102,22 @@ void _sx_process_read(sx_t s, sx_buf_t buf) {
         _sx_error(s, stream_err_POLICY_VIOLATION, errstring);
         _sx_close(s);
 
-        _sx_buffer_free(buf);
-
         return;
     }
 
-    /* done with the buffer */
-    _sx_buffer_free(buf);
-
     /* process completed nads */
     if(s->state >= state_STREAM)
         while((nad = jqueue_pull(s->rnadq)) != NULL) {
             int plugin_error;
+
+            /* find its wire bytes */
+            s->rrawpkt = NULL;
+            if(s->rrawspanhead < s->nrrawspan) {
+                s->rrawpkt = s->rraw + (s->rrawspan[s->rrawspanhead * 2] - s->rrawbase);
+                s->rrawpktlen = s->rrawspan[s->rrawspanhead * 2 + 1] - s->rrawspan[s->rrawspanhead * 2];
+                s->rrawspanhead++;
+            }
+
 #ifdef SX_DEBUG
             char *out; int len;
             nad_print(nad, 0, &out, &len);
@@ -154,6 +186,8 @@ void _sx_process_read(sx_t s, sx_buf_t buf) {
             /* hand it to the app */
             if ((plugin_error == 0) && (s->state < state_CLOSING))
                 _sx_event(s, event_PACKET, (void *) nad);
+
+            s->rrawpkt = NULL;
         }
 
     /* something went wrong, bail */
@@ -177,9 +211,41 @@ void _sx_process_read(sx_t s, sx_buf_t buf) {
     }
 }
 
+/** handler for read data */
+void _sx_process_read(sx_t s, sx_buf_t buf) {
+    int parsed;
+
+    /* Note that buf->len can validly be 0 here, if we got data from
+       the socket but the plugin didn't return anything to us (e.g. a
+       SSL packet was split across a tcp segment boundary) */
+
+    /* count bytes read */
+    s->rbytes += buf->len;
+
+    if(s->flags & SX_RAW_READ)
+        _sx_raw_read(s, buf->data, buf->len);
+
+    /* parse it */
+    parsed = XML_Parse(s->expat, buf->data, buf->len, 0);
+
+    /* done with the buffer */
+    _sx_buffer_free(buf);
+
+    _sx_process_parsed(s, parsed);
+}
+
+/** adjust the next read size - double it while reads fill the buffer, halve it when they barely touch it */
+static void _sx_read_size(sx_t s, int len) {
+    if(len >= s->rbufsize && s->rbufsize < SX_READ_MAX)
+        s->rbufsize <<= 1;
+    else if(len < (s->rbufsize >> 2) && s->rbufsize > SX_READ_MIN)
+        s->rbufsize >>= 1;
+}
+
 /** we can read */
 int sx_can_read(sx_t s) {
     sx_buf_t in, out;
+    struct _sx_buf_st direct;
     int read, ret;
 
     assert((int) (s != NULL));
@@ -190,57 +256,95 @@ int sx_can_read(sx_t s) {
 
     _sx_debug(ZONE, "%d ready for reading", s->tag);
 
-    /* new buffer */
-    in = _sx_buffer_new(NULL, 1024, NULL, NULL);
+    /* no io plugins to decode the data, so have the app read it straight
+     * into the parser's buffer and skip the copies */
+    if(s->rio == NULL && (direct.data = XML_GetBuffer(s->expat, s->rbufsize)) != NULL) {
+        direct.len = s->rbufsize;
+        direct.heap = NULL;
+        direct.notify = NULL;
+        direct.notify_arg = NULL;
 
-    /* get them to read stuff */
-    read = _sx_event(s, event_READ, (void *) in);
+        /* get them to read stuff */
+        read = _sx_event(s, event_READ, (void *) &direct);
 
-    /* bail if something went wrong */
-    if(read < 0) {
-        _sx_buffer_free(in);
-        s->want_read = 0;
-        s->want_write = 0;
-        return 0;
-    }
+        /* bail if something went wrong */
+        if(read < 0) {
+            s->want_read = 0;
+            s->want_write = 0;
+            return 0;
+        }
 
-    if(read == 0) {
-        /* nothing to read
-         * should never happen because we did get a read event,
-         * thus there is something to read, or error handled
-         * via (read < 0) block before (errors return -1) */
-        _sx_debug(ZONE, "decoded 0 bytes read data - this should not happen");
-        _sx_buffer_free(in);
+        if(read == 0) {
+            /* nothing to read, see below */
+            _sx_debug(ZONE, "decoded 0 bytes read data - this should not happen");
 
-    } else {
-        _sx_debug(ZONE, "passed %d read bytes", in->len);
+        } else {
+            _sx_debug(ZONE, "passed %d read bytes", direct.len);
 
-        /* make a copy for processing */
-        out = _sx_buffer_new(in->data, in->len, in->notify, in->notify_arg);
+            _sx_read_size(s, direct.len);
 
-        /* run it by the plugins */
-        ret = _sx_chain_io_read(s, out);
-        if(ret <= 0) {
-            if(ret < 0) {
-                /* permanent failure, its all over */
-                /* !!! shut down */
-                s->want_read = s->want_write = 0;
-            }
+            /* count bytes read, and into the parser with you */
+            s->rbytes += direct.len;
 
-            _sx_buffer_free(in);
-            _sx_buffer_free(out);
+            if(s->flags & SX_RAW_READ)
+                _sx_raw_read(s, direct.data, direct.len);
 
-            /* done */
-            if(s->want_write) _sx_event(s, event_WANT_WRITE, NULL);
-            return s->want_read;
+            _sx_process_parsed(s, XML_ParseBuffer(s->expat, direct.len, 0));
         }
+    }
 
-        _sx_buffer_free(in);
+    else {
+        /* new buffer */
+        in = _sx_buffer_new(NULL, s->rbufsize, NULL, NULL);
+
+        /* get them to read stuff */
+        read = _sx_event(s, event_READ, (void *) in);
+
+        /* bail if something went wrong */
+        if(read < 0) {
+            _sx_buffer_free(in);
+            s->want_read = 0;
+            s->want_write = 0;
+            return 0;
+        }
+
+        if(read == 0) {
+            /* nothing to read
+             * should never happen because we did get a read event,
+             * thus there is something to read, or error handled
+             * via (read < 0) block before (errors return -1) */
+            _sx_debug(ZONE, "decoded 0 bytes read data - this should not happen");
+            _sx_buffer_free(in);
+
+        } else {
+            _sx_debug(ZONE, "passed %d read bytes", in->len);
+
+            _sx_read_size(s, in->len);
+
+            /* the plugins decode in place, so they get the read buffer itself */
+            out = in;
+
+            /* run it by the plugins */
+            ret = _sx_chain_io_read(s, out);
+            if(ret <= 0) {
+                if(ret < 0) {
+                    /* permanent failure, its all over */
+                    /* !!! shut down */
+                    s->want_read = s->want_write = 0;
+                }
 
-        _sx_debug(ZONE, "decoded read data (%d bytes): %.*s", out->len, out->len, out->data);
+                _sx_buffer_free(out);
 
-        /* into the parser with you */
-        _sx_process_read(s, out);
+                /* done */
+                if(s->want_write) _sx_event(s, event_WANT_WRITE, NULL);
+                return s->want_read;
+            }
+
+            _sx_debug(ZONE, "decoded read data (%d bytes): %.*s", out->len, out->len, out->data);
+
+            /* into the parser with you */
+            _sx_process_read(s, out);
+        }
     }
 
     /* if we've written everything, and we're closed, then inform the app it can kill us */
@@ -260,64 +364,82 @@ int sx_can_read(sx_t s) {
 /** we can write */
 static int _sx_get_pending_write(sx_t s) {
     sx_buf_t in, out;
-    int ret;
+    int ret, max;
 
     assert(s != NULL);
 
-    if (s->wbufpending != NULL) {
-    /* there's already a pending buffer ready to write */
-    return 0;
-    }
+    /* streams that can't take a gathered write get one buffer at a time */
+    max = (s->flags & SX_WRITEV) ? SX_WRITEV_MAX : 1;
 
-    /* get the first buffer off the queue */
-    in = jqueue_pull(s->wbufq);
-    if(in == NULL) {
-        /* if there was a write event, and something is interested,
-       we still have to tell the plugins */
-        in = _sx_buffer_new(NULL, 0, NULL, NULL);
+    if (s->wbufpendingmax < max) {
+        s->wbufpending = (sx_buf_t *) realloc(s->wbufpending, sizeof(sx_buf_t) * max);
+        s->wbufpendingmax = max;
     }
 
-    /* if there's more to write, we want to make sure we get it */
-    s->want_write = jqueue_size(s->wbufq);
+    while (s->nwbufpending < max) {
+        /* the notify callback can change the io chain (eg starttls), so
+           nothing after a buffer that has one may go through the chain yet */
+        if (s->nwbufpending > 0 && s->wbufpending[s->nwbufpending - 1]->notify != NULL)
+            break;
 
-    /* make a copy for processing */
-    out = _sx_buffer_new(in->data, in->len, in->notify, in->notify_arg);
+        /* get the first buffer off the queue */
+        in = jqueue_pull(s->wbufq);
+        if(in == NULL) {
+            if (s->nwbufpending > 0)
+                break;
 
-    _sx_debug(ZONE, "encoding %d bytes for writing: %.*s", in->len, in->len, in->data);
+            /* if there was a write event, and something is interested,
+           we still have to tell the plugins */
+            in = _sx_buffer_new(NULL, 0, NULL, NULL);
+        }
 
-    /* run it by the plugins */
-    ret = _sx_chain_io_write(s, out);
-    if(ret <= 0) {
-    /* TODO/!!!: Are we leaking the 'out' buffer here? How about the 'in' buffer? */
-        if(ret == -1) {
-            /* temporary failure, push it back on the queue */
-            jqueue_push(s->wbufq, in, (s->wbufq->front != NULL) ? s->wbufq->front->priority : 0);
-            s->want_write = 1;
-        } else if(ret == -2) {
-            /* permanent failure, its all over */
-            /* !!! shut down */
-            s->want_read = s->want_write = 0;
-            return -1;
+        /* if there's more to write, we want to make sure we get it */
+        s->want_write = jqueue_size(s->wbufq);
+
+        /* make a copy for processing */
+        out = _sx_buffer_new(in->data, in->len, in->notify, in->notify_arg);
+
+        _sx_debug(ZONE, "encoding %d bytes for writing: %.*s", in->len, in->len, in->data);
+
+        /* run it by the plugins */
+        ret = _sx_chain_io_write(s, out);
+        if(ret <= 0) {
+        /* TODO/!!!: Are we leaking the 'out' buffer here? How about the 'in' buffer? */
+            if(ret == -1) {
+                /* temporary failure, push it back on the queue */
+                jqueue_push(s->wbufq, in, (s->wbufq->front != NULL) ? s->wbufq->front->priority : 0);
+                s->want_write = 1;
+            } else if(ret == -2) {
+                /* permanent failure, its all over */
+                /* !!! shut down */
+                s->want_read = s->want_write = 0;
+                return -1;
+            }
+
+            /* done */
+            return 0;
         }
 
-        /* done */
-        return 0;
-    }
+        _sx_buffer_free(in);
 
-    _sx_buffer_free(in);
+        if (out->len == 0) {
+        /* if there's nothing to write, then we're done with this one */
+            _sx_buffer_free(out);
 
-    if (out->len == 0)
-    /* if there's nothing to write, then we're done */
-        _sx_buffer_free(out);
-    else
-        s->wbufpending = out;
+            if (jqueue_size(s->wbufq) == 0)
+                break;
+        } else
+            s->wbufpending[s->nwbufpending++] = out;
+    }
 
     return 0;
 }
 
 int sx_can_write(sx_t s) {
-    sx_buf_t out;
-    int ret, written;
+    sx_buf_t out, done[SX_WRITEV_MAX];
+    struct iovec iov[SX_WRITEV_MAX];
+    sx_wvec_t wvec;
+    int ret, written, i, n;
 
     assert((int) (s != NULL));
 
@@ -337,37 +459,64 @@ int sx_can_write(sx_t s) {
     }
 
     /* if there's nothing to write, then we're done */
-    if(s->wbufpending == NULL) {
+    if(s->nwbufpending == 0) {
         if(s->want_read) _sx_event(s, event_WANT_READ, NULL);
         return s->want_write;
     }
 
-    out = s->wbufpending;
-    s->wbufpending = NULL;
-
     /* get the callback to do the write */
-    _sx_debug(ZONE, "handing app %d bytes to write", out->len);
-    written = _sx_event(s, event_WRITE, (void *) out);
+    if(s->nwbufpending == 1) {
+        _sx_debug(ZONE, "handing app %d bytes to write", s->wbufpending[0]->len);
+        written = _sx_event(s, event_WRITE, (void *) s->wbufpending[0]);
+    } else {
+        for(i = 0; i < s->nwbufpending; i++) {
+            iov[i].iov_base = s->wbufpending[i]->data;
+            iov[i].iov_len = s->wbufpending[i]->len;
+        }
+        wvec.iov = iov;
+        wvec.niov = s->nwbufpending;
+
+        _sx_debug(ZONE, "handing app %d buffers to write", wvec.niov);
+        written = _sx_event(s, event_WRITEV, (void *) &wvec);
+    }
 
     if(written < 0) {
         /* bail if something went wrong */
-        _sx_buffer_free(out);
+        while(s->nwbufpending > 0)
+            _sx_buffer_free(s->wbufpending[--s->nwbufpending]);
         s->want_read = 0;
         s->want_write = 0;
         return 0;
-    } else if(written < out->len) {
-        /* if not fully written, this buffer is still pending */
-        out->len -= written;
-        out->data += written;
-        s->wbufpending = out;
+    }
+
+    /* take whatever went out completely off the pending list */
+    for(n = 0; n < s->nwbufpending; n++) {
+        out = s->wbufpending[n];
+
+        if((unsigned int) written < out->len) {
+            /* if not fully written, this buffer is still pending */
+            out->len -= written;
+            out->data += written;
+            break;
+        }
+
+        written -= out->len;
+        done[n] = out;
+    }
+
+    s->nwbufpending -= n;
+    if(s->nwbufpending > 0) {
+        memmove(s->wbufpending, s->wbufpending + n, sizeof(sx_buf_t) * s->nwbufpending);
         s->want_write ++;
-    } else {
-        /* notify */
-        if(out->notify != NULL)
-            (out->notify)(s, out->notify_arg);
+    }
+
+    /* notify in order - these may reset the stream, so they're off the list first */
+    for(i = 0; i < n; i++) {
+        if(done[i]->notify != NULL)
+            (done[i]->notify)(s, done[i]->notify_arg);
 
         /* done with this */
-        _sx_buffer_free(out);
+        _sx_buffer_free(done[i]);
     }
 
     /* if we've written everything, and we're closed, then inform the app it can kill us */
@@ -386,8 +535,9 @@ int sx_can_write(sx_t s) {
 
 /** send a new nad out */
 int _sx_nad_write(sx_t s, nad_t nad, int elem) {
-    char *out;
-    int len;
+    sx_buf_t buf;
+    char *out = NULL;
+    int len = 0, size = 0;
 
     /* silently drop it if we're closing or closed */
     if(s->state >= state_CLOSING) {
@@ -400,13 +550,15 @@ int _sx_nad_write(sx_t s, nad_t nad, int elem) {
     if(_sx_chain_nad_write(s, nad, elem) == 0)
         return 1;
 
-    /* serialise it */
-    nad_print(nad, elem, &out, &len);
+    /* serialise it straight into the buffer that will be written */
+    nad_print_buf(nad, elem, &out, &len, &size);
 
     _sx_debug(ZONE, "queueing for write: %.*s", len, out);
 
     /* ready to go */
-    jqueue_push(s->wbufq, _sx_buffer_new(out, len, NULL, NULL), 0);
+    buf = _sx_buffer_new(NULL, 0, NULL, NULL);
+    _sx_buffer_set(buf, out, len, out);
+    jqueue_push(s->wbufq, buf, 0);
 
     nad_free(nad);
 
@@ -466,6 +618,19 @@ void sx_raw_write(sx_t s, char *buf, int len) {
     if(s->want_read) _sx_event(s, event_WANT_READ, NULL);
 }
 
+/** the packet being delivered, as it came off the wire */
+int sx_raw_packet(sx_t s, char **buf, int *len) {
+    assert((int) (s != NULL));
+
+    if(s->rrawpkt == NULL || s->rrawpktlen <= 0)
+        return 0;
+
+    *buf = s->rrawpkt;
+    *len = s->rrawpktlen;
+
+    return 1;
+}
+
 /** close a stream */
 void _sx_close(sx_t s) {
     /* close the stream if necessary */
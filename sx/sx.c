@@ -40,6 +40,8 @@ sx_t sx_new(sx_env_t env, int tag, sx_callback_t cb, void *arg) {
     s->wbufq = jqueue_new();
     s->rnadq = jqueue_new();
 
+    s->rbufsize = SX_READ_MIN;
+
     if(env != NULL) {
         s->plugin_data = (void **) calloc(1, sizeof(void *) * env->nplugins);
 
@@ -81,8 +83,10 @@ void sx_free(sx_t s) {
 
     while((buf = jqueue_pull(s->wbufq)) != NULL)
         _sx_buffer_free(buf);
+    while(s->nwbufpending > 0)
+        _sx_buffer_free(s->wbufpending[--s->nwbufpending]);
     if (s->wbufpending != NULL)
-        _sx_buffer_free(s->wbufpending);
+        free(s->wbufpending);
 
     while((nad = jqueue_pull(s->rnadq)) != NULL)
         nad_free(nad);
@@ -92,6 +96,9 @@ void sx_free(sx_t s) {
 
     XML_ParserFree(s->expat);
 
+    if(s->rraw != NULL) free(s->rraw);
+    if(s->rrawspan != NULL) free(s->rrawspan);
+
     if(s->nad != NULL) nad_free(s->nad);
 
     if(s->auth_method != NULL) free(s->auth_method);
@@ -62,7 +62,8 @@ typedef enum {
     event_OPEN,             /* normal operation */
     event_PACKET,           /* got a packet */
     event_CLOSED,           /* its over */
-    event_ERROR             /* something's wrong */
+    event_ERROR,            /* something's wrong */
+    event_WRITEV            /* write these buffers to the fd (SX_WRITEV streams only) */
 } sx_event_t;
 
 /** connection states */
@@ -105,6 +106,25 @@ typedef struct _sx_error_st {
 /** helper macro to populate this struct */
 #define _sx_gen_error(e,c,g,s)  do { e.code = c; e.generic = g; e.specific = s; } while(0);
 
+/** stream flag: the app handles event_WRITEV, so pending buffers can go out in one writev() */
+#define SX_WRITEV           (1<<8)
+
+/** most buffers gathered into one event_WRITEV */
+#define SX_WRITEV_MAX       (64)
+
+/** stream flag: keep the wire bytes of each incoming packet, see sx_raw_packet() */
+#define SX_RAW_READ         (1<<9)
+
+/** read size bounds - each stream starts small and grows while reads keep filling the buffer */
+#define SX_READ_MIN         (1024)
+#define SX_READ_MAX         (65536)
+
+/** gathered buffers for event_WRITEV - return the number of bytes written, as for event_WRITE */
+typedef struct _sx_wvec_st {
+    struct iovec            *iov;
+    int                     niov;
+} sx_wvec_t;
+
 /** prototype for the write notify function */
 typedef void (*_sx_notify_t)(sx_t s, void *arg);
 
@@ -168,6 +188,10 @@ JABBERD2_API void                        sx_nad_write_elem(sx_t s, nad_t nad, in
 /** sending raw data */
 JABBERD2_API void                        sx_raw_write(sx_t s, char *buf, int len);
 
+/** the packet being delivered by event_PACKET, as it came off the wire (SX_RAW_READ streams only).
+ *  valid until the callback returns; returns 0 if there's nothing to give */
+JABBERD2_API int                         sx_raw_packet(sx_t s, char **buf, int *len);
+
 /** authenticate the stream and move to the auth'd state */
 JABBERD2_API void                        sx_auth(sx_t s, const char *auth_method, const char *auth_id);
 
@@ -284,7 +308,8 @@ struct _sx_st {
 
     /* internal queues */
     jqueue_t                 wbufq;              /* buffers waiting to go to wio */
-    sx_buf_t                 wbufpending;        /* buffer passed through wio but not written yet */
+    sx_buf_t                 *wbufpending;       /* buffers passed through wio but not written yet */
+    int                      nwbufpending, wbufpendingmax;
     jqueue_t                 rnadq;              /* completed nads waiting to go to rnad */
 
     /* do we want to read or write? */
@@ -293,6 +318,20 @@ struct _sx_st {
     /* bytes read from socket */
     int                      rbytes;
 
+    /* size of the next read */
+    int                      rbufsize;
+
+    /* wire bytes of incoming packets, for SX_RAW_READ */
+    char                     *rraw;              /* stream bytes from offset rrawbase on */
+    int                      rrawlen, rrawsize;
+    long                     rrawbase;
+    long                     rrawstart, rrawend; /* the top-level element being parsed */
+    long                     rrawdone;           /* end of the last one completed */
+    long                     *rrawspan;          /* start/end pairs for the nads in rnadq */
+    int                      nrrawspan, rrawspanhead, rrawspanmax;
+    char                     *rrawpkt;           /* the packet being delivered */
+    int                      rrawpktlen;
+
     /* read bytes maximum */
     int                      rbytesmax;
 
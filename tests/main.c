@@ -7,6 +7,8 @@
 #endif
 
 #include "util/util.h"
+#include "mio/mio.h"
+#include "sx/sx.h"
 
 void s2s_wrap()
 {
@@ -82,10 +84,936 @@ void s2s_wrap()
     fprintf(stdout, "Mangled packet:\n%.*s\n", len, buf);
 }
 
+static int mio_timeout_fired;
+static unsigned long long mio_timeout_last;
+
+static unsigned long long now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (unsigned long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static int mio_timeout_check(void *data1, void *data2)
+{
+    unsigned long long due = (unsigned long long) (size_t) data1, now = now_ms();
+
+    if(now + 1 < due)
+        fprintf(stdout, "timeout fired %llu ms early\n", due - now);
+    if(due < mio_timeout_last)
+        fprintf(stdout, "timeout fired out of order\n");
+    mio_timeout_last = due;
+    mio_timeout_fired++;
+
+    return 0;
+}
+
+void mio_timeouts()
+{
+    mio_t mio = mio_new(16);
+    void **t;
+    int i, n = 1000000;
+    unsigned long long start, due;
+    clock_t c;
+
+    /* a few short ones, half cancelled */
+    t = malloc(sizeof(void *) * n);
+    start = now_ms();
+    for(i = 0; i < 200; i++) {
+        due = start + (i * 7919) % 600;
+        t[i] = mio_add_timeout(mio, mio_timeout_check, (void *) (size_t) due, NULL, due - start);
+    }
+    for(i = 0; i < 200; i += 2)
+        mio_cancel_timeout(mio, t[i]);
+    while(now_ms() < start + 700)
+        mio_run(mio, 100);
+    fprintf(stdout, "%d of 100 timeouts fired\n", mio_timeout_fired);
+
+    /* arm/cancel cost with a lot outstanding */
+    c = clock();
+    for(i = 0; i < n; i++)
+        t[i] = mio_add_timeout(mio, NULL, NULL, NULL, 1000 + (unsigned long long) i * 7919 % 3600000);
+    fprintf(stdout, "armed %d timeouts in %.0f ns each\n", n, (double) (clock() - c) * 1e9 / CLOCKS_PER_SEC / n);
+
+    c = clock();
+    for(i = 0; i < 1000; i++)
+        mio_run(mio, 0);
+    fprintf(stdout, "mio_run with %d outstanding in %.0f ns\n", n, (double) (clock() - c) * 1e9 / CLOCKS_PER_SEC / 1000);
+
+    c = clock();
+    for(i = 0; i < n; i++)
+        mio_cancel_timeout(mio, t[i]);
+    fprintf(stdout, "cancelled %d timeouts in %.0f ns each\n", n, (double) (clock() - c) * 1e9 / CLOCKS_PER_SEC / n);
+
+    free(t);
+    mio_free(mio);
+}
+
+static int sx_writes_syscalls;
+
+static int sx_writes_callback(sx_t s, sx_event_t e, void *data, void *arg)
+{
+    int fd = *(int *) arg;
+    sx_buf_t buf = (sx_buf_t) data;
+    int len;
+
+    switch(e) {
+        case event_WRITE:
+        case event_WRITEV:
+            sx_writes_syscalls++;
+            if(e == event_WRITEV)
+                len = writev(fd, ((sx_wvec_t *) data)->iov, ((sx_wvec_t *) data)->niov);
+            else
+                len = send(fd, buf->data, buf->len, 0);
+            if(len < 0)
+                return (errno == EAGAIN) ? 0 : -1;
+            return len;
+
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+/* router to sm: bursts of routed stanzas, one write per buffer vs gathered writes */
+void sx_writes()
+{
+    char *route = "<route xmlns='jabber:component:accept' to='sm' from='c2s'>"
+        "<message xmlns='jabber:client' to='user@example.com' from='friend@example.net/home' type='chat'>"
+        "<body>Hi there, are you around?</body>"
+        "</message></route>";
+    char drain[65536];
+    int fds[2], flags, i, j, nstanzas = 0, bursts = 2000, burst = 50;
+    sx_t s;
+    nad_t nad;
+    clock_t c;
+
+    for(flags = 0; flags <= SX_WRITEV; flags += SX_WRITEV) {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+        s = sx_new(NULL, fds[0], sx_writes_callback, (void *) &fds[0]);
+        s->flags = flags;
+
+        sx_writes_syscalls = 0;
+        nstanzas = 0;
+        c = clock();
+        for(i = 0; i < bursts; i++) {
+            for(j = 0; j < burst; j++) {
+                nad = nad_parse(route, 0);
+                sx_nad_write(s, nad);
+                nstanzas++;
+            }
+
+            while(sx_can_write(s))
+                while(recv(fds[1], drain, sizeof(drain), 0) > 0);
+            while(recv(fds[1], drain, sizeof(drain), 0) > 0);
+        }
+
+        fprintf(stdout, "%s: %d stanzas, %.2f syscalls/stanza, %.0f ns/stanza\n", flags ? "writev" : "write", nstanzas,
+            (double) sx_writes_syscalls / nstanzas, (double) (clock() - c) * 1e9 / CLOCKS_PER_SEC / nstanzas);
+
+        sx_free(s);
+        close(fds[0]);
+        close(fds[1]);
+    }
+}
+
+static int sx_reads_calls, sx_reads_packets;
+
+static int sx_reads_callback(sx_t s, sx_event_t e, void *data, void *arg)
+{
+    int fd = *(int *) arg;
+    sx_buf_t buf = (sx_buf_t) data;
+    int len;
+
+    switch(e) {
+        case event_READ:
+            sx_reads_calls++;
+            len = recv(fd, buf->data, buf->len, 0);
+            if(len < 0) {
+                buf->len = 0;
+                return (errno == EAGAIN) ? 0 : -1;
+            }
+            buf->len = len;
+            return len;
+
+        case event_WRITE:
+            /* nobody is listening to our side, just let it go */
+            return buf->len;
+
+        case event_PACKET:
+            sx_reads_packets++;
+            nad_free((nad_t) data);
+            break;
+
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+/* sm from router: a long run of routed stanzas, the read size should open up to match */
+void sx_reads()
+{
+    char *open = "<stream:stream xmlns:stream='http://etherx.jabber.org/streams' xmlns='jabber:component:accept' version='1.0'>";
+    char *route = "<route xmlns='jabber:component:accept' to='sm' from='c2s'>"
+        "<message xmlns='jabber:client' to='user@example.com' from='friend@example.net/home' type='chat'>"
+        "<body>Hi there, are you around?</body>"
+        "</message></route>";
+    int fds[2], i, nstanzas = 20000, sent = 0, rlen = strlen(route);
+    sx_t s;
+    clock_t c;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    s = sx_new(NULL, fds[0], sx_reads_callback, (void *) &fds[0]);
+    sx_server_init(s, 0);
+
+    sx_reads_calls = sx_reads_packets = 0;
+    c = clock();
+
+    send(fds[1], open, strlen(open), 0);
+    sx_can_read(s);
+    while(sx_can_write(s));
+
+    while(sent < nstanzas) {
+        for(i = 0; i < 64 && sent < nstanzas; i++, sent++)
+            send(fds[1], route, rlen, 0);
+        while(sx_reads_packets < sent && sx_can_read(s));
+    }
+
+    fprintf(stdout, "%d/%d stanzas, %.2f reads/stanza, read size %d, %.0f ns/stanza\n", sx_reads_packets, nstanzas,
+        (double) sx_reads_calls / nstanzas, s->rbufsize, (double) (clock() - c) * 1e9 / CLOCKS_PER_SEC / nstanzas);
+
+    sx_free(s);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* parse, copy and serialize stanzas through a recycled nad, with and without the cache */
+void nad_cache()
+{
+    char *route = "<route xmlns='jabber:component:accept' to='sm' from='c2s'>"
+        "<message xmlns='jabber:client' to='user@example.com' from='friend@example.net/home' type='chat'>"
+        "<body>Hi there, are you around?</body>"
+        "</message></route>";
+    char *xml, *ser, *ref;
+    int i, len, rlen, max, n = 100000, bad;
+    nad_t nad, copy;
+    nad_cache_stats_t before, after;
+    clock_t c;
+
+    /* what it should look like coming out the other end */
+    nad = nad_parse(route, 0);
+    nad_print(nad, 0, &xml, &rlen);
+    ref = strndup(xml, rlen);
+    nad_free(nad);
+
+    for(max = 0; max <= NAD_CACHE_MAX; max += NAD_CACHE_MAX) {
+        nad_cache_config(max, NAD_CACHE_SIZE);
+        nad_cache_stats(&before);
+        bad = 0;
+
+        c = clock();
+        for(i = 0; i < n; i++) {
+            nad = nad_parse(route, 0);
+            copy = nad_copy(nad);
+            nad_free(nad);
+
+            nad_serialize(copy, &ser, &len);
+            nad_free(copy);
+            nad = nad_deserialize(ser);
+            free(ser);
+
+            nad_print(nad, 0, &xml, &len);
+            if(len != rlen || strncmp(xml, ref, len) != 0)
+                bad++;
+            nad_free(nad);
+        }
+
+        nad_cache_stats(&after);
+        fprintf(stdout, "cache %s: %lu of %lu nads reused, %.2f reallocs/stanza, %.0f ns/stanza, %d mangled\n", max ? "on" : "off",
+            after.hits - before.hits, after.news - before.news, (double) (after.reallocs - before.reallocs) / n,
+            (double) (clock() - c) * 1e9 / CLOCKS_PER_SEC / n, bad);
+    }
+
+    /* what a thread does on its way out; its counts should survive it */
+    nad_cache_free();
+    nad_cache_stats(&before);
+    fprintf(stdout, "after freeing: %d nads cached, %lu handed out so far\n", before.cached, before.news);
+
+    free(ref);
+}
+
+/* serialising typical stanzas for the wire: print into the nad and copy out, or print straight into the write buffer */
+void nad_printing()
+{
+    char *stanzas[] = {
+        "<presence xmlns='jabber:client' from='juliet@example.com/balcony' to='romeo@example.net'>"
+            "<show>away</show><status>Gone to the &quot;balcony&quot; &amp; back soon</status><priority>5</priority>"
+            "<c xmlns='http://jabber.org/protocol/caps' hash='sha-1' node='http://jabberd.org/' ver='QgayPKawpkPSDYmwT/WM94uAlu0='/>"
+            "</presence>",
+        "<message xmlns='jabber:client' from='romeo@example.net/orchard' to='juliet@example.com' type='chat' id='m1'>"
+            "<body>Wherefore art thou? 3 &lt; 4 &amp;&amp; it&apos;s late</body>"
+            "<active xmlns='http://jabber.org/protocol/chatstates'/>"
+            "</message>",
+        NULL };
+    char *names[] = { "presence", "message" };
+    char *xml, *out, *copy;
+    int i, j, len, olen, size, ccur, n = 500000, bad;
+    long bytes;
+    nad_t nad, work;
+    clock_t c;
+    double t_print, t_buf;
+
+    for(j = 0; stanzas[j] != NULL; j++) {
+        nad = nad_parse(stanzas[j], 0);
+
+        bytes = 0;
+        c = clock();
+        for(i = 0; i < n; i++) {
+            /* printing appends to the cdata, put it back as a fresh nad would be */
+            ccur = nad->ccur;
+            nad_print(nad, 0, &xml, &len);
+            copy = malloc(len);
+            memcpy(copy, xml, len);
+            bytes += len;
+            free(copy);
+            nad->ccur = ccur;
+        }
+        t_print = (double) (clock() - c) / CLOCKS_PER_SEC;
+
+        c = clock();
+        for(i = 0; i < n; i++) {
+            out = NULL; olen = size = 0;
+            nad_print_buf(nad, 0, &out, &olen, &size);
+            free(out);
+        }
+        t_buf = (double) (clock() - c) / CLOCKS_PER_SEC;
+
+        /* same bytes either way */
+        out = NULL; olen = size = 0;
+        nad_print_buf(nad, 0, &out, &olen, &size);
+        nad_print(nad, 0, &xml, &len);
+        bad = (olen != len || memcmp(out, xml, len) != 0);
+
+        /* and it parses back to the same thing (twice, as parsing reverses the attribute order) */
+        work = nad_parse(out, olen);
+        nad_print(work, 0, &xml, &len);
+        copy = strndup(xml, len);
+        nad_free(work);
+        work = nad_parse(copy, len);
+        nad_print(work, 0, &xml, &len);
+        bad += (olen != len || memcmp(out, xml, len) != 0);
+        nad_free(work);
+        free(copy);
+        free(out);
+
+        fprintf(stdout, "%s: %ld bytes, nad_print + copy %.0f MB/s, nad_print_buf %.0f MB/s, %s\n", names[j], bytes / n,
+            bytes / t_print / 1e6, bytes / t_buf / 1e6, bad ? "DIFFERENT" : "same output");
+
+        nad_free(nad);
+    }
+}
+
+/* loading stored stanzas: parse the xml we used to store, or unpack the binary form */
+void nad_packing()
+{
+    char *stanzas[] = {
+        "<message xmlns='jabber:client' from='romeo@example.net/orchard' to='juliet@example.com' type='chat' id='m1'>"
+            "<body>Wherefore art thou? 3 &lt; 4 &amp;&amp; it&apos;s late</body>"
+            "<active xmlns='http://jabber.org/protocol/chatstates'/>"
+            "<x xmlns='jabber:x:delay' from='example.com' stamp='20260101T12:00:00'>Offline Storage</x>"
+            "</message>",
+        "<vCard xmlns='vcard-temp'><FN>Juliet Capulet</FN><N><FAMILY>Capulet</FAMILY><GIVEN>Juliet</GIVEN></N>"
+            "<NICKNAME>jc</NICKNAME><URL>http://example.com/~juliet</URL><ORG><ORGNAME>House of Capulet</ORGNAME></ORG>"
+            "<EMAIL><INTERNET/><PREF/><USERID>juliet@example.com</USERID></EMAIL><DESC>Balcony &amp; garden</DESC></vCard>",
+        NULL };
+    char *names[] = { "message", "vcard" };
+    char *xml, *ref, *enc, *bin;
+    int i, j, len, rlen, elen, blen, n = 100000, bad;
+    nad_t nad, work;
+    clock_t c;
+    double t_parse, t_decode, t_unpack;
+
+    for(j = 0; stanzas[j] != NULL; j++) {
+        nad = nad_parse(stanzas[j], 0);
+        nad_print(nad, 0, &xml, &rlen);
+        ref = strndup(xml, rlen);
+
+        nad_pack(nad, &bin, &blen);
+        nad_encode(nad, &enc, &elen);
+        nad_free(nad);
+
+        c = clock();
+        for(i = 0; i < n; i++)
+            nad_free(nad_parse(stanzas[j], 0));
+        t_parse = (double) (clock() - c) * 1e9 / CLOCKS_PER_SEC / n;
+
+        c = clock();
+        for(i = 0; i < n; i++)
+            nad_free(nad_decode(enc, elen));
+        t_decode = (double) (clock() - c) * 1e9 / CLOCKS_PER_SEC / n;
+
+        c = clock();
+        for(i = 0; i < n; i++)
+            nad_free(nad_unpack(bin, blen));
+        t_unpack = (double) (clock() - c) * 1e9 / CLOCKS_PER_SEC / n;
+
+        /* packed, encoded and legacy xml all come back as the same stanza */
+        bad = 0;
+        work = nad_unpack(bin, blen);
+        nad_print(work, 0, &xml, &len);
+        bad += (len != rlen || strncmp(xml, ref, len) != 0);
+        nad_free(work);
+
+        work = nad_decode(enc, 0);
+        nad_print(work, 0, &xml, &len);
+        bad += (len != rlen || strncmp(xml, ref, len) != 0);
+
+        /* and can be added to, as the offline queue does */
+        nad_append_elem(work, -1, "extra", 1);
+        nad_append_cdata(work, "tail", 4, 2);
+        nad_print(work, 0, &xml, &len);
+        bad += (strstr(xml, "<extra>tail</extra></") == NULL);
+        nad_free(work);
+
+        work = nad_decode(stanzas[j], 0);
+        nad_print(work, 0, &xml, &len);
+        bad += (len != rlen || strncmp(xml, ref, len) != 0);
+        nad_free(work);
+
+        /* damaged data is turned away, not trusted: cut short, or with a bad
+         * 24 byte header, it never unpacks; damaged further in, whatever does
+         * unpack still points inside itself, so it can be printed */
+        for(i = 0; i < blen; i++)
+            if((work = nad_unpack(bin, i)) != NULL) {
+                bad++;
+                nad_free(work);
+            }
+        for(i = 0; i < blen; i++) {
+            bin[i] ^= 0x80;
+            if((work = nad_unpack(bin, blen)) != NULL) {
+                if(i < 24)
+                    bad++;
+                else {
+                    nad_print(work, 0, &xml, &len);
+                    bad += (len <= 0);
+                }
+                nad_free(work);
+            }
+            bin[i] ^= 0x80;
+        }
+
+        fprintf(stdout, "%s: %d bytes xml, %d packed, %d encoded; nad_parse %.0f ns, nad_decode %.0f ns, nad_unpack %.0f ns, %s\n", names[j],
+            (int) strlen(stanzas[j]), blen, elen, t_parse, t_decode, t_unpack, bad ? "DIFFERENT" : "same stanza");
+
+        free(bin);
+        free(enc);
+        free(ref);
+    }
+
+    /* big ones don't fit in 16 bits */
+    nad = nad_new();
+    nad_append_elem(nad, nad_add_namespace(nad, "jabber:client", NULL), "message", 0);
+    nad_append_elem(nad, -1, "body", 1);
+    ref = malloc(40000);
+    memset(ref, 'x', 40000);
+    nad_append_cdata(nad, ref, 40000, 2);
+    nad_print(nad, 0, &xml, &rlen);
+    memcpy(ref, xml, rlen < 40000 ? rlen : 40000);
+
+    nad_encode(nad, &enc, &elen);
+    nad_free(nad);
+    work = nad_decode(enc, elen);
+    nad_print(work, 0, &xml, &len);
+    fprintf(stdout, "big: %d bytes xml, %d encoded, %s\n", rlen, elen,
+        (len != rlen || rlen < 40000 || memcmp(xml, ref, 40000) != 0) ? "DIFFERENT" : "same stanza");
+    nad_free(work);
+    free(enc);
+    free(ref);
+}
+
+struct fanout_check_st {
+    int     n, bad;
+    char    jid[64];
+};
+
+/* every unicast route out of a multicast should be the original stanza, addressed to the next contact */
+static void _fanout_check(nad_t nad, void *arg) {
+    struct fanout_check_st *fc = (struct fanout_check_st *) arg;
+    int attr;
+
+    snprintf(fc->jid, sizeof(fc->jid), "contact%d@domain%d.example", fc->n * 20, 0);
+    attr = nad_find_attr(nad, 1, -1, "to", NULL);
+    if(attr < 0 || NAD_AVAL_L(nad, attr) != strlen(fc->jid) || strncmp(NAD_AVAL(nad, attr), fc->jid, NAD_AVAL_L(nad, attr)) != 0 ||
+       nad_find_attr(nad, 0, -1, "type", NULL) >= 0 || nad_find_elem(nad, 0, -1, "address", 1) >= 0 ||
+       nad_find_elem(nad, 1, -1, "status", 1) < 0)
+        fc->bad++;
+
+    fc->n++;
+    nad_free(nad);
+}
+
+/* a login storm: available presence to a 2000 contact roster spread over 20 domains,
+ * one route per contact, or one multicast route per domain */
+void presence_fanout()
+{
+    char *route = "<route xmlns='jabber:component:accept' to='example.com' from='sm'>"
+        "<presence xmlns='jabber:client' from='juliet@example.com/balcony'>"
+        "<show>away</show><status>Gone to the balcony</status><priority>5</priority>"
+        "<c xmlns='http://jabber.org/protocol/caps' hash='sha-1' node='http://jabberd.org/' ver='QgayPKawpkPSDYmwT/WM94uAlu0='/>"
+        "</presence></route>";
+    char jid[64], *xml;
+    int i, d, len, ncontacts = 2000, ndomains = 20, nlogins = 200, routes;
+    long bytes;
+    nad_t pres, nad, work;
+    struct fanout_check_st fc;
+    clock_t c;
+
+    pres = nad_parse(route, 0);
+
+    /* a copy, readdress and print for each contact */
+    bytes = 0; routes = 0;
+    c = clock();
+    for(i = 0; i < nlogins * ncontacts; i++) {
+        snprintf(jid, sizeof(jid), "contact%d@domain%d.example", i % ncontacts, i % ndomains);
+        nad = nad_copy(pres);
+        nad_set_attr(nad, 0, -1, "to", strchr(jid, '@') + 1, 0);
+        nad_set_attr(nad, 1, -1, "to", jid, 0);
+        nad_print(nad, 0, &xml, &len);
+        bytes += len; routes++;
+        nad_free(nad);
+    }
+    fprintf(stdout, "unicast: %d routes/login, %ld bytes/login, %.0f us/login\n", routes / nlogins, bytes / nlogins,
+        (double) (clock() - c) * 1e6 / CLOCKS_PER_SEC / nlogins);
+
+    /* one copy and print for each domain */
+    bytes = 0; routes = 0;
+    c = clock();
+    for(i = 0; i < nlogins; i++)
+        for(d = 0; d < ndomains; d++) {
+            nad = nad_copy(pres);
+            snprintf(jid, sizeof(jid), "domain%d.example", d);
+            nad_set_attr(nad, 0, -1, "to", jid, 0);
+            nad_set_attr(nad, 0, -1, "type", "multicast", 9);
+            for(len = d; len < ncontacts; len += ndomains) {
+                snprintf(jid, sizeof(jid), "contact%d@domain%d.example", len, d);
+                nad_multicast_add(nad, jid);
+            }
+            nad_print(nad, 0, &xml, &len);
+            bytes += len; routes++;
+            nad_free(nad);
+        }
+    fprintf(stdout, "multicast: %d routes/login, %ld bytes/login, %.0f us/login\n", routes / nlogins, bytes / nlogins,
+        (double) (clock() - c) * 1e6 / CLOCKS_PER_SEC / nlogins);
+
+    /* and back to unicast at the far end */
+    nad = nad_copy(pres);
+    nad_set_attr(nad, 0, -1, "type", "multicast", 9);
+    for(i = 0; i < ncontacts; i += ndomains) {
+        snprintf(jid, sizeof(jid), "contact%d@domain0.example", i);
+        nad_multicast_add(nad, jid);
+    }
+
+    /* the wire form survives the trip, too */
+    nad_print(nad, 0, &xml, &len);
+    work = nad_parse(xml, len);
+    nad_free(nad);
+    nad = work;
+
+    memset(&fc, 0, sizeof(fc));
+    c = clock();
+    i = nad_multicast_expand(nad, _fanout_check, &fc);
+    fprintf(stdout, "expanded %d of %d recipients in %.0f ns each, %d wrong\n", fc.n, ncontacts / ndomains,
+        (double) (clock() - c) * 1e9 / CLOCKS_PER_SEC / (i > 0 ? i : 1), fc.bad + (i != fc.n));
+
+    nad_free(pres);
+}
+
+/* parsing the addresses a busy server sees: 2000 users on 20 domains, a few
+ * resources each, and some that don't prep, with and without the prep cache */
+void jid_cache()
+{
+    char id[64], *full[3];
+    int i, r, n = 200000, nusers = 2000, ndomains = 20, invalid, bad;
+    jid_t jid;
+    jid_cache_stats_t before, after;
+    clock_t c;
+
+    /* what each one should come out as (or NULL if it doesn't prep) */
+    full[0] = full[1] = full[2] = NULL;
+
+    for(r = 0; r < 2; r++) {
+        jid_cache_config(r ? JID_CACHE_SIZE : 0);
+        jid_cache_stats(&before);
+        invalid = bad = 0;
+
+        c = clock();
+        for(i = 0; i < n; i++) {
+            if(i % 100 == 99)
+                snprintf(id, sizeof(id), "not a user%d@Domain%d.Example", i % nusers, i % ndomains);
+            else
+                snprintf(id, sizeof(id), "User%d@Domain%d.Example/%s", i % nusers, i % ndomains, (i % 3) ? "home" : "Work");
+
+            jid = jid_new(id, -1);
+            if(jid == NULL)
+                invalid++;
+            else {
+                /* spot check against the uncached run */
+                if(i < 3) {
+                    if(r == 0)
+                        full[i] = strdup(jid_full(jid));
+                    else if(strcmp(full[i], jid_full(jid)) != 0)
+                        bad++;
+                }
+                jid_free(jid);
+            }
+        }
+
+        jid_cache_stats(&after);
+        fprintf(stdout, "cache %s: %.0f jids/sec, %lu of %lu parts from the cache (%lu invalid), %d invalid jids, %d mangled\n", r ? "on" : "off",
+            n / ((double) (clock() - c) / CLOCKS_PER_SEC), after.hits - before.hits, after.lookups - before.lookups,
+            after.invalid - before.invalid, invalid, bad);
+    }
+
+    for(i = 0; i < 3; i++)
+        free(full[i]);
+}
+
+/* iterations that stop early, and iterations that run while the table grows and shrinks */
+void xhash_iteration()
+{
+    xht h;
+    char key[32];
+    int i, j, n = 2000, seen[2000], twice, missed, added;
+    void *val;
+
+    /* stopping after the first item mustn't hold the table at its starting size */
+    h = xhash_new(11);
+    xhash_put(h, "first", (void *) 1);
+    xhash_iter_first(h);
+    for(i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        xhash_put(h, pstrdup(xhash_pool(h), key), (void *) 1);
+    }
+    fprintf(stdout, "after a broken-off iteration: %d items in %d buckets\n", xhash_count(h), h->size[0] + h->size[1]);
+    xhash_free(h);
+
+    /* adding enough to grow the table part way through */
+    h = xhash_new(11);
+    for(i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        xhash_put(h, pstrdup(xhash_pool(h), key), &seen[i]);
+        seen[i] = 0;
+    }
+
+    added = 0;
+    if(xhash_iter_first(h))
+        do {
+            xhash_iter_get(h, NULL, NULL, &val);
+            if(val != (void *) 1)
+                (*(int *) val)++;
+
+            if(added < 20 * n) {
+                snprintf(key, sizeof(key), "new%d", added++);
+                xhash_put(h, pstrdup(xhash_pool(h), key), (void *) 1);
+            }
+        } while(xhash_iter_next(h));
+
+    twice = missed = 0;
+    for(i = 0; i < n; i++) {
+        twice += (seen[i] > 1);
+        missed += (seen[i] == 0);
+        seen[i] = 0;
+    }
+    fprintf(stdout, "growing: %d returned twice, %d missed, %d items in %d buckets\n", twice, missed, xhash_count(h), h->size[0] + h->size[1]);
+
+    /* taking the new ones out again, so it shrinks */
+    j = 0;
+    if(xhash_iter_first(h))
+        do {
+            xhash_iter_get(h, NULL, NULL, &val);
+            if(val == (void *) 1)
+                continue;
+
+            (*(int *) val)++;
+            for(i = 0; i < 25 && j < added; i++) {
+                snprintf(key, sizeof(key), "new%d", j++);
+                xhash_zap(h, key);
+            }
+        } while(xhash_iter_next(h));
+
+    twice = missed = 0;
+    for(i = 0; i < n; i++) {
+        twice += (seen[i] > 1);
+        missed += (seen[i] == 0);
+    }
+    fprintf(stdout, "shrinking: %d returned twice, %d missed, %d items in %d buckets\n", twice, missed, xhash_count(h), h->size[0] + h->size[1]);
+    xhash_free(h);
+}
+
+static void _pool_cleanup_count(void *arg)
+{
+    (*(int *) arg)++;
+}
+
+/* the pools a busy sm makes and frees: one per user, session, hash and object,
+ * each with a handful of small allocations, with and without the block cache */
+void pool_cache()
+{
+    int i, j, r, n = 100000, cleanups, bad;
+    pool_t p;
+    char *str[8];
+    pool_cache_stats_t before, after;
+    clock_t c;
+
+    for(r = 0; r < 2; r++) {
+        pool_cache_config(r ? POOL_CACHE_SIZE : 0);
+        pool_cache_stats(&before);
+        cleanups = bad = 0;
+
+        c = clock();
+        for(i = 0; i < n; i++) {
+            p = (i % 2) ? pool_new() : pool_heap(256 + (i % 4) * 256);
+
+            /* a cleanup before anything else, then allocations after it */
+            pool_cleanup(p, _pool_cleanup_count, &cleanups);
+
+            for(j = 0; j < 8; j++) {
+                str[j] = pmalloc(p, 16 + ((i + j) % 10) * 20);
+                memset(str[j], 'a' + j, 16);
+            }
+
+            pstrdup(p, "user@example.com/resource");
+
+            for(j = 0; j < 8; j++)
+                if(str[j][0] != 'a' + j || str[j][15] != 'a' + j)
+                    bad++;
+
+            pool_free(p);
+        }
+
+        pool_cache_stats(&after);
+        fprintf(stdout, "cache %s: %.0f pools/sec, %lu of %lu blocks reused, %lu dropped, %lu bytes held, %d cleanups missed, %d clobbered\n", r ? "on" : "off",
+            n / ((double) (clock() - c) / CLOCKS_PER_SEC), after.hits - before.hits, after.allocs - before.allocs,
+            after.drops - before.drops, after.held, n - cleanups, bad);
+    }
+}
+
+static int connpool_opens, connpool_closes, connpool_fail_check;
+
+static void *connpool_test_open(void *arg)
+{
+    connpool_opens++;
+    return malloc(1);
+}
+
+static int connpool_test_check(void *conn, void *arg)
+{
+    return connpool_fail_check;
+}
+
+static void connpool_test_close(void *conn, void *arg)
+{
+    connpool_closes++;
+    free(conn);
+}
+
+void connpool()
+{
+    connpool_t cp;
+    connpool_stats_t stats;
+    void *a, *b;
+    int i;
+
+    /* checked every time it comes back out, since it's never idle for less than 0 seconds */
+    cp = connpool_new(2, 0, connpool_test_open, connpool_test_check, connpool_test_close, NULL);
+
+    for(i = 0; i < 1000; i++) {
+        a = connpool_get(cp);
+        b = connpool_get(cp);
+        connpool_put(cp, b, 0);
+        connpool_put(cp, a, 0);
+    }
+
+    /* a failed check gets a new one, and a broken one isn't kept */
+    connpool_fail_check = 1;
+    a = connpool_get(cp);
+    connpool_fail_check = 0;
+    connpool_put(cp, a, 1);
+
+    connpool_stats(cp, &stats);
+    fprintf(stdout, "%lu gets, %lu checks, %d opens, %d closes, %d open, %d of 2 busy at most\n",
+        stats.gets, stats.checks, connpool_opens, connpool_closes, stats.open, stats.inuse_max);
+
+    connpool_free(cp);
+
+    fprintf(stdout, "%d opens, %d closes after free\n", connpool_opens, connpool_closes);
+}
+
+struct sx_relay_st {
+    int     fd;
+    sx_t    out;
+    int     raw;
+    int     packets;
+};
+
+static int sx_relay_callback(sx_t s, sx_event_t e, void *data, void *arg)
+{
+    struct sx_relay_st *relay = (struct sx_relay_st *) arg;
+    sx_buf_t buf = (sx_buf_t) data;
+    char *raw;
+    int len;
+
+    switch(e) {
+        case event_READ:
+            len = recv(relay->fd, buf->data, buf->len, 0);
+            if(len < 0) {
+                buf->len = 0;
+                return (errno == EAGAIN) ? 0 : -1;
+            }
+            buf->len = len;
+            return len;
+
+        case event_WRITE:
+        case event_WRITEV:
+            if(relay->out == NULL)
+                return (e == event_WRITEV) ? 0 : buf->len;  /* our own stream header, nobody listening */
+            if(e == event_WRITEV)
+                len = writev(relay->fd, ((sx_wvec_t *) data)->iov, ((sx_wvec_t *) data)->niov);
+            else
+                len = send(relay->fd, buf->data, buf->len, 0);
+            if(len < 0)
+                return (errno == EAGAIN) ? 0 : -1;
+            return len;
+
+        case event_PACKET:
+            relay->packets++;
+            if(relay->raw && sx_raw_packet(s, &raw, &len)) {
+                sx_raw_write(relay->out, raw, len);
+                nad_free((nad_t) data);
+            } else
+                sx_nad_write(relay->out, (nad_t) data);
+            break;
+
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+/* router relaying sm to c2s: parse and reprint each route, or pass the wire bytes through */
+void sx_relay()
+{
+    char *open = "<stream:stream xmlns:stream='http://etherx.jabber.org/streams' xmlns='jabber:component:accept' version='1.0'>";
+    char *route = "<route xmlns='http://jabberd.jabberstudio.org/ns/component/1.0' to='c2s' from='sm'>"
+        "<message xmlns='jabber:client' to='user@example.com/home' from='friend@example.net/work' type='chat'>"
+        "<body>Are we still on for &lt;tonight&gt;?</body>"
+        "</message></route>";
+    char drain[65536];
+    int in[2], out[2], i, j, n = 100000, burst = 64, rlen = strlen(route), got, bad;
+    long wire;
+    struct sx_relay_st rin, rout;
+    sx_t sin, sout;
+    clock_t c;
+
+    for(rin.raw = 0; rin.raw <= 1; rin.raw++) {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, in);
+        socketpair(AF_UNIX, SOCK_STREAM, 0, out);
+        fcntl(in[0], F_SETFL, O_NONBLOCK);
+        fcntl(out[0], F_SETFL, O_NONBLOCK);
+        fcntl(out[1], F_SETFL, O_NONBLOCK);
+
+        rout.fd = out[0]; rout.out = NULL; rout.raw = 0;
+        sout = sx_new(NULL, out[0], sx_relay_callback, (void *) &rout);
+        sout->flags = SX_WRITEV;
+        rout.out = sout;
+
+        rin.fd = in[0]; rin.out = NULL; rin.packets = 0;
+        sin = sx_new(NULL, in[0], sx_relay_callback, (void *) &rin);
+        sx_server_init(sin, SX_WRITEV | (rin.raw ? SX_RAW_READ : 0));
+
+        send(in[1], open, strlen(open), 0);
+        sx_can_read(sin);
+        while(sx_can_write(sin));
+        rin.out = sout;
+
+        wire = 0;
+        bad = 0;
+        c = clock();
+        for(i = 0; i < n; i += burst) {
+            for(j = 0; j < burst; j++)
+                send(in[1], route, rlen, 0);
+            while(rin.packets < i + burst && sx_can_read(sin));
+
+            while(sx_can_write(sout))
+                while((got = recv(out[1], drain, sizeof(drain), 0)) > 0) {
+                    if(rin.raw && (got % rlen != 0 || strncmp(drain, route, rlen) != 0))
+                        bad++;
+                    wire += got;
+                }
+            while((got = recv(out[1], drain, sizeof(drain), 0)) > 0)
+                wire += got;
+        }
+
+        fprintf(stdout, "%s: %d routes relayed, %ld bytes out, %.0f ns/route (%.0f routes/sec)%s\n", rin.raw ? "pass-through" : "reprint",
+            rin.packets, wire, (double) (clock() - c) * 1e9 / CLOCKS_PER_SEC / n, n / ((double) (clock() - c) / CLOCKS_PER_SEC),
+            bad ? ", NOT AS SENT" : "");
+
+        sx_free(sin);
+        sx_free(sout);
+        close(in[0]); close(in[1]);
+        close(out[0]); close(out[1]);
+    }
+}
+
 int main(int argc, char* arcgv[])
 {
     fprintf(stdout, "Testing s2s incoming packet wrapper\n");
     s2s_wrap();
 
+    fprintf(stdout, "Testing mio timeouts\n");
+    mio_timeouts();
+
+    fprintf(stdout, "Testing nad cache\n");
+    nad_cache();
+
+    fprintf(stdout, "Testing nad printing\n");
+    nad_printing();
+
+    fprintf(stdout, "Testing nad packing\n");
+    nad_packing();
+
+    fprintf(stdout, "Testing presence fan-out\n");
+    presence_fanout();
+
+    fprintf(stdout, "Testing xhash iteration\n");
+    xhash_iteration();
+
+    fprintf(stdout, "Testing jid prep cache\n");
+    jid_cache();
+
+    fprintf(stdout, "Testing pool block cache\n");
+    pool_cache();
+
+    fprintf(stdout, "Testing connection pool\n");
+    connpool();
+
+    fprintf(stdout, "Testing sx gathered writes\n");
+    sx_writes();
+
+    fprintf(stdout, "Testing sx adaptive reads\n");
+    sx_reads();
+
+    fprintf(stdout, "Testing sx pass-through relay\n");
+    sx_relay();
+
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,287 @@
+#!/usr/bin/perl -w
+
+################################################################################
+# migrate-lmdb.pl
+#
+# Copy a Jabberd2 Berkeley DB or SQLite database into an LMDB environment.
+#
+# usage: migrate-lmdb.pl sm|authreg <source> <lmdb directory>
+#
+#   sm       copy session manager data for storage_lmdb. <source> is the
+#            sm.db file of the db driver, or the database of the sqlite
+#            driver.
+#   authreg  copy credentials for authreg_lmdb. <source> is the
+#            authreg.db file of the db module, or the database of the
+#            sqlite module.
+#
+# The kind of source is worked out from the file itself. Stop jabberd
+# before running this; objects already in the environment are kept, and
+# copied ones are added after them.
+#
+# NB:
+# - integers are written in the host's byte order, as the drivers do, so
+#   run this on the machine that will run jabberd
+#
+# This software is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+################################################################################
+
+use strict;
+use LMDB_File qw(:flags :cursor_op);
+
+# set to one to enable debug output
+my $DEBUG = 0;
+
+# object type identifiers, as in sm/storage.h
+my ($OS_BOOLEAN, $OS_INTEGER, $OS_STRING, $OS_NAD) = (0, 1, 2, 3);
+
+my ($what, $source, $target);
+my ($env, $txn);
+my (%dbs, %seqs);
+my $copied = 0;
+
+sub trc {
+    my $me = $0;
+    $me =~ s,.*/,,;
+    print STDERR "$me: @_\n";
+}
+
+sub trcdebug {
+    trc("@_") if $DEBUG;
+}
+
+sub error {
+    trc("@_");
+    exit 1;
+}
+
+sub usage {
+    trc <<EOF;
+usage: migrate-lmdb.pl sm|authreg <source> <lmdb directory>
+EOF
+    exit 1;
+}
+
+sub options {
+    $what = shift(@ARGV) || usage();
+    $source = shift(@ARGV) || usage();
+    $target = shift(@ARGV) || usage();
+
+    $what eq "sm" || $what eq "authreg" || usage();
+    -f $source || error("$source: no such file");
+    -d $target || error("$target: not a directory");
+}
+
+# is_sqlite $file
+sub is_sqlite {
+    my $file = shift;
+    my $magic = "";
+
+    open(my $fh, "<", $file) || error("$file: $!");
+    binmode($fh);
+    read($fh, $magic, 16);
+    close($fh);
+
+    return $magic eq "SQLite format 3\0";
+}
+
+# open_lmdb $size $maxdbs
+# $size in megabytes, same as <size/> in the config
+sub open_lmdb {
+    my ($size, $maxdbs) = @_;
+
+    $env = LMDB::Env->new($target, {
+        mapsize => $size * 1024 * 1024,
+        maxdbs => $maxdbs,
+        mode => 0600,
+    }) || error("couldn't open environment in $target: $LMDB_File::last_err");
+
+    $txn = $env->BeginTxn();
+}
+
+# get_db $dbname
+sub get_db {
+    my $dbname = shift;
+
+    $dbs{$dbname} = $txn->OpenDB({ dbname => $dbname, flags => MDB_CREATE })
+        if (!exists $dbs{$dbname});
+
+    return $dbs{$dbname};
+}
+
+# store $dbname $key $value
+sub store {
+    my ($dbname, $key, $value) = @_;
+
+    get_db($dbname)->put($key, $value);
+    $copied++;
+}
+
+# sm_key $type $owner
+# owner, a nul, then the next big-endian sequence number for this owner
+sub sm_key {
+    my ($type, $owner) = @_;
+
+    if (!exists $seqs{$type}{$owner}) {
+        # carry on after anything that's already there
+        my $cursor = get_db($type)->Cursor();
+        my ($k, $v) = ($owner . "\1", "");
+        my $seq = 0;
+
+        eval { $cursor->get($k, $v, MDB_SET_RANGE); 1 } ? eval { $cursor->get($k, $v, MDB_PREV); 1 }
+                                                        : eval { $cursor->get($k, $v, MDB_LAST); 1 };
+        $seq = unpack("N", substr($k, -4)) + 1
+            if (length($k) == length($owner) + 5 && substr($k, 0, length($owner) + 1) eq $owner . "\0");
+
+        $seqs{$type}{$owner} = $seq;
+    }
+
+    return pack("Z* N", $owner, $seqs{$type}{$owner}++);
+}
+
+# the db driver serialises objects the same way, so values copy as they are
+sub sm_from_bdb {
+    require BerkeleyDB;
+    BerkeleyDB->import();
+
+    my $db = new BerkeleyDB::Unknown -Filename => $source, -Flags => DB_RDONLY();
+    defined $db || error("error opening $source: $BerkeleyDB::Error");
+
+    my $cursor = $db->db_cursor() || error("could not get cursor: $BerkeleyDB::Error");
+    my ($type, $v) = ("", "");
+
+    while ($cursor->c_get($type, $v, DB_NEXT()) == 0) {
+        trcdebug("copying type $type");
+
+        my $tdb = new BerkeleyDB::Hash -Filename => $source, -Subname => $type, -Flags => DB_RDONLY();
+        defined $tdb || error("error opening $source/$type: $BerkeleyDB::Error");
+
+        my $tcursor = $tdb->db_cursor() || error("could not get cursor: $BerkeleyDB::Error");
+        my ($owner, $value) = ("", "");
+
+        while ($tcursor->c_get($owner, $value, DB_NEXT()) == 0) {
+            store($type, sm_key($type, $owner), $value);
+        }
+    }
+}
+
+# each row becomes an object, with its columns typed the way the sqlite
+# driver would have read them back
+sub sm_from_sqlite {
+    require DBI;
+
+    my $dbh = DBI->connect("dbi:SQLite:dbname=$source", "", "", { RaiseError => 1 }) ||
+        error("error opening $source: $DBI::errstr");
+
+    my $tables = $dbh->selectcol_arrayref("SELECT name FROM sqlite_master WHERE type = 'table'");
+
+    foreach my $type (@$tables) {
+        next if ($type eq "authreg" || $type =~ /^sqlite_/);
+
+        my @cols;
+        my $info = $dbh->prepare("PRAGMA table_info(\"$type\")");
+        $info->execute();
+        while (my $col = $info->fetchrow_hashref()) {
+            push(@cols, $col);
+        }
+
+        if (!grep { $_->{name} eq "collection-owner" } @cols) {
+            trc("warn: skipping $type, it has no collection-owner");
+            next;
+        }
+
+        trcdebug("copying type $type");
+
+        my $sth = $dbh->prepare("SELECT * FROM \"$type\" ORDER BY \"object-sequence\"");
+        $sth->execute();
+
+        while (my $row = $sth->fetchrow_hashref()) {
+            my $value = "";
+
+            foreach my $col (@cols) {
+                my $name = $col->{name};
+                my $val = $row->{$name};
+
+                next if ($name eq "collection-owner" || $name eq "object-sequence" || !defined $val);
+
+                if ($col->{type} eq "BOOL") {
+                    $value .= pack("Z* i i", $name, $OS_BOOLEAN, $val ? 1 : 0);
+                } elsif ($col->{type} =~ /INT|BOOL/i) {
+                    $value .= pack("Z* i i", $name, $OS_INTEGER, $val);
+                } elsif ($val =~ /^NAD/) {
+                    $value .= pack("Z* i Z*", $name, $OS_NAD, substr($val, 3));
+                } else {
+                    $value .= pack("Z* i Z*", $name, $OS_STRING, $val);
+                }
+            }
+
+            store($type, sm_key($type, $row->{"collection-owner"}), $value);
+        }
+    }
+
+    $dbh->disconnect();
+}
+
+# one database per realm, each value a struct of three 257 byte strings
+sub authreg_from_bdb {
+    require BerkeleyDB;
+    BerkeleyDB->import();
+
+    my $db = new BerkeleyDB::Unknown -Filename => $source, -Flags => DB_RDONLY();
+    defined $db || error("error opening $source: $BerkeleyDB::Error");
+
+    my $cursor = $db->db_cursor() || error("could not get cursor: $BerkeleyDB::Error");
+    my ($realm, $v) = ("", "");
+
+    while ($cursor->c_get($realm, $v, DB_NEXT()) == 0) {
+        trcdebug("copying realm '$realm'");
+
+        my $rdb = new BerkeleyDB::Hash -Filename => $source, -Subname => $realm, -Flags => DB_RDONLY();
+        defined $rdb || error("error opening $source/$realm: $BerkeleyDB::Error");
+
+        my $rcursor = $rdb->db_cursor() || error("could not get cursor: $BerkeleyDB::Error");
+        my ($key, $creds) = ("", "");
+
+        while ($rcursor->c_get($key, $creds, DB_NEXT()) == 0) {
+            my ($username, $crealm, $password) = unpack("Z257 Z257 Z257", $creds);
+            store("authreg", pack("Z* a*", $username, $crealm), pack("Z*", $password));
+        }
+    }
+}
+
+sub authreg_from_sqlite {
+    require DBI;
+
+    my $dbh = DBI->connect("dbi:SQLite:dbname=$source", "", "", { RaiseError => 1 }) ||
+        error("error opening $source: $DBI::errstr");
+
+    my $sth = $dbh->prepare("SELECT \"username\", \"realm\", \"password\" FROM \"authreg\"");
+    $sth->execute();
+
+    while (my ($username, $realm, $password) = $sth->fetchrow_array()) {
+        store("authreg", pack("Z* a*", $username, $realm || ""), pack("Z*", $password || ""));
+    }
+
+    $dbh->disconnect();
+}
+
+options();
+
+my $sqlite = is_sqlite($source);
+
+trcdebug("copying $what from " . ($sqlite ? "sqlite" : "berkeley db") . " $source to $target");
+
+if ($what eq "sm") {
+    open_lmdb(1024, 256);
+    $sqlite ? sm_from_sqlite() : sm_from_bdb();
+} else {
+    open_lmdb(64, 1);
+    $sqlite ? authreg_from_sqlite() : authreg_from_bdb();
+}
+
+$txn->commit();
+
+trc("copied $copied objects into $target");
@@ -0,0 +1,218 @@
+/*
+ * jabberd - Jabber Open Source Server
+ * Copyright (c) 2002 Jeremie Miller, Thomas Muldowney,
+ *                    Ryan Eatmon, Robert Norris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA02111-1307USA
+ */
+
+/* database connection pools. drivers open connections as they're needed, up
+ * to a limit, and threads take turns with them. a connection that's been
+ * sitting idle for a while is checked before it's handed out, so drivers
+ * don't need to ping the database before every query */
+
+#include "util.h"
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+typedef struct _connpool_conn_st {
+    void            *conn;
+    time_t          used;       /* when it was given back */
+} _connpool_conn_t;
+
+struct _connpool_st {
+    int                 size;   /* most connections open at once */
+    int                 idle;   /* check connections that have been idle this many seconds */
+
+    connpool_open_t     open;
+    connpool_check_t    check;
+    connpool_close_t    close;
+    void                *arg;
+
+    _connpool_conn_t    *free;  /* idle connections, most recently used last */
+    int                 nfree;
+
+    connpool_stats_t    stats;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;   /* signalled when a connection is given back */
+#endif
+};
+
+#ifdef HAVE_PTHREAD_H
+# define _connpool_lock(cp)     pthread_mutex_lock(&(cp)->lock)
+# define _connpool_unlock(cp)   pthread_mutex_unlock(&(cp)->lock)
+#else
+# define _connpool_lock(cp)
+# define _connpool_unlock(cp)
+#endif
+
+connpool_t connpool_new(int size, int idle, connpool_open_t open, connpool_check_t check, connpool_close_t close, void *arg) {
+    connpool_t cp;
+
+#ifndef HAVE_PTHREAD_H
+    /* nobody to share with */
+    size = 1;
+#endif
+    if(size < 1)
+        size = 1;
+
+    cp = (connpool_t) calloc(1, sizeof(struct _connpool_st));
+
+    cp->size = size;
+    cp->idle = idle;
+    cp->open = open;
+    cp->check = check;
+    cp->close = close;
+    cp->arg = arg;
+
+    cp->free = (_connpool_conn_t *) calloc(size, sizeof(_connpool_conn_t));
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&cp->lock, NULL);
+    pthread_cond_init(&cp->cond, NULL);
+#endif
+
+    return cp;
+}
+
+void connpool_free(connpool_t cp) {
+    int i;
+
+    if(cp == NULL)
+        return;
+
+    /* anything still handed out is the caller's problem */
+    for(i = 0; i < cp->nfree; i++)
+        (cp->close)(cp->free[i].conn, cp->arg);
+
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_destroy(&cp->cond);
+    pthread_mutex_destroy(&cp->lock);
+#endif
+
+    free(cp->free);
+    free(cp);
+}
+
+void *connpool_get(connpool_t cp) {
+    void *conn = NULL;
+    time_t used = 0;
+    int check;
+#ifdef HAVE_PTHREAD_H
+    struct timeval start, now;
+    int waited = 0;
+#endif
+
+    _connpool_lock(cp);
+
+    cp->stats.gets++;
+
+#ifdef HAVE_PTHREAD_H
+    /* all open and all busy */
+    while(cp->nfree == 0 && cp->stats.open >= cp->size) {
+        if(!waited) {
+            gettimeofday(&start, NULL);
+            cp->stats.waits++;
+            waited = 1;
+        }
+
+        pthread_cond_wait(&cp->cond, &cp->lock);
+    }
+
+    if(waited) {
+        gettimeofday(&now, NULL);
+        cp->stats.wait_usecs += (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec);
+    }
+#endif
+
+    if(cp->nfree > 0) {
+        cp->nfree--;
+        conn = cp->free[cp->nfree].conn;
+        used = cp->free[cp->nfree].used;
+    } else
+        cp->stats.open++;   /* we'll open one in a moment */
+
+    cp->stats.inuse++;
+    if(cp->stats.inuse > cp->stats.inuse_max)
+        cp->stats.inuse_max = cp->stats.inuse;
+
+    check = (conn != NULL && cp->check != NULL && cp->idle >= 0 && time(NULL) - used >= cp->idle);
+    if(check)
+        cp->stats.checks++;
+
+    _connpool_unlock(cp);
+
+    /* it's been sitting there a while, so make sure it's still any good */
+    if(check && (cp->check)(conn, cp->arg) != 0) {
+        (cp->close)(conn, cp->arg);
+        conn = NULL;
+
+        _connpool_lock(cp);
+        cp->stats.errors++;
+        _connpool_unlock(cp);
+    }
+
+    if(conn == NULL && (conn = (cp->open)(cp->arg)) == NULL) {
+        _connpool_lock(cp);
+        cp->stats.errors++;
+        cp->stats.open--;
+        cp->stats.inuse--;
+#ifdef HAVE_PTHREAD_H
+        pthread_cond_signal(&cp->cond);
+#endif
+        _connpool_unlock(cp);
+    }
+
+    return conn;
+}
+
+void connpool_put(connpool_t cp, void *conn, int broken) {
+    int drop;
+
+    _connpool_lock(cp);
+
+    cp->stats.inuse--;
+
+    /* without threads, a nested get opens more than we have room to keep */
+    drop = broken || cp->nfree >= cp->size;
+
+    if(drop) {
+        if(broken)
+            cp->stats.errors++;
+        cp->stats.open--;
+    } else {
+        cp->free[cp->nfree].conn = conn;
+        cp->free[cp->nfree].used = time(NULL);
+        cp->nfree++;
+    }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_signal(&cp->cond);
+#endif
+
+    _connpool_unlock(cp);
+
+    if(drop)
+        (cp->close)(conn, cp->arg);
+}
+
+void connpool_stats(connpool_t cp, connpool_stats_t *stats) {
+    _connpool_lock(cp);
+    memcpy(stats, &cp->stats, sizeof(connpool_stats_t));
+    _connpool_unlock(cp);
+}
@@ -24,22 +24,201 @@
 /** Forward declaration **/
 static jid_t jid_reset_components_internal(jid_t jid, const unsigned char *node, const unsigned char *domain, const unsigned char *resource, int prepare);
 
+/* stringprep result cache. the same few thousand domains and users get
+ * prepped over and over, so we remember what each raw part came out as (or
+ * that it was invalid). the sm's storage workers parse jids too, so the
+ * table is shared between threads: readers don't lock, they just check that
+ * the slot's sequence number didn't move while they copied it out. writers
+ * serialise on a spinlock and hold the sequence odd while they update */
+#if defined(__GNUC__)
+# define JID_THREAD __thread
+# define _jid_seq_get(seq)          __atomic_load_n(&(seq), __ATOMIC_ACQUIRE)
+# define _jid_seq_recheck(seq)      (__atomic_thread_fence(__ATOMIC_ACQUIRE), __atomic_load_n(&(seq), __ATOMIC_RELAXED))
+# define _jid_seq_begin(seq)        do { __atomic_store_n(&(seq), (seq) + 1, __ATOMIC_RELAXED); __atomic_thread_fence(__ATOMIC_RELEASE); } while(0)
+# define _jid_seq_end(seq)          __atomic_store_n(&(seq), (seq) + 1, __ATOMIC_RELEASE)
+# define _jid_cache_lock()          while(__sync_lock_test_and_set(&_jid_cache_locked, 1))
+# define _jid_cache_unlock()        __sync_lock_release(&_jid_cache_locked)
+#else
+# define JID_THREAD
+# define _jid_seq_get(seq)          (seq)
+# define _jid_seq_recheck(seq)      (seq)
+# define _jid_seq_begin(seq)        (seq)++
+# define _jid_seq_end(seq)          (seq)++
+# define _jid_cache_lock()
+# define _jid_cache_unlock()
+#endif
+
+typedef struct _jid_cache_slot_st {
+    unsigned int    seq;                    /* odd while it's being written */
+    unsigned char   part;                   /* jid_NODE, jid_DOMAIN or jid_RESOURCE, 0 if empty */
+    unsigned char   ok;                     /* 0 if the part didn't prep */
+    unsigned char   klen, vlen;
+    char            key[JID_CACHE_LEN];     /* the part as given */
+    char            val[JID_CACHE_LEN];     /* and as prepped */
+} _jid_cache_slot_t;
+
+static _jid_cache_slot_t _jid_cache[JID_CACHE_SIZE];
+static unsigned int _jid_cache_mask = JID_CACHE_SIZE - 1;
+static int _jid_cache_on = 1;
+static int _jid_cache_locked = 0;
+static JID_THREAD jid_cache_stats_t _jid_stats;
+
+void jid_cache_config(int size) {
+    int i, n;
+
+    for(n = 1; n * 2 <= size && n * 2 <= JID_CACHE_SIZE; n *= 2);
+
+    _jid_cache_lock();
+
+    /* empty it, so nothing is left stranded outside the new mask */
+    for(i = 0; i < JID_CACHE_SIZE; i++) {
+        _jid_seq_begin(_jid_cache[i].seq);
+        _jid_cache[i].part = 0;
+        _jid_seq_end(_jid_cache[i].seq);
+    }
+
+    _jid_cache_on = (size > 0);
+    _jid_cache_mask = n - 1;
+
+    _jid_cache_unlock();
+}
+
+void jid_cache_stats(jid_cache_stats_t *stats) {
+    memcpy(stats, &_jid_stats, sizeof(jid_cache_stats_t));
+}
+
+/** stringprep one part in place, with the profile for that part */
+static int _jid_stringprep(char *str, jid_part_t part) {
+    switch(part) {
+        case jid_NODE:
+            return stringprep_xmpp_nodeprep(str, 1024) != 0;
+        case jid_DOMAIN:
+            return stringprep_nameprep(str, 1024) != 0;
+        case jid_RESOURCE:
+            return stringprep_xmpp_resourceprep(str, 1024) != 0;
+    }
+
+    return 1;
+}
+
+/** look for a part in a cache slot, and copy the answer out if it's there */
+static int _jid_cache_get(_jid_cache_slot_t *slot, const char *str, int len, jid_part_t part, char *val, int *vlen, int *ok) {
+    unsigned int seq;
+
+    seq = _jid_seq_get(slot->seq);
+    if((seq & 1) || slot->part != part || slot->klen != len || memcmp(slot->key, str, len) != 0)
+        return 0;
+
+    *ok = slot->ok;
+    *vlen = slot->vlen;
+    if(*vlen >= JID_CACHE_LEN)
+        return 0;
+    memcpy(val, slot->val, *vlen);
+
+    /* only believe it if nobody was writing while we copied */
+    return _jid_seq_recheck(slot->seq) == seq;
+}
+
+/** stringprep one part in place, remembering the result */
+static int _jid_prep_part(char *str, jid_part_t part) {
+    _jid_cache_slot_t *slot;
+    char key[JID_CACHE_LEN], val[JID_CACHE_LEN];
+    unsigned int hash = 2166136261u ^ part;
+    int len, vlen, ok, i;
+
+    _jid_stats.lookups++;
+
+    len = strlen(str);
+    if(len >= JID_CACHE_LEN) {
+        _jid_stats.skipped++;
+        return _jid_stringprep(str, part);
+    }
+
+    if(!_jid_cache_on)
+        return _jid_stringprep(str, part);
+
+    /* fnv-1a */
+    for(i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char) str[i]) * 16777619u;
+
+    /* two slots per part, so a pair of hot parts that collide don't keep knocking each other out */
+    slot = &_jid_cache[hash & _jid_cache_mask & ~1];
+
+    if(_jid_cache_get(&slot[0], str, len, part, val, &vlen, &ok) || (_jid_cache_mask > 0 && _jid_cache_get(&slot[1], str, len, part, val, &vlen, &ok))) {
+        _jid_stats.hits++;
+
+        if(!ok) {
+            _jid_stats.invalid++;
+            return 1;
+        }
+
+        memcpy(str, val, vlen);
+        str[vlen] = '\0';
+
+        return 0;
+    }
+
+    /* do it the slow way, and remember the answer */
+    memcpy(key, str, len);
+
+    ok = (_jid_stringprep(str, part) == 0);
+
+    vlen = ok ? strlen(str) : 0;
+    if(vlen >= JID_CACHE_LEN)
+        return 0;
+
+    _jid_cache_lock();
+
+    /* an empty slot if there is one, otherwise one picked by the hash */
+    if(_jid_cache_mask > 0 && slot[0].part != 0 && (slot[1].part == 0 || (hash >> 16) & 1))
+        slot++;
+
+    _jid_seq_begin(slot->seq);
+
+    slot->part = part;
+    slot->ok = ok;
+    slot->klen = len;
+    memcpy(slot->key, key, len);
+    slot->vlen = vlen;
+    memcpy(slot->val, str, vlen);
+
+    _jid_seq_end(slot->seq);
+
+    _jid_cache_unlock();
+
+    return !ok;
+}
+
 /** do stringprep on the pieces */
 static int jid_prep_pieces(char *node, char *domain, char *resource) {
     if(node[0] != '\0')
-        if(stringprep_xmpp_nodeprep(node, 1024) != 0)
+        if(_jid_prep_part(node, jid_NODE) != 0)
             return 1;
 
-    if(stringprep_nameprep(domain, 1024) != 0)
+    if(_jid_prep_part(domain, jid_DOMAIN) != 0)
         return 1;
 
     if(resource[0] != '\0')
-        if(stringprep_xmpp_resourceprep(resource, 1024) != 0)
+        if(_jid_prep_part(resource, jid_RESOURCE) != 0)
             return 1;
 
     return 0;
 }
 
+/** copy a piece out to be prepped - not strncpy(), which would zero the rest of the buffer every time */
+static void jid_copy_piece(char *dest, const unsigned char *src) {
+    int len = 0;
+
+    if(src != NULL) {
+        len = strlen(src);
+        if(len > MAXLEN_JID_COMP)
+            len = MAXLEN_JID_COMP;
+        memcpy(dest, src, len);
+    }
+
+    dest[len] = '\0';
+}
+
 /** do stringprep on the piece **/
 int jid_prep(jid_t jid)
 {
@@ -47,30 +226,19 @@ int jid_prep(jid_t jid)
     char domain[MAXLEN_JID_COMP+1];
     char resource[MAXLEN_JID_COMP+1];
 
-    if(jid->node != NULL) {
-        strncpy(node, jid->node, MAXLEN_JID_COMP);
-        node[MAXLEN_JID_COMP]='\0';
-    }
-    else
-        node[0] = '\0';
-
-    if(jid->domain != NULL) {
-        strncpy(domain, jid->domain, MAXLEN_JID_COMP);
-        domain[MAXLEN_JID_COMP]='\0';
-    }
-    else
-        domain[0] = '\0';
-
-    if(jid->resource != NULL) {
-        strncpy(resource, jid->resource, MAXLEN_JID_COMP);
-        resource[MAXLEN_JID_COMP]='\0';
-    }
-    else
-        resource[0] = '\0';
+    jid_copy_piece(node, jid->node);
+    jid_copy_piece(domain, jid->domain);
+    jid_copy_piece(resource, jid->resource);
 
     if(jid_prep_pieces(node, domain, resource) != 0)
         return 1;
 
+    /* usually they were fine as they were, so leave them where they are */
+    if(strcmp(node, jid->node != NULL ? (char *) jid->node : "") == 0 &&
+       strcmp(domain, jid->domain != NULL ? (char *) jid->domain : "") == 0 &&
+       strcmp(resource, jid->resource != NULL ? (char *) jid->resource : "") == 0)
+        return 0;
+
     /* put prepared components into jid */
     jid_reset_components_internal(jid, node, domain, resource, 0);
 
@@ -76,6 +76,25 @@ typedef enum {
 /** JID static buffer **/
 typedef char jid_static_buf[3*1025];
 
+/** stringprep result cache defaults - number of slots, and the longest
+ *  jid part (in bytes, before and after prep) that will be cached */
+#define JID_CACHE_SIZE  (4096)
+#define JID_CACHE_LEN   (64)
+
+/** stringprep cache counters */
+typedef struct jid_cache_stats_st {
+    unsigned long   lookups;    /* jid parts prepped */
+    unsigned long   hits;       /* of those, how many came from the cache */
+    unsigned long   invalid;    /* hits that were remembered failures */
+    unsigned long   skipped;    /* parts too long to cache */
+} jid_cache_stats_t;
+
+/** set the number of cache slots (0 turns it off, rounded down to a power of two, at most JID_CACHE_SIZE), emptying it */
+JABBERD2_API void                jid_cache_config(int size);
+
+/** get this thread's cache counters */
+JABBERD2_API void                jid_cache_stats(jid_cache_stats_t *stats);
+
 /** make a new jid, and call jid_reset() to populate it */
 JABBERD2_API jid_t               jid_new(const unsigned char *id, int len);
 
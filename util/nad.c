@@ -34,6 +34,9 @@
 
 #include "nad.h"
 #include "util.h"
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
 
 /* define NAD_DEBUG to get pointer tracking - great for weird bugs that you can't reproduce */
 #ifdef NAD_DEBUG
@@ -63,6 +66,40 @@ static void _nad_ptr_check(const char *func, nad_t nad) {
 
 #define BLOCKSIZE 128
 
+/* freed nads, with their buffers, waiting to be handed out again by nad_new().
+ * the sm's storage workers make nads too, so each thread keeps its own list */
+#if defined(_MSC_VER)
+# define NAD_THREAD __declspec(thread)
+#elif defined(__GNUC__)
+# define NAD_THREAD __thread
+#else
+# define NAD_THREAD
+#endif
+
+static NAD_THREAD nad_t _nad_cache = NULL;
+static int _nad_cache_max = NAD_CACHE_MAX;
+static int _nad_cache_size = NAD_CACHE_SIZE;
+static NAD_THREAD nad_cache_stats_t _nad_stats;
+
+/* counters of threads that have gone, handed over by nad_cache_free() */
+static nad_cache_stats_t _nad_stats_gone;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t _nad_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/** internal: really free a nad */
+static void _nad_release(nad_t nad)
+{
+    free(nad->elems);
+    free(nad->attrs);
+    free(nad->cdata);
+    free(nad->nss);
+    free(nad->depths);
+#ifndef NAD_DEBUG
+    free(nad);
+#endif
+}
+
 /**
  * Reallocate the given buffer to make it larger.
  *
@@ -82,6 +119,7 @@ static int _nad_realloc(void **oblocks, int len)
 
     /* keep trying till we get it */
     *oblocks = realloc(*oblocks, nlen);
+    _nad_stats.reallocs++;
     return nlen;
 }
 
@@ -122,10 +160,88 @@ static int _nad_attr(nad_t nad, int elem, int ns, const char *name, const char *
     return attr;
 }
 
+void nad_cache_config(int max, int size)
+{
+    nad_t nad, *prev;
+
+    _nad_cache_max = max;
+    _nad_cache_size = size;
+
+    /* let go of the ones we're no longer allowed to keep */
+    prev = &_nad_cache;
+    while((nad = *prev) != NULL) {
+        if(_nad_stats.cached > _nad_cache_max || nad->elen + nad->alen + nad->nlen + nad->clen + nad->dlen > _nad_cache_size) {
+            *prev = nad->next;
+            _nad_release(nad);
+            _nad_stats.cached--;
+        } else
+            prev = &nad->next;
+    }
+}
+
+void nad_cache_stats(nad_cache_stats_t *stats)
+{
+    memcpy(stats, &_nad_stats, sizeof(nad_cache_stats_t));
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&_nad_stats_lock);
+#endif
+    stats->news += _nad_stats_gone.news;
+    stats->hits += _nad_stats_gone.hits;
+    stats->drops += _nad_stats_gone.drops;
+    stats->reallocs += _nad_stats_gone.reallocs;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&_nad_stats_lock);
+#endif
+}
+
+void nad_cache_free(void)
+{
+    nad_t nad;
+
+    while((nad = _nad_cache) != NULL) {
+        _nad_cache = nad->next;
+        _nad_release(nad);
+    }
+    _nad_stats.cached = 0;
+
+    /* keep the counts, so they still show up at shutdown */
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&_nad_stats_lock);
+#endif
+    _nad_stats_gone.news += _nad_stats.news;
+    _nad_stats_gone.hits += _nad_stats.hits;
+    _nad_stats_gone.drops += _nad_stats.drops;
+    _nad_stats_gone.reallocs += _nad_stats.reallocs;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&_nad_stats_lock);
+#endif
+
+    memset(&_nad_stats, 0, sizeof(nad_cache_stats_t));
+}
+
 nad_t nad_new(void)
 {
     nad_t nad;
 
+    _nad_stats.news++;
+
+#ifndef NAD_DEBUG
+    /* reuse a freed one if we can - its buffers are already grown */
+    if(_nad_cache != NULL) {
+        nad = _nad_cache;
+        _nad_cache = nad->next;
+        _nad_stats.cached--;
+        _nad_stats.hits++;
+
+        nad->ecur = nad->acur = nad->ncur = nad->ccur = 0;
+        nad->scope = -1;
+        nad->next = NULL;
+
+        return nad;
+    }
+#endif
+
     nad = calloc(1, sizeof(struct nad_st));
 
     nad->scope = -1;
@@ -153,16 +269,16 @@ nad_t nad_copy(nad_t nad)
     copy = nad_new();
 
     /* if it's not large enough, make bigger */
-    NAD_SAFE(copy->elems, nad->elen, copy->elen);
-    NAD_SAFE(copy->attrs, nad->alen, copy->alen);
-    NAD_SAFE(copy->nss, nad->nlen, copy->nlen);
-    NAD_SAFE(copy->cdata, nad->clen, copy->clen);
+    NAD_SAFE(copy->elems, nad->ecur * sizeof(struct nad_elem_st), copy->elen);
+    NAD_SAFE(copy->attrs, nad->acur * sizeof(struct nad_attr_st), copy->alen);
+    NAD_SAFE(copy->nss, nad->ncur * sizeof(struct nad_ns_st), copy->nlen);
+    NAD_SAFE(copy->cdata, nad->ccur, copy->clen);
 
-    /* copy all data */
-    memcpy(copy->elems, nad->elems, nad->elen);
-    memcpy(copy->attrs, nad->attrs, nad->alen);
-    memcpy(copy->nss, nad->nss, nad->nlen);
-    memcpy(copy->cdata, nad->cdata, nad->clen);
+    /* copy the data in use */
+    memcpy(copy->elems, nad->elems, nad->ecur * sizeof(struct nad_elem_st));
+    memcpy(copy->attrs, nad->attrs, nad->acur * sizeof(struct nad_attr_st));
+    memcpy(copy->nss, nad->nss, nad->ncur * sizeof(struct nad_ns_st));
+    memcpy(copy->cdata, nad->cdata, nad->ccur);
 
     /* sync data */
     copy->ecur = nad->ecur;
@@ -189,15 +305,20 @@ void nad_free(nad_t nad)
     }
 #endif
 
-    /* Free nad */
-    free(nad->elems);
-    free(nad->attrs);
-    free(nad->cdata);
-    free(nad->nss);
-    free(nad->depths);
 #ifndef NAD_DEBUG
-    free(nad);
+    /* keep it for later, unless it's grown too big to be worth holding on to */
+    if(_nad_stats.cached < _nad_cache_max && nad->elen + nad->alen + nad->nlen + nad->clen + nad->dlen <= _nad_cache_size) {
+        nad->next = _nad_cache;
+        _nad_cache = nad;
+        _nad_stats.cached++;
+        return;
+    }
+
+    _nad_stats.drops++;
 #endif
+
+    /* Free nad */
+    _nad_release(nad);
 }
 
 /** locate the next elem at a given depth with an optional matching name */
@@ -795,111 +916,69 @@ int nad_append_namespace(nad_t nad, int elem, const char *uri, const char *prefi
     return ns;
 }
 
-static void _nad_escape(nad_t nad, int data, int len, int flag)
+/** where the printer puts its output - a growable buffer, which may be the nad's own cdata */
+struct nad_out_st {
+    char **buf;
+    int *len, *size;
+};
+
+/** internal: append escaped cdata. flag says how much needs escaping - & always,
+ *  then > (1), < (2), ' (3) and " (4). done in one pass, copying the runs between
+ *  the characters that need replacing */
+static void _nad_escape(nad_t nad, struct nad_out_st *o, int data, int len, int flag)
 {
-    char *c;
-    int ic;
+    const char *rep;
+    int i, run, lrep;
 
     if(len <= 0) return;
 
-    /* first, if told, find and escape " */
-    while(flag >= 4 && (c = memchr(nad->cdata + data,'"',len)) != NULL)
-    {
-        /* get offset */
-        ic = c - nad->cdata;
-
-        /* cute, eh?  handle other data before this normally */
-        _nad_escape(nad, data, ic - data, 3);
-
-        /* ensure enough space, and add our escaped &quot; */
-        NAD_SAFE(nad->cdata, nad->ccur + 6, nad->clen);
-        memcpy(nad->cdata + nad->ccur, "&quot;", 6);
-        nad->ccur += 6;
-
-        /* just update and loop for more */
-        len -= (ic+1) - data;
-        data = ic+1;
-    }
-
-    /* next, find and escape ' */
-    while(flag >= 3 && (c = memchr(nad->cdata + data,'\'',len)) != NULL)
-    {
-        ic = c - nad->cdata;
-        _nad_escape(nad, data, ic - data, 2);
-
-        /* ensure enough space, and add our escaped &apos; */
-        NAD_SAFE(nad->cdata, nad->ccur + 6, nad->clen);
-        memcpy(nad->cdata + nad->ccur, "&apos;", 6);
-        nad->ccur += 6;
-
-        /* just update and loop for more */
-        len -= (ic+1) - data;
-        data = ic+1;
-    }
-
-    /* next look for < */
-    while(flag >= 2 && (c = memchr(nad->cdata + data,'<',len)) != NULL)
+    for(i = run = 0; i < len; i++)
     {
-        ic = c - nad->cdata;
-        _nad_escape(nad, data, ic - data, 1);
-
-        /* ensure enough space, and add our escaped &lt; */
-        NAD_SAFE(nad->cdata, nad->ccur + 4, nad->clen);
-        memcpy(nad->cdata + nad->ccur, "&lt;", 4);
-        nad->ccur += 4;
-
-        /* just update and loop for more */
-        len -= (ic+1) - data;
-        data = ic+1;
-    }
-
-    /* next look for > */
-    while(flag >= 1 && (c = memchr(nad->cdata + data, '>', len)) != NULL)
-    {
-        ic = c - nad->cdata;
-        _nad_escape(nad, data, ic - data, 0);
-
-        /* ensure enough space, and add our escaped &gt; */
-        NAD_SAFE(nad->cdata, nad->ccur + 4, nad->clen);
-        memcpy(nad->cdata + nad->ccur, "&gt;", 4);
-        nad->ccur += 4;
-
-        /* just update and loop for more */
-        len -= (ic+1) - data;
-        data = ic+1;
-    }
-
-    /* if & is found, escape it */
-    while((c = memchr(nad->cdata + data,'&',len)) != NULL)
-    {
-        ic = c - nad->cdata;
-
-        /* ensure enough space */
-        NAD_SAFE(nad->cdata, nad->ccur + 5 + (ic - data), nad->clen);
-
-        /* handle normal data */
-        memcpy(nad->cdata + nad->ccur, nad->cdata + data, (ic - data));
-        nad->ccur += (ic - data);
+        switch(nad->cdata[data + i])
+        {
+            case '&':
+                rep = "&amp;"; lrep = 5;
+                break;
+            case '>':
+                if(flag < 1) continue;
+                rep = "&gt;"; lrep = 4;
+                break;
+            case '<':
+                if(flag < 2) continue;
+                rep = "&lt;"; lrep = 4;
+                break;
+            case '\'':
+                if(flag < 3) continue;
+                rep = "&apos;"; lrep = 6;
+                break;
+            case '"':
+                if(flag < 4) continue;
+                rep = "&quot;"; lrep = 6;
+                break;
+            default:
+                continue;
+        }
 
-        /* append escaped &amp; */
-        memcpy(nad->cdata + nad->ccur, "&amp;", 5);
-        nad->ccur += 5;
+        /* ensure enough space, copy the normal data before it, then the escape */
+        NAD_SAFE(*o->buf, *o->len + (i - run) + lrep, *o->size);
+        memcpy(*o->buf + *o->len, nad->cdata + data + run, i - run);
+        *o->len += i - run;
+        memcpy(*o->buf + *o->len, rep, lrep);
+        *o->len += lrep;
 
-        /* just update and loop for more */
-        len -= (ic+1) - data;
-        data = ic+1;
+        run = i + 1;
     }
 
     /* nothing exciting, just append normal cdata */
-    if(len > 0) {
-        NAD_SAFE(nad->cdata, nad->ccur + len, nad->clen);
-        memcpy(nad->cdata + nad->ccur, nad->cdata + data, len);
-        nad->ccur += len;
+    if(run < len) {
+        NAD_SAFE(*o->buf, *o->len + (len - run), *o->size);
+        memcpy(*o->buf + *o->len, nad->cdata + data + run, len - run);
+        *o->len += len - run;
     }
 }
 
 /** internal recursive printing function */
-static int _nad_lp0(nad_t nad, int elem)
+static int _nad_lp0(nad_t nad, struct nad_out_st *o, int elem)
 {
     int attr;
     int ndepth;
@@ -915,25 +994,25 @@ static int _nad_lp0(nad_t nad, int elem)
     ns = nad->elems[elem].my_ns;
     if(ns >= 0 && nad->nss[ns].iprefix >= 0)
     {
-        NAD_SAFE(nad->cdata, nad->ccur + nad->elems[elem].lname + nad->nss[ns].lprefix + 2, nad->clen);
+        NAD_SAFE(*o->buf, *o->len + nad->elems[elem].lname + nad->nss[ns].lprefix + 2, *o->size);
     } else {
-        NAD_SAFE(nad->cdata, nad->ccur + nad->elems[elem].lname + 1, nad->clen);
+        NAD_SAFE(*o->buf, *o->len + nad->elems[elem].lname + 1, *o->size);
     }
 
     /* opening tag */
-    *(nad->cdata + nad->ccur++) = '<';
+    (*o->buf)[(*o->len)++] = '<';
 
     /* add the prefix if necessary */
     if(ns >= 0 && nad->nss[ns].iprefix >= 0)
     {
-        memcpy(nad->cdata + nad->ccur, nad->cdata + nad->nss[ns].iprefix, nad->nss[ns].lprefix);
-        nad->ccur += nad->nss[ns].lprefix;
-        *(nad->cdata + nad->ccur++) = ':';
+        memcpy(*o->buf + *o->len, nad->cdata + nad->nss[ns].iprefix, nad->nss[ns].lprefix);
+        *o->len += nad->nss[ns].lprefix;
+        (*o->buf)[(*o->len)++] = ':';
     }
     
     /* copy in the name */
-    memcpy(nad->cdata + nad->ccur, nad->cdata + nad->elems[elem].iname, nad->elems[elem].lname);
-    nad->ccur += nad->elems[elem].lname;
+    memcpy(*o->buf + *o->len, nad->cdata + nad->elems[elem].iname, nad->elems[elem].lname);
+    *o->len += nad->elems[elem].lname;
 
     /* add the namespaces */
     for(ns = nad->elems[elem].ns; ns >= 0; ns = nad->nss[ns].next)
@@ -945,31 +1024,31 @@ static int _nad_lp0(nad_t nad, int elem)
         /* make space */
         if(nad->nss[ns].iprefix >= 0)
         {
-            NAD_SAFE(nad->cdata, nad->ccur + nad->nss[ns].luri + nad->nss[ns].lprefix + 10, nad->clen);
+            NAD_SAFE(*o->buf, *o->len + nad->nss[ns].luri + nad->nss[ns].lprefix + 10, *o->size);
         } else {
-            NAD_SAFE(nad->cdata, nad->ccur + nad->nss[ns].luri + 9, nad->clen);
+            NAD_SAFE(*o->buf, *o->len + nad->nss[ns].luri + 9, *o->size);
         }
 
         /* start */
-        memcpy(nad->cdata + nad->ccur, " xmlns", 6);
-        nad->ccur += 6;
+        memcpy(*o->buf + *o->len, " xmlns", 6);
+        *o->len += 6;
 
         /* prefix if necessary */
         if(nad->nss[ns].iprefix >= 0)
         {
-            *(nad->cdata + nad->ccur++) = ':';
-            memcpy(nad->cdata + nad->ccur, nad->cdata + nad->nss[ns].iprefix, nad->nss[ns].lprefix);
-            nad->ccur += nad->nss[ns].lprefix;
+            (*o->buf)[(*o->len)++] = ':';
+            memcpy(*o->buf + *o->len, nad->cdata + nad->nss[ns].iprefix, nad->nss[ns].lprefix);
+            *o->len += nad->nss[ns].lprefix;
         }
 
-        *(nad->cdata + nad->ccur++) = '=';
-        *(nad->cdata + nad->ccur++) = '\'';
+        (*o->buf)[(*o->len)++] = '=';
+        (*o->buf)[(*o->len)++] = '\'';
 
         /* uri */
-        memcpy(nad->cdata + nad->ccur, nad->cdata + nad->nss[ns].iuri, nad->nss[ns].luri);
-        nad->ccur += nad->nss[ns].luri;
+        memcpy(*o->buf + *o->len, nad->cdata + nad->nss[ns].iuri, nad->nss[ns].luri);
+        *o->len += nad->nss[ns].luri;
 
-        *(nad->cdata + nad->ccur++) = '\'';
+        (*o->buf)[(*o->len)++] = '\'';
     }
 
     for(attr = nad->elems[elem].attr; attr >= 0; attr = nad->attrs[attr].next)
@@ -980,33 +1059,33 @@ static int _nad_lp0(nad_t nad, int elem)
         ns = nad->attrs[attr].my_ns;
         if(ns >= 0 && nad->nss[ns].iprefix >= 0)
         {
-            NAD_SAFE(nad->cdata, nad->ccur + nad->attrs[attr].lname + nad->nss[ns].lprefix + 4, nad->clen);
+            NAD_SAFE(*o->buf, *o->len + nad->attrs[attr].lname + nad->nss[ns].lprefix + 4, *o->size);
         } else {
-            NAD_SAFE(nad->cdata, nad->ccur + nad->attrs[attr].lname + 3, nad->clen);
+            NAD_SAFE(*o->buf, *o->len + nad->attrs[attr].lname + 3, *o->size);
         }
 
-        *(nad->cdata + nad->ccur++) = ' ';
+        (*o->buf)[(*o->len)++] = ' ';
 
         /* add the prefix if necessary */
         if(ns >= 0 && nad->nss[ns].iprefix >= 0)
         {
-            memcpy(nad->cdata + nad->ccur, nad->cdata + nad->nss[ns].iprefix, nad->nss[ns].lprefix);
-            nad->ccur += nad->nss[ns].lprefix;
-            *(nad->cdata + nad->ccur++) = ':';
+            memcpy(*o->buf + *o->len, nad->cdata + nad->nss[ns].iprefix, nad->nss[ns].lprefix);
+            *o->len += nad->nss[ns].lprefix;
+            (*o->buf)[(*o->len)++] = ':';
         }
     
         /* copy in the name parts */
-        memcpy(nad->cdata + nad->ccur, nad->cdata + nad->attrs[attr].iname, nad->attrs[attr].lname);
-        nad->ccur += nad->attrs[attr].lname;
-        *(nad->cdata + nad->ccur++) = '=';
-        *(nad->cdata + nad->ccur++) = '\'';
+        memcpy(*o->buf + *o->len, nad->cdata + nad->attrs[attr].iname, nad->attrs[attr].lname);
+        *o->len += nad->attrs[attr].lname;
+        (*o->buf)[(*o->len)++] = '=';
+        (*o->buf)[(*o->len)++] = '\'';
 
         /* copy in the escaped value */
-        _nad_escape(nad, nad->attrs[attr].ival, nad->attrs[attr].lval, 4);
+        _nad_escape(nad, o, nad->attrs[attr].ival, nad->attrs[attr].lval, 4);
 
         /* make enough space for the closing quote and add it */
-        NAD_SAFE(nad->cdata, nad->ccur + 1, nad->clen);
-        *(nad->cdata + nad->ccur++) = '\'';
+        NAD_SAFE(*o->buf, *o->len + 1, *o->size);
+        (*o->buf)[(*o->len)++] = '\'';
     }
 
     /* figure out what's next */
@@ -1019,45 +1098,45 @@ static int _nad_lp0(nad_t nad, int elem)
     if(ndepth <= nad->elems[elem].depth)
     {
         /* make sure there's enough for what we could need */
-        NAD_SAFE(nad->cdata, nad->ccur + 2, nad->clen);
+        NAD_SAFE(*o->buf, *o->len + 2, *o->size);
         if(nad->elems[elem].lcdata == 0)
         {
-            memcpy(nad->cdata + nad->ccur, "/>", 2);
-            nad->ccur += 2;
+            memcpy(*o->buf + *o->len, "/>", 2);
+            *o->len += 2;
         }else{
-            *(nad->cdata + nad->ccur++) = '>';
+            (*o->buf)[(*o->len)++] = '>';
 
             /* copy in escaped cdata */
-            _nad_escape(nad, nad->elems[elem].icdata, nad->elems[elem].lcdata,4);
+            _nad_escape(nad, o, nad->elems[elem].icdata, nad->elems[elem].lcdata,4);
 
             /* make room */
             ns = nad->elems[elem].my_ns;
             if(ns >= 0 && nad->nss[ns].iprefix >= 0)
             {
-                NAD_SAFE(nad->cdata, nad->ccur + 4 + nad->elems[elem].lname + nad->nss[ns].lprefix, nad->clen);
+                NAD_SAFE(*o->buf, *o->len + 4 + nad->elems[elem].lname + nad->nss[ns].lprefix, *o->size);
             } else {
-                NAD_SAFE(nad->cdata, nad->ccur + 3 + nad->elems[elem].lname, nad->clen);
+                NAD_SAFE(*o->buf, *o->len + 3 + nad->elems[elem].lname, *o->size);
             }
 
             /* close tag */
-            memcpy(nad->cdata + nad->ccur, "</", 2);
-            nad->ccur += 2;
+            memcpy(*o->buf + *o->len, "</", 2);
+            *o->len += 2;
     
             /* add the prefix if necessary */
             if(ns >= 0 && nad->nss[ns].iprefix >= 0)
             {
-                memcpy(nad->cdata + nad->ccur, nad->cdata + nad->nss[ns].iprefix, nad->nss[ns].lprefix);
-                nad->ccur += nad->nss[ns].lprefix;
-                *(nad->cdata + nad->ccur++) = ':';
+                memcpy(*o->buf + *o->len, nad->cdata + nad->nss[ns].iprefix, nad->nss[ns].lprefix);
+                *o->len += nad->nss[ns].lprefix;
+                (*o->buf)[(*o->len)++] = ':';
             }
     
-            memcpy(nad->cdata + nad->ccur, nad->cdata + nad->elems[elem].iname, nad->elems[elem].lname);
-            nad->ccur += nad->elems[elem].lname;
-            *(nad->cdata + nad->ccur++) = '>';
+            memcpy(*o->buf + *o->len, nad->cdata + nad->elems[elem].iname, nad->elems[elem].lname);
+            *o->len += nad->elems[elem].lname;
+            (*o->buf)[(*o->len)++] = '>';
         }
 
         /* always try to append the tail */
-        _nad_escape(nad, nad->elems[elem].itail, nad->elems[elem].ltail,4);
+        _nad_escape(nad, o, nad->elems[elem].itail, nad->elems[elem].ltail,4);
 
         /* if no siblings either, bail */
         if(ndepth < nad->elems[elem].depth)
@@ -1070,33 +1149,33 @@ static int _nad_lp0(nad_t nad, int elem)
         /* process any children */
 
         /* close ourself and append any cdata first */
-        NAD_SAFE(nad->cdata, nad->ccur + 1, nad->clen);
-        *(nad->cdata + nad->ccur++) = '>';
-        _nad_escape(nad, nad->elems[elem].icdata, nad->elems[elem].lcdata,4);
+        NAD_SAFE(*o->buf, *o->len + 1, *o->size);
+        (*o->buf)[(*o->len)++] = '>';
+        _nad_escape(nad, o, nad->elems[elem].icdata, nad->elems[elem].lcdata,4);
 
         /* process children */
-        nelem = _nad_lp0(nad,elem+1);
+        nelem = _nad_lp0(nad, o, elem+1);
 
         /* close and tail up */
         ns = nad->elems[elem].my_ns;
         if(ns >= 0 && nad->nss[ns].iprefix >= 0)
         {
-            NAD_SAFE(nad->cdata, nad->ccur + 4 + nad->elems[elem].lname + nad->nss[ns].lprefix, nad->clen);
+            NAD_SAFE(*o->buf, *o->len + 4 + nad->elems[elem].lname + nad->nss[ns].lprefix, *o->size);
         } else {
-            NAD_SAFE(nad->cdata, nad->ccur + 3 + nad->elems[elem].lname, nad->clen);
+            NAD_SAFE(*o->buf, *o->len + 3 + nad->elems[elem].lname, *o->size);
         }
-        memcpy(nad->cdata + nad->ccur, "</", 2);
-        nad->ccur += 2;
+        memcpy(*o->buf + *o->len, "</", 2);
+        *o->len += 2;
         if(ns >= 0 && nad->nss[ns].iprefix >= 0)
         {
-            memcpy(nad->cdata + nad->ccur, nad->cdata + nad->nss[ns].iprefix, nad->nss[ns].lprefix);
-            nad->ccur += nad->nss[ns].lprefix;
-            *(nad->cdata + nad->ccur++) = ':';
+            memcpy(*o->buf + *o->len, nad->cdata + nad->nss[ns].iprefix, nad->nss[ns].lprefix);
+            *o->len += nad->nss[ns].lprefix;
+            (*o->buf)[(*o->len)++] = ':';
         }
-        memcpy(nad->cdata + nad->ccur, nad->cdata + nad->elems[elem].iname, nad->elems[elem].lname);
-        nad->ccur += nad->elems[elem].lname;
-        *(nad->cdata + nad->ccur++) = '>';
-        _nad_escape(nad, nad->elems[elem].itail, nad->elems[elem].ltail,4);
+        memcpy(*o->buf + *o->len, nad->cdata + nad->elems[elem].iname, nad->elems[elem].lname);
+        *o->len += nad->elems[elem].lname;
+        (*o->buf)[(*o->len)++] = '>';
+        _nad_escape(nad, o, nad->elems[elem].itail, nad->elems[elem].ltail,4);
 
         /* if the next element is not our sibling, we're done */
         if(nelem < nad->ecur && nad->elems[nelem].depth < nad->elems[elem].depth)
@@ -1115,14 +1194,37 @@ static int _nad_lp0(nad_t nad, int elem)
 void nad_print(nad_t nad, int elem, char **xml, int *len)
 {
     int ixml = nad->ccur;
+    struct nad_out_st o;
 
     _nad_ptr_check(__func__, nad);
 
-    _nad_lp0(nad,elem);
+    /* print onto the end of the cdata */
+    o.buf = &nad->cdata;
+    o.len = &nad->ccur;
+    o.size = &nad->clen;
+
+    _nad_lp0(nad, &o, elem);
     *len = nad->ccur - ixml;
     *xml = nad->cdata + ixml;
 }
 
+void nad_print_buf(nad_t nad, int elem, char **buf, int *len, int *size)
+{
+    struct nad_out_st o;
+
+    _nad_ptr_check(__func__, nad);
+
+    /* guess at the space needed so we don't have to keep growing it -
+     * the names and values, plus markup for each element and attribute */
+    NAD_SAFE(*buf, *len + nad->ccur + (nad->ecur - elem) * 16 + nad->acur * 4, *size);
+
+    o.buf = buf;
+    o.len = len;
+    o.size = size;
+
+    _nad_lp0(nad, &o, elem);
+}
+
 /**
  * nads serialize to a buffer of this form:
  *
@@ -1176,35 +1278,32 @@ nad_t nad_deserialize(const char *buf) {
     nad->acur = * (int *) pos; pos += sizeof(int);
     nad->ncur = * (int *) pos; pos += sizeof(int);
     nad->ccur = * (int *) pos; pos += sizeof(int);
-    nad->elen = nad->ecur;
-    nad->alen = nad->acur;
-    nad->nlen = nad->ncur;
-    nad->clen = nad->ccur;
 
+    /* the nad may have come from the cache, so use what it already has */
     if(nad->ecur > 0)
     {
-        nad->elems = (struct nad_elem_st *) malloc(sizeof(struct nad_elem_st) * nad->ecur);
+        NAD_SAFE(nad->elems, sizeof(struct nad_elem_st) * nad->ecur, nad->elen);
         memcpy(nad->elems, pos, sizeof(struct nad_elem_st) * nad->ecur);
         pos += sizeof(struct nad_elem_st) * nad->ecur;
     }
 
     if(nad->acur > 0)
     {
-        nad->attrs = (struct nad_attr_st *) malloc(sizeof(struct nad_attr_st) * nad->acur);
+        NAD_SAFE(nad->attrs, sizeof(struct nad_attr_st) * nad->acur, nad->alen);
         memcpy(nad->attrs, pos, sizeof(struct nad_attr_st) * nad->acur);
         pos += sizeof(struct nad_attr_st) * nad->acur;
     }
 
     if(nad->ncur > 0)
     {
-        nad->nss = (struct nad_ns_st *) malloc(sizeof(struct nad_ns_st) * nad->ncur);
+        NAD_SAFE(nad->nss, sizeof(struct nad_ns_st) * nad->ncur, nad->nlen);
         memcpy(nad->nss, pos, sizeof(struct nad_ns_st) * nad->ncur);
         pos += sizeof(struct nad_ns_st) * nad->ncur;
     }
 
     if(nad->ccur > 0)
     {
-        nad->cdata = (char *) malloc(sizeof(char) * nad->ccur);
+        NAD_SAFE(nad->cdata, sizeof(char) * nad->ccur, nad->clen);
         memcpy(nad->cdata, pos, sizeof(char) * nad->ccur);
     }
 
@@ -1212,6 +1311,276 @@ nad_t nad_deserialize(const char *buf) {
 }
 
 
+/**
+ * portable binary form of a nad, for keeping stanzas in storage
+ *
+ * ["NB"][version][width][buflen][ecur][acur][ncur][ccur][elems][attrs][nss][cdata]
+ *
+ * unlike nad_serialize(), numbers are always little-endian, so the data can
+ * be moved between platforms. the header is 32-bit ints; elems, attrs and nss
+ * are written field by field, in the order they appear in their structs, as
+ * 16-bit ints if the whole nad is small enough (nearly every stanza is) and
+ * 32-bit ints otherwise
+ *
+ * on little-endian machines with 32-bit ints, wide arrays are copied straight
+ * in and out; nad_unpack() then checks that every index lands inside the nad
+ * and rebuilds the depths array, so the result can be changed like any other
+ */
+
+#define NAD_PACK_VERSION    (1)
+#define NAD_PACK_HEADER     (4 + 5 * 4)
+
+/* the elem, attr and ns structs are nothing but ints */
+#define NAD_PACK_EINTS      ((int) (sizeof(struct nad_elem_st) / sizeof(int)))
+#define NAD_PACK_AINTS      ((int) (sizeof(struct nad_attr_st) / sizeof(int)))
+#define NAD_PACK_NINTS      ((int) (sizeof(struct nad_ns_st) / sizeof(int)))
+
+#define NAD_PACK_LEN(ecur,acur,ncur,ccur,width) \
+    (NAD_PACK_HEADER + ((long) (ecur) * NAD_PACK_EINTS + (long) (acur) * NAD_PACK_AINTS + (long) (ncur) * NAD_PACK_NINTS) * (width) + (ccur))
+
+static int _nad_pack_native(void) {
+    int one = 1;
+
+    return sizeof(int) == 4 && * (char *) &one == 1;
+}
+
+static char *_nad_pack_ints(char *pos, const int *ints, int n, int width) {
+    unsigned long v;
+    int i;
+
+    if(width == 4 && _nad_pack_native()) {
+        memcpy(pos, ints, n * 4);
+        return pos + n * 4;
+    }
+
+    for(i = 0; i < n; i++) {
+        v = (unsigned long) ints[i];
+        pos[0] = (char) (v & 0xff);
+        pos[1] = (char) ((v >> 8) & 0xff);
+        if(width == 4) {
+            pos[2] = (char) ((v >> 16) & 0xff);
+            pos[3] = (char) ((v >> 24) & 0xff);
+        }
+        pos += width;
+    }
+
+    return pos;
+}
+
+static const char *_nad_unpack_ints(const char *pos, int *ints, int n, int width) {
+    const unsigned char *p = (const unsigned char *) pos;
+    unsigned long v;
+    int i;
+
+    if(width == 4 && _nad_pack_native()) {
+        memcpy(ints, pos, n * 4);
+        return pos + n * 4;
+    }
+
+    for(i = 0; i < n; i++, p += width) {
+        if(width == 2) {
+            v = (unsigned long) p[0] | (unsigned long) p[1] << 8;
+            ints[i] = (v & 0x8000UL) ? (int) v - 0x10000 : (int) v;
+        } else {
+            v = (unsigned long) p[0] | (unsigned long) p[1] << 8 | (unsigned long) p[2] << 16 | (unsigned long) p[3] << 24;
+            ints[i] = (v & 0x80000000UL) ? (int) (v - 0x80000000UL) - 0x7fffffff - 1 : (int) v;
+        }
+    }
+
+    return (const char *) p;
+}
+
+/** how much of the cdata is in use; nad_print() leaves its output on the end, which isn't worth keeping */
+static int _nad_pack_cdata(nad_t nad) {
+    int i, used = 0;
+
+#define NAD_PACK_USED(i,l) if((i) + (l) > used) used = (i) + (l);
+
+    for(i = 0; i < nad->ecur; i++) {
+        NAD_PACK_USED(nad->elems[i].iname, nad->elems[i].lname);
+        NAD_PACK_USED(nad->elems[i].icdata, nad->elems[i].lcdata);
+        NAD_PACK_USED(nad->elems[i].itail, nad->elems[i].ltail);
+    }
+
+    for(i = 0; i < nad->acur; i++) {
+        NAD_PACK_USED(nad->attrs[i].iname, nad->attrs[i].lname);
+        NAD_PACK_USED(nad->attrs[i].ival, nad->attrs[i].lval);
+    }
+
+    for(i = 0; i < nad->ncur; i++) {
+        NAD_PACK_USED(nad->nss[i].iuri, nad->nss[i].luri);
+        if(nad->nss[i].iprefix >= 0)
+            NAD_PACK_USED(nad->nss[i].iprefix, nad->nss[i].lprefix);
+    }
+
+#undef NAD_PACK_USED
+
+    return used;
+}
+
+void nad_pack(nad_t nad, char **buf, int *len) {
+    int head[5], width = 2, ccur;
+    char *pos;
+
+    _nad_ptr_check(__func__, nad);
+
+    ccur = _nad_pack_cdata(nad);
+
+    /* every index and length is smaller than the packed nad, so if that fits in 16 bits, they all do */
+    *len = NAD_PACK_LEN(nad->ecur, nad->acur, nad->ncur, ccur, 2);
+    if(*len > 0x7fff) {
+        width = 4;
+        *len = NAD_PACK_LEN(nad->ecur, nad->acur, nad->ncur, ccur, 4);
+    }
+
+    *buf = (char *) malloc(*len);
+    pos = *buf;
+
+    pos[0] = 'N'; pos[1] = 'B'; pos[2] = NAD_PACK_VERSION; pos[3] = (char) width;
+    pos += 4;
+
+    head[0] = *len; head[1] = nad->ecur; head[2] = nad->acur; head[3] = nad->ncur; head[4] = ccur;
+    pos = _nad_pack_ints(pos, head, 5, 4);
+
+    pos = _nad_pack_ints(pos, (int *) nad->elems, nad->ecur * NAD_PACK_EINTS, width);
+    pos = _nad_pack_ints(pos, (int *) nad->attrs, nad->acur * NAD_PACK_AINTS, width);
+    pos = _nad_pack_ints(pos, (int *) nad->nss, nad->ncur * NAD_PACK_NINTS, width);
+    memcpy(pos, nad->cdata, ccur);
+}
+
+/** make sure everything in an unpacked nad points inside it, and track the last elem at each depth */
+static int _nad_unpack_fixup(nad_t nad) {
+    struct nad_elem_st *elem;
+    struct nad_attr_st *attr;
+    struct nad_ns_st *ns;
+    int i;
+
+#define NAD_PACK_CDATA(i,l)  ((i) >= 0 && (l) >= 0 && (i) <= nad->ccur - (l))
+#define NAD_PACK_INDEX(i,n)  ((i) >= -1 && (i) < (n))
+
+    /* chains only ever point back, so a bad nad can't send anyone round in circles */
+    for(i = 0; i < nad->ncur; i++) {
+        ns = &nad->nss[i];
+        if(!NAD_PACK_CDATA(ns->iuri, ns->luri) || !NAD_PACK_INDEX(ns->next, i) ||
+           !(ns->iprefix == -1 || NAD_PACK_CDATA(ns->iprefix, ns->lprefix)))
+            return 1;
+    }
+
+    for(i = 0; i < nad->acur; i++) {
+        attr = &nad->attrs[i];
+        if(!NAD_PACK_CDATA(attr->iname, attr->lname) || !NAD_PACK_CDATA(attr->ival, attr->lval) ||
+           !NAD_PACK_INDEX(attr->my_ns, nad->ncur) || !NAD_PACK_INDEX(attr->next, i))
+            return 1;
+    }
+
+    for(i = 0; i < nad->ecur; i++) {
+        elem = &nad->elems[i];
+        if(!NAD_PACK_CDATA(elem->iname, elem->lname) || !NAD_PACK_CDATA(elem->icdata, elem->lcdata) ||
+           !NAD_PACK_CDATA(elem->itail, elem->ltail) || !NAD_PACK_INDEX(elem->parent, i) ||
+           !NAD_PACK_INDEX(elem->attr, nad->acur) || !NAD_PACK_INDEX(elem->ns, nad->ncur) ||
+           !NAD_PACK_INDEX(elem->my_ns, nad->ncur) || elem->depth < 0 || elem->depth > i)
+            return 1;
+
+        NAD_SAFE(nad->depths, (elem->depth + 1) * sizeof(int), nad->dlen);
+        nad->depths[elem->depth] = i;
+    }
+
+#undef NAD_PACK_CDATA
+#undef NAD_PACK_INDEX
+
+    return 0;
+}
+
+nad_t nad_unpack(const char *buf, int len) {
+    int head[5], width;
+    const char *pos;
+    nad_t nad;
+
+    if(len < NAD_PACK_HEADER || buf[0] != 'N' || buf[1] != 'B' || buf[2] != NAD_PACK_VERSION)
+        return NULL;
+
+    width = buf[3];
+    if(width != 2 && width != 4)
+        return NULL;
+
+    pos = _nad_unpack_ints(buf + 4, head, 5, 4);
+
+    /* the counts have to add up to exactly what we were given */
+    if(head[0] != len || head[1] < 0 || head[2] < 0 || head[3] < 0 || head[4] < 0 ||
+       head[1] > len || head[2] > len || head[3] > len || head[4] > len ||
+       NAD_PACK_LEN(head[1], head[2], head[3], head[4], width) != len)
+        return NULL;
+
+    nad = nad_new();
+
+    nad->ecur = head[1];
+    nad->acur = head[2];
+    nad->ncur = head[3];
+    nad->ccur = head[4];
+
+    /* the nad may have come from the cache, so use what it already has */
+    if(nad->ecur > 0) {
+        NAD_SAFE(nad->elems, sizeof(struct nad_elem_st) * nad->ecur, nad->elen);
+        pos = _nad_unpack_ints(pos, (int *) nad->elems, nad->ecur * NAD_PACK_EINTS, width);
+    }
+
+    if(nad->acur > 0) {
+        NAD_SAFE(nad->attrs, sizeof(struct nad_attr_st) * nad->acur, nad->alen);
+        pos = _nad_unpack_ints(pos, (int *) nad->attrs, nad->acur * NAD_PACK_AINTS, width);
+    }
+
+    if(nad->ncur > 0) {
+        NAD_SAFE(nad->nss, sizeof(struct nad_ns_st) * nad->ncur, nad->nlen);
+        pos = _nad_unpack_ints(pos, (int *) nad->nss, nad->ncur * NAD_PACK_NINTS, width);
+    }
+
+    if(nad->ccur > 0) {
+        NAD_SAFE(nad->cdata, nad->ccur, nad->clen);
+        memcpy(nad->cdata, pos, nad->ccur);
+    }
+
+    if(_nad_unpack_fixup(nad) != 0) {
+        nad_free(nad);
+        return NULL;
+    }
+
+    return nad;
+}
+
+void nad_encode(nad_t nad, char **buf, int *len) {
+    char *bin;
+    int blen;
+
+    nad_pack(nad, &bin, &blen);
+
+    *buf = (char *) malloc(apr_base64_encode_len(blen));
+    *len = apr_base64_encode(*buf, bin, blen) - 1;
+
+    free(bin);
+}
+
+nad_t nad_decode(const char *buf, int len) {
+    char *bin;
+    int blen;
+    nad_t nad;
+
+    if(len == 0)
+        len = strlen(buf);
+
+    /* xml, from before stanzas were stored packed */
+    if(len > 0 && buf[0] == '<')
+        return nad_parse(buf, len);
+
+    bin = (char *) malloc(apr_base64_decode_len(buf, len));
+    blen = apr_base64_decode(bin, buf, len);
+
+    nad = nad_unpack(bin, blen);
+
+    free(bin);
+
+    return nad;
+}
+
 /** parse a buffer into a nad */
 
 struct build_data {
@@ -1353,3 +1722,58 @@ nad_t nad_parse(const char *buf, int len) {
 
     return bd.nad;
 }
+
+/** add a recipient to a multicast route */
+void nad_multicast_add(nad_t nad, const char *jid) {
+    _nad_ptr_check(__func__, nad);
+
+    nad_append_elem(nad, NAD_ENS(nad, 0), "address", 1);
+    nad_append_attr(nad, -1, "jid", jid);
+}
+
+/** turn a multicast route into one unicast route per recipient */
+int nad_multicast_expand(nad_t nad, nad_multicast_fn fn, void *arg) {
+    int first, elem, attr, n = 0, *addrs, len;
+    nad_t base, route;
+    char *xml;
+
+    _nad_ptr_check(__func__, nad);
+
+    /* the addresses come after the stanza */
+    for(first = 1; first < nad->ecur; first++)
+        if(nad->elems[first].depth == 1 && NAD_ENAME_L(nad, first) == 7 && strncmp("address", NAD_ENAME(nad, first), 7) == 0)
+            break;
+
+    if(first == 1 || first == nad->ecur) {
+        nad_free(nad);
+        return 0;
+    }
+
+    addrs = (int *) malloc(sizeof(int) * (nad->ecur - first));
+    for(elem = first; elem < nad->ecur; elem++)
+        if(nad->elems[elem].depth == 1 && (attr = nad_find_attr(nad, elem, -1, "jid", NULL)) >= 0 && NAD_AVAL_L(nad, attr) > 0)
+            addrs[n++] = attr;
+
+    /* the rest is the unicast route. reparse it, so the copies don't carry the address list around */
+    nad->ecur = first;
+    nad_set_attr(nad, 0, -1, "type", NULL, 0);
+
+    nad_print(nad, 0, &xml, &len);
+    base = nad_parse(xml, len);
+
+    if(base != NULL)
+        for(elem = 0; elem < n; elem++) {
+            route = nad_copy(base);
+            nad_set_attr(route, 1, -1, "to", NAD_AVAL(nad, addrs[elem]), NAD_AVAL_L(nad, addrs[elem]));
+            (fn)(route, arg);
+        }
+    else
+        n = 0;
+
+    if(base != NULL)
+        nad_free(base);
+    free(addrs);
+    nad_free(nad);
+
+    return n;
+}
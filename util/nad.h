@@ -108,6 +108,29 @@ typedef struct nad_st
     struct nad_st *next; /* for keeping a list of nads */
 } *nad_t;
 
+/** nad cache defaults - how many freed nads are kept for reuse, and the
+ *  most buffer space (in bytes) a nad can hold and still be kept */
+#define NAD_CACHE_MAX   (1024)
+#define NAD_CACHE_SIZE  (65536)
+
+/** nad cache counters */
+typedef struct nad_cache_stats_st {
+    unsigned long   news;       /* nads handed out by nad_new() */
+    unsigned long   hits;       /* of those, how many came from the cache */
+    unsigned long   drops;      /* freed nads that were too big, or the cache full */
+    unsigned long   reallocs;   /* buffer growths */
+    int             cached;     /* nads in the cache right now */
+} nad_cache_stats_t;
+
+/** set the nad cache limits (max 0 turns it off), releasing anything outside them */
+JABBERD2_API void nad_cache_config(int max, int size);
+
+/** get the nad cache counters - this thread's cache, and everything done by threads that have called nad_cache_free() */
+JABBERD2_API void nad_cache_stats(nad_cache_stats_t *stats);
+
+/** release this thread's cached nads, for threads that are about to exit */
+JABBERD2_API void nad_cache_free(void);
+
 /** create a new nad */
 JABBERD2_API nad_t nad_new(void);
 
@@ -172,13 +195,42 @@ JABBERD2_API int nad_append_namespace(nad_t nad, int elem, const char *uri, cons
 /** create a string representation of the given element (and children), point references to it */
 JABBERD2_API void nad_print(nad_t nad, int elem, char **xml, int *len);
 
+/** print the given element (and children) onto the end of a malloc'd buffer, growing it as
+ *  needed. *buf and *size describe the allocation (NULL and 0 for a new one), *len is the
+ *  amount in use, and is advanced past the new xml */
+JABBERD2_API void nad_print_buf(nad_t nad, int elem, char **buf, int *len, int *size);
+
 /** serialize and deserialize a nad */
 JABBERD2_API void nad_serialize(nad_t nad, char **buf, int *len);
 JABBERD2_API nad_t nad_deserialize(const char *buf);
 
+/** pack and unpack a nad in a portable, versioned binary form (see nad.c) */
+JABBERD2_API void nad_pack(nad_t nad, char **buf, int *len);
+JABBERD2_API nad_t nad_unpack(const char *buf, int len);
+
+/** the packed form as base64 text, for storing in string columns. decoding
+ *  also takes the plain xml that was stored before, and returns NULL if the
+ *  data is damaged */
+JABBERD2_API void nad_encode(nad_t nad, char **buf, int *len);
+JABBERD2_API nad_t nad_decode(const char *buf, int len);
+
 /** create a nad from raw xml */
 JABBERD2_API nad_t nad_parse(const char *buf, int len);
 
+/** multicast routes are routes of type 'multicast' that carry one stanza, followed by an
+ *  <address jid=''/> element for each recipient. they save sending the same stanza to a
+ *  lot of people in the same place one route at a time */
+
+/** add a recipient to the end of a multicast route */
+JABBERD2_API void nad_multicast_add(nad_t nad, const char *jid);
+
+/** takes a unicast route made from a multicast one */
+typedef void (*nad_multicast_fn)(nad_t nad, void *arg);
+
+/** split a multicast route into unicast routes, one per recipient, and hand them to fn. the
+ *  multicast route is freed, fn owns the ones it's given. returns the number of recipients */
+JABBERD2_API int nad_multicast_expand(nad_t nad, nad_multicast_fn fn, void *arg);
+
 /* these are some helpful macros */
 #define NAD_ENAME(N,E) (N->cdata + N->elems[E].iname)
 #define NAD_ENAME_L(N,E) (N->elems[E].lname)
@@ -21,6 +21,137 @@
 #include "util.h"
 #include "pool.h"
 
+/* freed blocks, kept by size class and handed out again instead of going
+ * back to malloc. every pool, pfree and pheap comes from here too, so the
+ * churn of pools being made and freed for users, sessions, hashes, queues and
+ * objects mostly never reaches malloc. each block has a small header in front
+ * of it saying what class it is, so it can be put back in the right list by
+ * whichever thread frees it. the sm's storage workers make pools too, so each
+ * thread keeps its own lists */
+#if defined(_MSC_VER)
+# define POOL_THREAD __declspec(thread)
+#elif defined(__GNUC__)
+# define POOL_THREAD __thread
+#else
+# define POOL_THREAD
+#endif
+
+/* classes are 16 bytes up to 16k, doubling. bigger blocks aren't kept */
+#define POOL_CLASS_MIN  (16)
+#define POOL_CLASSES    (11)
+
+/* room in front of each block for its header, keeping malloc's alignment */
+#define POOL_HDR        (16)
+
+struct _pool_block_st
+{
+    struct _pool_block_st *next;    /* when it's in the cache */
+    int cls;                        /* size class, -1 if too big for one */
+    int size;                       /* usable size */
+};
+
+static POOL_THREAD struct _pool_block_st *_pool_cache[POOL_CLASSES];
+static int _pool_cache_size = POOL_CACHE_SIZE;
+static POOL_THREAD pool_cache_stats_t _pool_stats;
+
+/** get a block of at least size bytes, from the cache if we can */
+static void *_pool_block_get(int size)
+{
+    struct _pool_block_st *b;
+    int cls, csize;
+
+    _pool_stats.allocs++;
+    _pool_stats.requested += size;
+
+    for(cls = 0, csize = POOL_CLASS_MIN; cls < POOL_CLASSES && csize < size; cls++, csize <<= 1);
+
+    if(cls == POOL_CLASSES)
+    {
+        cls = -1;
+        csize = size;
+    }
+    else if((b = _pool_cache[cls]) != NULL)
+    {
+        _pool_cache[cls] = b->next;
+        _pool_stats.held -= csize;
+        _pool_stats.hits++;
+        _pool_stats.slack += csize - size;
+        return (char *)b + POOL_HDR;
+    }
+    else
+        _pool_stats.slack += csize - size;
+
+    if((b = malloc(POOL_HDR + csize)) == NULL)
+        return NULL;
+
+    b->cls = cls;
+    b->size = csize;
+
+    return (char *)b + POOL_HDR;
+}
+
+/** give a block back, keeping it if there's room */
+static void _pool_block_put(void *block)
+{
+    struct _pool_block_st *b = (struct _pool_block_st *)((char *)block - POOL_HDR);
+
+    if(b->cls >= 0)
+    {
+        if(_pool_stats.held + b->size <= _pool_cache_size)
+        {
+            b->next = _pool_cache[b->cls];
+            _pool_cache[b->cls] = b;
+            _pool_stats.held += b->size;
+            return;
+        }
+
+        _pool_stats.drops++;
+    }
+
+    free(b);
+}
+
+/** how much of a block can actually be used */
+static int _pool_block_size(void *block)
+{
+    return ((struct _pool_block_st *)((char *)block - POOL_HDR))->size;
+}
+
+/** release this thread's cached blocks until it holds no more than size bytes */
+static void _pool_cache_trim(int size)
+{
+    struct _pool_block_st *b;
+    int cls;
+
+    /* biggest first, they're the least likely to be wanted again */
+    for(cls = POOL_CLASSES - 1; cls >= 0 && _pool_stats.held > size; cls--)
+        while(_pool_stats.held > size && (b = _pool_cache[cls]) != NULL)
+        {
+            _pool_cache[cls] = b->next;
+            _pool_stats.held -= b->size;
+            free(b);
+        }
+}
+
+void pool_cache_config(int size)
+{
+    if(size < 0)
+        size = 0;
+
+    _pool_cache_size = size;
+    _pool_cache_trim(size);
+}
+
+void pool_cache_stats(pool_cache_stats_t *stats)
+{
+    memcpy(stats, &_pool_stats, sizeof(pool_cache_stats_t));
+}
+
+void pool_cache_free(void)
+{
+    _pool_cache_trim(0);
+}
+
 #ifdef POOL_DEBUG
 int pool__total = 0;
 int pool__ltotal = 0;
@@ -28,16 +159,16 @@ xht pool__disturbed = NULL;
 void *_pool__malloc(size_t size)
 {
     pool__total++;
-    return malloc(size);
+    return _pool_block_get(size);
 }
 void _pool__free(void *block)
 {
     pool__total--;
-    free(block);
+    _pool_block_put(block);
 }
 #else
-#define _pool__malloc malloc
-#define _pool__free free
+#define _pool__malloc _pool_block_get
+#define _pool__free _pool_block_put
 #endif
 
 
@@ -47,6 +178,7 @@ pool_t _pool_new(char *zone, int line)
     pool_t p;
     while((p = _pool__malloc(sizeof(_pool))) == NULL) sleep(1);
     p->cleanup = NULL;
+    p->cleanup_tail = NULL;
     p->heap = NULL;
     p->size = 0;
 
@@ -73,6 +205,8 @@ static void _pool_heap_free(void *arg)
 {
     struct pheap *h = (struct pheap *)arg;
 
+    _pool_stats.unused += h->size - h->used;
+
     _pool__free(h->block);
     _pool__free(h);
 }
@@ -118,8 +252,8 @@ static struct pheap *_pool_heap(pool_t p, int size)
     /* make the return heap */
     while((ret = _pool__malloc(sizeof(struct pheap))) == NULL) sleep(1);
     while((ret->block = _pool__malloc(size)) == NULL) sleep(1);
-    ret->size = size;
-    p->size += size;
+    ret->size = _pool_block_size(ret->block); /* the rest of the block's class is ours too */
+    p->size += ret->size;
     ret->used = 0;
 
     /* append to the cleanup list */
@@ -247,6 +381,41 @@ void pool_free(pool_t p)
 
 }
 
+/** run the cleanups and free everything but the first heap, which is emptied, so the pool can be used again */
+void pool_reset(pool_t p)
+{
+    struct pfree *cur, *stub, *keep = NULL;
+
+    if(p == NULL) return;
+
+    cur = p->cleanup;
+    while(cur != NULL)
+    {
+        stub = cur->next;
+        if(keep == NULL && cur->f == _pool_heap_free)
+            keep = cur;
+        else
+        {
+            (*cur->f)(cur->arg);
+            _pool__free(cur);
+        }
+        cur = stub;
+    }
+
+    p->cleanup = keep;
+    p->cleanup_tail = keep;
+    p->heap = NULL;
+    p->size = 0;
+
+    if(keep != NULL)
+    {
+        keep->next = NULL;
+        p->heap = keep->heap;
+        p->heap->used = 0;
+        p->size = p->heap->size;
+    }
+}
+
 /** public cleanup utils, insert in a way that they are run FIFO, before mem frees */
 void pool_cleanup(pool_t p, pool_cleanup_t f, void *arg)
 {
@@ -255,6 +424,8 @@ void pool_cleanup(pool_t p, pool_cleanup_t f, void *arg)
     clean = _pool_free(p, f, arg);
     clean->next = p->cleanup;
     p->cleanup = clean;
+    if(p->cleanup_tail == NULL)
+        p->cleanup_tail = clean;
 }
 
 #ifdef POOL_DEBUG
@@ -279,6 +450,7 @@ void pool_stat(int full)
     if(pool__total != pool__ltotal)
         fprintf(stderr, "POOL: %d total missed mallocs\n",pool__total);
     pool__ltotal = pool__total;
+    fprintf(stderr, "POOL: %lu of %lu blocks reused, %lu dropped, %lu bytes held\n",_pool_stats.hits,_pool_stats.allocs,_pool_stats.drops,_pool_stats.held);
     return;
 }
 #else
@@ -89,6 +89,21 @@ typedef struct pool_struct
 #endif
 } _pool, *pool_t;
 
+/** block cache default - how many bytes of freed blocks each thread keeps for reuse */
+#define POOL_CACHE_SIZE (1024*1024)
+
+/** block cache counters, per thread */
+typedef struct pool_cache_stats_st
+{
+    unsigned long allocs;       /* blocks asked for */
+    unsigned long hits;         /* of those, how many came from the cache */
+    unsigned long drops;        /* freed blocks let go because the cache was full */
+    unsigned long requested;    /* bytes asked for */
+    unsigned long slack;        /* bytes handed out beyond that, rounding up to a size class */
+    unsigned long unused;       /* bytes left over at the end of heaps when they were freed */
+    unsigned long held;         /* bytes in the cache right now */
+} pool_cache_stats_t;
+
 #ifdef POOL_DEBUG
 # define pool_new() _pool_new(__FILE__,__LINE__) 
 # define pool_heap(i) _pool_new_heap(i,__FILE__,__LINE__) 
@@ -107,7 +122,11 @@ JABBERD2_API char *pstrdupx(pool_t p, const char *src, int len); /* use given le
 JABBERD2_API void pool_stat(int full); /* print to stderr the changed pools and reset */
 JABBERD2_API void pool_cleanup(pool_t p, pool_cleanup_t fn, void *arg); /* calls f(arg) before the pool is freed during cleanup */
 JABBERD2_API void pool_free(pool_t p); /* calls the cleanup functions, frees all the data on the pool, and deletes the pool itself */
+JABBERD2_API void pool_reset(pool_t p); /* calls the cleanup functions and frees all the data, but keeps the pool and its first heap for reuse */
 JABBERD2_API int pool_size(pool_t p); /* returns total bytes allocated in this pool */
+JABBERD2_API void pool_cache_config(int size); /* sets how many bytes of freed blocks each thread keeps (0 turns it off), releasing any extra */
+JABBERD2_API void pool_cache_stats(pool_cache_stats_t *stats); /* gets this thread's block cache counters */
+JABBERD2_API void pool_cache_free(void); /* releases this thread's cached blocks, for threads that are about to exit */
 
 
 #endif
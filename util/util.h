@@ -57,6 +57,9 @@
 #ifdef HAVE_SYS_SOCKET_H
 # include <sys/socket.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
 #ifdef HAVE_NETINET_IN_H
 # include <netinet/in.h>
 #endif
@@ -337,6 +340,38 @@ JABBERD2_API int         jqueue_size(jqueue_t q);
 JABBERD2_API time_t      jqueue_age(jqueue_t q);
 
 
+/*
+ * database connection pools
+ */
+
+/** open a new connection, NULL if it couldn't be done */
+typedef void *(*connpool_open_t)(void *arg);
+/** check an idle connection before it's used again, 0 if it's still good */
+typedef int (*connpool_check_t)(void *conn, void *arg);
+/** close a connection */
+typedef void (*connpool_close_t)(void *conn, void *arg);
+
+/** connection pool counters */
+typedef struct connpool_stats_st {
+    unsigned long   gets;       /* connections handed out */
+    unsigned long   waits;      /* of those, how many had to wait for one to be given back */
+    unsigned long   wait_usecs; /* time spent waiting */
+    unsigned long   checks;     /* idle connections checked before they were used again */
+    unsigned long   errors;     /* connections that wouldn't open, failed their check, or were given back broken */
+    int             open;       /* connections open right now */
+    int             inuse;      /* of those, how many are handed out */
+    int             inuse_max;  /* the most ever handed out at once */
+} connpool_stats_t;
+
+typedef struct _connpool_st *connpool_t;
+
+JABBERD2_API connpool_t  connpool_new(int size, int idle, connpool_open_t open, connpool_check_t check, connpool_close_t close, void *arg);
+JABBERD2_API void        connpool_free(connpool_t cp);
+JABBERD2_API void        *connpool_get(connpool_t cp);
+JABBERD2_API void        connpool_put(connpool_t cp, void *conn, int broken);
+JABBERD2_API void        connpool_stats(connpool_t cp, connpool_stats_t *stats);
+
+
 /* ISO 8601 / JEP-0082 date/time manipulation */
 typedef enum {
     dt_DATE     = 1,
@@ -21,74 +21,205 @@
 #include "xhash.h"
 #include "util.h"
 
+/** buckets moved per operation while resizing */
+#define XHASH_REHASH_STEP   2
+
+/** grow once we average more than one node per bucket, shrink below 1/8 */
+#define XHASH_GROW(h)       ((h)->count > (h)->size[0])
+#define XHASH_SHRINK(h)     ((h)->size[0] > (h)->prime && (h)->count < (h)->size[0] / 8)
+
+#define XHASH_ROTL(x,r)     (((x) << (r)) | ((x) >> (32 - (r))))
 
 /* Generates a hash code for a string.
- * This function uses the ELF hashing algorithm as reprinted in 
- * Andrew Binstock, "Hashing Rehashed," Dr. Dobb's Journal, April 1996.
+ * This is MurmurHash3 (x86, 32-bit) by Austin Appleby, which is in
+ * the public domain. It consumes the key four bytes at a time and
+ * mixes well enough that the low bits can be used directly as the
+ * bucket index of our power-of-two tables.
  */
-static int _xhasher(const char *s, int len)
+static unsigned int _xhasher(const char *s, int len)
 {
-    /* ELF hash uses unsigned chars and unsigned arithmetic for portability */
-    const unsigned char *name = (const unsigned char *)s;
-    unsigned long h = 0, g;
-    int i;
-
-    for(i=0;i<len;i++)
-    { /* do some fancy bitwanking on the string */
-        h = (h << 4) + (unsigned long)(name[i]);
-        if ((g = (h & 0xF0000000UL))!=0)
-            h ^= (g >> 24);
-        h &= ~g;
+    const unsigned char *data = (const unsigned char *)s;
+    const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+    uint32_t h = 0x5bd1e995, k;
+    int i, nblocks = len / 4;
+
+    for(i = 0; i < nblocks; i++)
+    {
+        memcpy(&k, data + i * 4, 4);
+
+        k *= c1;
+        k = XHASH_ROTL(k, 15);
+        k *= c2;
+
+        h ^= k;
+        h = XHASH_ROTL(h, 13);
+        h = h * 5 + 0xe6546b64;
+    }
 
+    k = 0;
+    data += nblocks * 4;
+    switch(len & 3)
+    {
+        case 3: k ^= data[2] << 16;
+        case 2: k ^= data[1] << 8;
+        case 1: k ^= data[0];
+                k *= c1;
+                k = XHASH_ROTL(k, 15);
+                k *= c2;
+                h ^= k;
     }
 
-    return (int)h;
+    /* final avalanche */
+    h ^= (uint32_t) len;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
 }
 
+/** bucket array for table t that the given hash lands in */
+#define XHASH_BUCKET(h,t,hash) (&(h)->zen[t][(hash) & ((h)->size[t] - 1)])
 
-static xhn _xhash_node_new(xht h, int index)
+/** free the bucket arrays, they're malloc'd so we can release them as we resize */
+static void _xhash_tables_free(void *arg)
 {
-    xhn n;
-    int i = index % h->prime;
+    xht h = (xht) arg;
 
-    /* track total */
-    h->count++;
+    free(h->zen[0]);
+    free(h->zen[1]);
+}
 
-#ifdef XHASH_DEBUG
-    h->stat[i]++;
-#endif
- 
-    // if the zen[i] is empty, reuse it, else get a new one.
-    n = &h->zen[i];
-    
-    if( n->key != NULL ) 
+/** move a few buckets from the old table to the new one */
+static void _xhash_rehash_step(xht h, int steps)
+{
+    int empty = steps * 10;
+    xhn n, next, *bucket;
+
+    /* walkers rely on nodes staying put; iterators cope, see xhash_iter_next() */
+    if(h->rehash < 0 || h->walking)
+        return;
+
+    while(steps > 0 && h->rehash < h->size[0])
     {
-        if( h->free_list )
+        /* don't spend forever skipping over empty buckets */
+        if(h->zen[0][h->rehash] == NULL)
         {
-            n = h->free_list;
-            h->free_list = h->free_list->next;        
-        }else
-            n = pmalloco(h->p, sizeof(_xhn));
+            h->rehash++;
+            if(--empty == 0)
+                return;
+            continue;
+        }
 
-        //add it to the bucket list head.
-        n->prev = &h->zen[i];
-        n->next = h->zen[i].next;
+        for(n = h->zen[0][h->rehash]; n != NULL; n = next)
+        {
+            next = n->next;
 
-        if( n->next ) n->next->prev = n;
-        h->zen[i].next = n;
+            bucket = XHASH_BUCKET(h, 1, n->hash);
+            n->prev = NULL;
+            n->next = *bucket;
+            if(n->next) n->next->prev = n;
+            *bucket = n;
+        }
+
+        h->zen[0][h->rehash] = NULL;
+        h->rehash++;
+        steps--;
+    }
+
+    /* all moved, the new table becomes the only one */
+    if(h->rehash >= h->size[0])
+    {
+        /* an iterator in the new table keeps its place; one still in the old
+         * table has everything ahead of it in the new table, so it starts
+         * that over (it won't return the nodes it has already seen) */
+        if(h->iter_node != NULL)
+            h->iter_bucket = h->iter_bucket >= h->size[0] ? h->iter_bucket - h->size[0] : -1;
+
+        free(h->zen[0]);
+        h->zen[0] = h->zen[1];
+        h->size[0] = h->size[1];
+        h->zen[1] = NULL;
+        h->size[1] = 0;
+        h->rehash = -1;
+    }
+}
+
+/** start growing or shrinking the table if the load calls for it */
+static void _xhash_resize(xht h)
+{
+    int size;
+    xhn *zen;
+
+    if(h->rehash >= 0 || h->walking)
+        return;
+
+    if(XHASH_GROW(h))
+        for(size = h->size[0] * 2; size < h->count; size *= 2);
+    else if(XHASH_SHRINK(h))
+    {
+        for(size = h->prime; size < h->count * 2; size *= 2);
+        if(size >= h->size[0])
+            return;
     }
+    else
+        return;
+
+    /* if we can't get the memory, just carry on with longer chains */
+    if((zen = calloc(size, sizeof(xhn))) == NULL)
+        return;
+
+    h->zen[1] = zen;
+    h->size[1] = size;
+    h->rehash = 0;
+
+    _xhash_rehash_step(h, XHASH_REHASH_STEP);
+}
+
+
+static xhn _xhash_node_new(xht h, unsigned int hash)
+{
+    xhn n, *bucket;
+
+    /* track total */
+    h->count++;
+
+    // reuse a zapped node if there is one, else get a new one.
+    if( h->free_list )
+    {
+        n = h->free_list;
+        h->free_list = h->free_list->next;
+    }else
+        n = pmalloco(h->p, sizeof(_xhn));
+
+    /* new nodes always go in the newest table */
+    bucket = XHASH_BUCKET(h, h->zen[1] != NULL ? 1 : 0, hash);
+
+    //add it to the bucket list head.
+    n->hash = hash;
+    n->iter_gen = 0;
+    n->prev = NULL;
+    n->next = *bucket;
+
+    if( n->next ) n->next->prev = n;
+    *bucket = n;
 
     return n;
 }
 
 
-static xhn _xhash_node_get(xht h, const char *key, int len, int index)
+static xhn _xhash_node_get(xht h, const char *key, int len, unsigned int hash)
 {
     xhn n;
-    int i = index % h->prime;
-    for(n = &h->zen[i]; n != NULL; n = n->next)
-        if(n->key != NULL && (n->keylen==len) && (strncmp(key, n->key, len) == 0))
-            return n;
+    int t;
+
+    for(t = 0; t < 2 && h->zen[t] != NULL; t++)
+        for(n = *XHASH_BUCKET(h, t, hash); n != NULL; n = n->next)
+            if(n->hash == hash && n->keylen == len && memcmp(key, n->key, len) == 0)
+                return n;
+
     return NULL;
 }
 
@@ -97,51 +228,56 @@ xht xhash_new(int prime)
 {
     xht xnew;
     pool_t p;
+    int size;
 
 /*    log_debug(ZONE,"creating new hash table of size %d",prime); */
 
+    /* round the hint up to a power of two so we can mask instead of mod */
+    for(size = 8; size < prime; size *= 2);
+
     /**
      * NOTE:
      * all xhash's memory should be allocated from the pool by using pmalloco()/pmallocx(),
      * so that the xhash_free() can just call pool_free() simply.
+     * The bucket arrays are the exception, they come and go as the table
+     * resizes and are released by a pool cleanup.
      */
     
-    p = pool_heap(sizeof(_xhn)*prime + sizeof(_xht));
+    p = pool_heap(sizeof(_xhn)*size + sizeof(_xht));
     xnew = pmalloco(p, sizeof(_xht));
-    xnew->prime = prime;
+    xnew->prime = size;
     xnew->p = p;
-    xnew->zen = pmalloco(p, sizeof(_xhn)*prime); /* array of xhn size of prime */
+    while((xnew->zen[0] = calloc(size, sizeof(xhn))) == NULL) sleep(1);
+    xnew->size[0] = size;
+    xnew->rehash = -1;
+    pool_cleanup(p, _xhash_tables_free, (void *) xnew);
 
     xnew->free_list = NULL;
     
     xnew->iter_bucket = -1;
     xnew->iter_node = NULL;
 
-#ifdef XHASH_DEBUG
-    xnew->stat = pmalloco(p, sizeof(int)*prime );
-#else
-    xnew->stat = NULL;
-#endif
-
     return xnew;
 }
 
 
 void xhash_putx(xht h, const char *key, int len, void *val)
 {
-    int index;
+    unsigned int hash;
     xhn n;
 
     if(h == NULL || key == NULL)
         return;
 
-    index = _xhasher(key,len);
+    hash = _xhasher(key,len);
+
+    _xhash_rehash_step(h, XHASH_REHASH_STEP);
 
     /* dirty the xht */
     h->dirty++;
 
     /* if existing key, replace it */
-    if((n = _xhash_node_get(h, key, len, index)) != NULL)
+    if((n = _xhash_node_get(h, key, len, hash)) != NULL)
     {
 /*        log_debug(ZONE,"replacing %s with new val %X",key,val); */
 
@@ -154,10 +290,12 @@ void xhash_putx(xht h, const char *key, int len, void *val)
 /*    log_debug(ZONE,"saving %s val %X",key,val); */
 
     /* new node */
-    n = _xhash_node_new(h, index);
+    n = _xhash_node_new(h, hash);
     n->key = key;
     n->keylen = len;
     n->val = val;
+
+    _xhash_resize(h);
 }
 
 void xhash_put(xht h, const char *key, void *val)
@@ -171,7 +309,12 @@ void *xhash_getx(xht h, const char *key, int len)
 {
     xhn n;
 
-    if(h == NULL || key == NULL || len <= 0 || (n = _xhash_node_get(h, key, len, _xhasher(key,len))) == NULL)
+    if(h == NULL || key == NULL || len <= 0)
+        return NULL;
+
+    _xhash_rehash_step(h, XHASH_REHASH_STEP);
+
+    if((n = _xhash_node_get(h, key, len, _xhasher(key,len))) == NULL)
     {
 /*        log_debug(ZONE,"failed lookup of %s",key); */
         return NULL;
@@ -187,25 +330,30 @@ void *xhash_get(xht h, const char *key)
     return xhash_getx(h,key,strlen(key));
 }
 
-void xhash_zap_inner( xht h, xhn n, int index)
+static void _xhash_zap_inner( xht h, xhn n)
 {
-    int i = index % h->prime;
-    
+    xhn *bucket;
+
     /* if we just killed the current iter, move to the next one */
     if(h->iter_node == n)
         xhash_iter_next(h);
     
-    // if element:n is in bucket list.
-    if( &h->zen[i] != n ) 
+    // unlink element:n from its bucket list.
+    if(n->prev)
+        n->prev->next = n->next;
+    else
     {
-        if(n->prev) n->prev->next = n->next;
-        if(n->next) n->next->prev = n->prev;
-
-        // add it to the free_list head.
-        n->prev = NULL;
-        n->next = h->free_list;
-        h->free_list = n;
+        bucket = XHASH_BUCKET(h, 0, n->hash);
+        if(*bucket != n)
+            bucket = XHASH_BUCKET(h, 1, n->hash);
+        *bucket = n->next;
     }
+    if(n->next) n->next->prev = n->prev;
+
+    // add it to the free_list head.
+    n->prev = NULL;
+    n->next = h->free_list;
+    h->free_list = n;
 
     //empty the value.
     n->key = NULL;
@@ -215,25 +363,23 @@ void xhash_zap_inner( xht h, xhn n, int index)
     h->dirty++;
     h->count--;
 
-#ifdef XHASH_DEBUG
-    h->stat[i]--;
-#endif
+    _xhash_resize(h);
 }
 
 void xhash_zapx(xht h, const char *key, int len)
 {
     xhn n;
-    int index;
 
     if( !h || !key ) return;
     
-    index = _xhasher(key,len);
-    n = _xhash_node_get(h, key, len, index);
+    _xhash_rehash_step(h, XHASH_REHASH_STEP);
+
+    n = _xhash_node_get(h, key, len, _xhasher(key,len));
     if( !n ) return;
 
 /*    log_debug(ZONE,"zapping %s",key); */
 
-    xhash_zap_inner(h ,n, index );
+    _xhash_zap_inner(h, n);
 }
 
 void xhash_zap(xht h, const char *key)
@@ -254,35 +400,48 @@ void xhash_free(xht h)
 void xhash_stat( xht h )
 {
 #ifdef XHASH_DEBUG
+    int t, i, len, longest = 0, used = 0;
+    xhn n;
+
     if( !h ) return;
     
-    fprintf(stderr, "XHASH: table prime: %d , number of elements: %d\n", h->prime, h->count );
+    fprintf(stderr, "XHASH: table size: %d (%d while resizing), number of elements: %d\n", h->size[0], h->size[1], h->count );
 
-    int i;
-    for( i = 0; i< h->prime ; ++i )
-    {
-        if( h->stat[i] > 1 )
-            fprintf(stderr, "%d: %d\t", i, h->stat[i]);
-    }
-    fprintf(stderr, "\n");
+    for( t = 0; t < 2 && h->zen[t] != NULL; t++ )
+        for( i = 0; i < h->size[t]; ++i )
+        {
+            for( len = 0, n = h->zen[t][i]; n != NULL; n = n->next ) len++;
+            if( len > 0 ) used++;
+            if( len > longest ) longest = len;
+        }
+    fprintf(stderr, "XHASH: %d buckets used, longest chain %d\n", used, longest);
     
 #endif
 }
 
 void xhash_walk(xht h, xhash_walker w, void *arg)
 {
-    int i;
-    xhn n;
+    int t, i;
+    xhn n, next;
 
     if(h == NULL || w == NULL)
         return;
 
 /*    log_debug(ZONE,"walking %X",h); */
 
-    for(i = 0; i < h->prime; i++)
-        for(n = &h->zen[i]; n != NULL; n = n->next)
-            if(n->key != NULL && n->val != NULL)
-                (*w)(n->key, n->keylen, n->val, arg);
+    /* keep the rehash from moving nodes under the walker */
+    h->walking++;
+
+    for(t = 0; t < 2 && h->zen[t] != NULL; t++)
+        for(i = 0; i < h->size[t]; i++)
+            for(n = h->zen[t][i]; n != NULL; n = next)
+            {
+                next = n->next;
+                if(n->val != NULL)
+                    (*w)(n->key, n->keylen, n->val, arg);
+            }
+
+    h->walking--;
 }
 
 /** return the dirty flag (and reset) */
@@ -311,34 +470,64 @@ pool_t xhash_pool(xht h)
     return h->p;
 }
 
+/** hash a key the way we do */
+unsigned int xhash_hash(const char *key, int len)
+{
+    return _xhasher(key, len);
+}
+
+/** a node the current iteration should return */
+#define XHASH_ITER_WANT(h,n) ((n)->val != NULL && (n)->iter_gen != (h)->iter_gen)
+
 /** iteration */
 int xhash_iter_first(xht h) {
     if(h == NULL) return 0;
 
+    /* 0 is what new nodes start with */
+    if(++h->iter_gen == 0)
+        h->iter_gen = 1;
+
     h->iter_bucket = -1;
     h->iter_node = NULL;
 
     return xhash_iter_next(h);
 }
 
+/*
+ * the table can resize under an iteration, which doesn't have to run to the
+ * end. a resize moves nodes from the old table to the new one, which is
+ * scanned after the old one, so a node can come round again; each node
+ * remembers the iteration that last returned it, and gets skipped the
+ * second time
+ */
 int xhash_iter_next(xht h) {
+    int bucket;
+
     if(h == NULL) return 0;
 
     /* next in this bucket */
     while(h->iter_node != NULL) {
         h->iter_node = h->iter_node->next;
 
-        if(h->iter_node != NULL && h->iter_node->key != NULL && h->iter_node->val != NULL)
+        if(h->iter_node != NULL && XHASH_ITER_WANT(h, h->iter_node)) {
+            h->iter_node->iter_gen = h->iter_gen;
             return 1;
+        }
     }
 
-    /* next bucket */
-    for(h->iter_bucket++; h->iter_bucket < h->prime; h->iter_bucket++) {
-        h->iter_node = &h->zen[h->iter_bucket];
+    /* next bucket, old table first then the new one if we're resizing */
+    for(h->iter_bucket++; h->iter_bucket < h->size[0] + h->size[1]; h->iter_bucket++) {
+        bucket = h->iter_bucket;
+        if(bucket < h->size[0])
+            h->iter_node = h->zen[0][bucket];
+        else
+            h->iter_node = h->zen[1][bucket - h->size[0]];
 
         while(h->iter_node != NULL) {
-            if(h->iter_node->key != NULL && h->iter_node->val != NULL)
+            if(XHASH_ITER_WANT(h, h->iter_node)) {
+                h->iter_node->iter_gen = h->iter_gen;
                 return 1;
+            }
 
             h->iter_node = h->iter_node->next;
         }
@@ -353,13 +542,9 @@ int xhash_iter_next(xht h) {
 
 void xhash_iter_zap(xht h)
 {
-    int index;
-
     if( !h || !h->iter_node ) return;
 
-    index = _xhasher( h->iter_node->key, h->iter_node->keylen );
-
-    xhash_zap_inner( h ,h->iter_node, index);
+    _xhash_zap_inner( h ,h->iter_node);
 }
 
 int xhash_iter_get(xht h, const char **key, int *keylen, void **val) {
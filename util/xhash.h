@@ -39,20 +39,34 @@ typedef struct xhn_struct
     struct xhn_struct *prev;
     const char *key;
     int keylen;
+    unsigned int hash;
+    unsigned int iter_gen;  /* iteration that last returned this node */
     void *val;
 } *xhn, _xhn;
 
+/**
+ * The table grows and shrinks by powers of two. While resizing, both
+ * bucket arrays are live: zen[0] is drained into zen[1] a few buckets
+ * at a time by regular operations, so no single call pays for the
+ * whole rehash. Rehashing carries on while an iteration is open: each
+ * node remembers the last iteration that returned it (iter_gen), so one
+ * moved ahead of the iterator isn't handed out again. Only xhash_walk()
+ * holds rehashing off, for the length of the walk.
+ */
 typedef struct xht_struct
 {
     pool_t p;
-    int prime;
+    int prime;          /* initial size hint, we never shrink below it */
     int dirty;
     int count;
-    struct xhn_struct *zen;
+    struct xhn_struct **zen[2];
+    int size[2];
+    int rehash;         /* next zen[0] bucket to move, -1 if not resizing */
+    int walking;
     struct xhn_struct *free_list; // list of zaped elements to be reused.
     int iter_bucket;
     xhn iter_node;
-    int *stat;
+    unsigned int iter_gen;  /* bumped by each xhash_iter_first() */
 } *xht, _xht;
 
 JABBERD2_API xht xhash_new(int prime);
@@ -70,7 +84,14 @@ JABBERD2_API int xhash_dirty(xht h);
 JABBERD2_API int xhash_count(xht h);
 JABBERD2_API pool_t xhash_pool(xht h);
 
-/* iteration functions */
+/** the (non-cryptographic) hash we use for keys, for anyone else that wants one */
+JABBERD2_API unsigned int xhash_hash(const char *key, int len);
+
+/* iteration functions
+ * the table can still grow or shrink during an iteration, and
+ * xhash_iter_next() skips nodes this iteration has already returned, so
+ * each item comes back once. an iteration that's broken off needs no
+ * cleanup; the next xhash_iter_first() starts a new one */
 JABBERD2_API int xhash_iter_first(xht h);
 JABBERD2_API int xhash_iter_next(xht h);
 JABBERD2_API void xhash_iter_zap(xht h);